@@ -0,0 +1,158 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <new>
+#include "bench.h"
+
+namespace
+{
+	volatile uint64_t allocation_count(0);
+	__thread uint64_t thread_allocation_count(0);
+}
+
+// count every allocation, so that the benchmarks can report allocations per urb
+void* operator new(size_t size) throw(std::bad_alloc)
+{
+	__sync_fetch_and_add(&allocation_count, 1);
+	thread_allocation_count++;
+	void* p(malloc(size ? size : 1));
+	if(!p) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size) throw(std::bad_alloc)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) throw()
+{
+	__sync_fetch_and_add(&allocation_count, 1);
+	thread_allocation_count++;
+	return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) throw()
+{
+	return operator new(size, std::nothrow);
+}
+
+void operator delete(void* p) throw() { free(p); }
+void operator delete[](void* p) throw() { free(p); }
+void operator delete(void* p, const std::nothrow_t&) throw() { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) throw() { free(p); }
+
+namespace bench
+{
+	uint64_t now() throw()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	}
+
+	uint64_t allocations() throw()
+	{
+		return allocation_count;
+	}
+
+	uint64_t thread_allocations() throw()
+	{
+		return thread_allocation_count;
+	}
+
+	uint64_t latencies::percentile(double p)
+	{
+		if(samples.empty()) return 0;
+		if(!sorted)
+		{
+			std::sort(samples.begin(), samples.end());
+			sorted = true;
+		}
+		size_t i(static_cast<size_t>(p * (samples.size() - 1) + 0.5));
+		return samples[std::min(i, samples.size() - 1)];
+	}
+
+	report::report(FILE* out, const char* suite) : out(out), first_result(true), first_field(true)
+	{
+		fprintf(out, "{\n  \"suite\": \"%s\",\n  \"timestamp\": %ld,\n  \"results\": [", suite, static_cast<long>(time(NULL)));
+	}
+
+	report::~report()
+	{
+		fprintf(out, "\n  ]\n}\n");
+		fflush(out);
+	}
+
+	void report::begin(const char* name)
+	{
+		fprintf(out, "%s\n    {", first_result ? "" : ",");
+		first_result = false;
+		first_field = true;
+		field("name", name);
+	}
+
+	void report::field(const char* name, double value)
+	{
+		fprintf(out, "%s\"%s\": %.3f", first_field ? " " : ", ", name, value);
+		first_field = false;
+	}
+
+	void report::field(const char* name, uint64_t value)
+	{
+		fprintf(out, "%s\"%s\": %llu", first_field ? " " : ", ", name, static_cast<unsigned long long>(value));
+		first_field = false;
+	}
+
+	void report::field(const char* name, const char* value)
+	{
+		fprintf(out, "%s\"%s\": \"%s\"", first_field ? " " : ", ", name, value);
+		first_field = false;
+	}
+
+	void report::summary(uint64_t ops, uint64_t elapsed, latencies& lat, uint64_t allocs)
+	{
+		field("ops", ops);
+		field("ops_per_sec", elapsed ? ops * 1e9 / elapsed : 0.0);
+		field("p50_ns", lat.percentile(0.5));
+		field("p99_ns", lat.percentile(0.99));
+		field("p999_ns", lat.percentile(0.999));
+		field("allocs_per_op", ops ? static_cast<double>(allocs) / ops : 0.0);
+	}
+
+	void report::end()
+	{
+		fprintf(out, " }");
+		fflush(out);
+	}
+}
@@ -0,0 +1,86 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace bench
+{
+	uint64_t now() throw();
+	// number of operator new calls since program start, in all threads and
+	// in the calling thread only
+	uint64_t allocations() throw();
+	uint64_t thread_allocations() throw();
+
+	class latencies
+	{
+	private:
+		std::vector<uint64_t> samples;
+		bool sorted;
+
+	public:
+		latencies() : samples(), sorted(true) { }
+		void reserve(size_t n) { samples.reserve(n); }
+		void add(uint64_t ns) { samples.push_back(ns); sorted = false; }
+		size_t count() const throw() { return samples.size(); }
+		// p in [0, 1]
+		uint64_t percentile(double p);
+	};
+
+	// collects results and prints them as one JSON document
+	class report
+	{
+	private:
+		FILE* out;
+		bool first_result;
+		bool first_field;
+
+		report(const report&);
+		report& operator=(const report&);
+
+	public:
+		report(FILE* out, const char* suite);
+		~report();
+		void begin(const char* name);
+		void field(const char* name, double value);
+		void field(const char* name, uint64_t value);
+		void field(const char* name, const char* value);
+		// ops, ops_per_sec, p50_ns, p99_ns, p999_ns, allocs_per_op
+		void summary(uint64_t ops, uint64_t elapsed, latencies& lat, uint64_t allocs);
+		void end();
+	};
+}
+
+#endif // _BENCH_H
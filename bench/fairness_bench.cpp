@@ -0,0 +1,238 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Latency of a quiet device while its neighbor port floods the same
+ * controller with 64 KiB bulk OUT urbs, for the orders of
+ * hcd::set_work_order. The quiet device keeps one small interrupt IN urb
+ * in flight; its submit to reap latency is what the percentiles show,
+ * bytes_per_sec is the throughput of the flooding device. The device
+ * emulation reads every OUT buffer, so that the consumer thread and not
+ * the host side is the bottleneck and works pile up in the inbox.
+ * allocs_per_op counts the allocations for the flooding urbs, too.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/libusb_vhci.h"
+#include "bench.h"
+
+namespace
+{
+	using namespace usb::vhci;
+
+	const uint8_t noisy_address(1);
+	const uint8_t quiet_address(2);
+	const int32_t noisy_size(65536);
+	const unsigned noisy_depth(64);
+
+	class device
+	{
+	private:
+		local_hcd& hcd;
+		pthread_t thread;
+		volatile bool stop;
+		volatile uint32_t checksum;
+
+		device(const device&);
+		device& operator=(const device&);
+
+		static void* start(void* arg)
+		{
+			reinterpret_cast<device*>(arg)->run();
+			return NULL;
+		}
+
+		void process(usb::urb& urb)
+		{
+			if(urb.is_in())
+			{
+				memset(urb.get_buffer(), 0x5a, urb.get_buffer_length());
+				urb.set_buffer_actual(urb.get_buffer_length());
+			}
+			else
+			{
+				// stands in for whatever a device does with the data
+				uint32_t sum(0);
+				const uint8_t* b(urb.get_buffer());
+				for(int32_t i(0); i < urb.get_buffer_actual(); i++)
+					sum = sum * 31 + b[i];
+				checksum = sum;
+			}
+			urb.ack();
+		}
+
+		void run()
+		{
+			while(!stop)
+			{
+				work* w;
+				hcd.next_work(&w);
+				if(!w)
+				{
+					sched_yield();
+					continue;
+				}
+				if(port_stat_work* psw = dynamic_cast<port_stat_work*>(w))
+				{
+					uint8_t port(psw->get_port());
+					if(psw->triggers_power_on())
+						hcd.port_connect(port, usb::data_rate_high);
+					if(psw->triggers_reset() && hcd.get_port_stat(port).get_connection())
+						hcd.port_reset_done(port);
+				}
+				else if(process_urb_work* puw = dynamic_cast<process_urb_work*>(w))
+				{
+					if(puw->get_urb()->is_control()) puw->get_urb()->ack();
+					else process(*puw->get_urb());
+				}
+				hcd.finish_work(w);
+			}
+		}
+
+	public:
+		explicit device(local_hcd& hcd) : hcd(hcd), thread(), stop(false), checksum(0)
+		{
+			pthread_create(&thread, NULL, start, this);
+		}
+
+		~device()
+		{
+			stop = true;
+			pthread_join(thread, NULL);
+		}
+	};
+
+	void fail(const char* what)
+	{
+		fprintf(stderr, "fairness_bench: %s\n", what);
+		exit(1);
+	}
+
+	usb::urb* reap(loopback_transport& lb)
+	{
+		usb::urb* u;
+		if(!lb.reap(&u, 5000)) fail("timeout while waiting for urb");
+		return u;
+	}
+
+	void wait_port_status(loopback_transport& lb, uint8_t port, uint16_t mask, bool set)
+	{
+		uint64_t until(bench::now() + 5000000000ull);
+		while(!(lb.get_port_stat(port).status & mask) == set)
+		{
+			if(bench::now() > until) fail("timeout while waiting for port status");
+			sched_yield();
+		}
+	}
+
+	void enumerate(loopback_transport& lb, uint8_t port, uint8_t address)
+	{
+		wait_port_status(lb, port, USB_VHCI_PORT_STAT_CONNECTION, true);
+		lb.reset(port);
+		wait_port_status(lb, port, USB_VHCI_PORT_STAT_ENABLE, true);
+		lb.clear_port_change(port, USB_VHCI_PORT_STAT_C_RESET);
+		lb.submit(usb::urb(0, usb::urb_type_control, 0, NULL, false, 0, NULL, false, 0, 0, 0, 0, 0,
+		                   0, 0x00, 0x00, URB_RQ_SET_ADDRESS, address, 0, 0));
+		delete reap(lb);
+	}
+
+	void run(bench::report& r, const char* name, loopback_transport& lb, local_hcd& hcd, work_queue::order o, uint64_t n)
+	{
+		hcd.set_work_order(o);
+		std::vector<uint8_t> data(noisy_size, 0xa5);
+		usb::urb noisy(0, usb::urb_type_bulk, noisy_size, &data[0], false, 0, NULL, false, noisy_size, 0, 0, 0, 0,
+		               noisy_address, 0x01, 0, 0, 0, 0, 0);
+		usb::urb quiet(0, usb::urb_type_interrupt, 8, NULL, false, 0, NULL, false, 0, 0, 0, 0, 1,
+		               quiet_address, 0x81, 0, 0, 0, 0, 0);
+		for(unsigned i(0); i < noisy_depth; i++)
+			lb.submit(noisy);
+		// let the flood build up before measuring
+		usleep(20000);
+		bench::latencies lat;
+		lat.reserve(n);
+		uint64_t start(bench::now()), allocs(bench::allocations()), noisy_done(0), done(0);
+		uint64_t submitted(bench::now());
+		uint64_t quiet_handle(lb.submit(quiet));
+		unsigned noisy_in_flight(noisy_depth);
+		while(done < n || noisy_in_flight)
+		{
+			usb::urb* u(reap(lb));
+			if(u->get_status() != USB_VHCI_STATUS_SUCCESS) fail("urb failed");
+			if(u->get_handle() == quiet_handle)
+			{
+				lat.add(bench::now() - submitted);
+				if(++done < n)
+				{
+					submitted = bench::now();
+					quiet_handle = lb.submit(quiet);
+				}
+				else quiet_handle = 0;
+			}
+			else
+			{
+				noisy_done++;
+				noisy_in_flight--;
+				if(done < n)
+				{
+					lb.submit(noisy);
+					noisy_in_flight++;
+				}
+			}
+			delete u;
+		}
+		const uint64_t elapsed(bench::now() - start);
+		r.begin(name);
+		r.summary(n, elapsed, lat, bench::allocations() - allocs);
+		r.field("bytes_per_sec", noisy_done * noisy_size * 1e9 / elapsed);
+		r.end();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	loopback_transport lb;
+	local_hcd hcd(2, lb);
+	device dev(hcd);
+	lb.power_on(1);
+	enumerate(lb, 1, noisy_address);
+	lb.power_on(2);
+	enumerate(lb, 2, quiet_address);
+
+	bench::report r(stdout, "fairness");
+	const uint64_t n(2000);
+	run(r, "fifo", lb, hcd, work_queue::order_fifo, n);
+	run(r, "strict", lb, hcd, work_queue::order_strict, n);
+	run(r, "port_drr", lb, hcd, work_queue::order_port_drr, n);
+	return 0;
+}
@@ -0,0 +1,444 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Throughput and latency benchmarks for hcd. The host side is driven
+ * through a loopback_transport, so neither the kernel module nor root
+ * privileges are needed. Results are written to stdout as JSON; run
+ * "make bench" in the top level directory.
+ *
+ * allocs_per_op counts the allocations of the device side (the hcd
+ * background thread and the consumer thread), host_allocs_per_op the ones
+ * of the thread emulating the usb core.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <list>
+#include "../src/libusb_vhci.h"
+#include "bench.h"
+
+namespace
+{
+	using namespace usb::vhci;
+
+	const uint8_t dev_desc[18] = { 18, 1, 0x00, 0x02, 0, 0, 0, 64, 0xad, 0xde, 0xef, 0xbe, 0x38, 0x11, 0, 1, 0, 1 };
+
+	// endpoint whose urbs the device never completes on its own
+	const uint8_t hold_ep = 0x82;
+
+	// consumer thread, woken through the work_enqueued callback like in
+	// examples/virtual_device.cpp
+	class device
+	{
+	private:
+		local_hcd& hcd;
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		bool has_work;
+		bool stop;
+		std::list<process_urb_work*> held;
+		volatile size_t held_count;
+
+		device(const device&);
+		device& operator=(const device&);
+
+		static void signal(void* arg, usb::vhci::hcd& from) throw()
+		{
+			device& d(*reinterpret_cast<device*>(arg));
+			pthread_mutex_lock(&d.mutex);
+			d.has_work = true;
+			pthread_cond_signal(&d.cond);
+			pthread_mutex_unlock(&d.mutex);
+		}
+
+		static void* start(void* arg)
+		{
+			reinterpret_cast<device*>(arg)->run();
+			return NULL;
+		}
+
+		void process(usb::urb& urb)
+		{
+			if(urb.is_control())
+			{
+				if(urb.get_bmRequestType() == 0x80 && urb.get_bRequest() == URB_RQ_GET_DESCRIPTOR)
+				{
+					int32_t l(std::min<int32_t>(urb.get_wLength(), sizeof dev_desc));
+					memcpy(urb.get_buffer(), dev_desc, l);
+					urb.set_buffer_actual(l);
+				}
+				urb.ack();
+			}
+			else if(urb.is_isochronous())
+			{
+				for(int32_t i(0); i < urb.get_iso_packet_count(); i++)
+				{
+					if(urb.is_in()) memset(urb.get_iso_packet_buffer(i), i, urb.get_iso_packet_length(i));
+					urb.set_iso_packet_actual(i, urb.get_iso_packet_length(i));
+					urb.ack_iso(i);
+				}
+				urb.set_iso_results();
+			}
+			else
+			{
+				if(urb.is_in())
+				{
+					memset(urb.get_buffer(), 0x5a, urb.get_buffer_length());
+					urb.set_buffer_actual(urb.get_buffer_length());
+				}
+				urb.ack();
+			}
+		}
+
+		void run()
+		{
+			while(true)
+			{
+				pthread_mutex_lock(&mutex);
+				while(!has_work && !stop)
+					pthread_cond_wait(&cond, &mutex);
+				if(stop)
+				{
+					pthread_mutex_unlock(&mutex);
+					break;
+				}
+				has_work = false;
+				pthread_mutex_unlock(&mutex);
+				work* w;
+				do
+				{
+					hcd.next_work(&w);
+					if(!w) break;
+					if(port_stat_work* psw = dynamic_cast<port_stat_work*>(w))
+					{
+						uint8_t port(psw->get_port());
+						if(psw->triggers_power_on())
+							hcd.port_connect(port, usb::data_rate_high);
+						if(psw->triggers_reset() && hcd.get_port_stat(port).get_connection())
+							hcd.port_reset_done(port);
+						if(psw->triggers_resuming())
+							hcd.port_resumed(port);
+					}
+					else if(process_urb_work* puw = dynamic_cast<process_urb_work*>(w))
+					{
+						if(puw->get_urb()->get_endpoint_address() == hold_ep)
+						{
+							held.push_back(puw);
+							held_count = held.size();
+							continue;
+						}
+						process(*puw->get_urb());
+					}
+					else if(cancel_urb_work* cuw = dynamic_cast<cancel_urb_work*>(w))
+					{
+						for(std::list<process_urb_work*>::iterator i(held.begin()); i != held.end(); i++)
+						{
+							if((*i)->get_urb()->get_handle() == cuw->get_handle())
+							{
+								(*i)->get_urb()->set_status(USB_VHCI_STATUS_CANCELED);
+								hcd.finish_work(*i);
+								held.erase(i);
+								held_count = held.size();
+								break;
+							}
+						}
+					}
+					hcd.finish_work(w);
+				} while(true);
+			}
+		}
+
+	public:
+		explicit device(local_hcd& hcd) :
+			hcd(hcd),
+			thread(),
+			mutex(),
+			cond(),
+			has_work(false),
+			stop(false),
+			held(),
+			held_count(0)
+		{
+			pthread_mutex_init(&mutex, NULL);
+			pthread_cond_init(&cond, NULL);
+			hcd.add_work_enqueued_callback(usb::vhci::hcd::callback(&signal, this));
+			pthread_create(&thread, NULL, start, this);
+		}
+
+		~device()
+		{
+			hcd.remove_work_enqueued_callback(usb::vhci::hcd::callback(&signal, this));
+			pthread_mutex_lock(&mutex);
+			stop = true;
+			pthread_cond_signal(&cond);
+			pthread_mutex_unlock(&mutex);
+			pthread_join(thread, NULL);
+			pthread_cond_destroy(&cond);
+			pthread_mutex_destroy(&mutex);
+		}
+
+		size_t get_held_count() const { return held_count; }
+	};
+
+	void fail(const char* what)
+	{
+		fprintf(stderr, "hcd_bench: %s\n", what);
+		exit(1);
+	}
+
+	usb::urb* reap(loopback_transport& lb)
+	{
+		usb::urb* u;
+		if(!lb.reap(&u, 5000)) fail("timeout while waiting for urb");
+		return u;
+	}
+
+	void wait_port_status(loopback_transport& lb, uint8_t port, uint16_t mask, bool set)
+	{
+		uint64_t until(bench::now() + 5000000000ull);
+		while(!(lb.get_port_stat(port).status & mask) == set)
+		{
+			if(bench::now() > until) fail("timeout while waiting for port status");
+			sched_yield();
+		}
+	}
+
+	usb::urb control_urb(uint8_t devadr, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wLength)
+	{
+		return usb::urb(0, usb::urb_type_control, wLength, NULL, false, 0, NULL, false, 0, 0, 0, 0, 0,
+		                devadr, bmRequestType & 0x80, bmRequestType, bRequest, wValue, 0, wLength);
+	}
+
+	// reset the connected device on port and move it to address
+	void enumerate(loopback_transport& lb, uint8_t port, uint8_t address)
+	{
+		wait_port_status(lb, port, USB_VHCI_PORT_STAT_CONNECTION, true);
+		lb.reset(port);
+		wait_port_status(lb, port, USB_VHCI_PORT_STAT_ENABLE, true);
+		lb.clear_port_change(port, USB_VHCI_PORT_STAT_C_RESET);
+		lb.submit(control_urb(0, 0x00, URB_RQ_SET_ADDRESS, address, 0));
+		delete reap(lb);
+	}
+
+	struct counters
+	{
+		uint64_t start, total, host;
+		counters() : start(bench::now()), total(bench::allocations()), host(bench::thread_allocations()) { }
+	};
+
+	void finish(bench::report& r, const counters& c, uint64_t ops, bench::latencies& lat)
+	{
+		uint64_t elapsed(bench::now() - c.start);
+		uint64_t host(bench::thread_allocations() - c.host);
+		uint64_t total(bench::allocations() - c.total);
+		r.summary(ops, elapsed, lat, total - host);
+		r.field("host_allocs_per_op", ops ? static_cast<double>(host) / ops : 0.0);
+	}
+
+	void control_roundtrip(bench::report& r, loopback_transport& lb, uint8_t address, uint64_t n)
+	{
+		usb::urb u(control_urb(address, 0x80, URB_RQ_GET_DESCRIPTOR, 0x0100, sizeof dev_desc));
+		bench::latencies lat;
+		lat.reserve(n);
+		counters c;
+		for(uint64_t i(0); i < n; i++)
+		{
+			uint64_t t(bench::now());
+			lb.submit(u);
+			usb::urb* d(reap(lb));
+			lat.add(bench::now() - t);
+			if(d->get_buffer_actual() != sizeof dev_desc) fail("short descriptor");
+			delete d;
+		}
+		r.begin("control_roundtrip");
+		finish(r, c, n, lat);
+		r.end();
+	}
+
+	// keeps depth urbs in flight; latency is measured from submit to reap
+	void stream(bench::report& r,
+	            const char* name,
+	            loopback_transport& lb,
+	            const usb::urb& u,
+	            uint64_t n,
+	            unsigned depth)
+	{
+		std::vector<uint64_t> submitted(n);
+		bench::latencies lat;
+		lat.reserve(n);
+		counters c;
+		uint64_t first(0), sent(0), done(0);
+		for(; sent < depth && sent < n; sent++)
+		{
+			submitted[sent] = bench::now();
+			uint64_t h(lb.submit(u));
+			if(!sent) first = h;
+		}
+		while(done < n)
+		{
+			usb::urb* d(reap(lb));
+			lat.add(bench::now() - submitted[d->get_handle() - first]);
+			if(d->get_status() != USB_VHCI_STATUS_SUCCESS) fail("urb failed");
+			delete d;
+			done++;
+			if(sent < n)
+			{
+				submitted[sent++] = bench::now();
+				lb.submit(u);
+			}
+		}
+		r.begin(name);
+		finish(r, c, n, lat);
+		r.field("buffer_length", static_cast<uint64_t>(u.get_buffer_length()));
+		r.field("bytes_per_sec", lat.count() ? u.get_buffer_length() * n * 1e9 / (bench::now() - c.start) : 0.0);
+		r.end();
+	}
+
+	void bulk(bench::report& r, loopback_transport& lb, uint8_t address)
+	{
+		static const int32_t sizes[] = { 512, 4096, 65536, 1048576 };
+		for(size_t i(0); i < sizeof sizes / sizeof *sizes; i++)
+		{
+			const int32_t size(sizes[i]);
+			const uint64_t n(std::max<uint64_t>(200, (256u << 20) / size / 4));
+			usb::urb in(0, usb::urb_type_bulk, size, NULL, false, 0, NULL, false, 0, 0, 0, 0, 0,
+			            address, 0x81, 0, 0, 0, 0, 0);
+			stream(r, "bulk_in", lb, in, std::min<uint64_t>(n, 50000), 8);
+			usb::urb out(0, usb::urb_type_bulk, size, NULL, false, 0, NULL, false, size, 0, 0, 0, 0,
+			             address, 0x01, 0, 0, 0, 0, 0);
+			stream(r, "bulk_out", lb, out, std::min<uint64_t>(n, 50000), 8);
+		}
+	}
+
+	void iso(bench::report& r, loopback_transport& lb, uint8_t address)
+	{
+		static const int32_t counts[] = { 8, 64, 256, 1024 };
+		const int32_t packet_size(192);
+		for(size_t i(0); i < sizeof counts / sizeof *counts; i++)
+		{
+			const int32_t pc(counts[i]);
+			std::vector<usb_vhci_iso_packet> packets(pc);
+			for(int32_t p(0); p < pc; p++)
+			{
+				packets[p].offset = p * packet_size;
+				packets[p].packet_length = packet_size;
+				packets[p].packet_actual = 0;
+				packets[p].status = USB_VHCI_STATUS_PENDING;
+			}
+			usb::urb in(0, usb::urb_type_isochronous, pc * packet_size, NULL, false, pc, &packets[0], false,
+			            0, 0, 0, 0, 1, address, 0x83, 0, 0, 0, 0, 0);
+			char name[32];
+			snprintf(name, sizeof name, "iso_in_%d", pc);
+			stream(r, name, lb, in, std::max(500, 200000 / pc), 4);
+		}
+	}
+
+	void cancel_storm(bench::report& r, loopback_transport& lb, device& dev, uint8_t address, uint64_t n)
+	{
+		usb::urb u(0, usb::urb_type_bulk, 512, NULL, false, 0, NULL, false, 0, 0, 0, 0, 0,
+		           address, hold_ep, 0, 0, 0, 0, 0);
+		std::vector<uint64_t> handles(n);
+		for(uint64_t i(0); i < n; i++)
+			handles[i] = lb.submit(u);
+		uint64_t until(bench::now() + 5000000000ull);
+		while(dev.get_held_count() < n)
+		{
+			if(bench::now() > until) fail("timeout while waiting for held urbs");
+			sched_yield();
+		}
+		bench::latencies lat;
+		lat.reserve(n);
+		counters c;
+		for(uint64_t i(0); i < n; i++)
+		{
+			uint64_t t(bench::now());
+			if(!lb.cancel(handles[i])) fail("cancel failed");
+			delete reap(lb);
+			lat.add(bench::now() - t);
+		}
+		// the device has to see every cancel_urb_work, too
+		while(dev.get_held_count())
+		{
+			if(bench::now() > until + 5000000000ull) fail("timeout while waiting for canceled urbs");
+			sched_yield();
+		}
+		r.begin("cancel_storm");
+		finish(r, c, n, lat);
+		r.end();
+	}
+
+	void hotplug_churn(bench::report& r, loopback_transport& lb, local_hcd& hcd, uint8_t port, uint64_t n)
+	{
+		bench::latencies lat;
+		lat.reserve(n);
+		counters c;
+		for(uint64_t i(0); i < n; i++)
+		{
+			uint64_t t(bench::now());
+			hcd.port_disconnect(port);
+			wait_port_status(lb, port, USB_VHCI_PORT_STAT_CONNECTION, false);
+			lb.clear_port_change(port, USB_VHCI_PORT_STAT_C_CONNECTION);
+			hcd.port_connect(port, usb::data_rate_high);
+			enumerate(lb, port, port);
+			lb.submit(control_urb(port, 0x80, URB_RQ_GET_DESCRIPTOR, 0x0100, sizeof dev_desc));
+			delete reap(lb);
+			lat.add(bench::now() - t);
+		}
+		r.begin("hotplug_churn");
+		finish(r, c, n, lat);
+		r.end();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint8_t ports(2);
+	loopback_transport lb;
+	local_hcd hcd(ports, lb);
+	device dev(hcd);
+	for(uint8_t p(1); p <= ports; p++)
+	{
+		lb.power_on(p);
+		enumerate(lb, p, p);
+	}
+
+	bench::report r(stdout, "hcd");
+	control_roundtrip(r, lb, 1, 20000);
+	bulk(r, lb, 1);
+	iso(r, lb, 1);
+	cancel_storm(r, lb, dev, 1, 2000);
+	hotplug_churn(r, lb, hcd, 2, 500);
+	return 0;
+}
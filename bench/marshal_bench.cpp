@@ -0,0 +1,283 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for the conversions done by usb_vhci_fetch_work_timeout,
+ * usb_vhci_fetch_data and usb_vhci_giveback. ioctl is replaced by a stub
+ * (see below), so the numbers only contain the marshalling between the
+ * kernel structures and usb_vhci_urb, not the cost of the syscall.
+ *
+ * Per-call costs are reported in cycles (rdtsc) on x86 and in
+ * nanoseconds elsewhere. The cost of calling the stub directly is
+ * reported as "stub_baseline" and may be subtracted.
+ */
+
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#include "../src/libusb_vhci.h"
+#include "bench.h"
+
+namespace
+{
+	// calls with this fd end up in the stub, everything else goes to the kernel
+	const int stub_fd = 0x7ffffff0;
+
+	struct stub_state
+	{
+		uint8_t type;
+		uint8_t endpoint;
+		int32_t packet_count;
+		int32_t buffer_length;
+		volatile int32_t sink;
+	} stub;
+
+	inline uint64_t ticks() throw()
+	{
+#if defined(__i386__) || defined(__x86_64__)
+		return __rdtsc();
+#else
+		return bench::now();
+#endif
+	}
+
+	int stub_ioctl(unsigned long request, void* arg) throw()
+	{
+		switch(request)
+		{
+		case USB_VHCI_HCD_IOCFETCHWORK:
+		{
+			usb_vhci_ioc_work& w(*reinterpret_cast<usb_vhci_ioc_work*>(arg));
+			w.handle = 0x1234;
+			w.type = USB_VHCI_WORK_TYPE_PROCESS_URB;
+			w.work.urb.type = stub.type;
+			w.work.urb.endpoint = stub.endpoint;
+			w.work.urb.address = 1;
+			w.work.urb.buffer_length = stub.buffer_length;
+			w.work.urb.packet_count = stub.packet_count;
+			w.work.urb.interval = 1;
+			w.work.urb.flags = 0;
+			w.work.urb.setup_packet.bmRequestType = 0x80;
+			w.work.urb.setup_packet.bRequest = URB_RQ_GET_DESCRIPTOR;
+			w.work.urb.setup_packet.wValue = 0x0100;
+			w.work.urb.setup_packet.wIndex = 0;
+			w.work.urb.setup_packet.wLength = stub.buffer_length;
+			return 0;
+		}
+		case USB_VHCI_HCD_IOCFETCHDATA:
+		{
+			// the payload copy is left out on purpose
+			usb_vhci_ioc_urb_data& u(*reinterpret_cast<usb_vhci_ioc_urb_data*>(arg));
+			const uint32_t l(u.packet_count ? u.buffer_length / u.packet_count : 0);
+			for(int32_t i(0); i < u.packet_count; i++)
+			{
+				u.iso_packets[i].offset = i * l;
+				u.iso_packets[i].packet_length = l;
+			}
+			return 0;
+		}
+		case USB_VHCI_HCD_IOCGIVEBACK:
+		{
+			usb_vhci_ioc_giveback& gb(*reinterpret_cast<usb_vhci_ioc_giveback*>(arg));
+			int32_t s(gb.status + gb.buffer_actual);
+			if(gb.packet_count)
+				s += gb.iso_packets[gb.packet_count - 1].status + gb.iso_packets[0].packet_actual;
+			stub.sink = s;
+			return 0;
+		}
+		default:
+			errno = ENOTTY;
+			return -1;
+		}
+	}
+
+	void configure(uint8_t type, uint8_t endpoint, int32_t packet_count, int32_t buffer_length)
+	{
+		stub.type = type;
+		stub.endpoint = endpoint;
+		stub.packet_count = packet_count;
+		stub.buffer_length = buffer_length;
+	}
+
+	void report_ticks(bench::report& r, const char* name, int32_t packets, bench::latencies& lat, uint64_t total, uint64_t n)
+	{
+		r.begin(name);
+		r.field("packets", static_cast<uint64_t>(packets));
+		r.field("calls", n);
+#if defined(__i386__) || defined(__x86_64__)
+		r.field("unit", "cycles");
+#else
+		r.field("unit", "ns");
+#endif
+		r.field("mean", static_cast<double>(total) / n);
+		r.field("p50", lat.percentile(0.5));
+		r.field("p99", lat.percentile(0.99));
+		r.end();
+	}
+
+	const uint64_t calls = 100000;
+
+	void stub_baseline(bench::report& r)
+	{
+		usb_vhci_ioc_giveback gb;
+		memset(&gb, 0, sizeof gb);
+		bench::latencies lat;
+		lat.reserve(calls);
+		uint64_t total(0);
+		for(uint64_t i(0); i < calls; i++)
+		{
+			uint64_t t(ticks());
+			ioctl(stub_fd, USB_VHCI_HCD_IOCGIVEBACK, &gb);
+			t = ticks() - t;
+			total += t;
+			lat.add(t);
+		}
+		report_ticks(r, "stub_baseline", 0, lat, total, calls);
+	}
+
+	void fetch_work(bench::report& r, const char* name, uint8_t type, uint8_t endpoint, int32_t packets)
+	{
+		configure(type, endpoint, packets, packets ? packets * 192 : 64);
+		usb_vhci_work w;
+		bench::latencies lat;
+		lat.reserve(calls);
+		uint64_t total(0);
+		for(uint64_t i(0); i < calls; i++)
+		{
+			uint64_t t(ticks());
+			usb_vhci_fetch_work_timeout(stub_fd, &w, 100);
+			t = ticks() - t;
+			total += t;
+			lat.add(t);
+		}
+		report_ticks(r, name, packets, lat, total, calls);
+	}
+
+	void fetch_data(bench::report& r, int32_t packets)
+	{
+		configure(USB_VHCI_URB_TYPE_ISO, 0x81, packets, packets * 192);
+		std::vector<uint8_t> buffer(packets * 192);
+		std::vector<usb_vhci_iso_packet> iso(packets);
+		usb_vhci_urb u;
+		memset(&u, 0, sizeof u);
+		u.type = USB_VHCI_URB_TYPE_ISO;
+		u.epadr = 0x81;
+		u.buffer = &buffer[0];
+		u.buffer_length = buffer.size();
+		u.iso_packets = &iso[0];
+		u.packet_count = packets;
+		const uint64_t n(calls / (packets / 64 + 1));
+		bench::latencies lat;
+		lat.reserve(n);
+		uint64_t total(0);
+		for(uint64_t i(0); i < n; i++)
+		{
+			uint64_t t(ticks());
+			usb_vhci_fetch_data(stub_fd, &u);
+			t = ticks() - t;
+			total += t;
+			lat.add(t);
+		}
+		report_ticks(r, "fetch_data_iso", packets, lat, total, n);
+	}
+
+	void giveback(bench::report& r, const char* name, uint8_t type, uint8_t endpoint, int32_t packets, bool errors)
+	{
+		std::vector<uint8_t> buffer(packets ? packets * 192 : 64);
+		std::vector<usb_vhci_iso_packet> iso(packets ? packets : 1);
+		for(int32_t i(0); i < packets; i++)
+		{
+			iso[i].offset = i * 192;
+			iso[i].packet_length = 192;
+			iso[i].packet_actual = 192;
+			// every 7th packet failed, if requested
+			iso[i].status = errors && !(i % 7) ? USB_VHCI_STATUS_CRC : USB_VHCI_STATUS_SUCCESS;
+		}
+		usb_vhci_urb u;
+		memset(&u, 0, sizeof u);
+		u.type = type;
+		u.epadr = endpoint;
+		u.buffer = &buffer[0];
+		u.buffer_length = buffer.size();
+		u.buffer_actual = buffer.size();
+		u.iso_packets = &iso[0];
+		u.packet_count = packets;
+		u.status = USB_VHCI_STATUS_SUCCESS;
+		const uint64_t n(calls / (packets / 64 + 1));
+		bench::latencies lat;
+		lat.reserve(n);
+		uint64_t total(0);
+		for(uint64_t i(0); i < n; i++)
+		{
+			uint64_t t(ticks());
+			usb_vhci_giveback(stub_fd, &u);
+			t = ticks() - t;
+			total += t;
+			lat.add(t);
+		}
+		report_ticks(r, name, packets, lat, total, n);
+	}
+}
+
+// overrides the libc function for the whole program, including libusb_vhci
+extern "C" int ioctl(int fd, unsigned long request, ...) throw()
+{
+	va_list ap;
+	va_start(ap, request);
+	void* arg(va_arg(ap, void*));
+	va_end(ap);
+	if(fd == stub_fd)
+		return stub_ioctl(request, arg);
+	return syscall(SYS_ioctl, fd, request, arg);
+}
+
+int main(int argc, char** argv)
+{
+	static const int32_t packet_counts[] = { 1, 8, 32, 128, 512, 1024 };
+	bench::report r(stdout, "marshal");
+	stub_baseline(r);
+	fetch_work(r, "fetch_work_control", USB_VHCI_URB_TYPE_CONTROL, 0x80, 0);
+	fetch_work(r, "fetch_work_bulk", USB_VHCI_URB_TYPE_BULK, 0x81, 0);
+	giveback(r, "giveback_bulk", USB_VHCI_URB_TYPE_BULK, 0x81, 0, false);
+	for(size_t i(0); i < sizeof packet_counts / sizeof *packet_counts; i++)
+	{
+		const int32_t pc(packet_counts[i]);
+		fetch_work(r, "fetch_work_iso", USB_VHCI_URB_TYPE_ISO, 0x81, pc);
+		fetch_data(r, pc);
+		giveback(r, "giveback_iso", USB_VHCI_URB_TYPE_ISO, 0x81, pc, false);
+		giveback(r, "giveback_iso_errors", USB_VHCI_URB_TYPE_ISO, 0x81, pc, true);
+	}
+	return 0;
+}
@@ -0,0 +1,296 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compares remote_hcd, served by an hcd_server over a unix domain socket
+ * (with and without shared memory for the payload), with the in-process
+ * local_hcd it wraps. All are driven through a loopback_transport and
+ * answered by the same device emulation; the server runs in this process,
+ * so the numbers show the cost of the protocol and of the extra thread
+ * hops, not of a second address space.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/libusb_vhci.h"
+#include "bench.h"
+
+namespace
+{
+	using namespace usb::vhci;
+
+	const uint8_t dev_desc[18] = { 18, 1, 0x00, 0x02, 0, 0, 0, 64, 0xad, 0xde, 0xef, 0xbe, 0x38, 0x11, 0, 1, 0, 1 };
+
+	// consumer thread for any hcd, woken through the work_enqueued callback
+	class device
+	{
+	private:
+		usb::vhci::hcd& hcd;
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		bool has_work;
+		bool stop;
+
+		device(const device&);
+		device& operator=(const device&);
+
+		static void signal(void* arg, usb::vhci::hcd& from) throw()
+		{
+			device& d(*reinterpret_cast<device*>(arg));
+			pthread_mutex_lock(&d.mutex);
+			d.has_work = true;
+			pthread_cond_signal(&d.cond);
+			pthread_mutex_unlock(&d.mutex);
+		}
+
+		static void* start(void* arg)
+		{
+			reinterpret_cast<device*>(arg)->run();
+			return NULL;
+		}
+
+		void process(usb::urb& urb)
+		{
+			if(urb.is_control())
+			{
+				if(urb.get_bmRequestType() == 0x80 && urb.get_bRequest() == URB_RQ_GET_DESCRIPTOR)
+				{
+					int32_t l(std::min<int32_t>(urb.get_wLength(), sizeof dev_desc));
+					memcpy(urb.get_buffer(), dev_desc, l);
+					urb.set_buffer_actual(l);
+				}
+			}
+			else if(urb.is_in())
+			{
+				memset(urb.get_buffer(), 0x5a, urb.get_buffer_length());
+				urb.set_buffer_actual(urb.get_buffer_length());
+			}
+			urb.ack();
+		}
+
+		void run()
+		{
+			while(true)
+			{
+				pthread_mutex_lock(&mutex);
+				while(!has_work && !stop)
+					pthread_cond_wait(&cond, &mutex);
+				if(stop)
+				{
+					pthread_mutex_unlock(&mutex);
+					break;
+				}
+				has_work = false;
+				pthread_mutex_unlock(&mutex);
+				work* w;
+				do
+				{
+					hcd.next_work(&w);
+					if(!w) break;
+					if(port_stat_work* psw = dynamic_cast<port_stat_work*>(w))
+					{
+						uint8_t port(psw->get_port());
+						if(psw->triggers_power_on())
+							hcd.port_connect(port, usb::data_rate_high);
+						if(psw->triggers_reset() && hcd.get_port_stat(port).get_connection())
+							hcd.port_reset_done(port);
+					}
+					else if(process_urb_work* puw = dynamic_cast<process_urb_work*>(w))
+						process(*puw->get_urb());
+					hcd.finish_work(w);
+				} while(true);
+			}
+		}
+
+	public:
+		explicit device(usb::vhci::hcd& hcd) :
+			hcd(hcd),
+			thread(),
+			mutex(),
+			cond(),
+			has_work(false),
+			stop(false)
+		{
+			pthread_mutex_init(&mutex, NULL);
+			pthread_cond_init(&cond, NULL);
+			hcd.add_work_enqueued_callback(usb::vhci::hcd::callback(&signal, this));
+			pthread_create(&thread, NULL, start, this);
+		}
+
+		~device()
+		{
+			hcd.remove_work_enqueued_callback(usb::vhci::hcd::callback(&signal, this));
+			pthread_mutex_lock(&mutex);
+			stop = true;
+			pthread_cond_signal(&cond);
+			pthread_mutex_unlock(&mutex);
+			pthread_join(thread, NULL);
+			pthread_cond_destroy(&cond);
+			pthread_mutex_destroy(&mutex);
+		}
+	};
+
+	void fail(const char* what)
+	{
+		fprintf(stderr, "remote_bench: %s\n", what);
+		exit(1);
+	}
+
+	usb::urb* reap(loopback_transport& lb)
+	{
+		usb::urb* u;
+		if(!lb.reap(&u, 5000)) fail("timeout while waiting for urb");
+		return u;
+	}
+
+	void wait_port_status(loopback_transport& lb, uint8_t port, uint16_t mask)
+	{
+		uint64_t until(bench::now() + 5000000000ull);
+		while(!(lb.get_port_stat(port).status & mask))
+		{
+			if(bench::now() > until) fail("timeout while waiting for port status");
+			sched_yield();
+		}
+	}
+
+	usb::urb control_urb(uint8_t devadr, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wLength)
+	{
+		return usb::urb(0, usb::urb_type_control, wLength, NULL, false, 0, NULL, false, 0, 0, 0, 0, 0,
+		                devadr, bmRequestType & 0x80, bmRequestType, bRequest, wValue, 0, wLength);
+	}
+
+	void enumerate(loopback_transport& lb, uint8_t port, uint8_t address)
+	{
+		lb.power_on(port);
+		wait_port_status(lb, port, USB_VHCI_PORT_STAT_CONNECTION);
+		lb.reset(port);
+		wait_port_status(lb, port, USB_VHCI_PORT_STAT_ENABLE);
+		lb.clear_port_change(port, USB_VHCI_PORT_STAT_C_RESET);
+		lb.submit(control_urb(0, 0x00, URB_RQ_SET_ADDRESS, address, 0));
+		delete reap(lb);
+	}
+
+	// keeps depth urbs in flight; latency is measured from submit to reap
+	void stream(bench::report& r,
+	            const char* name,
+	            const char* side,
+	            loopback_transport& lb,
+	            const usb::urb& u,
+	            uint64_t n,
+	            unsigned depth)
+	{
+		std::vector<uint64_t> submitted(n);
+		bench::latencies lat;
+		lat.reserve(n);
+		const uint64_t start(bench::now());
+		const uint64_t allocs(bench::allocations());
+		uint64_t first(0), sent(0), done(0);
+		for(; sent < depth && sent < n; sent++)
+		{
+			submitted[sent] = bench::now();
+			uint64_t h(lb.submit(u));
+			if(!sent) first = h;
+		}
+		while(done < n)
+		{
+			usb::urb* d(reap(lb));
+			lat.add(bench::now() - submitted[d->get_handle() - first]);
+			if(d->get_status() != USB_VHCI_STATUS_SUCCESS) fail("urb failed");
+			if(d->is_in() && d->get_buffer_actual() != u.get_buffer_length()) fail("short transfer");
+			delete d;
+			done++;
+			if(sent < n)
+			{
+				submitted[sent++] = bench::now();
+				lb.submit(u);
+			}
+		}
+		const uint64_t elapsed(bench::now() - start);
+		r.begin(name);
+		r.summary(n, elapsed, lat, bench::allocations() - allocs);
+		r.field("hcd", side);
+		r.field("depth", static_cast<uint64_t>(depth));
+		r.field("buffer_length", static_cast<uint64_t>(u.get_buffer_length()));
+		r.field("bytes_per_sec", u.get_buffer_length() * n * 1e9 / elapsed);
+		r.end();
+	}
+
+	void run(bench::report& r, const char* side, loopback_transport& lb)
+	{
+		enumerate(lb, 1, 1);
+		stream(r, "control_roundtrip", side, lb, control_urb(1, 0x80, URB_RQ_GET_DESCRIPTOR, 0x0100, sizeof dev_desc), 20000, 1);
+		static const int32_t sizes[] = { 512, 4096, 65536 };
+		for(size_t i(0); i < sizeof sizes / sizeof *sizes; i++)
+		{
+			const int32_t size(sizes[i]);
+			const uint64_t n(std::min<uint64_t>(50000, (256u << 20) / size / 4));
+			usb::urb in(0, usb::urb_type_bulk, size, NULL, false, 0, NULL, false, 0, 0, 0, 0, 0,
+			            1, 0x81, 0, 0, 0, 0, 0);
+			stream(r, "bulk_in", side, lb, in, n, 8);
+			usb::urb out(0, usb::urb_type_bulk, size, NULL, false, 0, NULL, false, size, 0, 0, 0, 0,
+			             1, 0x01, 0, 0, 0, 0, 0);
+			stream(r, "bulk_out", side, lb, out, n, 8);
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	bench::report r(stdout, "remote");
+	{
+		loopback_transport lb;
+		local_hcd hcd(1, lb);
+		device dev(hcd);
+		run(r, "local", lb);
+	}
+	char path[64];
+	snprintf(path, sizeof path, "/tmp/remote_bench.%d.sock", static_cast<int>(getpid()));
+	{
+		loopback_transport lb;
+		local_hcd server_hcd(1, lb);
+		hcd_server server(server_hcd, path);
+		remote_hcd hcd(remote_hcd::connect(path));
+		device dev(hcd);
+		run(r, "remote", lb);
+	}
+	{
+		loopback_transport lb;
+		local_hcd server_hcd(1, lb);
+		hcd_server server(server_hcd, path, 64u << 20);
+		remote_hcd hcd(remote_hcd::connect(path));
+		device dev(hcd);
+		run(r, "remote_shared", lb);
+	}
+	return 0;
+}
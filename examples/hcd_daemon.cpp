@@ -0,0 +1,92 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This example creates a virtual usb host controller and serves it on a
+ * unix domain socket, so that the device emulation can run in a process of
+ * its own which attaches with usb::vhci::remote_hcd:
+ *
+ *     usb::vhci::remote_hcd hcd(usb::vhci::remote_hcd::connect(path));
+ *
+ * and then uses hcd like a local_hcd. Run
+ * "./hcd_daemon [socket path] [number of ports] [shared MiB]" in the
+ * examples subdirectory (as root, unless /dev/usb-vhci is accessible for
+ * all users), and stop it with ctrl-c. With a shared memory size, the urb
+ * payload is exchanged through a memfd mapped by both processes instead of
+ * being copied over the socket. When the emulator goes away, its devices
+ * are unplugged and the next one can attach.
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <iostream>
+#include "../src/libusb_vhci.h"
+
+int main(int argc, char** argv)
+{
+	const char* path(argc > 1 ? argv[1] : "/tmp/usb-vhci.sock");
+	const int ports(argc > 2 ? atoi(argv[2]) : 1);
+	const int shared(argc > 3 ? atoi(argv[3]) : 0);
+	if(ports < 1 || ports > 31)
+	{
+		std::cerr << "invalid number of ports" << std::endl;
+		return 1;
+	}
+	if(shared < 0 || shared > 4095)
+	{
+		std::cerr << "invalid shared memory size" << std::endl;
+		return 1;
+	}
+
+	// block the signals before any thread is created, so that only sigwait
+	// sees them
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	try
+	{
+		usb::vhci::local_hcd hcd(ports);
+		std::cout << "created " << hcd.get_bus_id() << " (bus# " << hcd.get_usb_bus_num() << ")" << std::endl;
+		usb::vhci::hcd_server server(hcd, path, static_cast<size_t>(shared) << 20);
+		std::cout << "listening on " << path << std::endl;
+		int sig;
+		sigwait(&set, &sig);
+		std::cout << "shutting down" << std::endl;
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "failed to start: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -100,15 +100,7 @@ const uint8_t conf_desc[] = {
 	0       // interface string
 };
 
-const uint8_t str0_desc[] = {
-	4,      // descriptor length
-	3,      // type: string
-	0x09,   // lang id: english (us)
-	0x04    //  "
-};
-
-const uint8_t* str1_desc =
-	reinterpret_cast<const uint8_t*>("\x1a\x03H\0e\0l\0l\0o\0 \0W\0o\0r\0l\0d\0!");
+const char* str1 = "Hello World!";
 
 void signal_work_enqueued(void* arg, usb::vhci::hcd& from) throw()
 {
@@ -122,85 +114,13 @@ void signal_work_enqueued(void* arg, usb::vhci::hcd& from) throw()
 	pthread_mutex_unlock(&has_work_mutex);
 }
 
+// the standard requests are answered by the descriptor_set in the
+// background thread of hcd, so everything arriving here is unsupported
 void process_urb(usb::urb* urb)
 {
-	if(!urb->is_control())
-	{
-		std::cout << "not CONTROL" << std::endl;
-		return;
-	}
-	if(urb->get_endpoint_number())
-	{
-		std::cout << "not ep0" << std::endl;
-		urb->stall();
-		return;
-	}
-
-	uint8_t rt(urb->get_bmRequestType());
-	uint8_t r(urb->get_bRequest());
-	if(rt == 0x00 && r == URB_RQ_SET_ADDRESS)
-	{
-		std::cout << "SET_ADDRESS" << std::endl;
-		urb->ack();
-	}
-	else if(rt == 0x00 && r == URB_RQ_SET_CONFIGURATION)
-	{
-		std::cout << "SET_CONFIGURATION" << std::endl;
-		urb->ack();
-	}
-	else if(rt == 0x00 && r == URB_RQ_SET_INTERFACE)
-	{
-		std::cout << "SET_INTERFACE" << std::endl;
-		urb->ack();
-	}
-	else if(rt == 0x80 && r == URB_RQ_GET_DESCRIPTOR)
-	{
-		std::cout << "GET_DESCRIPTOR" << std::endl;
-		int l(urb->get_wLength());
-		uint8_t* buffer(urb->get_buffer());
-		switch(urb->get_wValue() >> 8)
-		{
-		case 1:
-			std::cout << "DEVICE_DESCRIPTOR" << std::endl;
-			if(dev_desc[0] < l) l = dev_desc[0];
-			std::copy(dev_desc, dev_desc + l, buffer);
-			urb->set_buffer_actual(l);
-			urb->ack();
-			break;
-		case 2:
-			std::cout << "CONFIGURATION_DESCRIPTOR" << std::endl;
-			if(conf_desc[2] < l) l = conf_desc[2];
-			std::copy(conf_desc, conf_desc + l, buffer);
-			urb->set_buffer_actual(l);
-			urb->ack();
-			break;
-		case 3:
-			std::cout << "STRING_DESCRIPTOR" << std::endl;
-			switch(urb->get_wValue() & 0xff)
-			{
-			case 0:
-				if(str0_desc[0] < l) l = str0_desc[0];
-				std::copy(str0_desc, str0_desc + l, buffer);
-				urb->set_buffer_actual(l);
-				urb->ack();
-				break;
-			case 1:
-				if(str1_desc[0] < l) l = str1_desc[0];
-				std::copy(str1_desc, str1_desc + l, buffer);
-				urb->set_buffer_actual(l);
-				urb->ack();
-				break;
-			default:
-				urb->stall();
-				break;
-			}
-		default:
-			urb->stall();
-			break;
-		}
-	}
-	else
-		urb->stall();
+	std::cout << "unsupported request on ep 0x" << std::hex <<
+	             static_cast<int>(urb->get_endpoint_address()) << std::dec << std::endl;
+	urb->stall();
 }
 
 int main()
@@ -208,8 +128,13 @@ int main()
 	pthread_mutex_init(&has_work_mutex, NULL);
 	pthread_cond_init(&has_work_cv, NULL);
 
+	usb::descriptor_set descriptors(dev_desc, sizeof dev_desc);
+	descriptors.add_configuration(conf_desc, sizeof conf_desc);
+	descriptors.add_string(1, str1);
+
 	usb::vhci::local_hcd hcd(1);
 	std::cout << "created " << hcd.get_bus_id() << " (bus# " << hcd.get_usb_bus_num() << ")" << std::endl;
+	hcd.set_port_descriptors(1, &descriptors);
 	hcd.add_work_enqueued_callback(usb::vhci::hcd::callback(&signal_work_enqueued, NULL));
 
 	bool cont(false);
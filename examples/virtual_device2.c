@@ -174,6 +174,7 @@ void process_urb(struct usb_vhci_urb *urb)
 				urb->status = USB_VHCI_STATUS_STALL;
 				break;
 			}
+			break;
 		default:
 			urb->status = USB_VHCI_STATUS_STALL;
 			break;
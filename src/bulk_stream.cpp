@@ -0,0 +1,284 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+#include <algorithm>
+#include <new>
+#include "libusb_vhci.h"
+
+namespace usb
+{
+	namespace vhci
+	{
+		bulk_in_stream::bulk_in_stream(hcd& h, uint8_t port, uint8_t epadr, size_t capacity) throw(std::exception) :
+			owner(h),
+			port(port),
+			epadr(epadr),
+			ring(capacity),
+			written(0),
+			sent(0),
+			mark(0),
+			pending(),
+			_lock()
+		{
+			pthread_mutex_init(&_lock, NULL);
+			try { owner.set_endpoint_handler(port, epadr, this); }
+			catch(...)
+			{
+				pthread_mutex_destroy(&_lock);
+				throw;
+			}
+		}
+
+		bulk_in_stream::~bulk_in_stream() throw()
+		{
+			// passes the pending urbs to the application
+			try { owner.remove_endpoint_handler(port, epadr, this); }
+			catch(...) { }
+			pthread_mutex_destroy(&_lock);
+		}
+
+		size_t bulk_in_stream::write(const void* data, size_t size) volatile throw()
+		{
+			iovec iov;
+			iov.iov_base = const_cast<void*>(data);
+			iov.iov_len = size;
+			return writev(&iov, 1);
+		}
+
+		size_t bulk_in_stream::writev(const iovec* iov, int count) volatile throw()
+		{
+			bulk_in_stream& _this(const_cast<bulk_in_stream&>(*this));
+			size_t total(0);
+			for(int i(0); i < count; i++)
+			{
+				const size_t n(ring.write(iov[i].iov_base, iov[i].iov_len));
+				total += n;
+				if(n < iov[i].iov_len) break;
+			}
+			if(!total) return 0;
+			written += total;
+			_this.deliver();
+			return total;
+		}
+
+		void bulk_in_stream::flush() volatile throw()
+		{
+			bulk_in_stream& _this(const_cast<bulk_in_stream&>(*this));
+			{
+				lock _(_lock);
+				mark = written;
+			}
+			_this.deliver();
+		}
+
+		size_t bulk_in_stream::get_pending_count() volatile throw()
+		{
+			lock _(_lock);
+			return const_cast<bulk_in_stream&>(*this).pending.size();
+		}
+
+		// caller has _lock; false if there is not enough data for urb yet
+		bool bulk_in_stream::fill(usb::urb& urb) throw()
+		{
+			const size_t length(urb.get_buffer_length());
+			size_t n(written - sent);
+			if(n >= length)
+				n = length;
+			else if(static_cast<ptrdiff_t>(mark - sent) > 0)
+				n = mark - sent;
+			else
+				return false;
+			ring.read(urb.get_buffer(), n);
+			sent += n;
+			urb.set_buffer_actual(static_cast<int32_t>(n));
+			if(n < length && urb.is_short_not_ok())
+				urb.set_status(USB_VHCI_STATUS_SHORT_PACKET);
+			else
+				urb.ack();
+			return true;
+		}
+
+		// completes the pending urbs which can be filled now
+		void bulk_in_stream::deliver() throw()
+		{
+			for(;;)
+			{
+				process_urb_work* w;
+				{
+					lock _(_lock);
+					if(pending.empty() || !fill(*pending.front()->get_urb())) return;
+					w = pending.front();
+					pending.pop_front();
+				}
+				// outside of _lock, because owner calls release with its lock held
+				try { owner.complete_held(w); }
+				catch(...) { }
+			}
+		}
+
+		endpoint_handler::disposition bulk_in_stream::submit(hcd& from, process_urb_work* w) throw()
+		{
+			usb::urb& urb(*w->get_urb());
+			if(!urb.is_bulk()) return disposition_pass;
+			lock _(_lock);
+			// keep the order of the urbs
+			if(pending.empty() && fill(urb)) return disposition_complete;
+			try { pending.push_back(w); }
+			catch(std::bad_alloc) { return disposition_pass; }
+			return disposition_hold;
+		}
+
+		bool bulk_in_stream::release(hcd& from, process_urb_work* w) throw()
+		{
+			lock _(_lock);
+			std::deque<process_urb_work*>::iterator i(std::find(pending.begin(), pending.end(), w));
+			if(i == pending.end()) return false;
+			pending.erase(i);
+			return true;
+		}
+
+		bulk_out_stream::bulk_out_stream(hcd& h, uint8_t port, uint8_t epadr, size_t capacity) throw(std::exception) :
+			owner(h),
+			port(port),
+			epadr(epadr),
+			ring(capacity),
+			pending(),
+			offset(0),
+			_lock()
+		{
+			pthread_mutex_init(&_lock, NULL);
+			try { owner.set_endpoint_handler(port, epadr, this); }
+			catch(...)
+			{
+				pthread_mutex_destroy(&_lock);
+				throw;
+			}
+		}
+
+		bulk_out_stream::~bulk_out_stream() throw()
+		{
+			// passes the pending urbs to the application
+			try { owner.remove_endpoint_handler(port, epadr, this); }
+			catch(...) { }
+			pthread_mutex_destroy(&_lock);
+		}
+
+		size_t bulk_out_stream::read(void* data, size_t size) volatile throw()
+		{
+			iovec iov;
+			iov.iov_base = data;
+			iov.iov_len = size;
+			return readv(&iov, 1);
+		}
+
+		size_t bulk_out_stream::readv(const iovec* iov, int count) volatile throw()
+		{
+			bulk_out_stream& _this(const_cast<bulk_out_stream&>(*this));
+			size_t total(0);
+			for(int i(0); i < count; i++)
+			{
+				const size_t n(ring.read(iov[i].iov_base, iov[i].iov_len));
+				total += n;
+				if(n < iov[i].iov_len) break;
+			}
+			if(total) _this.make_room();
+			return total;
+		}
+
+		size_t bulk_out_stream::get_pending_count() volatile throw()
+		{
+			lock _(_lock);
+			return const_cast<bulk_out_stream&>(*this).pending.size();
+		}
+
+		// caller has _lock; moves what fits of urb (from offset on) into
+		// the ring and returns true if all of it is there
+		bool bulk_out_stream::drain(usb::urb& urb) throw()
+		{
+			const size_t length(urb.get_buffer_length());
+			offset += ring.write(urb.get_buffer() + offset, length - offset);
+			if(offset < length) return false;
+			offset = 0;
+			urb.set_buffer_actual(static_cast<int32_t>(length));
+			urb.ack();
+			return true;
+		}
+
+		// completes the pending urbs which fit into the ring now
+		void bulk_out_stream::make_room() throw()
+		{
+			for(;;)
+			{
+				process_urb_work* w;
+				{
+					lock _(_lock);
+					if(pending.empty() || !drain(*pending.front()->get_urb())) return;
+					w = pending.front();
+					pending.pop_front();
+				}
+				// outside of _lock, because owner calls release with its lock held
+				try { owner.complete_held(w); }
+				catch(...) { }
+			}
+		}
+
+		endpoint_handler::disposition bulk_out_stream::submit(hcd& from, process_urb_work* w) throw()
+		{
+			usb::urb& urb(*w->get_urb());
+			if(!urb.is_bulk()) return disposition_pass;
+			lock _(_lock);
+			// make room first, so that no data gets into the ring twice
+			try { pending.push_back(w); }
+			catch(std::bad_alloc) { return disposition_pass; }
+			if(pending.size() == 1 && drain(urb))
+			{
+				pending.pop_back();
+				return disposition_complete;
+			}
+			return disposition_hold;
+		}
+
+		bool bulk_out_stream::release(hcd& from, process_urb_work* w) throw()
+		{
+			lock _(_lock);
+			std::deque<process_urb_work*>::iterator i(std::find(pending.begin(), pending.end(), w));
+			if(i == pending.end()) return false;
+			// what is in the ring already stays there, like on a real device
+			if(i == pending.begin()) offset = 0;
+			pending.erase(i);
+			return true;
+		}
+	}
+}
@@ -0,0 +1,100 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <algorithm>
+#include "libusb_vhci.h"
+
+namespace usb
+{
+	namespace vhci
+	{
+		byte_ring::byte_ring(size_t capacity) throw(std::invalid_argument, std::bad_alloc) :
+			buf(NULL),
+			mask(0),
+			head(0),
+			tail(0)
+		{
+			if(!capacity || capacity > (~static_cast<size_t>(0) >> 1) + 1)
+				throw std::invalid_argument("capacity");
+			size_t c(1);
+			while(c < capacity) c <<= 1;
+			buf = new uint8_t[c];
+			mask = c - 1;
+		}
+
+		byte_ring::~byte_ring() throw()
+		{
+			delete[] buf;
+		}
+
+		size_t byte_ring::write(const void* data, size_t size) volatile throw()
+		{
+			byte_ring& _this(const_cast<byte_ring&>(*this));
+			const size_t h(head);
+			const size_t free(get_capacity() - (h - tail));
+			if(size > free) size = free;
+			if(!size) return 0;
+			// the consumer must have finished reading before we overwrite
+			__sync_synchronize();
+			const size_t at(h & mask);
+			const size_t first(std::min(size, get_capacity() - at));
+			memcpy(_this.buf + at, data, first);
+			memcpy(_this.buf, static_cast<const uint8_t*>(data) + first, size - first);
+			// publish the data before the new head
+			__sync_synchronize();
+			head = h + size;
+			return size;
+		}
+
+		size_t byte_ring::read(void* data, size_t size) volatile throw()
+		{
+			byte_ring& _this(const_cast<byte_ring&>(*this));
+			const size_t t(tail);
+			const size_t used(head - t);
+			if(size > used) size = used;
+			if(!size) return 0;
+			// see the data the producer published with head
+			__sync_synchronize();
+			const size_t at(t & mask);
+			const size_t first(std::min(size, get_capacity() - at));
+			memcpy(data, _this.buf + at, first);
+			memcpy(static_cast<uint8_t*>(data) + first, _this.buf, size - first);
+			// finish reading before the producer may reuse the space
+			__sync_synchronize();
+			tail = t + size;
+			return size;
+		}
+	}
+}
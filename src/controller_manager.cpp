@@ -0,0 +1,260 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "libusb_vhci.h"
+
+namespace
+{
+	// works fetched from one controller before the next one gets its turn
+	const int batch_size(32);
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		controller_manager::controller_manager(unsigned int threads, int poll_interval) throw(std::exception) :
+			reactors(),
+			placement(),
+			poll_interval(poll_interval),
+			shutdown(false),
+			_lock()
+		{
+			if(poll_interval <= 0) throw std::invalid_argument("poll_interval");
+			if(!threads)
+			{
+				long n(sysconf(_SC_NPROCESSORS_ONLN));
+				threads = (n > 0) ? n : 1;
+			}
+			pthread_mutex_init(&_lock, NULL);
+			try
+			{
+				reactors.reserve(threads);
+				for(unsigned int i(0); i < threads; i++)
+				{
+					_reactor* r(new _reactor(this));
+					reactors.push_back(r);
+					if((r->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+						throw std::exception();
+					if((r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+						throw std::exception();
+					epoll_event ev;
+					ev.events = EPOLLIN;
+					ev.data.ptr = NULL;
+					if(epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev) == -1)
+						throw std::exception();
+					pthread_t t;
+					if(pthread_create(&t, NULL, reactor_start, r))
+						throw std::exception();
+					r->thread = t;
+				}
+			}
+			catch(...)
+			{
+				stop();
+				pthread_mutex_destroy(&_lock);
+				throw;
+			}
+		}
+
+		controller_manager::~controller_manager() throw()
+		{
+			stop();
+			pthread_mutex_destroy(&_lock);
+		}
+
+		void controller_manager::stop() throw()
+		{
+			shutdown = true;
+			for(std::vector<_reactor*>::iterator i(reactors.begin()); i < reactors.end(); i++)
+			{
+				_reactor* r(*i);
+				if(r->thread != pthread_t())
+				{
+					wake(*r);
+					pthread_join(r->thread, NULL);
+				}
+				if(r->wake_fd != -1) close(r->wake_fd);
+				if(r->epoll_fd != -1) close(r->epoll_fd);
+				delete r;
+			}
+			reactors.clear();
+		}
+
+		void controller_manager::wake(_reactor& r) throw()
+		{
+			uint64_t v(1);
+			while(write(r.wake_fd, &v, sizeof v) == -1 && errno == EINTR);
+		}
+
+		unsigned int controller_manager::get_thread_count() const volatile throw()
+		{
+			return const_cast<const controller_manager&>(*this).reactors.size();
+		}
+
+		size_t controller_manager::get_controller_count() const volatile throw()
+		{
+			controller_manager& _this(const_cast<controller_manager&>(*this));
+			lock _(_this._lock);
+			return _this.placement.size();
+		}
+
+		void controller_manager::add(local_hcd& h) volatile throw(std::exception)
+		{
+			controller_manager& _this(const_cast<controller_manager&>(*this));
+			lock _(_this._lock);
+			// least loaded reactor
+			_reactor* r(_this.reactors.front());
+			for(std::vector<_reactor*>::iterator i(_this.reactors.begin()); i < _this.reactors.end(); i++)
+				if((*i)->controllers.size() < r->controllers.size())
+					r = *i;
+			std::pair<std::map<local_hcd*, _reactor*>::iterator, bool> p(_this.placement.insert(std::make_pair(&h, r)));
+			if(!p.second) throw std::invalid_argument("h");
+			try
+			{
+				lock __(r->_lock);
+				r->controllers.insert(&h);
+				int fd(h.trans->get_poll_fd());
+				epoll_event ev;
+				ev.events = EPOLLIN;
+				ev.data.ptr = &h;
+				if(fd == -1 || epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+				{
+					// EPERM: the descriptor does not support polling
+					if(fd != -1 && errno != EPERM)
+					{
+						r->controllers.erase(&h);
+						throw std::exception();
+					}
+					try { r->polled.push_back(&h); }
+					catch(...)
+					{
+						r->controllers.erase(&h);
+						throw;
+					}
+					wake(*r);
+				}
+			}
+			catch(...)
+			{
+				_this.placement.erase(p.first);
+				throw;
+			}
+		}
+
+		void controller_manager::remove(local_hcd& h) volatile throw()
+		{
+			controller_manager& _this(const_cast<controller_manager&>(*this));
+			lock _(_this._lock);
+			std::map<local_hcd*, _reactor*>::iterator p(_this.placement.find(&h));
+			if(p == _this.placement.end()) return;
+			_reactor& r(*p->second);
+			_this.placement.erase(p);
+			// waits for the reactor to leave h
+			lock __(r._lock);
+			int fd(h.trans->get_poll_fd());
+			if(fd != -1) epoll_ctl(r.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			r.controllers.erase(&h);
+			for(std::vector<local_hcd*>::iterator i(r.polled.begin()); i < r.polled.end(); i++)
+			{
+				if(*i == &h)
+				{
+					r.polled.erase(i);
+					break;
+				}
+			}
+		}
+
+		void* controller_manager::reactor_start(void* r) throw()
+		{
+			_reactor& _r(*reinterpret_cast<_reactor*>(r));
+			_r.owner->run(_r);
+			return NULL;
+		}
+
+		bool controller_manager::drive(local_hcd& h) throw()
+		{
+			// running out of mem must not make the reactor wait, so works
+			// which cannot be queued are deferred
+			for(int i(0); i < batch_size && h.process_work(0, true); i++);
+			return h.has_deferred_work();
+		}
+
+		void controller_manager::run(_reactor& r) volatile throw()
+		{
+			epoll_event ev[64];
+			while(!shutdown)
+			{
+				int timeout;
+				{
+					lock _(r._lock);
+					timeout = (r.polled.empty() && !r.deferred) ? -1 : poll_interval;
+				}
+				int n(epoll_wait(r.epoll_fd, ev, sizeof ev / sizeof *ev, timeout));
+				if(n == -1)
+				{
+					if(errno == EINTR) continue;
+					// TODO: debug msg
+					n = 0;
+				}
+				lock _(r._lock);
+				bool deferred(false);
+				for(int i(0); i < n; i++)
+				{
+					if(!ev[i].data.ptr)
+					{
+						uint64_t v;
+						while(read(r.wake_fd, &v, sizeof v) == -1 && errno == EINTR);
+						continue;
+					}
+					// h may have been removed while we were waiting
+					local_hcd* h(reinterpret_cast<local_hcd*>(ev[i].data.ptr));
+					if(r.controllers.count(h) && drive(*h)) deferred = true;
+				}
+				for(std::vector<local_hcd*>::iterator i(r.polled.begin()); i < r.polled.end(); i++)
+					if(drive(**i)) deferred = true;
+				// the descriptor does not report a deferred work again
+				if(r.deferred)
+				{
+					for(std::set<local_hcd*>::iterator i(r.controllers.begin()); i != r.controllers.end(); i++)
+						if((*i)->has_deferred_work() && drive(**i)) deferred = true;
+				}
+				r.deferred = deferred;
+			}
+		}
+	}
+}
@@ -0,0 +1,153 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "libusb_vhci.h"
+
+namespace usb
+{
+	namespace vhci
+	{
+		controller_pool::controller_pool(unsigned int count, uint8_t ports, controller_manager* m) throw(std::exception) :
+			port_count(ports),
+			manager(m),
+			idle(),
+			leased(),
+			_lock()
+		{
+			pthread_mutex_init(&_lock, NULL);
+			try
+			{
+				idle.reserve(count);
+				for(unsigned int i(0); i < count; i++)
+					idle.push_back(m ? new local_hcd(ports, *m) : new local_hcd(ports));
+			}
+			catch(...)
+			{
+				for(std::vector<local_hcd*>::iterator i(idle.begin()); i < idle.end(); i++)
+					delete *i;
+				pthread_mutex_destroy(&_lock);
+				throw;
+			}
+		}
+
+		controller_pool::~controller_pool() throw()
+		{
+			// let the threads stop in parallel rather than one after the other
+			for(std::vector<local_hcd*>::iterator i(idle.begin()); i < idle.end(); i++)
+				(*i)->shutdown();
+			for(std::set<local_hcd*>::iterator i(leased.begin()); i != leased.end(); i++)
+				(*i)->shutdown();
+			for(std::vector<local_hcd*>::iterator i(idle.begin()); i < idle.end(); i++)
+				delete *i;
+			for(std::set<local_hcd*>::iterator i(leased.begin()); i != leased.end(); i++)
+				delete *i;
+			pthread_mutex_destroy(&_lock);
+		}
+
+		void controller_pool::add(local_hcd* h) volatile throw(std::invalid_argument, std::bad_alloc)
+		{
+			if(!h) throw std::invalid_argument("h");
+			if(h->get_port_count() != port_count) throw std::invalid_argument("h");
+			controller_pool& _this(const_cast<controller_pool&>(*this));
+			lock _(_this._lock);
+			_this.idle.push_back(h);
+		}
+
+		local_hcd& controller_pool::acquire() volatile throw(std::exception)
+		{
+			controller_pool& _this(const_cast<controller_pool&>(*this));
+			{
+				lock _(_this._lock);
+				if(!_this.idle.empty())
+				{
+					local_hcd* h(_this.idle.back());
+					_this.leased.insert(h);
+					_this.idle.pop_back();
+					return *h;
+				}
+			}
+			// the pool ran dry; this is the slow path the pool is there to avoid
+			local_hcd* h(_this.manager ? new local_hcd(port_count, *_this.manager) : new local_hcd(port_count));
+			try
+			{
+				lock _(_this._lock);
+				_this.leased.insert(h);
+			}
+			catch(...)
+			{
+				delete h;
+				throw;
+			}
+			return *h;
+		}
+
+		void controller_pool::release(local_hcd& h) volatile throw(std::exception)
+		{
+			controller_pool& _this(const_cast<controller_pool&>(*this));
+			{
+				lock _(_this._lock);
+				// taken out right away, so that a second release of h fails
+				// instead of putting it into idle twice
+				if(!_this.leased.erase(&h)) throw std::invalid_argument("h");
+			}
+			try
+			{
+				h.reset();
+				lock _(_this._lock);
+				_this.idle.push_back(&h);
+			}
+			catch(...)
+			{
+				// the caller still holds it
+				lock _(_this._lock);
+				_this.leased.insert(&h);
+				throw;
+			}
+		}
+
+		size_t controller_pool::get_idle_count() const volatile throw()
+		{
+			controller_pool& _this(const_cast<controller_pool&>(*this));
+			lock _(_this._lock);
+			return _this.idle.size();
+		}
+
+		size_t controller_pool::get_leased_count() const volatile throw()
+		{
+			controller_pool& _this(const_cast<controller_pool&>(*this));
+			lock _(_this._lock);
+			return _this.leased.size();
+		}
+	}
+}
@@ -0,0 +1,307 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+#include <time.h>
+#include "libusb_vhci.h"
+
+namespace
+{
+	// time constant of the urb rate in nanoseconds; with one second the
+	// decaying urb counter approximates urbs per second
+	const double rate_tau(1e9);
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		controller_set::controller_set() throw() :
+			controllers(),
+			work_enqueued_callbacks(),
+			next(0),
+			_lock()
+		{
+			pthread_mutex_init(&_lock, NULL);
+		}
+
+		controller_set::controller_set(unsigned int count, uint8_t ports, controller_manager* m) throw(std::exception) :
+			controllers(),
+			work_enqueued_callbacks(),
+			next(0),
+			_lock()
+		{
+			pthread_mutex_init(&_lock, NULL);
+			try
+			{
+				controllers.reserve(count);
+				for(unsigned int i(0); i < count; i++)
+				{
+					local_hcd* h(m ? new local_hcd(ports, *m) : new local_hcd(ports));
+					try { controllers.push_back(_controller(h, true)); }
+					catch(...)
+					{
+						delete h;
+						throw;
+					}
+				}
+			}
+			catch(...)
+			{
+				for(std::vector<_controller>::iterator i(controllers.begin()); i < controllers.end(); i++)
+					delete i->hcd;
+				pthread_mutex_destroy(&_lock);
+				throw;
+			}
+		}
+
+		controller_set::~controller_set() throw()
+		{
+			// let the threads stop in parallel rather than one after the other
+			for(std::vector<_controller>::iterator i(controllers.begin()); i < controllers.end(); i++)
+				if(i->own) i->hcd->shutdown();
+			for(std::vector<_controller>::iterator i(controllers.begin()); i < controllers.end(); i++)
+			{
+				for(std::vector<hcd::callback>::const_iterator c(work_enqueued_callbacks.begin());
+				    c < work_enqueued_callbacks.end();
+				    c++)
+				{
+					i->hcd->remove_work_enqueued_callback(*c);
+				}
+				if(i->own) delete i->hcd;
+			}
+			pthread_mutex_destroy(&_lock);
+		}
+
+		uint64_t controller_set::now() throw()
+		{
+			timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+		}
+
+		double controller_set::decayed(const _port& p, uint64_t t) throw()
+		{
+			if(t <= p.stamp) return p.rate;
+			return p.rate * exp(-static_cast<double>(t - p.stamp) / rate_tau);
+		}
+
+		// caller has _lock
+		controller_set::_port& controller_set::slot(const placement& p, bool used) throw(std::invalid_argument)
+		{
+			for(std::vector<_controller>::iterator i(controllers.begin()); i < controllers.end(); i++)
+			{
+				if(i->hcd != p.controller) continue;
+				if(!p.port || p.port > i->ports.size() || i->ports[p.port - 1].used != used)
+					break;
+				return i->ports[p.port - 1];
+			}
+			throw std::invalid_argument("p");
+		}
+
+		// caller has _lock
+		controller_set::placement controller_set::place(uint64_t t) throw(std::out_of_range)
+		{
+			placement best;
+			double best_load(0.0);
+			for(std::vector<_controller>::iterator i(controllers.begin()); i < controllers.end(); i++)
+			{
+				uint8_t free_port(0);
+				double load(0.0);
+				for(size_t j(0); j < i->ports.size(); j++)
+				{
+					if(i->ports[j].used)
+						load += 1.0 + decayed(i->ports[j], t);
+					else if(!free_port)
+						free_port = j + 1;
+				}
+				if(free_port && (!best.controller || load < best_load))
+				{
+					best = placement(i->hcd, free_port);
+					best_load = load;
+				}
+			}
+			if(!best.controller) throw std::out_of_range("ports");
+			return best;
+		}
+
+		void controller_set::add(local_hcd& h) volatile throw(std::bad_alloc)
+		{
+			controller_set& _this(const_cast<controller_set&>(*this));
+			lock _(_this._lock);
+			_this.controllers.push_back(_controller(&h, false));
+			for(std::vector<hcd::callback>::const_iterator c(_this.work_enqueued_callbacks.begin());
+			    c < _this.work_enqueued_callbacks.end();
+			    c++)
+			{
+				h.add_work_enqueued_callback(*c);
+			}
+		}
+
+		size_t controller_set::get_controller_count() const volatile throw()
+		{
+			controller_set& _this(const_cast<controller_set&>(*this));
+			lock _(_this._lock);
+			return _this.controllers.size();
+		}
+
+		local_hcd& controller_set::get_controller(size_t index) volatile throw(std::out_of_range)
+		{
+			controller_set& _this(const_cast<controller_set&>(*this));
+			lock _(_this._lock);
+			if(index >= _this.controllers.size()) throw std::out_of_range("index");
+			return *_this.controllers[index].hcd;
+		}
+
+		controller_set::placement controller_set::connect(usb::data_rate rate) volatile throw(std::exception)
+		{
+			controller_set& _this(const_cast<controller_set&>(*this));
+			lock _(_this._lock);
+			uint64_t t(now());
+			placement p(_this.place(t));
+			_port& s(_this.slot(p, false));
+			p.controller->port_connect(p.port, rate);
+			s.used = true;
+			s.rate = 0.0;
+			s.stamp = t;
+			return p;
+		}
+
+		void controller_set::disconnect(const placement& p) volatile throw(std::exception)
+		{
+			controller_set& _this(const_cast<controller_set&>(*this));
+			lock _(_this._lock);
+			_port& s(_this.slot(p, true));
+			p.controller->port_disconnect(p.port);
+			s.used = false;
+		}
+
+		controller_set::placement controller_set::reconnect(const placement& p, usb::data_rate rate) volatile throw(std::exception)
+		{
+			controller_set& _this(const_cast<controller_set&>(*this));
+			lock _(_this._lock);
+			uint64_t t(now());
+			_port& s(_this.slot(p, true));
+			p.controller->port_disconnect(p.port);
+			s.used = false;
+			const double r(decayed(s, t));
+			// the old port counts as free now, so the device may stay
+			placement np(_this.place(t));
+			_port& ns(_this.slot(np, false));
+			np.controller->port_connect(np.port, rate);
+			ns.used = true;
+			ns.rate = r;
+			ns.stamp = t;
+			return np;
+		}
+
+		double controller_set::get_rate(const placement& p) volatile throw(std::invalid_argument)
+		{
+			controller_set& _this(const_cast<controller_set&>(*this));
+			lock _(_this._lock);
+			return decayed(_this.slot(p, true), now());
+		}
+
+		double controller_set::get_load(size_t index) volatile throw(std::out_of_range)
+		{
+			controller_set& _this(const_cast<controller_set&>(*this));
+			lock _(_this._lock);
+			if(index >= _this.controllers.size()) throw std::out_of_range("index");
+			const std::vector<_port>& ports(_this.controllers[index].ports);
+			uint64_t t(now());
+			double load(0.0);
+			for(std::vector<_port>::const_iterator i(ports.begin()); i < ports.end(); i++)
+				if(i->used) load += 1.0 + decayed(*i, t);
+			return load;
+		}
+
+		void controller_set::add_work_enqueued_callback(hcd::callback c) volatile throw(std::bad_alloc)
+		{
+			controller_set& _this(const_cast<controller_set&>(*this));
+			lock _(_this._lock);
+			_this.work_enqueued_callbacks.push_back(c);
+			for(std::vector<_controller>::iterator i(_this.controllers.begin()); i < _this.controllers.end(); i++)
+				i->hcd->add_work_enqueued_callback(c);
+		}
+
+		void controller_set::remove_work_enqueued_callback(hcd::callback c) volatile throw()
+		{
+			controller_set& _this(const_cast<controller_set&>(*this));
+			lock _(_this._lock);
+			std::vector<hcd::callback>& wec(_this.work_enqueued_callbacks);
+			for(std::vector<hcd::callback>::iterator i(wec.begin()); i < wec.end(); i++)
+			{
+				if(*i == c)
+				{
+					wec.erase(i);
+					break;
+				}
+			}
+			for(std::vector<_controller>::iterator i(_this.controllers.begin()); i < _this.controllers.end(); i++)
+				i->hcd->remove_work_enqueued_callback(c);
+		}
+
+		bool controller_set::next_work(local_hcd** from, work** w) volatile throw(std::bad_alloc)
+		{
+			controller_set& _this(const_cast<controller_set&>(*this));
+			lock _(_this._lock);
+			*from = NULL;
+			*w = NULL;
+			const size_t n(_this.controllers.size());
+			for(size_t i(0); i < n; i++)
+			{
+				_controller& c(_this.controllers[(_this.next + i) % n]);
+				c.hcd->next_work(w);
+				if(!*w) continue;
+				_this.next = (_this.next + i + 1) % n;
+				*from = c.hcd;
+				if(process_urb_work* uw = dynamic_cast<process_urb_work*>(*w))
+				{
+					uint8_t port(uw->get_port());
+					if(port && port <= c.ports.size() && c.ports[port - 1].used)
+					{
+						_port& s(c.ports[port - 1]);
+						uint64_t t(now());
+						s.rate = decayed(s, t) + 1.0;
+						s.stamp = t;
+					}
+				}
+				// only a round without any work says that all are empty; the
+				// more flag of c says nothing about the others
+				return true;
+			}
+			return false;
+		}
+	}
+}
@@ -0,0 +1,264 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <algorithm>
+#include "libusb_vhci.h"
+
+namespace usb
+{
+	descriptor_set::descriptor_set(const uint8_t* device, size_t length) throw(std::invalid_argument, std::bad_alloc) :
+		blob(),
+		entries(),
+		configurations(),
+		langids()
+	{
+		if(!device) throw std::invalid_argument("device");
+		if(length != 18 || device[0] != 18 || device[1] != 1) throw std::invalid_argument("device");
+		put(1, 0, 0, device, length);
+	}
+
+	void descriptor_set::put(uint8_t type, uint8_t index, uint16_t langid, const uint8_t* desc, size_t length) throw(std::bad_alloc)
+	{
+		const size_t offset(blob.size());
+		blob.insert(blob.end(), desc, desc + length);
+		// a replaced descriptor leaves its old bytes behind
+		for(std::vector<_entry>::iterator i(entries.begin()); i < entries.end(); i++)
+		{
+			if(i->type == type && i->index == index && i->langid == langid)
+			{
+				i->offset = offset;
+				i->length = length;
+				return;
+			}
+		}
+		_entry e;
+		e.type = type;
+		e.index = index;
+		e.langid = langid;
+		e.offset = offset;
+		e.length = length;
+		try { entries.push_back(e); }
+		catch(...)
+		{
+			blob.resize(offset);
+			throw;
+		}
+	}
+
+	const descriptor_set::_entry* descriptor_set::find(uint8_t type, uint8_t index, uint16_t langid) const throw()
+	{
+		const _entry* fallback(NULL);
+		for(std::vector<_entry>::const_iterator i(entries.begin()); i < entries.end(); i++)
+		{
+			if(i->type != type || i->index != index) continue;
+			if(i->langid == langid) return &*i;
+			// strings are returned in any language if the requested one is missing
+			if(!fallback && type == 3 && index) fallback = &*i;
+		}
+		return fallback;
+	}
+
+	const descriptor_set::_configuration* descriptor_set::find_configuration(uint8_t value) const throw()
+	{
+		for(std::vector<_configuration>::const_iterator i(configurations.begin()); i < configurations.end(); i++)
+			if(i->value == value)
+				return &*i;
+		return NULL;
+	}
+
+	bool descriptor_set::has_interface(const _configuration& c, uint8_t number, int alternate) throw()
+	{
+		for(std::vector<uint16_t>::const_iterator i(c.interfaces.begin()); i < c.interfaces.end(); i++)
+			if((*i >> 8) == number && (alternate == -1 || (*i & 0xff) == alternate))
+				return true;
+		return false;
+	}
+
+	void descriptor_set::add_configuration(const uint8_t* desc, size_t length) throw(std::invalid_argument, std::bad_alloc)
+	{
+		if(!desc) throw std::invalid_argument("desc");
+		if(length < 9 || length > 0xffff || desc[0] != 9 || desc[1] != 2) throw std::invalid_argument("desc");
+		if(static_cast<size_t>(desc[2] | desc[3] << 8) != length) throw std::invalid_argument("length");
+		if(!desc[5] || find_configuration(desc[5])) throw std::invalid_argument("desc");
+		// bNumConfigurations of the device descriptor
+		if(configurations.size() >= blob[17]) throw std::invalid_argument("desc");
+		_configuration c(desc[5], desc[7]);
+		uint8_t numbers(0);
+		for(size_t pos(0); pos < length; pos += desc[pos])
+		{
+			if(desc[pos] < 2 || pos + desc[pos] > length) throw std::invalid_argument("desc");
+			if(desc[pos + 1] != 4) continue;
+			if(desc[pos] < 9) throw std::invalid_argument("desc");
+			const uint8_t number(desc[pos + 2]), alternate(desc[pos + 3]);
+			if(number >= sizeof device_state().alternate_setting) throw std::invalid_argument("desc");
+			if(has_interface(c, number, alternate)) throw std::invalid_argument("desc");
+			if(!has_interface(c, number, -1)) numbers++;
+			c.interfaces.push_back(number << 8 | alternate);
+		}
+		if(numbers != desc[4]) throw std::invalid_argument("desc");
+		put(2, configurations.size(), 0, desc, length);
+		configurations.push_back(c);
+	}
+
+	void descriptor_set::add_string(uint8_t index, const uint8_t* desc, size_t length, uint16_t langid) throw(std::invalid_argument, std::bad_alloc)
+	{
+		if(!index) throw std::invalid_argument("index");
+		if(!desc) throw std::invalid_argument("desc");
+		if(length < 2 || length > 0xff || length & 1 || desc[0] != length || desc[1] != 3)
+			throw std::invalid_argument("desc");
+		if(std::find(langids.begin(), langids.end(), langid) == langids.end())
+		{
+			if(langids.size() >= 126) throw std::invalid_argument("langid");
+			langids.push_back(langid);
+			std::vector<uint8_t> d(2 + 2 * langids.size());
+			d[0] = d.size();
+			d[1] = 3;
+			for(size_t i(0); i < langids.size(); i++)
+			{
+				d[2 + 2 * i] = langids[i] & 0xff;
+				d[3 + 2 * i] = langids[i] >> 8;
+			}
+			put(3, 0, 0, &d[0], d.size());
+		}
+		put(3, index, langid, desc, length);
+	}
+
+	void descriptor_set::add_string(uint8_t index, const char* text, uint16_t langid) throw(std::invalid_argument, std::bad_alloc)
+	{
+		if(!text) throw std::invalid_argument("text");
+		const size_t l(strlen(text));
+		if(l > 126) throw std::invalid_argument("text");
+		std::vector<uint8_t> d(2 + 2 * l);
+		d[0] = d.size();
+		d[1] = 3;
+		for(size_t i(0); i < l; i++)
+			d[2 + 2 * i] = static_cast<uint8_t>(text[i]);
+		add_string(index, &d[0], d.size(), langid);
+	}
+
+	void descriptor_set::add_descriptor(uint8_t type, uint8_t index, const uint8_t* desc, size_t length) throw(std::invalid_argument, std::bad_alloc)
+	{
+		if(type >= 1 && type <= 3) throw std::invalid_argument("type");
+		if(!desc) throw std::invalid_argument("desc");
+		if(length < 2 || length > 0xffff || desc[1] != type) throw std::invalid_argument("desc");
+		put(type, index, 0, desc, length);
+	}
+
+	void descriptor_set::respond(usb::urb& urb, const uint8_t* data, size_t length) const throw()
+	{
+		size_t l(std::min<size_t>(length, urb.get_wLength()));
+		if(l > static_cast<size_t>(urb.get_buffer_length())) l = urb.get_buffer_length();
+		if(l) memcpy(urb.get_buffer(), data, l);
+		urb.set_buffer_actual(l);
+		urb.ack();
+	}
+
+	bool descriptor_set::handle(usb::urb& urb, device_state& state) const throw()
+	{
+		if(!urb.is_control() || urb.get_endpoint_number()) return false;
+		const uint8_t rt(urb.get_bmRequestType());
+		const uint16_t value(urb.get_wValue()), index(urb.get_wIndex());
+		const _configuration* c(find_configuration(state.configuration));
+		switch(urb.get_bRequest())
+		{
+		case URB_RQ_GET_DESCRIPTOR:
+		{
+			if(rt != 0x80) return false;
+			const uint8_t type(value >> 8);
+			const _entry* e(find(type, value & 0xff, (type == 3) ? index : 0));
+			if(e) respond(urb, &blob[e->offset], e->length);
+			else urb.stall();
+			return true;
+		}
+		case URB_RQ_GET_STATUS:
+		{
+			uint8_t status[2] = { 0, 0 };
+			if(rt == 0x80)
+			{
+				// self powered bit; an unconfigured device reports the first configuration
+				if(!c && !configurations.empty()) c = &configurations[0];
+				if(c && c->attributes & 0x40) status[0] = 1;
+			}
+			else if(rt == 0x81)
+			{
+				if(!c || index > 0xff || !has_interface(*c, index, -1))
+				{
+					urb.stall();
+					return true;
+				}
+			}
+			else return false;
+			respond(urb, status, sizeof status);
+			return true;
+		}
+		case URB_RQ_GET_CONFIGURATION:
+			if(rt != 0x80) return false;
+			respond(urb, &state.configuration, 1);
+			return true;
+		case URB_RQ_SET_CONFIGURATION:
+			if(rt != 0x00) return false;
+			if(value > 0xff || (value && !find_configuration(value)))
+				urb.stall();
+			else
+			{
+				state.reset();
+				state.configuration = value;
+				urb.set_buffer_actual(0);
+				urb.ack();
+			}
+			return true;
+		case URB_RQ_GET_INTERFACE:
+			if(rt != 0x81) return false;
+			if(!c || index > 0xff || !has_interface(*c, index, -1))
+				urb.stall();
+			else
+				respond(urb, &state.alternate_setting[index], 1);
+			return true;
+		case URB_RQ_SET_INTERFACE:
+			if(rt != 0x01) return false;
+			if(!c || index > 0xff || value > 0xff || !has_interface(*c, index, value))
+				urb.stall();
+			else
+			{
+				state.alternate_setting[index] = value;
+				urb.set_buffer_actual(0);
+				urb.ack();
+			}
+			return true;
+		default:
+			return false;
+		}
+	}
+}
@@ -0,0 +1,258 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "libusb_vhci.h"
+
+namespace
+{
+	const uint32_t HANDOFF_MAGIC(0x48484356);
+	const uint16_t HANDOFF_VERSION(1);
+
+	struct handoff_header
+	{
+		uint32_t magic;
+		uint16_t version;
+		uint16_t bus_id_length;
+		int32_t id;
+		int32_t usb_bus_num;
+		uint8_t port_count;
+		uint8_t reserved[3];
+	};
+
+	struct handoff_port
+	{
+		uint8_t adr;
+		uint8_t flags;
+		uint16_t status;
+		uint16_t change;
+		uint8_t configuration;
+		uint8_t reserved;
+		uint8_t alternate_setting[32];
+	};
+
+	// waits up to timeout milliseconds (-1 forever) for more data
+	bool wait_readable(int socket, int timeout) throw()
+	{
+		pollfd p;
+		p.fd = socket;
+		p.events = POLLIN;
+		int res;
+		while((res = poll(&p, 1, timeout)) == -1 && errno == EINTR);
+		if(res == 0) errno = ETIMEDOUT;
+		return res > 0;
+	}
+
+	bool read_all(int socket, uint8_t* buf, size_t len, int timeout) throw()
+	{
+		while(len)
+		{
+			if(!wait_readable(socket, timeout)) return false;
+			ssize_t n(recv(socket, buf, len, 0));
+			if(n == -1)
+			{
+				if(errno == EINTR || errno == EAGAIN) continue;
+				return false;
+			}
+			if(n == 0)
+			{
+				errno = EPROTO;
+				return false;
+			}
+			buf += n;
+			len -= n;
+		}
+		return true;
+	}
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		controller_handoff::controller_handoff() throw() :
+			fd(-1),
+			id(),
+			usb_bus_num(),
+			bus_id(),
+			ports()
+		{
+		}
+
+		controller_handoff::~controller_handoff() throw()
+		{
+			if(fd != -1) usb_vhci_close(fd);
+		}
+
+		const controller_handoff::port& controller_handoff::get_port(uint8_t port) const throw(std::invalid_argument, std::out_of_range)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > ports.size()) throw std::out_of_range("port");
+			return ports[port - 1];
+		}
+
+		void controller_handoff::send(int socket) const throw(std::exception)
+		{
+			if(bus_id.size() > 0xffff) throw std::invalid_argument("bus_id");
+			std::vector<uint8_t> buf(sizeof(handoff_header) + bus_id.size() + ports.size() * sizeof(handoff_port));
+			handoff_header& h(*reinterpret_cast<handoff_header*>(&buf[0]));
+			h.magic = HANDOFF_MAGIC;
+			h.version = HANDOFF_VERSION;
+			h.bus_id_length = bus_id.size();
+			h.id = id;
+			h.usb_bus_num = usb_bus_num;
+			h.port_count = ports.size();
+			memcpy(&buf[sizeof h], bus_id.data(), bus_id.size());
+			// the entries follow the bus id right away, so they are not aligned
+			uint8_t* at(&buf[sizeof h + bus_id.size()]);
+			for(size_t i(0); i < ports.size(); i++, at += sizeof(handoff_port))
+			{
+				handoff_port p;
+				memset(&p, 0, sizeof p);
+				p.adr = ports[i].adr;
+				p.flags = ports[i].stat.get_flags();
+				p.status = ports[i].stat.get_status();
+				p.change = ports[i].stat.get_change();
+				p.configuration = ports[i].state.configuration;
+				memcpy(p.alternate_setting, ports[i].state.alternate_setting, sizeof p.alternate_setting);
+				memcpy(at, &p, sizeof p);
+			}
+
+			// the descriptor travels with the first byte
+			iovec iov;
+			iov.iov_base = &buf[0];
+			iov.iov_len = buf.size();
+			msghdr m;
+			memset(&m, 0, sizeof m);
+			m.msg_iov = &iov;
+			m.msg_iovlen = 1;
+			union
+			{
+				cmsghdr c;
+				uint8_t buf[CMSG_SPACE(sizeof(int))];
+			} control;
+			memset(&control, 0, sizeof control);
+			m.msg_control = control.buf;
+			m.msg_controllen = sizeof control.buf;
+			cmsghdr* c(CMSG_FIRSTHDR(&m));
+			c->cmsg_level = SOL_SOCKET;
+			c->cmsg_type = SCM_RIGHTS;
+			c->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(c), &fd, sizeof fd);
+			ssize_t n;
+			while((n = sendmsg(socket, &m, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+			if(n == -1) throw std::exception();
+			for(size_t off(n); off < buf.size(); off += n)
+			{
+				while((n = ::send(socket, &buf[off], buf.size() - off, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+				if(n == -1) throw std::exception();
+			}
+		}
+
+		void controller_handoff::receive(int socket, int timeout) throw(std::exception)
+		{
+			if(fd != -1)
+			{
+				errno = EBUSY;
+				throw std::exception();
+			}
+			handoff_header h;
+			if(!wait_readable(socket, timeout)) throw std::exception();
+			iovec iov;
+			iov.iov_base = &h;
+			iov.iov_len = sizeof h;
+			msghdr m;
+			memset(&m, 0, sizeof m);
+			m.msg_iov = &iov;
+			m.msg_iovlen = 1;
+			union
+			{
+				cmsghdr c;
+				uint8_t buf[CMSG_SPACE(sizeof(int))];
+			} control;
+			memset(&control, 0, sizeof control);
+			m.msg_control = control.buf;
+			m.msg_controllen = sizeof control.buf;
+			ssize_t n;
+			while((n = recvmsg(socket, &m, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+			if(n == -1) throw std::exception();
+			int received(-1);
+			for(cmsghdr* c(CMSG_FIRSTHDR(&m)); c; c = CMSG_NXTHDR(&m, c))
+				if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len >= CMSG_LEN(sizeof(int)))
+					memcpy(&received, CMSG_DATA(c), sizeof received);
+			try
+			{
+				if(n == 0 || received == -1 || (m.msg_flags & MSG_CTRUNC))
+				{
+					errno = EPROTO;
+					throw std::exception();
+				}
+				if(!read_all(socket, reinterpret_cast<uint8_t*>(&h) + n, sizeof h - n, timeout)) throw std::exception();
+				if(h.magic != HANDOFF_MAGIC || h.version != HANDOFF_VERSION || !h.port_count)
+				{
+					errno = EPROTO;
+					throw std::exception();
+				}
+				std::vector<uint8_t> buf(h.bus_id_length + h.port_count * sizeof(handoff_port));
+				if(!read_all(socket, &buf[0], buf.size(), timeout)) throw std::exception();
+				std::vector<port> _ports(h.port_count);
+				// not aligned, see send
+				for(uint8_t i(0); i < h.port_count; i++)
+				{
+					handoff_port p;
+					memcpy(&p, &buf[h.bus_id_length + i * sizeof p], sizeof p);
+					_ports[i].adr = p.adr;
+					_ports[i].stat = port_stat(p.status, p.change, p.flags);
+					_ports[i].state.configuration = p.configuration;
+					memcpy(_ports[i].state.alternate_setting, p.alternate_setting, sizeof p.alternate_setting);
+				}
+				bus_id.assign(reinterpret_cast<const char*>(&buf[0]), h.bus_id_length);
+				ports.swap(_ports);
+			}
+			catch(...)
+			{
+				int err(errno);
+				::close(received);
+				errno = err;
+				throw;
+			}
+			fd = received;
+			id = h.id;
+			usb_bus_num = h.usb_bus_num;
+		}
+	}
+}
@@ -32,8 +32,40 @@
 #include <config.h>
 #endif
 
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <algorithm>
 #include "libusb_vhci.h"
 
+namespace
+{
+	// ignored by default, so a stray one does no harm
+	const int interrupt_signal(SIGURG);
+	pthread_once_t interrupt_once = PTHREAD_ONCE_INIT;
+
+	void interrupt_handler(int) throw()
+	{
+	}
+
+	void install_interrupt_handler() throw()
+	{
+		struct sigaction sa;
+		if(sigaction(interrupt_signal, NULL, &sa) == -1) return;
+		// leave a handler of the application alone
+		if((sa.sa_flags & SA_SIGINFO) || (sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN)) return;
+		memset(&sa, 0, sizeof sa);
+		sa.sa_handler = interrupt_handler;
+		sigemptyset(&sa.sa_mask);
+		// no SA_RESTART, so that blocking calls fail with EINTR
+		sa.sa_flags = 0;
+		sigaction(interrupt_signal, &sa, NULL);
+	}
+}
+
 namespace usb
 {
 	namespace vhci
@@ -43,10 +75,16 @@ namespace usb
 			bg_thread(),
 			thread_shutdown(false),
 			thread_sync(),
+			wake_fd(-1),
+			interrupt_bg_thread(false),
 			port_count(ports),
 			_lock(),
 			inbox(),
-			processing()
+			processing(),
+			recorder(NULL),
+			endpoint_handlers(),
+			held(),
+			parked()
 		{
 			if(ports == 0) throw std::invalid_argument("ports");
 			pthread_mutex_init(&thread_sync, NULL);
@@ -56,10 +94,16 @@ namespace usb
 		hcd::~hcd() throw()
 		{
 			join_bg_thread();
-			for(std::deque<work*>::iterator w(inbox.begin()); w < inbox.end(); w++)
-				delete *w;
+			while(!inbox.empty())
+				delete inbox.pop();
 			for(std::list<work*>::iterator w(processing.begin()); w != processing.end(); w++)
 				delete *w;
+			for(std::list<std::pair<process_urb_work*, endpoint_handler*> >::iterator w(held.begin()); w != held.end(); w++)
+				delete w->first;
+			for(std::map<uint16_t, std::deque<process_urb_work*> >::iterator e(parked.begin()); e != parked.end(); e++)
+				for(std::deque<process_urb_work*>::iterator w(e->second.begin()); w < e->second.end(); w++)
+					delete *w;
+			if(wake_fd != -1) close(wake_fd);
 			pthread_mutex_destroy(&_lock);
 			pthread_mutex_destroy(&thread_sync);
 		}
@@ -75,14 +119,52 @@ namespace usb
 			}
 		}
 
+		endpoint_handler::~endpoint_handler() throw() { }
+
 		// caller has _lock
-		void hcd::enqueue_work(work* w) throw(std::bad_alloc)
+		bool hcd::enqueue_work(work* w) throw(std::bad_alloc)
 		{
-			inbox.push_back(w);
+			process_urb_work* uw;
+			if(!endpoint_handlers.empty() && (uw = dynamic_cast<process_urb_work*>(w)))
+			{
+				std::map<uint16_t, endpoint_handler*>::const_iterator h(endpoint_handlers.find(
+					uw->get_port() << 8 | uw->get_urb()->get_endpoint_address()));
+				if(h != endpoint_handlers.end())
+				{
+					// make room first, so that a held work is never lost
+					held.push_back(std::make_pair(uw, h->second));
+					if(recorder) recorder->record_work(*w);
+					switch(h->second->submit(*this, uw))
+					{
+					case endpoint_handler::disposition_hold:
+						return false;
+					case endpoint_handler::disposition_complete:
+						held.pop_back();
+						give_back_held(uw);
+						return false;
+					case endpoint_handler::disposition_pass:
+						held.pop_back();
+						inbox.push(w);
+						return true;
+					}
+				}
+			}
+			inbox.push(w);
+			if(recorder) recorder->record_work(*w);
+			return true;
 		}
 
-		void hcd::init_bg_thread() volatile throw(std::exception)
+		// caller has _lock; w must be neither held nor parked anymore
+		void hcd::give_back_held(process_urb_work* w) throw(std::exception)
 		{
+			if(recorder) recorder->record_giveback(w->get_port(), *w->get_urb());
+			finishing_work(w);
+			delete w;
+		}
+
+		void hcd::init_bg_thread(bool interruptible) volatile throw(std::exception)
+		{
+			if(interruptible) pthread_once(&interrupt_once, install_interrupt_handler);
 			pthread_attr_t attr;
 			pthread_attr_init(&attr);
 			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
@@ -93,6 +175,12 @@ namespace usb
 				lock _(thread_sync);
 				if(bg_thread != pthread_t())
 					throw std::exception();
+				if(wake_fd == -1 && (wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+				{
+					pthread_attr_destroy(&attr);
+					throw std::exception();
+				}
+				interrupt_bg_thread = interruptible;
 				res = pthread_create(&t, NULL, bg_thread_start, const_cast<hcd*>(this));
 				if(res) goto cleanup;
 				bg_thread = t;
@@ -107,14 +195,66 @@ namespace usb
 			lock _(thread_sync);
 			if(bg_thread == pthread_t()) return;
 			thread_shutdown = true;
-			pthread_join(bg_thread, NULL);
+			uint64_t v(1);
+			while(write(wake_fd, &v, sizeof v) == -1 && errno == EINTR);
+			if(interrupt_bg_thread)
+			{
+				// the signal is lost if it arrives right before the thread
+				// enters the blocking call, so repeat it until the thread is gone
+				for(;;)
+				{
+					pthread_kill(bg_thread, interrupt_signal);
+					timespec ts;
+					clock_gettime(CLOCK_REALTIME, &ts);
+					ts.tv_nsec += 1000000;
+					if(ts.tv_nsec >= 1000000000)
+					{
+						ts.tv_sec++;
+						ts.tv_nsec -= 1000000000;
+					}
+					if(pthread_timedjoin_np(bg_thread, NULL, &ts) != ETIMEDOUT) break;
+				}
+			}
+			else pthread_join(bg_thread, NULL);
+			while(read(wake_fd, &v, sizeof v) == -1 && errno == EINTR);
 			thread_shutdown = false;
 			bg_thread = pthread_t();
 		}
 
+		void hcd::shutdown() volatile throw()
+		{
+			lock _(thread_sync);
+			if(bg_thread == pthread_t()) return;
+			thread_shutdown = true;
+			uint64_t v(1);
+			while(write(wake_fd, &v, sizeof v) == -1 && errno == EINTR);
+			if(interrupt_bg_thread) pthread_kill(bg_thread, interrupt_signal);
+		}
+
+		bool hcd::wait_for_shutdown(int timeout) volatile throw()
+		{
+			if(wake_fd == -1) usleep(timeout * 1000);
+			else
+			{
+				pollfd p;
+				p.fd = wake_fd;
+				p.events = POLLIN;
+				while(poll(&p, 1, timeout) == -1 && errno == EINTR);
+			}
+			return thread_shutdown;
+		}
+
 		void* hcd::bg_thread_start(void* _this) throw()
 		{
 			hcd& dev = *reinterpret_cast<hcd*>(_this);
+			if(dev.interrupt_bg_thread)
+			{
+				// the thread inherits the signal mask of its creator
+				sigset_t set;
+				sigemptyset(&set);
+				sigaddset(&set, interrupt_signal);
+				pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+			}
 			while(!dev.thread_shutdown)
 				dev.bg_work();
 			return NULL;
@@ -125,19 +265,16 @@ namespace usb
 			*w = NULL;
 			lock _(_lock);
 			hcd& _this(const_cast<hcd&>(*this));
-			std::deque<work*>::size_type len(_this.inbox.size());
-			while(len)
+			while(!_this.inbox.empty())
 			{
-				work* _w(_this.inbox.front());
-				_this.inbox.pop_front();
+				work* _w(_this.inbox.pop());
 				if(!_w->is_canceled())
 				{
 					_this.processing.push_back(_w);
 					*w = _w;
-					return len != 1;
+					return !_this.inbox.empty();
 				}
 				delete _w;
-				len = _this.inbox.size();
 			}
 			return false;
 		}
@@ -147,6 +284,9 @@ namespace usb
 			{
 				lock _(_lock);
 				hcd& _this(const_cast<hcd&>(*this));
+				if(_this.recorder)
+					if(process_urb_work* uw = dynamic_cast<process_urb_work*>(w))
+						_this.recorder->record_giveback(uw->get_port(), *uw->get_urb());
 				_this.finishing_work(w);
 				_this.processing.remove(w);
 			}
@@ -157,19 +297,47 @@ namespace usb
 		{
 			lock _(_lock);
 			hcd& _this(const_cast<hcd&>(*this));
-			process_urb_work* wrk(NULL);
-			for(std::deque<work*>::iterator w(_this.inbox.begin()); w < _this.inbox.end(); w++)
+			if(_this.recorder) _this.recorder->record_cancel(handle);
+			for(std::list<std::pair<process_urb_work*, endpoint_handler*> >::iterator w(_this.held.begin());
+			    w != _this.held.end();
+			    w++)
+			{
+				if(w->first->get_urb()->get_handle() == handle)
+				{
+					process_urb_work* uw(w->first);
+					// otherwise the handler gives it back on its own
+					if(w->second->release(_this, uw))
+					{
+						_this.held.erase(w);
+						uw->cancel();
+						_this.canceling_work(uw, false);
+						_this.give_back_held(uw);
+					}
+					return false;
+				}
+			}
+			if(!_this.parked.empty())
 			{
-				process_urb_work* uw = dynamic_cast<process_urb_work*>(*w);
-				if(uw)
+				for(std::map<uint16_t, std::deque<process_urb_work*> >::iterator e(_this.parked.begin());
+				    e != _this.parked.end();
+				    e++)
 				{
-					if(uw->get_urb()->get_handle() == handle)
+					for(std::deque<process_urb_work*>::iterator w(e->second.begin()); w < e->second.end(); w++)
 					{
-						wrk = uw;
-						break;
+						if((*w)->get_urb()->get_handle() == handle)
+						{
+							process_urb_work* uw(*w);
+							e->second.erase(w);
+							if(e->second.empty()) _this.parked.erase(e);
+							uw->cancel();
+							_this.canceling_work(uw, false);
+							_this.give_back_held(uw);
+							return false;
+						}
 					}
 				}
 			}
+			process_urb_work* wrk(_this.inbox.find_urb(handle));
 			if(!wrk)
 			{
 				for(std::list<work*>::iterator w(_this.processing.begin()); w != _this.processing.end(); w++)
@@ -186,6 +354,9 @@ namespace usb
 				}
 				if(wrk)
 				{
+					// the application is busy with it, so it gets the token
+					// now and the cancel_urb_work later
+					wrk->cancel();
 					_this.canceling_work(wrk, true);
 					return true;
 				}
@@ -194,6 +365,7 @@ namespace usb
 			{
 				wrk->cancel();
 				_this.canceling_work(wrk, false);
+				if(_this.recorder) _this.recorder->record_giveback(wrk->get_port(), *wrk->get_urb());
 				_this.finishing_work(wrk);
 			}
 			return false;
@@ -225,5 +397,237 @@ namespace usb
 				}
 			}
 		}
+
+		// caller has _lock
+		void hcd::replace_endpoint_handler(uint16_t key, endpoint_handler* h) throw(std::bad_alloc)
+		{
+			std::map<uint16_t, endpoint_handler*>::iterator i(endpoint_handlers.find(key));
+			endpoint_handler* old(NULL);
+			if(i != endpoint_handlers.end())
+			{
+				old = i->second;
+				if(h) i->second = h;
+				else endpoint_handlers.erase(i);
+			}
+			else if(h)
+				endpoint_handlers.insert(std::make_pair(key, h));
+			if(!old || old == h) return;
+			bool enqueued(false);
+			std::list<std::pair<process_urb_work*, endpoint_handler*> >::iterator w(held.begin());
+			while(w != held.end())
+			{
+				if(w->second != old || !old->release(*this, w->first))
+				{
+					w++;
+					continue;
+				}
+				process_urb_work* uw(w->first);
+				w = held.erase(w);
+				try
+				{
+					inbox.push(uw);
+					enqueued = true;
+				}
+				catch(std::bad_alloc)
+				{
+					uw->get_urb()->set_status(USB_VHCI_STATUS_CANCELED);
+					give_back_held(uw);
+				}
+			}
+			if(enqueued) on_work_enqueued();
+		}
+
+		void hcd::set_endpoint_handler(uint8_t port, uint8_t epadr, endpoint_handler* h) volatile throw(std::exception)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > port_count) throw std::out_of_range("port");
+			lock _(_lock);
+			const_cast<hcd&>(*this).replace_endpoint_handler(port << 8 | epadr, h);
+		}
+
+		void hcd::remove_endpoint_handler(uint8_t port, uint8_t epadr, endpoint_handler* h) volatile throw(std::exception)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > port_count) throw std::out_of_range("port");
+			lock _(_lock);
+			hcd& _this(const_cast<hcd&>(*this));
+			const uint16_t key(port << 8 | epadr);
+			std::map<uint16_t, endpoint_handler*>::const_iterator i(_this.endpoint_handlers.find(key));
+			if(i != _this.endpoint_handlers.end() && i->second == h)
+				_this.replace_endpoint_handler(key, NULL);
+		}
+
+		void hcd::complete_held(process_urb_work* w) volatile throw(std::exception)
+		{
+			lock _(_lock);
+			hcd& _this(const_cast<hcd&>(*this));
+			for(std::list<std::pair<process_urb_work*, endpoint_handler*> >::iterator i(_this.held.begin());
+			    i != _this.held.end();
+			    i++)
+			{
+				if(i->first == w)
+				{
+					_this.held.erase(i);
+					_this.give_back_held(w);
+					return;
+				}
+			}
+		}
+
+		void hcd::park(work* w) volatile throw(std::exception)
+		{
+			process_urb_work* uw(dynamic_cast<process_urb_work*>(w));
+			if(!uw) throw std::invalid_argument("w");
+			lock _(_lock);
+			hcd& _this(const_cast<hcd&>(*this));
+			if(uw->is_canceled())
+			{
+				// the kernel canceled it while it was processed, and nobody
+				// would look for it in parked anymore
+				_this.processing.remove(w);
+				uw->get_urb()->set_status(USB_VHCI_STATUS_CANCELED);
+				_this.give_back_held(uw);
+				return;
+			}
+			_this.parked[uw->get_port() << 8 | uw->get_urb()->get_endpoint_address()].push_back(uw);
+			_this.processing.remove(w);
+		}
+
+		bool hcd::complete_parked(uint8_t port, uint8_t epadr, const void* data, size_t size) volatile throw(std::exception)
+		{
+			lock _(_lock);
+			hcd& _this(const_cast<hcd&>(*this));
+			std::map<uint16_t, std::deque<process_urb_work*> >::iterator e(_this.parked.find(port << 8 | epadr));
+			if(e == _this.parked.end()) return false;
+			process_urb_work* w(e->second.front());
+			e->second.pop_front();
+			if(e->second.empty()) _this.parked.erase(e);
+			usb::urb& urb(*w->get_urb());
+			if(urb.is_in())
+			{
+				const size_t length(urb.get_buffer_length());
+				const size_t n(std::min(size, length));
+				if(n) memcpy(urb.get_buffer(), data, n);
+				urb.set_buffer_actual(static_cast<int32_t>(n));
+				if(n < length && urb.is_short_not_ok())
+					urb.set_status(USB_VHCI_STATUS_SHORT_PACKET);
+				else
+					urb.ack();
+			}
+			else
+			{
+				urb.set_buffer_actual(urb.get_buffer_length());
+				urb.ack();
+			}
+			_this.give_back_held(w);
+			return true;
+		}
+
+		size_t hcd::get_parked_count(uint8_t port, uint8_t epadr) volatile throw()
+		{
+			lock _(_lock);
+			hcd& _this(const_cast<hcd&>(*this));
+			std::map<uint16_t, std::deque<process_urb_work*> >::const_iterator e(_this.parked.find(port << 8 | epadr));
+			return (e == _this.parked.end()) ? 0 : e->second.size();
+		}
+
+		bool hcd::is_idle() volatile throw()
+		{
+			lock _(_lock);
+			hcd& _this(const_cast<hcd&>(*this));
+			if(!_this.inbox.empty() || !_this.processing.empty() || !_this.held.empty()) return false;
+			for(std::map<uint16_t, std::deque<process_urb_work*> >::const_iterator i(_this.parked.begin()); i != _this.parked.end(); i++)
+				if(!i->second.empty()) return false;
+			return true;
+		}
+
+		void hcd::drop_works() volatile throw(std::exception)
+		{
+			lock _(_lock);
+			hcd& _this(const_cast<hcd&>(*this));
+			for(std::list<std::pair<process_urb_work*, endpoint_handler*> >::iterator w(_this.held.begin());
+			    w != _this.held.end();)
+			{
+				process_urb_work* uw(w->first);
+				// otherwise the handler gives it back on its own
+				if(w->second->release(_this, uw))
+				{
+					w = _this.held.erase(w);
+					uw->cancel();
+					_this.canceling_work(uw, false);
+					_this.give_back_held(uw);
+				}
+				else w++;
+			}
+			while(!_this.parked.empty())
+			{
+				std::deque<process_urb_work*>& q(_this.parked.begin()->second);
+				while(!q.empty())
+				{
+					process_urb_work* uw(q.front());
+					q.pop_front();
+					uw->cancel();
+					_this.canceling_work(uw, false);
+					_this.give_back_held(uw);
+				}
+				_this.parked.erase(_this.parked.begin());
+			}
+			while(!_this.inbox.empty())
+			{
+				work* w(_this.inbox.pop());
+				process_urb_work* uw(dynamic_cast<process_urb_work*>(w));
+				if(uw && !uw->is_canceled())
+				{
+					uw->cancel();
+					_this.canceling_work(uw, false);
+					if(_this.recorder) _this.recorder->record_giveback(uw->get_port(), *uw->get_urb());
+					_this.finishing_work(uw);
+				}
+				delete w;
+			}
+		}
+
+		void hcd::forget_consumers() volatile throw(std::bad_alloc)
+		{
+			lock _(_lock);
+			hcd& _this(const_cast<hcd&>(*this));
+			// first, as it is the only thing that can fail
+			_this.inbox.set_order(work_queue::order_fifo);
+			_this.inbox.reset_weights();
+			_this.work_enqueued_callbacks.clear();
+			_this.endpoint_handlers.clear();
+		}
+
+		void hcd::set_work_order(work_queue::order o) volatile throw(std::bad_alloc)
+		{
+			lock _(_lock);
+			const_cast<hcd&>(*this).inbox.set_order(o);
+		}
+
+		void hcd::set_work_class_weight(work_queue::work_class c, unsigned int weight) volatile throw(std::invalid_argument, std::out_of_range)
+		{
+			lock _(_lock);
+			const_cast<hcd&>(*this).inbox.set_weight(c, weight);
+		}
+
+		work_queue::class_stats hcd::get_work_class_stats(work_queue::work_class c) volatile throw(std::out_of_range)
+		{
+			lock _(_lock);
+			return const_cast<hcd&>(*this).inbox.get_stats(c);
+		}
+
+		void hcd::set_port_weight(uint8_t port, unsigned int weight) volatile throw(std::invalid_argument, std::out_of_range, std::bad_alloc)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			lock _(_lock);
+			const_cast<hcd&>(*this).inbox.set_port_weight(port, weight);
+		}
+
+		void hcd::set_recorder(urb_recorder* r) volatile throw()
+		{
+			lock _(_lock);
+			const_cast<hcd&>(*this).recorder = r;
+		}
 	}
 }
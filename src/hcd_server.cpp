@@ -0,0 +1,756 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include "libusb_vhci.h"
+#include "remote_protocol.h"
+
+namespace
+{
+	void ring_doorbell(int fd) throw()
+	{
+		uint64_t v(1);
+		while(write(fd, &v, sizeof v) == -1 && errno == EINTR);
+	}
+
+	void drain_doorbell(int fd) throw()
+	{
+		uint64_t v;
+		while(read(fd, &v, sizeof v) == -1 && errno == EINTR);
+	}
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		hcd_server::hcd_server(local_hcd& h, const char* path, size_t shared_size) throw(std::exception) :
+			owner(h),
+			path(path),
+			listen_fd(-1),
+			client_fd(-1),
+			wake_fd(-1),
+			wake_pending(0),
+			thread(),
+			shutdown(false),
+			in_flight(),
+			in(),
+			out(),
+			out_pos(0),
+			connected(false),
+			attached(false),
+			region(NULL),
+			work_slots(NULL),
+			completion_slots(NULL),
+			work_fd(-1),
+			completion_fd(-1),
+			backlog()
+		{
+			sockaddr_un sa;
+			memset(&sa, 0, sizeof sa);
+			sa.sun_family = AF_UNIX;
+			if(this->path.size() >= sizeof sa.sun_path) throw std::invalid_argument("path");
+			strcpy(sa.sun_path, path);
+			try
+			{
+				if((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+					throw std::exception();
+				unlink(path);
+				if(bind(listen_fd, reinterpret_cast<sockaddr*>(&sa), sizeof sa) == -1)
+					throw std::exception();
+				if(listen(listen_fd, 1) == -1)
+					throw std::exception();
+				if((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+					throw std::exception();
+				if(shared_size)
+				{
+					region = new shared_region(shared_size, remote::shm_reserved());
+					remote::shm_header& sh(*reinterpret_cast<remote::shm_header*>(region->get_base()));
+					sh.magic = REMOTE_SHM_MAGIC;
+					sh.entries = REMOTE_SHM_ENTRIES;
+					const uint32_t work_offset(sizeof sh);
+					const uint32_t completion_offset(work_offset + REMOTE_SHM_ENTRIES * sizeof(remote::shm_work));
+					sh.work_offset = work_offset;
+					sh.completion_offset = completion_offset;
+					work_slots = reinterpret_cast<remote::shm_work*>(region->get_base() + work_offset);
+					completion_slots = reinterpret_cast<const remote::shm_completion*>(region->get_base() + completion_offset);
+					if((work_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+					   (completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+						throw std::exception();
+				}
+				owner.add_work_enqueued_callback(hcd::callback(work_enqueued, this));
+				pthread_t t;
+				if(pthread_create(&t, NULL, thread_start, this))
+				{
+					owner.remove_work_enqueued_callback(hcd::callback(work_enqueued, this));
+					throw std::exception();
+				}
+				thread = t;
+				if(region) owner.set_buffer_pool(region);
+			}
+			catch(...)
+			{
+				if(completion_fd != -1) close(completion_fd);
+				if(work_fd != -1) close(work_fd);
+				delete region;
+				if(wake_fd != -1) close(wake_fd);
+				if(listen_fd != -1)
+				{
+					close(listen_fd);
+					unlink(path);
+				}
+				throw;
+			}
+		}
+
+		hcd_server::~hcd_server() throw()
+		{
+			stop();
+			owner.remove_work_enqueued_callback(hcd::callback(work_enqueued, this));
+			if(region) owner.set_buffer_pool(NULL);
+			drop_client();
+			if(region)
+			{
+				// urbs with buffers in the region may still be on their way
+				// into the inbox of owner; with no client, send_works fails
+				// them
+				for(int i(0); i < 1000 && region->get_used(); i++)
+				{
+					send_works();
+					if(region->get_used()) usleep(1000);
+				}
+				// rather leak the mapping than free it under an urb
+				if(!region->get_used()) delete region;
+				close(work_fd);
+				close(completion_fd);
+			}
+			close(wake_fd);
+			close(listen_fd);
+			unlink(path.c_str());
+		}
+
+		void hcd_server::stop() throw()
+		{
+			shutdown = true;
+			ring_doorbell(wake_fd);
+			pthread_join(thread, NULL);
+		}
+
+		void* hcd_server::thread_start(void* s) throw()
+		{
+			reinterpret_cast<hcd_server*>(s)->run();
+			return NULL;
+		}
+
+		// called by the background thread of owner with its lock held
+		void hcd_server::work_enqueued(void* s, hcd& from) throw()
+		{
+			hcd_server& _this(*reinterpret_cast<hcd_server*>(s));
+			// one wakeup per batch
+			if(__sync_bool_compare_and_swap(&_this.wake_pending, 0, 1))
+				ring_doorbell(_this.wake_fd);
+		}
+
+		void hcd_server::run() throw()
+		{
+			while(!shutdown)
+			{
+				pollfd fds[3];
+				fds[0].fd = wake_fd;
+				fds[0].events = POLLIN;
+				if(client_fd != -1)
+				{
+					fds[1].fd = client_fd;
+					fds[1].events = POLLIN | ((out_pos < out.size()) ? POLLOUT : 0);
+				}
+				else
+				{
+					fds[1].fd = listen_fd;
+					fds[1].events = POLLIN;
+				}
+				fds[2].fd = completion_fd;
+				fds[2].events = POLLIN;
+				fds[0].revents = fds[1].revents = fds[2].revents = 0;
+				const bool shared(region && attached);
+				// there is no doorbell for free space in the work ring
+				if(poll(fds, shared ? 3 : 2, backlog.empty() ? -1 : 1) == -1 && errno != EINTR) break;
+				if(fds[0].revents & POLLIN)
+				{
+					drain_doorbell(wake_fd);
+					wake_pending = 0;
+					__sync_synchronize();
+				}
+				if(client_fd == -1)
+				{
+					if(fds[1].revents & POLLIN) accept_client();
+				}
+				else if(fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+				{
+					if(!read_client()) drop_client();
+				}
+				if(region && attached)
+				{
+					if(fds[2].revents & POLLIN) drain_doorbell(completion_fd);
+					reap_completions();
+				}
+				send_works();
+				if(client_fd != -1 && out_pos < out.size() && !write_client())
+					drop_client();
+			}
+		}
+
+		void hcd_server::accept_client() throw()
+		{
+			int fd(accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC));
+			if(fd == -1) return;
+			client_fd = fd;
+			in.clear();
+			out.clear();
+			out_pos = 0;
+			attached = false;
+			try
+			{
+				remote::hello h;
+				memset(&h, 0, sizeof h);
+				h.version = REMOTE_PROTOCOL_VERSION;
+				h.port_count = owner.get_port_count();
+				const size_t at(remote::begin_frame(out, REMOTE_FRAME_HELLO));
+				remote::append(out, &h, sizeof h);
+				remote::end_frame(out, at);
+			}
+			catch(std::bad_alloc)
+			{
+				drop_client();
+				return;
+			}
+			if(region)
+			{
+				remote::shm_header& sh(*reinterpret_cast<remote::shm_header*>(region->get_base()));
+				sh.works.head = sh.works.tail = 0;
+				sh.completions.head = sh.completions.tail = 0;
+				drain_doorbell(work_fd);
+				drain_doorbell(completion_fd);
+			}
+			connected = true;
+		}
+
+		// answers REMOTE_FRAME_ATTACH; the descriptors must not travel with
+		// other data, so out is flushed first and the frame is sent directly
+		bool hcd_server::attach() throw()
+		{
+			if(attached || !write_client() || out_pos < out.size()) return false;
+			struct
+			{
+				remote::frame_header h;
+				remote::attached a;
+			} f;
+			memset(&f, 0, sizeof f);
+			f.h.size = sizeof f.a;
+			f.h.type = REMOTE_FRAME_ATTACHED;
+			f.a.flags = region ? REMOTE_ATTACHED_SHARED : 0;
+			iovec iov;
+			iov.iov_base = &f;
+			iov.iov_len = sizeof f;
+			msghdr m;
+			memset(&m, 0, sizeof m);
+			m.msg_iov = &iov;
+			m.msg_iovlen = 1;
+			union
+			{
+				cmsghdr c;
+				uint8_t buf[CMSG_SPACE(3 * sizeof(int))];
+			} control;
+			if(region)
+			{
+				memset(&control, 0, sizeof control);
+				m.msg_control = control.buf;
+				m.msg_controllen = sizeof control.buf;
+				cmsghdr* c(CMSG_FIRSTHDR(&m));
+				c->cmsg_level = SOL_SOCKET;
+				c->cmsg_type = SCM_RIGHTS;
+				c->cmsg_len = CMSG_LEN(3 * sizeof(int));
+				const int fds[3] = { region->get_fd(), work_fd, completion_fd };
+				memcpy(CMSG_DATA(c), fds, sizeof fds);
+			}
+			ssize_t n;
+			do n = sendmsg(client_fd, &m, MSG_DONTWAIT | MSG_NOSIGNAL);
+			while(n == -1 && errno == EINTR);
+			// the socket buffer is empty, so anything but all of it is an error
+			if(n != static_cast<ssize_t>(sizeof f)) return false;
+			attached = true;
+			return true;
+		}
+
+		void hcd_server::fail_work(work* w) throw()
+		{
+			if(process_urb_work* uw = dynamic_cast<process_urb_work*>(w))
+				uw->get_urb()->set_status(USB_VHCI_STATUS_DEVICE_DISCONNECTED);
+			try { owner.finish_work(w); }
+			catch(...) { }
+		}
+
+		void hcd_server::drop_client() throw()
+		{
+			if(client_fd == -1) return;
+			close(client_fd);
+			client_fd = -1;
+			connected = false;
+			attached = false;
+			in.clear();
+			out.clear();
+			out_pos = 0;
+			for(std::map<uint64_t, std::pair<process_urb_work*, uint8_t*> >::iterator i(in_flight.begin()); i != in_flight.end(); i++)
+			{
+				if(i->second.second)
+				{
+					const usb::urb& u(*i->second.first->get_urb());
+					region->release(i->second.second, u.get_iso_packet_count() * sizeof(usb_vhci_iso_packet) + u.get_buffer_length());
+				}
+				fail_work(i->second.first);
+			}
+			in_flight.clear();
+			for(std::deque<work*>::iterator i(backlog.begin()); i != backlog.end(); i++)
+				fail_work(*i);
+			backlog.clear();
+			for(uint8_t port(1); port <= owner.get_port_count(); port++)
+			{
+				try
+				{
+					if(owner.get_port_stat(port).get_connection())
+						owner.port_disconnect(port);
+				}
+				catch(...) { }
+			}
+		}
+
+		// false if the client has gone or violated the protocol
+		bool hcd_server::read_client() throw()
+		{
+			const size_t chunk(65536);
+			for(;;)
+			{
+				const size_t have(in.size());
+				try { in.resize(have + chunk); }
+				catch(std::bad_alloc) { return false; }
+				ssize_t n(recv(client_fd, &in[have], chunk, MSG_DONTWAIT));
+				if(n <= 0)
+				{
+					in.resize(have);
+					if(!n) return false;
+					if(errno == EINTR) continue;
+					if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+					return false;
+				}
+				in.resize(have + n);
+				if(static_cast<size_t>(n) < chunk) break;
+			}
+			size_t pos(0);
+			remote::frame_header h;
+			const uint8_t* body;
+			while(remote::next(in.empty() ? NULL : &in[0], in.size(), &pos, &h, &body))
+				if(!handle_frame(h.type, body, h.size)) return false;
+			if(in.size() - pos >= sizeof h)
+			{
+				memcpy(&h, &in[pos], sizeof h);
+				if(h.size > REMOTE_FRAME_MAX) return false;
+			}
+			in.erase(in.begin(), in.begin() + pos);
+			return true;
+		}
+
+		bool hcd_server::write_client() throw()
+		{
+			while(out_pos < out.size())
+			{
+				ssize_t n(send(client_fd, &out[out_pos], out.size() - out_pos, MSG_DONTWAIT | MSG_NOSIGNAL));
+				if(n == -1)
+				{
+					if(errno == EINTR) continue;
+					return errno == EAGAIN || errno == EWOULDBLOCK;
+				}
+				out_pos += n;
+			}
+			out.clear();
+			out_pos = 0;
+			return true;
+		}
+
+		bool hcd_server::handle_frame(uint8_t type, const uint8_t* body, size_t size) throw()
+		{
+			switch(type)
+			{
+			case REMOTE_FRAME_ATTACH:
+				return attach();
+			case REMOTE_FRAME_GIVEBACKS:
+			{
+				size_t pos(0);
+				remote::entry_header eh;
+				const uint8_t* entry;
+				while(remote::next(body, size, &pos, &eh, &entry))
+					handle_giveback(entry, eh.size);
+				return pos == size;
+			}
+			case REMOTE_FRAME_PORT_OP:
+				handle_port_op(body, size);
+				return true;
+			default:
+				return false;
+			}
+		}
+
+		void hcd_server::handle_giveback(const uint8_t* body, size_t size) throw()
+		{
+			remote::giveback_entry g;
+			if(size < sizeof g) return;
+			memcpy(&g, body, sizeof g);
+			std::map<uint64_t, std::pair<process_urb_work*, uint8_t*> >::iterator i(in_flight.find(g.handle));
+			if(i == in_flight.end()) return;
+			process_urb_work* w(i->second.first);
+			uint8_t* bounce(i->second.second);
+			in_flight.erase(i);
+			usb::urb& urb(*w->get_urb());
+			if(bounce)
+				region->release(bounce, urb.get_iso_packet_count() * sizeof(usb_vhci_iso_packet) + urb.get_buffer_length());
+			const uint8_t* p(body + sizeof g);
+			const size_t rest(size - sizeof g);
+			if(g.packet_count == urb.get_iso_packet_count() &&
+			   g.data_length >= 0 &&
+			   g.packet_count * sizeof(remote::iso_result) + g.data_length <= rest)
+			{
+				urb.set_status(g.status);
+				urb.set_buffer_actual(std::max(0, std::min(g.buffer_actual, urb.get_buffer_length())));
+				urb.set_iso_error_count(g.error_count);
+				for(int32_t k(0); k < g.packet_count; k++, p += sizeof(remote::iso_result))
+				{
+					remote::iso_result r;
+					memcpy(&r, p, sizeof r);
+					urb.set_iso_packet_actual(k, r.packet_actual);
+					urb.set_iso_status(k, r.status);
+				}
+				if(urb.is_in() && urb.get_buffer())
+					memcpy(urb.get_buffer(), p, std::min(g.data_length, urb.get_buffer_length()));
+			}
+			else
+				urb.set_status(USB_VHCI_STATUS_ERROR);
+			try { owner.finish_work(w); }
+			catch(...) { }
+		}
+
+		void hcd_server::handle_port_op(const uint8_t* body, size_t size) throw()
+		{
+			remote::port_op op;
+			remote::port_result r;
+			r.error = EINVAL;
+			if(size >= sizeof op)
+			{
+				memcpy(&op, body, sizeof op);
+				errno = 0;
+				try
+				{
+					switch(op.op)
+					{
+					case REMOTE_PORT_CONNECT:     owner.port_connect(op.port, static_cast<usb::data_rate>(op.arg)); break;
+					case REMOTE_PORT_DISCONNECT:  owner.port_disconnect(op.port); break;
+					case REMOTE_PORT_DISABLE:     owner.port_disable(op.port); break;
+					case REMOTE_PORT_RESUMED:     owner.port_resumed(op.port); break;
+					case REMOTE_PORT_OVERCURRENT: owner.port_overcurrent(op.port, op.arg); break;
+					case REMOTE_PORT_RESET_DONE:  owner.port_reset_done(op.port, op.arg); break;
+					default: throw std::invalid_argument("op");
+					}
+					r.error = 0;
+				}
+				catch(std::invalid_argument) { r.error = EINVAL; }
+				catch(std::out_of_range) { r.error = EINVAL; }
+				catch(std::exception) { r.error = errno ? errno : EIO; }
+			}
+			try
+			{
+				const size_t at(remote::begin_frame(out, REMOTE_FRAME_PORT_RESULT));
+				remote::append(out, &r, sizeof r);
+				remote::end_frame(out, at);
+			}
+			catch(std::bad_alloc)
+			{
+				// TODO: debug msg
+			}
+		}
+
+		// moves everything in the inbox of owner into one frame, or onto the
+		// work ring
+		void hcd_server::send_works() throw()
+		{
+			// works wait in the inbox until the client is ready
+			if(client_fd != -1 && !attached) return;
+			if(client_fd != -1 && region)
+			{
+				publish_works();
+				return;
+			}
+			size_t frame(0);
+			bool open(false);
+			for(;;)
+			{
+				work* w;
+				bool more;
+				try { more = owner.next_work(&w); }
+				catch(std::bad_alloc) { break; }
+				if(!w) break;
+				try
+				{
+					if(client_fd == -1)
+						throw std::exception();
+					if(!open)
+					{
+						frame = remote::begin_frame(out, REMOTE_FRAME_WORKS);
+						open = true;
+					}
+					if(process_urb_work* uw = dynamic_cast<process_urb_work*>(w))
+					{
+						const usb::urb& u(*uw->get_urb());
+						remote::urb_entry e;
+						memset(&e, 0, sizeof e);
+						e.handle = u.get_handle();
+						e.buffer_length = u.get_buffer_length();
+						e.buffer_actual = u.get_buffer_actual();
+						e.packet_count = u.get_iso_packet_count();
+						e.interval = u.get_interval();
+						e.flags = u.get_flags();
+						e.wValue = u.get_wValue();
+						e.wIndex = u.get_wIndex();
+						e.wLength = u.get_wLength();
+						e.bmRequestType = u.get_bmRequestType();
+						e.bRequest = u.get_bRequest();
+						e.devadr = u.get_device_address();
+						e.epadr = u.get_endpoint_address();
+						e.type = u.get_internal()->type;
+						const size_t at(remote::begin_entry(out, REMOTE_WORK_URB, uw->get_port()));
+						remote::append(out, &e, sizeof e);
+						for(int32_t i(0); i < e.packet_count; i++)
+						{
+							remote::iso_entry ie;
+							ie.offset = u.get_iso_packet_offset(i);
+							ie.packet_length = u.get_iso_packet_length(i);
+							remote::append(out, &ie, sizeof ie);
+						}
+						if((u.is_out() || u.is_isochronous()) && u.get_buffer() && e.buffer_actual > 0)
+							remote::append(out, u.get_buffer(), std::min(e.buffer_actual, e.buffer_length));
+						remote::end_entry(out, at);
+						in_flight[e.handle] = std::make_pair(uw, static_cast<uint8_t*>(NULL));
+					}
+					else if(port_stat_work* pw = dynamic_cast<port_stat_work*>(w))
+					{
+						remote::port_stat_entry e;
+						memset(&e, 0, sizeof e);
+						e.status = pw->get_port_stat().get_status();
+						e.change = pw->get_port_stat().get_change();
+						e.flags = pw->get_port_stat().get_flags();
+						const size_t at(remote::begin_entry(out, REMOTE_WORK_PORT_STAT, pw->get_port()));
+						remote::append(out, &e, sizeof e);
+						remote::end_entry(out, at);
+						owner.finish_work(w);
+					}
+					else if(cancel_urb_work* cw = dynamic_cast<cancel_urb_work*>(w))
+					{
+						// the client still gives back the urb itself
+						remote::cancel_entry e;
+						e.handle = cw->get_handle();
+						const size_t at(remote::begin_entry(out, REMOTE_WORK_CANCEL, cw->get_port()));
+						remote::append(out, &e, sizeof e);
+						remote::end_entry(out, at);
+						owner.finish_work(w);
+					}
+					else
+						owner.finish_work(w);
+				}
+				catch(...)
+				{
+					// no client (or no memory): nobody will answer the urb
+					if(process_urb_work* uw = dynamic_cast<process_urb_work*>(w))
+						in_flight.erase(uw->get_urb()->get_handle());
+					fail_work(w);
+				}
+				if(!more) break;
+			}
+			if(open) remote::end_frame(out, frame);
+		}
+
+		// moves the backlog and then the inbox of owner onto the work ring
+		// until it is full
+		void hcd_server::publish_works() throw()
+		{
+			bool ring(false);
+			while(!backlog.empty() && publish(backlog.front(), &ring))
+				backlog.pop_front();
+			while(backlog.empty())
+			{
+				work* w;
+				bool more;
+				try { more = owner.next_work(&w); }
+				catch(std::bad_alloc) { break; }
+				if(!w) break;
+				if(!publish(w, &ring))
+				{
+					try { backlog.push_back(w); }
+					catch(std::bad_alloc) { fail_work(w); }
+				}
+				if(!more) break;
+			}
+			if(ring) ring_doorbell(work_fd);
+		}
+
+		// false if w has to wait for space in the ring or in the region
+		bool hcd_server::publish(work* w, bool* ring) throw()
+		{
+			uint8_t* const base(region->get_base());
+			remote::shm_header& sh(*reinterpret_cast<remote::shm_header*>(base));
+			remote::shm_work d;
+			memset(&d, 0, sizeof d);
+			d.port = w->get_port();
+			bool was_empty;
+			if(process_urb_work* uw = dynamic_cast<process_urb_work*>(w))
+			{
+				const usb_vhci_urb& u(*uw->get_urb()->get_internal());
+				const size_t iso_size(u.packet_count * sizeof *u.iso_packets);
+				uint8_t* buffer(u.buffer);
+				uint8_t* iso(reinterpret_cast<uint8_t*>(u.iso_packets));
+				uint8_t* bounce(NULL);
+				// urbs allocated before the pool was set, or after it was
+				// exhausted, are copied into the region
+				if((u.buffer_length && !region->contains(buffer, u.buffer_length)) ||
+				   (iso_size && !region->contains(iso, iso_size)))
+				{
+					if(!(bounce = region->allocate(iso_size + u.buffer_length))) return false;
+					memcpy(bounce, iso, iso_size);
+					if(usb_vhci_is_out(u.epadr) || usb_vhci_is_iso(u.type))
+						memcpy(bounce + iso_size, buffer, std::max(0, std::min(u.buffer_actual, u.buffer_length)));
+					iso = bounce;
+					buffer = bounce + iso_size;
+				}
+				d.kind = REMOTE_WORK_URB;
+				d.handle = u.handle;
+				d.buffer_offset = u.buffer_length ? buffer - base : 0;
+				d.buffer_length = u.buffer_length;
+				d.buffer_actual = u.buffer_actual;
+				d.iso_offset = iso_size ? iso - base : 0;
+				d.packet_count = u.packet_count;
+				d.interval = u.interval;
+				d.flags = u.flags;
+				d.wValue = u.wValue;
+				d.wIndex = u.wIndex;
+				d.wLength = u.wLength;
+				d.bmRequestType = u.bmRequestType;
+				d.bRequest = u.bRequest;
+				d.devadr = u.devadr;
+				d.epadr = u.epadr;
+				d.type = u.type;
+				try { in_flight[u.handle] = std::make_pair(uw, bounce); }
+				catch(std::bad_alloc)
+				{
+					if(bounce) region->release(bounce, iso_size + u.buffer_length);
+					return false;
+				}
+				if(!remote::ring_push(sh.works, work_slots, d, &was_empty))
+				{
+					in_flight.erase(u.handle);
+					if(bounce) region->release(bounce, iso_size + u.buffer_length);
+					return false;
+				}
+				*ring = *ring || was_empty;
+				return true;
+			}
+			if(port_stat_work* pw = dynamic_cast<port_stat_work*>(w))
+			{
+				d.kind = REMOTE_WORK_PORT_STAT;
+				d.port_status = pw->get_port_stat().get_status();
+				d.port_change = pw->get_port_stat().get_change();
+				d.port_flags = pw->get_port_stat().get_flags();
+			}
+			else if(cancel_urb_work* cw = dynamic_cast<cancel_urb_work*>(w))
+			{
+				d.kind = REMOTE_WORK_CANCEL;
+				d.handle = cw->get_handle();
+			}
+			if(d.kind)
+			{
+				if(!remote::ring_push(sh.works, work_slots, d, &was_empty)) return false;
+				*ring = *ring || was_empty;
+			}
+			try { owner.finish_work(w); }
+			catch(...) { }
+			return true;
+		}
+
+		void hcd_server::reap_completions() throw()
+		{
+			uint8_t* const base(region->get_base());
+			remote::shm_header& sh(*reinterpret_cast<remote::shm_header*>(base));
+			remote::shm_completion c;
+			while(remote::ring_pop(sh.completions, completion_slots, &c))
+			{
+				std::map<uint64_t, std::pair<process_urb_work*, uint8_t*> >::iterator i(in_flight.find(c.handle));
+				if(i == in_flight.end()) continue;
+				process_urb_work* w(i->second.first);
+				uint8_t* bounce(i->second.second);
+				in_flight.erase(i);
+				usb::urb& urb(*w->get_urb());
+				urb.set_status(c.status);
+				urb.set_buffer_actual(std::max(0, std::min(c.buffer_actual, urb.get_buffer_length())));
+				urb.set_iso_error_count(c.error_count);
+				if(bounce)
+				{
+					const int32_t pc(urb.get_iso_packet_count());
+					const usb_vhci_iso_packet* packets(reinterpret_cast<const usb_vhci_iso_packet*>(bounce));
+					for(int32_t k(0); k < pc; k++)
+					{
+						urb.set_iso_packet_actual(k, packets[k].packet_actual);
+						urb.set_iso_status(k, packets[k].status);
+					}
+					const size_t iso_size(pc * sizeof *packets);
+					if(urb.is_in() && urb.get_buffer())
+						memcpy(urb.get_buffer(), bounce + iso_size, urb.get_buffer_length());
+					region->release(bounce, iso_size + urb.get_buffer_length());
+				}
+				try { owner.finish_work(w); }
+				catch(...) { }
+			}
+		}
+	}
+}
@@ -0,0 +1,402 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <algorithm>
+#include "libusb_vhci.h"
+
+namespace
+{
+	// a power of two; boundaries further ahead take more than one turn
+	const size_t wheel_size(256);
+
+	uint64_t now() throw()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+	}
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		interrupt_scheduler::interrupt_scheduler(uint64_t tick_ns) throw(std::exception) :
+			tick_ns(tick_ns),
+			epoch(now()),
+			wheel(wheel_size, static_cast<_endpoint*>(NULL)),
+			current(0),
+			scheduled(0),
+			endpoints(),
+			timer_fd(-1),
+			wake_fd(-1),
+			thread(),
+			shutdown(false),
+			_lock()
+		{
+			if(!tick_ns) throw std::invalid_argument("tick_ns");
+			pthread_mutex_init(&_lock, NULL);
+			try
+			{
+				if((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+					throw std::exception();
+				if((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+					throw std::exception();
+				pthread_t t;
+				if(pthread_create(&t, NULL, thread_start, this))
+					throw std::exception();
+				thread = t;
+			}
+			catch(...)
+			{
+				stop();
+				pthread_mutex_destroy(&_lock);
+				throw;
+			}
+		}
+
+		interrupt_scheduler::~interrupt_scheduler() throw()
+		{
+			std::vector<_key> keys;
+			{
+				lock _(_lock);
+				for(std::map<_key, _endpoint*>::const_iterator i(endpoints.begin()); i != endpoints.end(); i++)
+				{
+					try { keys.push_back(i->first); }
+					catch(std::bad_alloc) { break; }
+				}
+			}
+			for(std::vector<_key>::const_iterator i(keys.begin()); i < keys.end(); i++)
+				detach(*i->first, i->second >> 8, i->second & 0xff);
+			stop();
+			for(std::map<_key, _endpoint*>::iterator i(endpoints.begin()); i != endpoints.end(); i++)
+				delete i->second;
+			pthread_mutex_destroy(&_lock);
+		}
+
+		void interrupt_scheduler::stop() throw()
+		{
+			shutdown = true;
+			if(thread != pthread_t())
+			{
+				uint64_t v(1);
+				while(write(wake_fd, &v, sizeof v) == -1 && errno == EINTR);
+				pthread_join(thread, NULL);
+				thread = pthread_t();
+			}
+			if(wake_fd != -1) close(wake_fd);
+			if(timer_fd != -1) close(timer_fd);
+			wake_fd = timer_fd = -1;
+		}
+
+		void* interrupt_scheduler::thread_start(void* s) throw()
+		{
+			reinterpret_cast<interrupt_scheduler*>(s)->run();
+			return NULL;
+		}
+
+		void interrupt_scheduler::run() throw()
+		{
+			pollfd fds[2];
+			fds[0].fd = timer_fd;
+			fds[0].events = POLLIN;
+			fds[1].fd = wake_fd;
+			fds[1].events = POLLIN;
+			_done done;
+			while(!shutdown)
+			{
+				if(poll(fds, 2, -1) == -1) continue;
+				if(!(fds[0].revents & POLLIN)) continue;
+				uint64_t expirations;
+				if(read(timer_fd, &expirations, sizeof expirations) == -1) continue;
+				done.clear();
+				{
+					lock _(_lock);
+					advance(done);
+				}
+				complete(done);
+			}
+		}
+
+		// caller has _lock
+		void interrupt_scheduler::arm(bool on) throw()
+		{
+			itimerspec its;
+			memset(&its, 0, sizeof its);
+			if(on)
+			{
+				// expire right on the tick boundaries
+				const uint64_t first(epoch + ((now() - epoch) / tick_ns + 1) * tick_ns);
+				its.it_interval.tv_sec = tick_ns / 1000000000ull;
+				its.it_interval.tv_nsec = tick_ns % 1000000000ull;
+				its.it_value.tv_sec = first / 1000000000ull;
+				its.it_value.tv_nsec = first % 1000000000ull;
+			}
+			timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+		}
+
+		// caller has _lock; tick is relative to epoch
+		void interrupt_scheduler::schedule(_endpoint& e, uint64_t tick) throw()
+		{
+			if(e.queued) unschedule(e);
+			// boundaries already passed are handled by the next advance
+			e.due = std::max(tick, current + 1);
+			_endpoint*& head(wheel[e.due & (wheel_size - 1)]);
+			e.prev = NULL;
+			e.next = head;
+			if(head) head->prev = &e;
+			head = &e;
+			e.queued = true;
+			if(!scheduled++) arm(true);
+		}
+
+		// caller has _lock
+		void interrupt_scheduler::unschedule(_endpoint& e) throw()
+		{
+			if(!e.queued) return;
+			if(e.prev) e.prev->next = e.next;
+			else wheel[e.due & (wheel_size - 1)] = e.next;
+			if(e.next) e.next->prev = e.prev;
+			e.prev = e.next = NULL;
+			e.queued = false;
+			scheduled--;
+		}
+
+		// caller has _lock; puts e into the wheel if it has something to
+		// send for its oldest parked urb, t being now
+		void interrupt_scheduler::reschedule(_endpoint& e, uint64_t t) throw()
+		{
+			if(e.parked.empty() || (e.reports.empty() && !(e.repeat && e.have_last)))
+			{
+				unschedule(e);
+				return;
+			}
+			const int32_t interval(std::max(e.parked.front()->get_urb()->get_interval(), 1));
+			const uint64_t boundary(std::max(t, e.last_complete + interval * e.unit_ns));
+			// round up, so that the interval is never cut short
+			schedule(e, (boundary - epoch + tick_ns - 1) / tick_ns);
+		}
+
+		// caller has _lock; completes the oldest parked urb of e with the next
+		// report, or the last one again; NULL if there is nothing to send
+		process_urb_work* interrupt_scheduler::send(_endpoint& e, uint64_t t) throw()
+		{
+			if(e.parked.empty()) return NULL;
+			if(!e.reports.empty())
+			{
+				e.last.swap(e.reports.front());
+				e.reports.pop_front();
+				e.have_last = true;
+			}
+			else if(!e.repeat || !e.have_last)
+				return NULL;
+			process_urb_work* w(e.parked.front());
+			e.parked.pop_front();
+			usb::urb& urb(*w->get_urb());
+			const size_t n(std::min(e.last.size(), static_cast<size_t>(urb.get_buffer_length())));
+			if(n) memcpy(urb.get_buffer(), &e.last[0], n);
+			urb.set_buffer_actual(static_cast<int32_t>(n));
+			urb.ack();
+			e.last_complete = t;
+			return w;
+		}
+
+		// caller has _lock; handles all boundaries up to now
+		void interrupt_scheduler::advance(_done& done) throw()
+		{
+			const uint64_t t(now());
+			const uint64_t tick((t - epoch) / tick_ns);
+			if(tick <= current) return;
+			// a full turn visits every slot
+			// the boundary counts as the time of completion, so that the
+			// next interval does not pick up the latency of the timer
+			const uint64_t boundary(epoch + tick * tick_ns);
+			const uint64_t steps(std::min(tick - current, static_cast<uint64_t>(wheel_size)));
+			for(uint64_t k(1); k <= steps; k++)
+			{
+				_endpoint* e(wheel[(current + k) & (wheel_size - 1)]);
+				while(e)
+				{
+					_endpoint* next(e->next);
+					if(e->due <= tick)
+					{
+						unschedule(*e);
+						try
+						{
+							done.push_back(std::make_pair(e->owner, static_cast<process_urb_work*>(NULL)));
+							if(!(done.back().second = send(*e, boundary)))
+								done.pop_back();
+						}
+						catch(std::bad_alloc)
+						{
+							// try again on the next tick
+						}
+						reschedule(*e, t);
+					}
+					e = next;
+				}
+			}
+			current = tick;
+			if(!scheduled) arm(false);
+		}
+
+		// without _lock, because the owners call release with their lock held
+		void interrupt_scheduler::complete(const _done& done) throw()
+		{
+			for(_done::const_iterator i(done.begin()); i < done.end(); i++)
+			{
+				try { i->first->complete_held(i->second); }
+				catch(...) { }
+			}
+		}
+
+		void interrupt_scheduler::attach(hcd& h, uint8_t port, uint8_t epadr, usb::data_rate rate, bool repeat) volatile throw(std::exception)
+		{
+			interrupt_scheduler& _this(const_cast<interrupt_scheduler&>(*this));
+			const _key k(&h, port << 8 | epadr);
+			{
+				lock _(_lock);
+				if(_this.endpoints.count(k)) return;
+				_endpoint* e(new _endpoint(&h, port, epadr, (rate == usb::data_rate_high) ? 125000 : 1000000, repeat));
+				try { _this.endpoints.insert(std::make_pair(k, e)); }
+				catch(...)
+				{
+					delete e;
+					throw;
+				}
+			}
+			try { h.set_endpoint_handler(port, epadr, &_this); }
+			catch(...)
+			{
+				lock _(_lock);
+				std::map<_key, _endpoint*>::iterator i(_this.endpoints.find(k));
+				delete i->second;
+				_this.endpoints.erase(i);
+				throw;
+			}
+		}
+
+		void interrupt_scheduler::detach(hcd& h, uint8_t port, uint8_t epadr) volatile throw()
+		{
+			interrupt_scheduler& _this(const_cast<interrupt_scheduler&>(*this));
+			// releases the parked urbs first
+			try { h.remove_endpoint_handler(port, epadr, &_this); }
+			catch(...) { }
+			lock _(_lock);
+			std::map<_key, _endpoint*>::iterator i(_this.endpoints.find(_key(&h, port << 8 | epadr)));
+			if(i == _this.endpoints.end()) return;
+			_this.unschedule(*i->second);
+			delete i->second;
+			_this.endpoints.erase(i);
+		}
+
+		void interrupt_scheduler::post(hcd& h, uint8_t port, uint8_t epadr, const void* report, size_t size) volatile throw(std::exception)
+		{
+			interrupt_scheduler& _this(const_cast<interrupt_scheduler&>(*this));
+			_done done;
+			{
+				lock _(_lock);
+				std::map<_key, _endpoint*>::iterator i(_this.endpoints.find(_key(&h, port << 8 | epadr)));
+				if(i == _this.endpoints.end()) throw std::invalid_argument("epadr");
+				_endpoint& e(*i->second);
+				const uint8_t* r(static_cast<const uint8_t*>(report));
+				e.reports.push_back(std::vector<uint8_t>(r, r + size));
+				const uint64_t t(now());
+				// nothing queued before: no need to wait for a boundary
+				if(e.reports.size() == 1 && !e.parked.empty())
+				{
+					try
+					{
+						done.push_back(std::make_pair(&h, static_cast<process_urb_work*>(NULL)));
+						done.back().second = _this.send(e, t);
+					}
+					catch(std::bad_alloc) { }
+				}
+				_this.reschedule(e, t);
+			}
+			complete(done);
+		}
+
+		size_t interrupt_scheduler::get_parked_count() volatile throw()
+		{
+			interrupt_scheduler& _this(const_cast<interrupt_scheduler&>(*this));
+			lock _(_lock);
+			size_t n(0);
+			for(std::map<_key, _endpoint*>::const_iterator i(_this.endpoints.begin()); i != _this.endpoints.end(); i++)
+				n += i->second->parked.size();
+			return n;
+		}
+
+		endpoint_handler::disposition interrupt_scheduler::submit(hcd& from, process_urb_work* w) throw()
+		{
+			usb::urb& urb(*w->get_urb());
+			if(!urb.is_interrupt() || !urb.is_in()) return disposition_pass;
+			lock _(_lock);
+			std::map<_key, _endpoint*>::iterator i(endpoints.find(_key(&from, w->get_port() << 8 | urb.get_endpoint_address())));
+			if(i == endpoints.end()) return disposition_pass;
+			_endpoint& e(*i->second);
+			try { e.parked.push_back(w); }
+			catch(std::bad_alloc) { return disposition_pass; }
+			const uint64_t t(now());
+			const uint64_t interval(std::max(urb.get_interval(), 1) * e.unit_ns);
+			if(e.parked.size() == 1 && !e.reports.empty() && t >= e.last_complete + interval)
+			{
+				send(e, t);
+				reschedule(e, t);
+				return disposition_complete;
+			}
+			reschedule(e, t);
+			return disposition_hold;
+		}
+
+		bool interrupt_scheduler::release(hcd& from, process_urb_work* w) throw()
+		{
+			lock _(_lock);
+			std::map<_key, _endpoint*>::iterator i(endpoints.find(_key(&from, w->get_port() << 8 | w->get_urb()->get_endpoint_address())));
+			if(i == endpoints.end()) return false;
+			_endpoint& e(*i->second);
+			std::deque<process_urb_work*>::iterator p(std::find(e.parked.begin(), e.parked.end(), w));
+			if(p == e.parked.end()) return false;
+			e.parked.erase(p);
+			reschedule(e, now());
+			return true;
+		}
+	}
+}
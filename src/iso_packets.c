@@ -0,0 +1,305 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+#include "iso_packets.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define ISO_PACKETS_X86 1
+#include <immintrin.h>
+#endif
+
+// usb_vhci_iso_packet is {offset, packet_length, packet_actual, status}, so
+// four packets are a 4x4 matrix of 32 bit values. The vector kernels
+// transpose it into one register per field (structure of arrays) and work
+// on whole columns; the layout in memory stays the one of the kernel ABI.
+
+// the kernels move the packets as raw 32 bit lanes, so they break silently
+// if one of these layouts changes; a negative array size stops the build
+#define ISO_PACKETS_ASSERT(name, cond) typedef char iso_packets_assert_##name[(cond) ? 1 : -1]
+#define ISO_PACKETS_FIELD(type, field, at) \
+	ISO_PACKETS_ASSERT(type##_##field, offsetof(struct type, field) == (at) && \
+	                                   sizeof(((struct type *)0)->field) == 4)
+
+ISO_PACKETS_ASSERT(usb_vhci_iso_packet_size, sizeof(struct usb_vhci_iso_packet) == 16);
+ISO_PACKETS_FIELD(usb_vhci_iso_packet, offset, 0);
+ISO_PACKETS_FIELD(usb_vhci_iso_packet, packet_length, 4);
+ISO_PACKETS_FIELD(usb_vhci_iso_packet, packet_actual, 8);
+ISO_PACKETS_FIELD(usb_vhci_iso_packet, status, 12);
+ISO_PACKETS_ASSERT(usb_vhci_ioc_iso_packet_data_size, sizeof(struct usb_vhci_ioc_iso_packet_data) == 8);
+ISO_PACKETS_FIELD(usb_vhci_ioc_iso_packet_data, offset, 0);
+ISO_PACKETS_FIELD(usb_vhci_ioc_iso_packet_data, packet_length, 4);
+ISO_PACKETS_ASSERT(usb_vhci_ioc_iso_packet_giveback_size, sizeof(struct usb_vhci_ioc_iso_packet_giveback) == 8);
+ISO_PACKETS_FIELD(usb_vhci_ioc_iso_packet_giveback, packet_actual, 0);
+ISO_PACKETS_FIELD(usb_vhci_ioc_iso_packet_giveback, status, 4);
+
+static void unpack_scalar(struct usb_vhci_iso_packet *dst,
+                          const struct usb_vhci_ioc_iso_packet_data *src,
+                          int32_t count)
+{
+	for(int32_t i = 0; i < count; i++)
+	{
+		dst[i].offset = src[i].offset;
+		dst[i].packet_length = (int32_t)src[i].packet_length;
+		dst[i].packet_actual = 0;
+		dst[i].status = USB_VHCI_STATUS_PENDING;
+	}
+}
+
+static void pack_scalar(struct usb_vhci_ioc_iso_packet_giveback *dst,
+                        const struct usb_vhci_iso_packet *src,
+                        int32_t count)
+{
+	for(int32_t i = 0; i < count; i++)
+	{
+		dst[i].status = src[i].status == USB_VHCI_STATUS_SUCCESS ? 0 :
+		                usb_vhci_to_iso_packets_errno(src[i].status);
+		dst[i].packet_actual = (uint32_t)src[i].packet_actual;
+	}
+}
+
+static int32_t count_errors_scalar(const struct usb_vhci_iso_packet *packets, int32_t count)
+{
+	int32_t errors = 0;
+	for(int32_t i = 0; i < count; i++)
+		errors += packets[i].status != USB_VHCI_STATUS_SUCCESS;
+	return errors;
+}
+
+#ifdef ISO_PACKETS_X86
+struct soa4_sse2
+{
+	__m128i offset, length, actual, status;
+};
+
+__attribute__((target("sse2")))
+static inline struct soa4_sse2 load_soa4_sse2(const struct usb_vhci_iso_packet *p)
+{
+	const __m128i a = _mm_loadu_si128((const __m128i *)(p + 0));
+	const __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+	const __m128i c = _mm_loadu_si128((const __m128i *)(p + 2));
+	const __m128i d = _mm_loadu_si128((const __m128i *)(p + 3));
+	const __m128i ab_lo = _mm_unpacklo_epi32(a, b), ab_hi = _mm_unpackhi_epi32(a, b);
+	const __m128i cd_lo = _mm_unpacklo_epi32(c, d), cd_hi = _mm_unpackhi_epi32(c, d);
+	struct soa4_sse2 s;
+	s.offset = _mm_unpacklo_epi64(ab_lo, cd_lo);
+	s.length = _mm_unpackhi_epi64(ab_lo, cd_lo);
+	s.actual = _mm_unpacklo_epi64(ab_hi, cd_hi);
+	s.status = _mm_unpackhi_epi64(ab_hi, cd_hi);
+	return s;
+}
+
+__attribute__((target("sse2")))
+static void unpack_sse2(struct usb_vhci_iso_packet *dst,
+                        const struct usb_vhci_ioc_iso_packet_data *src,
+                        int32_t count)
+{
+	// {packet_actual, status} of a freshly fetched packet
+	const __m128i fill = _mm_set_epi32(USB_VHCI_STATUS_PENDING, 0, USB_VHCI_STATUS_PENDING, 0);
+	int32_t i = 0;
+	for(; i + 2 <= count; i += 2)
+	{
+		const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi64(v, fill));
+		_mm_storeu_si128((__m128i *)(dst + i + 1), _mm_unpackhi_epi64(v, fill));
+	}
+	unpack_scalar(dst + i, src + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void pack_sse2(struct usb_vhci_ioc_iso_packet_giveback *dst,
+                      const struct usb_vhci_iso_packet *src,
+                      int32_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int32_t i = 0;
+	for(; i + 4 <= count; i += 4)
+	{
+		const struct soa4_sse2 s = load_soa4_sse2(src + i);
+		// successful packets map to errno 0, so the status column can be
+		// used as is; blocks with errors go through the lookup table
+		if(_mm_movemask_epi8(_mm_cmpeq_epi32(s.status, zero)) != 0xffff)
+		{
+			pack_scalar(dst + i, src + i, 4);
+			continue;
+		}
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi32(s.actual, zero));
+		_mm_storeu_si128((__m128i *)(dst + i + 2), _mm_unpackhi_epi32(s.actual, zero));
+	}
+	pack_scalar(dst + i, src + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static int32_t count_errors_sse2(const struct usb_vhci_iso_packet *packets, int32_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	// cmpeq yields -1 per successful packet
+	__m128i ok = zero;
+	int32_t i = 0;
+	for(; i + 4 <= count; i += 4)
+		ok = _mm_sub_epi32(ok, _mm_cmpeq_epi32(load_soa4_sse2(packets + i).status, zero));
+	ok = _mm_add_epi32(ok, _mm_shuffle_epi32(ok, _MM_SHUFFLE(1, 0, 3, 2)));
+	ok = _mm_add_epi32(ok, _mm_shuffle_epi32(ok, _MM_SHUFFLE(2, 3, 0, 1)));
+	return i - _mm_cvtsi128_si32(ok) + count_errors_scalar(packets + i, count - i);
+}
+
+// eight packets; the columns come out in the order 0 2 4 6 | 1 3 5 7
+struct soa8_avx2
+{
+	__m256i offset, length, actual, status;
+};
+
+__attribute__((target("avx2")))
+static inline struct soa8_avx2 load_soa8_avx2(const struct usb_vhci_iso_packet *p)
+{
+	const __m256i a = _mm256_loadu_si256((const __m256i *)(p + 0));
+	const __m256i b = _mm256_loadu_si256((const __m256i *)(p + 2));
+	const __m256i c = _mm256_loadu_si256((const __m256i *)(p + 4));
+	const __m256i d = _mm256_loadu_si256((const __m256i *)(p + 6));
+	const __m256i ab_lo = _mm256_unpacklo_epi32(a, b), ab_hi = _mm256_unpackhi_epi32(a, b);
+	const __m256i cd_lo = _mm256_unpacklo_epi32(c, d), cd_hi = _mm256_unpackhi_epi32(c, d);
+	struct soa8_avx2 s;
+	s.offset = _mm256_unpacklo_epi64(ab_lo, cd_lo);
+	s.length = _mm256_unpackhi_epi64(ab_lo, cd_lo);
+	s.actual = _mm256_unpacklo_epi64(ab_hi, cd_hi);
+	s.status = _mm256_unpackhi_epi64(ab_hi, cd_hi);
+	return s;
+}
+
+__attribute__((target("avx2")))
+static void unpack_avx2(struct usb_vhci_iso_packet *dst,
+                        const struct usb_vhci_ioc_iso_packet_data *src,
+                        int32_t count)
+{
+	const __m256i fill = _mm256_set_epi32(USB_VHCI_STATUS_PENDING, 0, USB_VHCI_STATUS_PENDING, 0,
+	                                      USB_VHCI_STATUS_PENDING, 0, USB_VHCI_STATUS_PENDING, 0);
+	int32_t i = 0;
+	for(; i + 4 <= count; i += 4)
+	{
+		const __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		const __m256i lo = _mm256_unpacklo_epi64(v, fill); // 0 2
+		const __m256i hi = _mm256_unpackhi_epi64(v, fill); // 1 3
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + i + 2), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	unpack_scalar(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void pack_avx2(struct usb_vhci_ioc_iso_packet_giveback *dst,
+                      const struct usb_vhci_iso_packet *src,
+                      int32_t count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	int32_t i = 0;
+	for(; i + 8 <= count; i += 8)
+	{
+		const struct soa8_avx2 s = load_soa8_avx2(src + i);
+		if(!_mm256_testz_si256(s.status, s.status))
+		{
+			pack_scalar(dst + i, src + i, 8);
+			continue;
+		}
+		// lo holds packets 0 2 | 1 3 and hi 4 6 | 5 7, the permute restores the order
+		const __m256i lo = _mm256_unpacklo_epi32(s.actual, zero);
+		const __m256i hi = _mm256_unpackhi_epi32(s.actual, zero);
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(lo, 0xd8));
+		_mm256_storeu_si256((__m256i *)(dst + i + 4), _mm256_permute4x64_epi64(hi, 0xd8));
+	}
+	pack_scalar(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static int32_t count_errors_avx2(const struct usb_vhci_iso_packet *packets, int32_t count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i ok = zero;
+	int32_t i = 0;
+	for(; i + 8 <= count; i += 8)
+		ok = _mm256_sub_epi32(ok, _mm256_cmpeq_epi32(load_soa8_avx2(packets + i).status, zero));
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(ok), _mm256_extracti128_si256(ok, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	return i - _mm_cvtsi128_si32(sum) + count_errors_scalar(packets + i, count - i);
+}
+#endif // ISO_PACKETS_X86
+
+static void (*unpack_impl)(struct usb_vhci_iso_packet *,
+                           const struct usb_vhci_ioc_iso_packet_data *,
+                           int32_t) = unpack_scalar;
+static void (*pack_impl)(struct usb_vhci_ioc_iso_packet_giveback *,
+                         const struct usb_vhci_iso_packet *,
+                         int32_t) = pack_scalar;
+static int32_t (*count_errors_impl)(const struct usb_vhci_iso_packet *,
+                                    int32_t) = count_errors_scalar;
+
+#ifdef ISO_PACKETS_X86
+__attribute__((constructor))
+static void select_impl(void)
+{
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		unpack_impl = unpack_avx2;
+		pack_impl = pack_avx2;
+		count_errors_impl = count_errors_avx2;
+	}
+	else if(__builtin_cpu_supports("sse2"))
+	{
+		unpack_impl = unpack_sse2;
+		pack_impl = pack_sse2;
+		count_errors_impl = count_errors_sse2;
+	}
+}
+#endif
+
+void usb_vhci_iso_unpack(struct usb_vhci_iso_packet *dst,
+                         const struct usb_vhci_ioc_iso_packet_data *src,
+                         int32_t count)
+{
+	unpack_impl(dst, src, count);
+}
+
+void usb_vhci_iso_pack(struct usb_vhci_ioc_iso_packet_giveback *dst,
+                       const struct usb_vhci_iso_packet *src,
+                       int32_t count)
+{
+	pack_impl(dst, src, count);
+}
+
+int32_t usb_vhci_iso_count_errors(const struct usb_vhci_iso_packet *packets, int32_t count)
+{
+	return count_errors_impl(packets, count);
+}
@@ -0,0 +1,55 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _ISO_PACKETS_H
+#define _ISO_PACKETS_H 1
+
+#include "libusb_vhci.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Per packet conversions used by usb_vhci_fetch_data, usb_vhci_giveback and
+// urb::set_iso_results. They use SSE2 or AVX2 if the cpu supports it.
+void usb_vhci_iso_unpack(struct usb_vhci_iso_packet *dst,
+                         const struct usb_vhci_ioc_iso_packet_data *src,
+                         int32_t count) _LIB_USB_VHCI_NOTHROW;
+void usb_vhci_iso_pack(struct usb_vhci_ioc_iso_packet_giveback *dst,
+                       const struct usb_vhci_iso_packet *src,
+                       int32_t count) _LIB_USB_VHCI_NOTHROW;
+int32_t usb_vhci_iso_count_errors(const struct usb_vhci_iso_packet *packets,
+                                  int32_t count) _LIB_USB_VHCI_NOTHROW;
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include "libusb_vhci.h"
+
+namespace
+{
+	uint64_t now() throw()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+	}
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		iso_stream::iso_stream(hcd& h, uint8_t port, uint8_t epadr, size_t capacity, size_t frame_size) throw(std::exception) :
+			owner(h),
+			port(port),
+			epadr(epadr),
+			frame_size(frame_size),
+			ring(capacity),
+			stats(),
+			write_overruns(0),
+			last_arrival(0),
+			interval(0.0),
+			jitter(0.0),
+			_lock()
+		{
+			if(!frame_size) throw std::invalid_argument("frame_size");
+			pthread_mutex_init(&_lock, NULL);
+			try { owner.set_endpoint_handler(port, epadr, this); }
+			catch(...)
+			{
+				pthread_mutex_destroy(&_lock);
+				throw;
+			}
+		}
+
+		iso_stream::~iso_stream() throw()
+		{
+			try { owner.remove_endpoint_handler(port, epadr, this); }
+			catch(...) { }
+			pthread_mutex_destroy(&_lock);
+		}
+
+		size_t iso_stream::write(const void* data, size_t size) volatile throw()
+		{
+			const size_t n(ring.write(data, size));
+			if(n < size)
+				__sync_fetch_and_add(const_cast<uint64_t*>(&write_overruns), size - n);
+			return n;
+		}
+
+		size_t iso_stream::read(void* data, size_t size) volatile throw()
+		{
+			return ring.read(data, size);
+		}
+
+		iso_stream::statistics iso_stream::get_statistics() volatile throw()
+		{
+			lock _(_lock);
+			statistics s(const_cast<iso_stream&>(*this).stats);
+			s.overruns += write_overruns;
+			return s;
+		}
+
+		endpoint_handler::disposition iso_stream::submit(hcd& from, process_urb_work* w) throw()
+		{
+			usb::urb& urb(*w->get_urb());
+			if(!urb.is_isochronous()) return disposition_pass;
+			lock _(_lock);
+			note_arrival();
+			if(urb.is_in()) fill(urb);
+			else drain(urb);
+			urb.set_iso_results();
+			return disposition_complete;
+		}
+
+		bool iso_stream::release(hcd& from, process_urb_work* w) throw()
+		{
+			// never holds a work
+			return true;
+		}
+
+		// caller has _lock
+		void iso_stream::note_arrival() throw()
+		{
+			const uint64_t t(now());
+			if(last_arrival)
+			{
+				// exponential averages over roughly the last 16 urbs
+				const double d(static_cast<double>(t - last_arrival));
+				if(interval == 0.0) interval = d;
+				else interval += (d - interval) / 16.0;
+				const double dev(fabs(d - interval));
+				jitter += (dev - jitter) / 16.0;
+				stats.interval_ns = static_cast<uint64_t>(interval);
+				stats.jitter_ns = static_cast<uint64_t>(jitter);
+				if(static_cast<uint64_t>(dev) > stats.max_jitter_ns)
+					stats.max_jitter_ns = static_cast<uint64_t>(dev);
+			}
+			last_arrival = t;
+			stats.urbs++;
+		}
+
+		// caller has _lock
+		void iso_stream::fill(usb::urb& urb) throw()
+		{
+			const int32_t count(urb.get_iso_packet_count());
+			if(!count) return;
+			const int32_t len(urb.get_iso_packet_length(0));
+			bool uniform(len > 0 && !(len % frame_size));
+			for(int32_t i(1); uniform && i < count; i++)
+				uniform = urb.get_iso_packet_length(i) == len &&
+				          urb.get_iso_packet_offset(i) == urb.get_iso_packet_offset(0) + static_cast<uint32_t>(i * len);
+			const size_t total(static_cast<size_t>(len) * count);
+			if(uniform && ring.get_used() >= total)
+			{
+				// back to back packets of the same size: one copy for all
+				ring.read(urb.get_iso_packet_buffer(0), total);
+				for(int32_t i(0); i < count; i++)
+				{
+					urb.set_iso_packet_actual(i, len);
+					urb.ack_iso(i);
+				}
+				stats.bytes += total;
+			}
+			else
+			{
+				for(int32_t i(0); i < count; i++)
+				{
+					const size_t want(urb.get_iso_packet_length(i) - urb.get_iso_packet_length(i) % frame_size);
+					size_t n(std::min(want, ring.get_used()));
+					n = ring.read(urb.get_iso_packet_buffer(i), n - n % frame_size);
+					urb.set_iso_packet_actual(i, static_cast<int32_t>(n));
+					urb.ack_iso(i);
+					if(n < want) stats.underruns++;
+					stats.bytes += n;
+				}
+			}
+			stats.packets += count;
+		}
+
+		// caller has _lock
+		void iso_stream::drain(usb::urb& urb) throw()
+		{
+			const int32_t count(urb.get_iso_packet_count());
+			for(int32_t i(0); i < count; i++)
+			{
+				const size_t len(urb.get_iso_packet_length(i));
+				const size_t n(ring.write(urb.get_iso_packet_buffer(i), len));
+				urb.set_iso_packet_actual(i, static_cast<int32_t>(len));
+				urb.ack_iso(i);
+				stats.overruns += len - n;
+				stats.bytes += n;
+			}
+			stats.packets += count;
+		}
+	}
+}
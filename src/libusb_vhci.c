@@ -41,6 +41,7 @@
 #include <sys/ioctl.h>
 
 #include "libusb_vhci.h"
+#include "iso_packets.h"
 
 int usb_vhci_open(uint8_t port_count,  // [IN]  number of ports
                   int32_t *id,         // [OUT] controller id
@@ -168,13 +169,8 @@ int usb_vhci_fetch_data(int fd, const struct usb_vhci_urb *urb)
 	if(ret == -1)
 		goto err;
 	ret = 0;
-	for(int i = 0; i < pc; i++)
-	{
-		urb->iso_packets[i].offset = u.iso_packets[i].offset;
-		urb->iso_packets[i].packet_length = (int32_t)u.iso_packets[i].packet_length;
-		urb->iso_packets[i].packet_actual = 0;
-		urb->iso_packets[i].status = USB_VHCI_STATUS_PENDING;
-	}
+	if(pc > 0)
+		usb_vhci_iso_unpack(urb->iso_packets, u.iso_packets, pc);
 
 err:
 	if(u.iso_packets)
@@ -201,11 +197,7 @@ int usb_vhci_giveback(int fd, const struct usb_vhci_urb *urb)
 		gb.iso_packets = malloc(sizeof *gb.iso_packets * pc);
 		gb.packet_count = pc;
 		gb.error_count = urb->error_count;
-		for(int i = 0; i < pc; i++)
-		{
-			gb.iso_packets[i].status = usb_vhci_to_iso_packets_errno(urb->iso_packets[i].status);
-			gb.iso_packets[i].packet_actual = (uint32_t)urb->iso_packets[i].packet_actual;
-		}
+		usb_vhci_iso_pack(gb.iso_packets, urb->iso_packets, pc);
 	}
 
 	int ret = ioctl(fd, USB_VHCI_HCD_IOCGIVEBACK, &gb);
@@ -347,53 +339,72 @@ uint8_t usb_vhci_port_stat_triggers(const struct usb_vhci_port_stat *stat,
 	return flags;
 }
 
+// USB_VHCI_STATUS_* values are sparse; this hash maps each of them to its own
+// slot in a 64 entry table
+#define STATUS_HASH(status) \
+	((((uint32_t)(status) >> 16) ^ ((uint32_t)(status) >> 24) ^ ((uint32_t)(status) << 2)) & 63)
+
+static const struct
+{
+	int32_t status;
+	int err;
+} to_errno_table[64] =
+{
+	[STATUS_HASH(USB_VHCI_STATUS_SUCCESS)]                = { USB_VHCI_STATUS_SUCCESS,                0 },
+	[STATUS_HASH(USB_VHCI_STATUS_PENDING)]                = { USB_VHCI_STATUS_PENDING,                -EINPROGRESS },
+	[STATUS_HASH(USB_VHCI_STATUS_SHORT_PACKET)]           = { USB_VHCI_STATUS_SHORT_PACKET,           -EREMOTEIO },
+	[STATUS_HASH(USB_VHCI_STATUS_ERROR)]                  = { USB_VHCI_STATUS_ERROR,                  -EPROTO },
+	[STATUS_HASH(USB_VHCI_STATUS_CANCELED)]               = { USB_VHCI_STATUS_CANCELED,               -ECONNRESET }, // or -ENOENT
+	[STATUS_HASH(USB_VHCI_STATUS_TIMEDOUT)]               = { USB_VHCI_STATUS_TIMEDOUT,               -ETIMEDOUT },
+	[STATUS_HASH(USB_VHCI_STATUS_DEVICE_DISABLED)]        = { USB_VHCI_STATUS_DEVICE_DISABLED,        -ESHUTDOWN },
+	[STATUS_HASH(USB_VHCI_STATUS_DEVICE_DISCONNECTED)]    = { USB_VHCI_STATUS_DEVICE_DISCONNECTED,    -ENODEV },
+	[STATUS_HASH(USB_VHCI_STATUS_BIT_STUFF)]              = { USB_VHCI_STATUS_BIT_STUFF,              -EPROTO },
+	[STATUS_HASH(USB_VHCI_STATUS_CRC)]                    = { USB_VHCI_STATUS_CRC,                    -EILSEQ },
+	[STATUS_HASH(USB_VHCI_STATUS_NO_RESPONSE)]            = { USB_VHCI_STATUS_NO_RESPONSE,            -ETIME },
+	[STATUS_HASH(USB_VHCI_STATUS_BABBLE)]                 = { USB_VHCI_STATUS_BABBLE,                 -EOVERFLOW },
+	[STATUS_HASH(USB_VHCI_STATUS_STALL)]                  = { USB_VHCI_STATUS_STALL,                  -EPIPE },
+	[STATUS_HASH(USB_VHCI_STATUS_BUFFER_OVERRUN)]         = { USB_VHCI_STATUS_BUFFER_OVERRUN,         -ECOMM },
+	[STATUS_HASH(USB_VHCI_STATUS_BUFFER_UNDERRUN)]        = { USB_VHCI_STATUS_BUFFER_UNDERRUN,        -ENOSR },
+	[STATUS_HASH(USB_VHCI_STATUS_ALL_ISO_PACKETS_FAILED)] = { USB_VHCI_STATUS_ALL_ISO_PACKETS_FAILED, -EPROTO }
+};
+
+// indexed by -errno; everything not listed is USB_VHCI_STATUS_ERROR
+static const int32_t from_errno_table[256] =
+{
+	[0 ... 255]   = USB_VHCI_STATUS_ERROR,
+	[0]           = USB_VHCI_STATUS_SUCCESS,
+	[EINPROGRESS] = USB_VHCI_STATUS_PENDING,
+	[EREMOTEIO]   = USB_VHCI_STATUS_SHORT_PACKET,
+	[ENOENT]      = USB_VHCI_STATUS_CANCELED,
+	[ECONNRESET]  = USB_VHCI_STATUS_CANCELED,
+	[ETIMEDOUT]   = USB_VHCI_STATUS_TIMEDOUT,
+	[ESHUTDOWN]   = USB_VHCI_STATUS_DEVICE_DISABLED,
+	[ENODEV]      = USB_VHCI_STATUS_DEVICE_DISCONNECTED,
+	[EPROTO]      = USB_VHCI_STATUS_BIT_STUFF,
+	[EILSEQ]      = USB_VHCI_STATUS_CRC,
+	[ETIME]       = USB_VHCI_STATUS_NO_RESPONSE,
+	[EOVERFLOW]   = USB_VHCI_STATUS_BABBLE,
+	[EPIPE]       = USB_VHCI_STATUS_STALL,
+	[ECOMM]       = USB_VHCI_STATUS_BUFFER_OVERRUN,
+	[ENOSR]       = USB_VHCI_STATUS_BUFFER_UNDERRUN
+};
+
 int usb_vhci_to_errno(int32_t status, uint8_t iso_urb)
 {
-	switch(status)
+	if(iso_urb)
 	{
-	case USB_VHCI_STATUS_SUCCESS:                return 0;
-	case USB_VHCI_STATUS_PENDING:                return -EINPROGRESS;
-	case USB_VHCI_STATUS_SHORT_PACKET:           return -EREMOTEIO;
-	case USB_VHCI_STATUS_ERROR:                  return iso_urb ? -EXDEV : -EPROTO;
-	case USB_VHCI_STATUS_CANCELED:               return -ECONNRESET; // or -ENOENT
-	case USB_VHCI_STATUS_TIMEDOUT:               return -ETIMEDOUT;
-	case USB_VHCI_STATUS_DEVICE_DISABLED:        return -ESHUTDOWN;
-	case USB_VHCI_STATUS_DEVICE_DISCONNECTED:    return -ENODEV;
-	case USB_VHCI_STATUS_BIT_STUFF:              return -EPROTO;
-	case USB_VHCI_STATUS_CRC:                    return -EILSEQ;
-	case USB_VHCI_STATUS_NO_RESPONSE:            return -ETIME;
-	case USB_VHCI_STATUS_BABBLE:                 return -EOVERFLOW;
-	case USB_VHCI_STATUS_STALL:                  return -EPIPE;
-	case USB_VHCI_STATUS_BUFFER_OVERRUN:         return -ECOMM;
-	case USB_VHCI_STATUS_BUFFER_UNDERRUN:        return -ENOSR;
-	case USB_VHCI_STATUS_ALL_ISO_PACKETS_FAILED: return iso_urb ? -EINVAL : -EPROTO;
-	default:                                     return -EPROTO;
+		if(status == USB_VHCI_STATUS_ERROR)                  return -EXDEV;
+		if(status == USB_VHCI_STATUS_ALL_ISO_PACKETS_FAILED) return -EINVAL;
 	}
+	const int i = STATUS_HASH(status);
+	return (to_errno_table[i].status == status) ? to_errno_table[i].err : -EPROTO;
 }
 
-int32_t usb_vhci_from_errno(int errno, uint8_t iso_urb)
+int32_t usb_vhci_from_errno(int err, uint8_t iso_urb)
 {
-	switch(errno)
-	{
-	case 0:            return USB_VHCI_STATUS_SUCCESS;
-	case -EINPROGRESS: return USB_VHCI_STATUS_PENDING;
-	case -EREMOTEIO:   return USB_VHCI_STATUS_SHORT_PACKET;
-	case -ENOENT:
-	case -ECONNRESET:  return USB_VHCI_STATUS_CANCELED;
-	case -ETIMEDOUT:   return USB_VHCI_STATUS_TIMEDOUT;
-	case -ESHUTDOWN:   return USB_VHCI_STATUS_DEVICE_DISABLED;
-	case -ENODEV:      return USB_VHCI_STATUS_DEVICE_DISCONNECTED;
-	case -EPROTO:      return USB_VHCI_STATUS_BIT_STUFF;
-	case -EILSEQ:      return USB_VHCI_STATUS_CRC;
-	case -ETIME:       return USB_VHCI_STATUS_NO_RESPONSE;
-	case -EOVERFLOW:   return USB_VHCI_STATUS_BABBLE;
-	case -EPIPE:       return USB_VHCI_STATUS_STALL;
-	case -ECOMM:       return USB_VHCI_STATUS_BUFFER_OVERRUN;
-	case -ENOSR:       return USB_VHCI_STATUS_BUFFER_UNDERRUN;
-	case -EINVAL:      return iso_urb ? USB_VHCI_STATUS_ALL_ISO_PACKETS_FAILED :
-	                                    USB_VHCI_STATUS_ERROR;
-	default:           return USB_VHCI_STATUS_ERROR;
-	}
+	if(iso_urb && err == -EINVAL) return USB_VHCI_STATUS_ALL_ISO_PACKETS_FAILED;
+	if(err > 0 || err <= -256)    return USB_VHCI_STATUS_ERROR;
+	return from_errno_table[-err];
 }
 
 int usb_vhci_to_iso_packets_errno(int32_t status)
@@ -401,8 +412,8 @@ int usb_vhci_to_iso_packets_errno(int32_t status)
 	return usb_vhci_to_errno(status, 0);
 }
 
-int32_t usb_vhci_from_iso_packets_errno(int errno)
+int32_t usb_vhci_from_iso_packets_errno(int err)
 {
-	return usb_vhci_from_errno(errno, 0);
+	return usb_vhci_from_errno(err, 0);
 }
 
@@ -36,12 +36,30 @@
 
 #ifdef __cplusplus
 #include <errno.h>
+#include <sys/uio.h>
 #include <string>
 #include <exception>
 #include <stdexcept>
 #include <vector>
 #include <list>
+#include <map>
+#include <set>
 #include <queue>
+
+// exception specifications; c++17 dropped the dynamic ones, so that newer
+// compilers (see libusb_vhci_coro.h) get the noexcept equivalents. One macro
+// per number of types, as c++98 has no variadic macros
+#if __cplusplus >= 201703L
+#define USB_VHCI_NOTHROW noexcept
+#define USB_VHCI_THROWS(a) noexcept(false)
+#define USB_VHCI_THROWS2(a, b) noexcept(false)
+#define USB_VHCI_THROWS3(a, b, c) noexcept(false)
+#else
+#define USB_VHCI_NOTHROW throw()
+#define USB_VHCI_THROWS(a) throw(a)
+#define USB_VHCI_THROWS2(a, b) throw(a, b)
+#define USB_VHCI_THROWS3(a, b, c) throw(a, b, c)
+#endif
 #endif
 
 #include <linux/usb-vhci.h>
@@ -53,7 +71,7 @@
 #endif
 #ifdef __cplusplus
 extern "C" {
-#define _LIB_USB_VHCI_NOTHROW throw()
+#define _LIB_USB_VHCI_NOTHROW USB_VHCI_NOTHROW
 #else
 #define _LIB_USB_VHCI_NOTHROW
 #endif
@@ -153,9 +171,9 @@ uint8_t usb_vhci_port_stat_triggers(const struct usb_vhci_port_stat *stat,
 
 // for converting status codes
 int usb_vhci_to_errno(int32_t status, uint8_t iso_urb) _LIB_USB_VHCI_NOTHROW;
-int32_t usb_vhci_from_errno(int errno, uint8_t iso_urb) _LIB_USB_VHCI_NOTHROW;
+int32_t usb_vhci_from_errno(int err, uint8_t iso_urb) _LIB_USB_VHCI_NOTHROW;
 int usb_vhci_to_iso_packets_errno(int32_t status) _LIB_USB_VHCI_NOTHROW;
-int32_t usb_vhci_from_iso_packets_errno(int errno) _LIB_USB_VHCI_NOTHROW;
+int32_t usb_vhci_from_iso_packets_errno(int err) _LIB_USB_VHCI_NOTHROW;
 
 #ifdef __cplusplus
 } // extern "C"
@@ -210,11 +228,16 @@ namespace usb
 	private:
 		usb_vhci_urb _urb;
 
-		void _cpy(const usb_vhci_urb& u) throw(std::bad_alloc);
-		void _chk() throw(std::invalid_argument);
+		void _cpy(const usb_vhci_urb& u) USB_VHCI_THROWS(std::bad_alloc);
+		void _chk() USB_VHCI_THROWS(std::invalid_argument);
+
+	protected:
+		// forgets the data buffer and the iso packets, so that the
+		// destructor does not delete them
+		void detach() USB_VHCI_NOTHROW { _urb.buffer = NULL; _urb.iso_packets = NULL; }
 
 	public:
-		urb(const urb&) throw(std::bad_alloc);
+		urb(const urb&) USB_VHCI_THROWS(std::bad_alloc);
 		urb(uint64_t handle,
 		    urb_type type,
 		    int32_t buffer_length,
@@ -234,54 +257,126 @@ namespace usb
 		    uint8_t bRequest,
 		    uint16_t wValue,
 		    uint16_t wIndex,
-		    uint16_t wLength) throw(std::invalid_argument, std::bad_alloc);
-		urb(const usb_vhci_urb& urb) throw(std::invalid_argument, std::bad_alloc);
-		urb(const usb_vhci_urb& urb, bool own) throw(std::invalid_argument, std::bad_alloc);
-		virtual ~urb() throw();
-		urb& operator=(const urb&) throw(std::bad_alloc);
-
-		const usb_vhci_urb* get_internal() const throw() { return &_urb; }
-		uint64_t get_handle() const throw() { return _urb.handle; }
-		uint8_t* get_buffer() const throw() { return _urb.buffer; }
-		uint32_t get_iso_packet_offset(int32_t index) const throw() { return _urb.iso_packets[index].offset; }
-		int32_t get_iso_packet_length(int32_t index) const throw() { return _urb.iso_packets[index].packet_length; }
-		int32_t get_iso_packet_actual(int32_t index) const throw() { return _urb.iso_packets[index].packet_actual; }
-		int32_t get_iso_packet_status(int32_t index) const throw() { return _urb.iso_packets[index].status; }
-		uint8_t* get_iso_packet_buffer(int32_t index) const throw() { return _urb.buffer + _urb.iso_packets[index].offset; }
-		int32_t get_buffer_length() const throw() { return _urb.buffer_length; }
-		int32_t get_buffer_actual() const throw() { return _urb.buffer_actual; }
-		int32_t get_iso_packet_count() const throw() { return _urb.packet_count; }
-		int32_t get_iso_error_count() const throw() { return _urb.error_count; }
-		int32_t get_status() const throw() { return _urb.status; }
-		int32_t get_interval() const throw() { return _urb.interval; }
-		uint16_t get_flags() const throw() { return _urb.flags; }
-		uint16_t get_wValue() const throw() { return _urb.wValue; }
-		uint16_t get_wIndex() const throw() { return _urb.wIndex; }
-		uint16_t get_wLength() const throw() { return _urb.wLength; }
-		uint8_t get_bmRequestType() const throw() { return _urb.bmRequestType; }
-		uint8_t get_bRequest() const throw() { return _urb.bRequest; }
-		uint8_t get_device_address() const throw() { return _urb.devadr; }
-		uint8_t get_endpoint_address() const throw() { return _urb.epadr; }
-		uint8_t get_endpoint_number() const throw() { return _urb.epadr & 0x07; }
-		urb_type get_type() const throw() { return static_cast<urb_type>(_urb.type); }
-		bool is_in() const throw() { return _urb.epadr & 0x80; }
-		bool is_out() const throw() { return !is_in(); }
-		bool is_isochronous() const throw() { return get_type() == urb_type_isochronous; }
-		bool is_interrupt() const throw() { return get_type() == urb_type_interrupt; }
-		bool is_control() const throw() { return get_type() == urb_type_control; }
-		bool is_bulk() const throw() { return get_type() == urb_type_bulk; }
-		void set_status(int32_t value) throw() { _urb.status = value; }
-		void ack() throw() { set_status(USB_VHCI_STATUS_SUCCESS); }
-		void stall() throw() { set_status(USB_VHCI_STATUS_STALL); }
-		void set_buffer_actual(int32_t value) throw() { _urb.buffer_actual = value; }
-		void set_iso_error_count(int32_t value) throw() { _urb.error_count = value; }
-		void set_iso_status(int32_t index, int32_t value) throw() { _urb.iso_packets[index].status = value; }
-		void ack_iso(int32_t index) throw() { set_iso_status(index, USB_VHCI_STATUS_SUCCESS); }
-		void stall_iso(int32_t index) throw() { set_iso_status(index, USB_VHCI_STATUS_STALL); }
-		void set_iso_packet_actual(int32_t index, int32_t value) throw() { _urb.iso_packets[index].packet_actual = value; }
-		bool is_short_not_ok() const throw() { return _urb.flags & USB_VHCI_URB_FLAGS_SHORT_NOT_OK; }
-		bool is_zero_packet() const throw() { return _urb.flags & USB_VHCI_URB_FLAGS_ZERO_PACKET; }
-		void set_iso_results() throw(std::logic_error);
+		    uint16_t wLength) USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+		urb(const usb_vhci_urb& urb) USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+		urb(const usb_vhci_urb& urb, bool own) USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+		virtual ~urb() USB_VHCI_NOTHROW;
+		urb& operator=(const urb&) USB_VHCI_THROWS(std::bad_alloc);
+
+		const usb_vhci_urb* get_internal() const USB_VHCI_NOTHROW { return &_urb; }
+		uint64_t get_handle() const USB_VHCI_NOTHROW { return _urb.handle; }
+		uint8_t* get_buffer() const USB_VHCI_NOTHROW { return _urb.buffer; }
+		uint32_t get_iso_packet_offset(int32_t index) const USB_VHCI_NOTHROW { return _urb.iso_packets[index].offset; }
+		int32_t get_iso_packet_length(int32_t index) const USB_VHCI_NOTHROW { return _urb.iso_packets[index].packet_length; }
+		int32_t get_iso_packet_actual(int32_t index) const USB_VHCI_NOTHROW { return _urb.iso_packets[index].packet_actual; }
+		int32_t get_iso_packet_status(int32_t index) const USB_VHCI_NOTHROW { return _urb.iso_packets[index].status; }
+		uint8_t* get_iso_packet_buffer(int32_t index) const USB_VHCI_NOTHROW { return _urb.buffer + _urb.iso_packets[index].offset; }
+		int32_t get_buffer_length() const USB_VHCI_NOTHROW { return _urb.buffer_length; }
+		int32_t get_buffer_actual() const USB_VHCI_NOTHROW { return _urb.buffer_actual; }
+		int32_t get_iso_packet_count() const USB_VHCI_NOTHROW { return _urb.packet_count; }
+		int32_t get_iso_error_count() const USB_VHCI_NOTHROW { return _urb.error_count; }
+		int32_t get_status() const USB_VHCI_NOTHROW { return _urb.status; }
+		int32_t get_interval() const USB_VHCI_NOTHROW { return _urb.interval; }
+		uint16_t get_flags() const USB_VHCI_NOTHROW { return _urb.flags; }
+		uint16_t get_wValue() const USB_VHCI_NOTHROW { return _urb.wValue; }
+		uint16_t get_wIndex() const USB_VHCI_NOTHROW { return _urb.wIndex; }
+		uint16_t get_wLength() const USB_VHCI_NOTHROW { return _urb.wLength; }
+		uint8_t get_bmRequestType() const USB_VHCI_NOTHROW { return _urb.bmRequestType; }
+		uint8_t get_bRequest() const USB_VHCI_NOTHROW { return _urb.bRequest; }
+		uint8_t get_device_address() const USB_VHCI_NOTHROW { return _urb.devadr; }
+		uint8_t get_endpoint_address() const USB_VHCI_NOTHROW { return _urb.epadr; }
+		uint8_t get_endpoint_number() const USB_VHCI_NOTHROW { return _urb.epadr & 0x07; }
+		urb_type get_type() const USB_VHCI_NOTHROW { return static_cast<urb_type>(_urb.type); }
+		bool is_in() const USB_VHCI_NOTHROW { return _urb.epadr & 0x80; }
+		bool is_out() const USB_VHCI_NOTHROW { return !is_in(); }
+		bool is_isochronous() const USB_VHCI_NOTHROW { return get_type() == urb_type_isochronous; }
+		bool is_interrupt() const USB_VHCI_NOTHROW { return get_type() == urb_type_interrupt; }
+		bool is_control() const USB_VHCI_NOTHROW { return get_type() == urb_type_control; }
+		bool is_bulk() const USB_VHCI_NOTHROW { return get_type() == urb_type_bulk; }
+		void set_status(int32_t value) USB_VHCI_NOTHROW { _urb.status = value; }
+		void ack() USB_VHCI_NOTHROW { set_status(USB_VHCI_STATUS_SUCCESS); }
+		void stall() USB_VHCI_NOTHROW { set_status(USB_VHCI_STATUS_STALL); }
+		void set_buffer_actual(int32_t value) USB_VHCI_NOTHROW { _urb.buffer_actual = value; }
+		void set_iso_error_count(int32_t value) USB_VHCI_NOTHROW { _urb.error_count = value; }
+		void set_iso_status(int32_t index, int32_t value) USB_VHCI_NOTHROW { _urb.iso_packets[index].status = value; }
+		void ack_iso(int32_t index) USB_VHCI_NOTHROW { set_iso_status(index, USB_VHCI_STATUS_SUCCESS); }
+		void stall_iso(int32_t index) USB_VHCI_NOTHROW { set_iso_status(index, USB_VHCI_STATUS_STALL); }
+		void set_iso_packet_actual(int32_t index, int32_t value) USB_VHCI_NOTHROW { _urb.iso_packets[index].packet_actual = value; }
+		bool is_short_not_ok() const USB_VHCI_NOTHROW { return _urb.flags & USB_VHCI_URB_FLAGS_SHORT_NOT_OK; }
+		bool is_zero_packet() const USB_VHCI_NOTHROW { return _urb.flags & USB_VHCI_URB_FLAGS_ZERO_PACKET; }
+		void set_iso_results() USB_VHCI_THROWS(std::logic_error);
+	};
+
+	// what a device has to remember for answering the standard requests;
+	// see descriptor_set::handle
+	struct device_state
+	{
+		uint8_t configuration;
+		uint8_t alternate_setting[32];
+
+		device_state() USB_VHCI_NOTHROW : configuration(0), alternate_setting() { }
+		void reset() USB_VHCI_NOTHROW { *this = device_state(); }
+	};
+
+	// the descriptors of one device, validated and copied into a single
+	// buffer when they are added, so that the standard requests of the usb
+	// core can be answered without calling back into the application
+	class descriptor_set
+	{
+	private:
+		struct _entry
+		{
+			uint8_t type;
+			uint8_t index;
+			uint16_t langid;
+			size_t offset;
+			uint16_t length;
+		};
+
+		struct _configuration
+		{
+			uint8_t value;
+			uint8_t attributes;
+			// (interface number << 8) | alternate setting
+			std::vector<uint16_t> interfaces;
+
+			_configuration(uint8_t value, uint8_t attributes) USB_VHCI_NOTHROW :
+				value(value), attributes(attributes), interfaces() { }
+		};
+
+		std::vector<uint8_t> blob;
+		std::vector<_entry> entries;
+		std::vector<_configuration> configurations;
+		std::vector<uint16_t> langids;
+
+		void put(uint8_t type, uint8_t index, uint16_t langid, const uint8_t* desc, size_t length) USB_VHCI_THROWS(std::bad_alloc);
+		const _entry* find(uint8_t type, uint8_t index, uint16_t langid) const USB_VHCI_NOTHROW;
+		const _configuration* find_configuration(uint8_t value) const USB_VHCI_NOTHROW;
+		// alternate == -1 matches any alternate setting
+		static bool has_interface(const _configuration& c, uint8_t number, int alternate) USB_VHCI_NOTHROW;
+		void respond(usb::urb& urb, const uint8_t* data, size_t length) const USB_VHCI_NOTHROW;
+
+	public:
+		// device has to be a device descriptor
+		descriptor_set(const uint8_t* device, size_t length) USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+
+		// desc is a configuration descriptor followed by its interface,
+		// endpoint and class descriptors (wTotalLength bytes); GET_DESCRIPTOR
+		// indexes configurations in the order they were added
+		void add_configuration(const uint8_t* desc, size_t length) USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+		// string descriptor 0 (the list of language ids) is maintained
+		// automatically
+		void add_string(uint8_t index, const uint8_t* desc, size_t length, uint16_t langid = 0x0409) USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+		// converts latin-1 text
+		void add_string(uint8_t index, const char* text, uint16_t langid = 0x0409) USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+		// any other descriptor returned by GET_DESCRIPTOR, e.g. the device qualifier
+		void add_descriptor(uint8_t type, uint8_t index, const uint8_t* desc, size_t length) USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+
+		// answers GET_DESCRIPTOR, GET_STATUS (device and interface),
+		// GET_CONFIGURATION, SET_CONFIGURATION, GET_INTERFACE and SET_INTERFACE
+		// on endpoint 0 by acking or stalling urb; returns false for every
+		// other request, which is left untouched
+		bool handle(usb::urb& urb, device_state& state) const USB_VHCI_NOTHROW;
 	};
 
 	namespace vhci
@@ -291,16 +386,16 @@ namespace usb
 		private:
 			pthread_mutex_t& mutex;
 
-			lock& operator=(const lock&) throw();
-			lock(const lock&) throw();
+			lock& operator=(const lock&) USB_VHCI_NOTHROW;
+			lock(const lock&) USB_VHCI_NOTHROW;
 
 		public:
-			explicit lock(volatile pthread_mutex_t& m) throw() : mutex(const_cast<pthread_mutex_t&>(m))
+			explicit lock(volatile pthread_mutex_t& m) USB_VHCI_NOTHROW : mutex(const_cast<pthread_mutex_t&>(m))
 			{
 				pthread_mutex_lock(&mutex);
 			}
 
-			~lock() throw()
+			~lock() USB_VHCI_NOTHROW
 			{
 				pthread_mutex_unlock(&mutex);
 			}
@@ -314,76 +409,109 @@ namespace usb
 			uint8_t flags;
 
 		public:
-			port_stat() throw() : status(0), change(0), flags(0) { }
-			port_stat(uint16_t status, uint16_t change, uint8_t flags) throw() :
+			port_stat() USB_VHCI_NOTHROW : status(0), change(0), flags(0) { }
+			port_stat(uint16_t status, uint16_t change, uint8_t flags) USB_VHCI_NOTHROW :
 				status(status),
 				change(change),
 				flags(flags) { }
-			virtual ~port_stat() throw();
-			uint16_t get_status() const throw() { return status; }
-			uint16_t get_change() const throw() { return change; }
-			uint8_t get_flags()   const throw() { return flags; }
-			void set_status(uint16_t value) throw() { status = value; }
-			void set_change(uint16_t value) throw() { change = value; }
-			void set_flags(uint8_t value)   throw() { flags = value; }
-			bool get_resuming() const throw() { return flags & USB_VHCI_PORT_STAT_FLAG_RESUMING; }
-			void set_resuming(bool value) throw()
+			virtual ~port_stat() USB_VHCI_NOTHROW;
+			uint16_t get_status() const USB_VHCI_NOTHROW { return status; }
+			uint16_t get_change() const USB_VHCI_NOTHROW { return change; }
+			uint8_t get_flags()   const USB_VHCI_NOTHROW { return flags; }
+			void set_status(uint16_t value) USB_VHCI_NOTHROW { status = value; }
+			void set_change(uint16_t value) USB_VHCI_NOTHROW { change = value; }
+			void set_flags(uint8_t value)   USB_VHCI_NOTHROW { flags = value; }
+			bool get_resuming() const USB_VHCI_NOTHROW { return flags & USB_VHCI_PORT_STAT_FLAG_RESUMING; }
+			void set_resuming(bool value) USB_VHCI_NOTHROW
 			{ flags = (flags & ~USB_VHCI_PORT_STAT_FLAG_RESUMING) | (value ? USB_VHCI_PORT_STAT_FLAG_RESUMING : 0); }
-			bool get_connection()  const throw() { return status & USB_VHCI_PORT_STAT_CONNECTION; }
-			bool get_enable()      const throw() { return status & USB_VHCI_PORT_STAT_ENABLE; }
-			bool get_suspend()     const throw() { return status & USB_VHCI_PORT_STAT_SUSPEND; }
-			bool get_overcurrent() const throw() { return status & USB_VHCI_PORT_STAT_OVERCURRENT; }
-			bool get_reset()       const throw() { return status & USB_VHCI_PORT_STAT_RESET; }
-			bool get_power()       const throw() { return status & USB_VHCI_PORT_STAT_POWER; }
-			bool get_low_speed()   const throw() { return status & USB_VHCI_PORT_STAT_LOW_SPEED; }
-			bool get_high_speed()  const throw() { return status & USB_VHCI_PORT_STAT_HIGH_SPEED; }
-			void set_connection(bool value) throw()
+			bool get_connection()  const USB_VHCI_NOTHROW { return status & USB_VHCI_PORT_STAT_CONNECTION; }
+			bool get_enable()      const USB_VHCI_NOTHROW { return status & USB_VHCI_PORT_STAT_ENABLE; }
+			bool get_suspend()     const USB_VHCI_NOTHROW { return status & USB_VHCI_PORT_STAT_SUSPEND; }
+			bool get_overcurrent() const USB_VHCI_NOTHROW { return status & USB_VHCI_PORT_STAT_OVERCURRENT; }
+			bool get_reset()       const USB_VHCI_NOTHROW { return status & USB_VHCI_PORT_STAT_RESET; }
+			bool get_power()       const USB_VHCI_NOTHROW { return status & USB_VHCI_PORT_STAT_POWER; }
+			bool get_low_speed()   const USB_VHCI_NOTHROW { return status & USB_VHCI_PORT_STAT_LOW_SPEED; }
+			bool get_high_speed()  const USB_VHCI_NOTHROW { return status & USB_VHCI_PORT_STAT_HIGH_SPEED; }
+			void set_connection(bool value) USB_VHCI_NOTHROW
 			{ status = (status & ~USB_VHCI_PORT_STAT_CONNECTION) |  (value ? USB_VHCI_PORT_STAT_CONNECTION : 0); }
-			void set_enable(bool value) throw()
+			void set_enable(bool value) USB_VHCI_NOTHROW
 			{ status = (status & ~USB_VHCI_PORT_STAT_ENABLE) |      (value ? USB_VHCI_PORT_STAT_ENABLE : 0); }
-			void set_suspend(bool value) throw()
+			void set_suspend(bool value) USB_VHCI_NOTHROW
 			{ status = (status & ~USB_VHCI_PORT_STAT_SUSPEND) |     (value ? USB_VHCI_PORT_STAT_SUSPEND : 0); }
-			void set_overcurrent(bool value) throw()
+			void set_overcurrent(bool value) USB_VHCI_NOTHROW
 			{ status = (status & ~USB_VHCI_PORT_STAT_OVERCURRENT) | (value ? USB_VHCI_PORT_STAT_OVERCURRENT : 0); }
-			void set_reset(bool value) throw()
+			void set_reset(bool value) USB_VHCI_NOTHROW
 			{ status = (status & ~USB_VHCI_PORT_STAT_RESET) |       (value ? USB_VHCI_PORT_STAT_RESET : 0); }
-			void set_power(bool value) throw()
+			void set_power(bool value) USB_VHCI_NOTHROW
 			{ status = (status & ~USB_VHCI_PORT_STAT_POWER) |       (value ? USB_VHCI_PORT_STAT_POWER: 0); }
-			void set_low_speed(bool value) throw()
+			void set_low_speed(bool value) USB_VHCI_NOTHROW
 			{ status = (status & ~USB_VHCI_PORT_STAT_LOW_SPEED) |   (value ? USB_VHCI_PORT_STAT_LOW_SPEED : 0); }
-			void set_high_speed(bool value) throw()
+			void set_high_speed(bool value) USB_VHCI_NOTHROW
 			{ status = (status & ~USB_VHCI_PORT_STAT_HIGH_SPEED) |  (value ? USB_VHCI_PORT_STAT_HIGH_SPEED : 0); }
-			bool get_connection_changed()  const throw() { return change & USB_VHCI_PORT_STAT_C_CONNECTION; }
-			bool get_enable_changed()      const throw() { return change & USB_VHCI_PORT_STAT_C_ENABLE; }
-			bool get_suspend_changed()     const throw() { return change & USB_VHCI_PORT_STAT_C_SUSPEND; }
-			bool get_overcurrent_changed() const throw() { return change & USB_VHCI_PORT_STAT_C_OVERCURRENT; }
-			bool get_reset_changed()       const throw() { return change & USB_VHCI_PORT_STAT_C_RESET; }
-			void set_connection_changed(bool value) throw()
+			bool get_connection_changed()  const USB_VHCI_NOTHROW { return change & USB_VHCI_PORT_STAT_C_CONNECTION; }
+			bool get_enable_changed()      const USB_VHCI_NOTHROW { return change & USB_VHCI_PORT_STAT_C_ENABLE; }
+			bool get_suspend_changed()     const USB_VHCI_NOTHROW { return change & USB_VHCI_PORT_STAT_C_SUSPEND; }
+			bool get_overcurrent_changed() const USB_VHCI_NOTHROW { return change & USB_VHCI_PORT_STAT_C_OVERCURRENT; }
+			bool get_reset_changed()       const USB_VHCI_NOTHROW { return change & USB_VHCI_PORT_STAT_C_RESET; }
+			void set_connection_changed(bool value) USB_VHCI_NOTHROW
 			{ change = (change & ~USB_VHCI_PORT_STAT_C_CONNECTION) |  (value ? USB_VHCI_PORT_STAT_C_CONNECTION : 0); }
-			void set_enable_changed(bool value) throw()
+			void set_enable_changed(bool value) USB_VHCI_NOTHROW
 			{ change = (change & ~USB_VHCI_PORT_STAT_C_ENABLE) |      (value ? USB_VHCI_PORT_STAT_C_ENABLE : 0); }
-			void set_suspend_changed(bool value) throw()
+			void set_suspend_changed(bool value) USB_VHCI_NOTHROW
 			{ change = (change & ~USB_VHCI_PORT_STAT_C_SUSPEND) |     (value ? USB_VHCI_PORT_STAT_C_SUSPEND : 0); }
-			void set_overcurrent_changed(bool value) throw()
+			void set_overcurrent_changed(bool value) USB_VHCI_NOTHROW
 			{ change = (change & ~USB_VHCI_PORT_STAT_C_OVERCURRENT) | (value ? USB_VHCI_PORT_STAT_C_OVERCURRENT : 0); }
-			void set_reset_changed(bool value) throw()
+			void set_reset_changed(bool value) USB_VHCI_NOTHROW
 			{ change = (change & ~USB_VHCI_PORT_STAT_C_RESET) |       (value ? USB_VHCI_PORT_STAT_C_RESET : 0); }
 		};
 
+		// a work carries its own cancellation token: hcd::cancel_process_urb_work
+		// sets it right away, also while the application is still busy with
+		// the work, so that a long running handler can stop early by polling
+		// is_canceled (a single load) or by registering a callback
 		class work
 		{
+		public:
+			typedef void (*cancel_callback)(void* arg, work& w);
+
 		private:
+			enum
+			{
+				cancel_state_none,
+				cancel_state_callback,
+				cancel_state_canceled
+			};
+
 			uint8_t port;
-			bool canceled;
+			volatile int cancel_state;
+			cancel_callback cancel_func;
+			void* cancel_arg;
 
 		protected:
-			work(uint8_t port) throw(std::invalid_argument);
+			work(uint8_t port) USB_VHCI_THROWS(std::invalid_argument);
+			// copies the port and whether w is canceled, but not the callback
+			work(const work& w) USB_VHCI_NOTHROW;
+			work& operator=(const work& w) USB_VHCI_NOTHROW;
 
 		public:
-			virtual ~work() throw();
-			uint8_t get_port() const throw() { return port; }
-			bool is_canceled() const throw() { return canceled; }
-			void cancel() throw();
+			virtual ~work() USB_VHCI_NOTHROW;
+			uint8_t get_port() const USB_VHCI_NOTHROW { return port; }
+			// an acquire load, so a handler which sees the token also sees
+			// what the canceling thread wrote before; the __sync builtins
+			// have no plain load, and a locked add would cost every poll
+			bool is_canceled() const USB_VHCI_NOTHROW { return __atomic_load_n(&cancel_state, __ATOMIC_ACQUIRE) == cancel_state_canceled; }
+			// sets the token and runs the callback, once; safe to call from
+			// any thread
+			void cancel() USB_VHCI_NOTHROW;
+			// func runs on the thread which cancels the work, with the lock of
+			// the hcd held, so it must not call back into the hcd; it replaces
+			// the previous callback (NULL clears it). Returns false without
+			// registering func if the work is canceled already
+			bool set_cancel_callback(cancel_callback func, void* arg) USB_VHCI_NOTHROW;
+			// false if the work got canceled, in which case the callback has
+			// run or is still running until the hcd lock is released (finish
+			// the work before freeing arg)
+			bool clear_cancel_callback() USB_VHCI_NOTHROW;
 		};
 
 		class process_urb_work : public work
@@ -392,11 +520,11 @@ namespace usb
 			usb::urb* urb;
 
 		public:
-			process_urb_work(uint8_t port, usb::urb* urb) throw(std::invalid_argument);
-			process_urb_work(const process_urb_work&) throw(std::bad_alloc);
-			process_urb_work& operator=(const process_urb_work&) throw(std::bad_alloc);
-			virtual ~process_urb_work() throw();
-			usb::urb* get_urb() const throw() { return urb; }
+			process_urb_work(uint8_t port, usb::urb* urb) USB_VHCI_THROWS(std::invalid_argument);
+			process_urb_work(const process_urb_work&) USB_VHCI_THROWS(std::bad_alloc);
+			process_urb_work& operator=(const process_urb_work&) USB_VHCI_THROWS(std::bad_alloc);
+			virtual ~process_urb_work() USB_VHCI_NOTHROW;
+			usb::urb* get_urb() const USB_VHCI_NOTHROW { return urb; }
 		};
 
 		class cancel_urb_work : public work
@@ -405,8 +533,8 @@ namespace usb
 			uint64_t handle;
 
 		public:
-			cancel_urb_work(uint8_t port, uint64_t handle) throw(std::invalid_argument);
-			uint64_t get_handle() const throw() { return handle; }
+			cancel_urb_work(uint8_t port, uint64_t handle) USB_VHCI_THROWS(std::invalid_argument);
+			uint64_t get_handle() const USB_VHCI_NOTHROW { return handle; }
 		};
 
 		class port_stat_work : public work
@@ -416,16 +544,256 @@ namespace usb
 			uint8_t trigger_flags;
 
 		public:
-			port_stat_work(uint8_t port, const port_stat& stat) throw(std::invalid_argument);
-			port_stat_work(uint8_t port, const port_stat& stat, const port_stat& prev) throw(std::invalid_argument);
-			const port_stat& get_port_stat() const throw() { return stat; }
-			uint8_t get_trigger_flags()     const throw() { return trigger_flags; }
-			bool triggers_disable()  const throw() { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_DISABLE; }
-			bool triggers_suspend()  const throw() { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_SUSPEND; }
-			bool triggers_resuming() const throw() { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_RESUMING; }
-			bool triggers_reset()    const throw() { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_RESET; }
-			bool triggers_power_on()  const throw() { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_POWER_ON; }
-			bool triggers_power_off() const throw() { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_POWER_OFF; }
+			port_stat_work(uint8_t port, const port_stat& stat) USB_VHCI_THROWS(std::invalid_argument);
+			port_stat_work(uint8_t port, const port_stat& stat, const port_stat& prev) USB_VHCI_THROWS(std::invalid_argument);
+			const port_stat& get_port_stat() const USB_VHCI_NOTHROW { return stat; }
+			uint8_t get_trigger_flags()     const USB_VHCI_NOTHROW { return trigger_flags; }
+			bool triggers_disable()  const USB_VHCI_NOTHROW { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_DISABLE; }
+			bool triggers_suspend()  const USB_VHCI_NOTHROW { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_SUSPEND; }
+			bool triggers_resuming() const USB_VHCI_NOTHROW { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_RESUMING; }
+			bool triggers_reset()    const USB_VHCI_NOTHROW { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_RESET; }
+			bool triggers_power_on()  const USB_VHCI_NOTHROW { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_POWER_ON; }
+			bool triggers_power_off() const USB_VHCI_NOTHROW { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_POWER_OFF; }
+		};
+
+		// writes urb submissions and completions as a pcapng stream with
+		// LINKTYPE_USB_LINUX_MMAPPED (usbmon) headers; records are built in the
+		// caller's thread and written to the file by a separate writer thread
+		class usbmon_capture
+		{
+		private:
+			int fd;
+			bool own_fd;
+			uint32_t snaplen;
+			size_t max_pending;
+			volatile uint32_t port_mask[8];
+			volatile uint64_t dropped;
+
+			pthread_t writer_thread;
+			bool writer_shutdown;
+			pthread_mutex_t _lock;
+			pthread_cond_t pending_cond;
+			std::deque<std::vector<uint8_t>*> pending;
+
+			usbmon_capture(const usbmon_capture&) USB_VHCI_NOTHROW;
+			usbmon_capture& operator=(const usbmon_capture&) USB_VHCI_NOTHROW;
+
+			void init() USB_VHCI_THROWS(std::exception);
+			void write_header() USB_VHCI_THROWS(std::exception);
+			void record(char event, uint16_t busnum, uint8_t port, const usb::urb& urb) volatile USB_VHCI_NOTHROW;
+			static void* writer_thread_start(void* _this) USB_VHCI_NOTHROW;
+
+		public:
+			explicit usbmon_capture(const char* path,
+			                        uint32_t snaplen = 0xffff,
+			                        size_t max_pending = 4096) USB_VHCI_THROWS(std::exception);
+			explicit usbmon_capture(int fd,
+			                        uint32_t snaplen = 0xffff,
+			                        size_t max_pending = 4096) USB_VHCI_THROWS(std::exception);
+			virtual ~usbmon_capture() USB_VHCI_NOTHROW;
+
+			uint32_t get_snaplen() const volatile USB_VHCI_NOTHROW { return snaplen; }
+			uint64_t get_dropped() const volatile USB_VHCI_NOTHROW { return dropped; }
+			// all ports are captured by default
+			void set_port_filter(uint8_t port, bool capture) volatile USB_VHCI_NOTHROW;
+			bool is_port_captured(uint8_t port) const volatile USB_VHCI_NOTHROW
+			{ return port_mask[port >> 5] & (1u << (port & 0x1f)); }
+			void submit(uint16_t busnum, uint8_t port, const usb::urb& urb) volatile USB_VHCI_NOTHROW
+			{ if(is_port_captured(port)) record('S', busnum, port, urb); }
+			void complete(uint16_t busnum, uint8_t port, const usb::urb& urb) volatile USB_VHCI_NOTHROW
+			{ if(is_port_captured(port)) record('C', busnum, port, urb); }
+		};
+
+		// writes every urb submission, cancel request, giveback and port status
+		// change of an hcd together with its timing into a binary file, which
+		// can be played back with replay_hcd. Like usbmon_capture, the records
+		// are written by a thread of their own, so the hcd never waits for the
+		// disk; records which do not fit into max_pending are dropped
+		class urb_recorder
+		{
+		private:
+			int fd;
+			volatile uint64_t record_count;
+			uint64_t start_time;
+			uint8_t port_count;
+			size_t max_pending;
+			volatile uint64_t dropped;
+			volatile int error;
+			// what the writer thread got into the file
+			uint64_t written_count;
+			uint64_t written_end;
+
+			pthread_t writer_thread;
+			bool writer_shutdown;
+			pthread_mutex_t _lock;
+			pthread_cond_t pending_cond;
+			std::deque<std::vector<uint8_t>*> pending;
+
+			urb_recorder(const urb_recorder&) USB_VHCI_NOTHROW;
+			urb_recorder& operator=(const urb_recorder&) USB_VHCI_NOTHROW;
+
+			void write_record(uint8_t kind,
+			                  uint8_t port,
+			                  const void* body,
+			                  size_t body_size,
+			                  const void* data = NULL,
+			                  size_t data_size = 0) volatile USB_VHCI_NOTHROW;
+			void write_batch(std::deque<std::vector<uint8_t>*>& batch) USB_VHCI_NOTHROW;
+			static void* writer_thread_start(void* _this) USB_VHCI_NOTHROW;
+
+		public:
+			explicit urb_recorder(const char* path, size_t max_pending = 4096) USB_VHCI_THROWS(std::exception);
+			virtual ~urb_recorder() USB_VHCI_NOTHROW;
+
+			// records handed to the writer thread
+			uint64_t get_record_count() const volatile USB_VHCI_NOTHROW { return record_count; }
+			// records which did not make it into the file
+			uint64_t get_dropped() const volatile USB_VHCI_NOTHROW { return dropped; }
+			// the errno of the write which failed, 0 if none did; every record
+			// after a failed write is dropped
+			int get_error() const volatile USB_VHCI_NOTHROW { return error; }
+			void record_work(const work& w) volatile USB_VHCI_NOTHROW;
+			void record_cancel(uint64_t handle) volatile USB_VHCI_NOTHROW;
+			void record_giveback(uint8_t port, const usb::urb& urb) volatile USB_VHCI_NOTHROW;
+		};
+
+		class hcd;
+
+		// takes over the process_urb_work of one endpoint instead of the
+		// application; see hcd::set_endpoint_handler
+		class endpoint_handler
+		{
+		public:
+			enum disposition
+			{
+				// enqueue the work for the application as usual
+				disposition_pass,
+				// the handler keeps the work and passes it to hcd::complete_held later
+				disposition_hold,
+				// the urb is done and can be given back right away
+				disposition_complete
+			};
+
+			virtual ~endpoint_handler() USB_VHCI_NOTHROW;
+			// called with the lock of from held, so it must not call back into from
+			virtual disposition submit(hcd& from, process_urb_work* w) USB_VHCI_NOTHROW = 0;
+			// from takes back a held work, because it got canceled or the
+			// handler gets removed; false if w is already on its way to
+			// complete_held (also called with the lock of from held)
+			virtual bool release(hcd& from, process_urb_work* w) USB_VHCI_NOTHROW = 0;
+		};
+
+		// the works hcd::next_work hands out, in one fifo per work_class, so
+		// that a burst of bulk urbs does not have to delay port changes or the
+		// urbs of other transfer types; the urbs of one endpoint always share
+		// a class, so their order is kept in every order. Not thread-safe, hcd
+		// uses it under its lock
+		class work_queue
+		{
+		public:
+			enum work_class
+			{
+				// port_stat_work and cancel_urb_work
+				class_port,
+				class_control,
+				class_isochronous,
+				class_interrupt,
+				class_bulk,
+				class_count
+			};
+
+			enum order
+			{
+				// oldest first, as if there were no classes
+				order_fifo,
+				// the first class in work_class order which is not empty
+				order_strict,
+				// round robin over the classes, taking up to the weight of a
+				// class in a row
+				order_weighted,
+				// class_port first, then deficit round robin over the ports
+				// regardless of the class: every round a port may take urbs
+				// with buffers of up to its weight times 4 KiB in total (more
+				// if it saved up from earlier rounds), so that a port flooded
+				// with urbs cannot starve the others
+				order_port_drr
+			};
+
+			struct class_stats
+			{
+				size_t depth;
+				size_t max_depth;
+				uint64_t dequeued;
+				// nanoseconds from push to pop
+				uint64_t total_wait;
+				uint64_t max_wait;
+
+				class_stats() USB_VHCI_NOTHROW :
+					depth(0), max_depth(0), dequeued(0), total_wait(0), max_wait(0) { }
+			};
+
+		private:
+			struct _entry
+			{
+				work* w;
+				uint64_t seq;
+				uint64_t time;
+
+				bool operator<(const _entry& other) const USB_VHCI_NOTHROW { return seq < other.seq; }
+			};
+
+			// the urbs of one port for order_port_drr
+			struct _port
+			{
+				std::deque<_entry> entries;
+				unsigned int weight;
+				uint64_t deficit;
+				// deficit got the quantum of the current visit already
+				bool granted;
+
+				_port() USB_VHCI_NOTHROW : entries(), weight(1), deficit(0), granted(false) { }
+			};
+
+			// with order_port_drr only class_port is used
+			std::deque<_entry> queues[class_count];
+			// indexed by port; the active ones are served in the order of ring
+			std::vector<_port> ports;
+			std::deque<uint8_t> ring;
+			class_stats stats[class_count];
+			unsigned int weights[class_count];
+			order ord;
+			uint64_t next_seq;
+			size_t count;
+			// the class order_weighted takes from and how often it did in a row
+			unsigned int current;
+			unsigned int served;
+
+			_port& port_queue(uint8_t port) USB_VHCI_THROWS(std::bad_alloc);
+			void insert(const _entry& e) USB_VHCI_THROWS(std::bad_alloc);
+			_entry take_drr() USB_VHCI_NOTHROW;
+
+		public:
+			work_queue() USB_VHCI_NOTHROW;
+
+			static work_class classify(const work& w) USB_VHCI_NOTHROW;
+			void push(work* w) USB_VHCI_THROWS(std::bad_alloc);
+			// NULL if empty
+			work* pop() USB_VHCI_NOTHROW;
+			bool empty() const USB_VHCI_NOTHROW { return !count; }
+			size_t size() const USB_VHCI_NOTHROW { return count; }
+			// the queued process_urb_work for the urb with handle, or NULL
+			process_urb_work* find_urb(uint64_t handle) const USB_VHCI_NOTHROW;
+			order get_order() const USB_VHCI_NOTHROW { return ord; }
+			// rearranges the queued works if o switches to or from order_port_drr
+			void set_order(order o) USB_VHCI_THROWS(std::bad_alloc);
+			unsigned int get_weight(work_class c) const USB_VHCI_THROWS(std::out_of_range);
+			void set_weight(work_class c, unsigned int weight) USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			// the weight of port in order_port_drr, 1 by default
+			unsigned int get_port_weight(uint8_t port) const USB_VHCI_NOTHROW;
+			void set_port_weight(uint8_t port, unsigned int weight) USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+			// restores the default class weights and a weight of 1 for every port
+			void reset_weights() USB_VHCI_NOTHROW;
+			class_stats get_stats(work_class c) const USB_VHCI_THROWS(std::out_of_range);
 		};
 
 		class hcd
@@ -434,24 +802,24 @@ namespace usb
 			class callback
 			{
 			private:
-				void (*func)(void*, hcd&) throw();
+				void (*func)(void*, hcd&) USB_VHCI_NOTHROW;
 				void* arg;
 
 			public:
-				callback(void (*func)(void*, hcd&) throw(), void* arg) throw(std::invalid_argument) : func(func), arg(arg)
+				callback(void (*func)(void*, hcd&) USB_VHCI_NOTHROW, void* arg) USB_VHCI_THROWS(std::invalid_argument) : func(func), arg(arg)
 				{
 					if(!func) throw std::invalid_argument("func");
 				}
 
-				bool operator==(const callback& other) const throw()
+				bool operator==(const callback& other) const USB_VHCI_NOTHROW
 				{
 					return func == other.func && arg == other.arg;
 				}
 
-				bool operator!=(const callback& other) const throw() { return !(*this == other); }
-				void (*get_func() const throw())(void*, hcd&) throw() { return func; }
-				void* get_arg() const throw() { return arg; }
-				void call(hcd& from) const throw() { (*func)(arg, from); }
+				bool operator!=(const callback& other) const USB_VHCI_NOTHROW { return !(*this == other); }
+				void (*get_func() const USB_VHCI_NOTHROW)(void*, hcd&) USB_VHCI_NOTHROW { return func; }
+				void* get_arg() const USB_VHCI_NOTHROW { return arg; }
+				void call(hcd& from) const USB_VHCI_NOTHROW { (*func)(arg, from); }
 			};
 
 		private:
@@ -460,47 +828,408 @@ namespace usb
 			pthread_t bg_thread;
 			volatile bool thread_shutdown;
 			pthread_mutex_t thread_sync;
+			// eventfd, readable while the background thread is asked to stop
+			int wake_fd;
+			// the background thread blocks in calls wake_fd cannot end, so it
+			// gets a signal to end them with EINTR (see init_bg_thread)
+			bool interrupt_bg_thread;
 
 			uint8_t port_count;
 			pthread_mutex_t _lock;
-			std::deque<work*> inbox;
+			work_queue inbox;
 			std::list<work*> processing;
+			urb_recorder* recorder;
+			// keyed by port << 8 | endpoint address
+			std::map<uint16_t, endpoint_handler*> endpoint_handlers;
+			std::list<std::pair<process_urb_work*, endpoint_handler*> > held;
+			// same keys, oldest first
+			std::map<uint16_t, std::deque<process_urb_work*> > parked;
 
-			hcd(const hcd&) throw();
-			hcd& operator=(const hcd&) throw();
+			hcd(const hcd&) USB_VHCI_NOTHROW;
+			hcd& operator=(const hcd&) USB_VHCI_NOTHROW;
 
-			static void* bg_thread_start(void* _this) throw();
+			static void* bg_thread_start(void* _this) USB_VHCI_NOTHROW;
+			void give_back_held(process_urb_work* w) USB_VHCI_THROWS(std::exception);
+			void replace_endpoint_handler(uint16_t key, endpoint_handler* h) USB_VHCI_THROWS(std::bad_alloc);
 
 		protected:
-			explicit hcd(uint8_t ports) throw(std::invalid_argument, std::bad_alloc);
-			virtual void bg_work() volatile throw() = 0;
-			virtual uint8_t address_from_port(uint8_t port) const throw(std::exception) = 0;
-			virtual uint8_t port_from_address(uint8_t address) const throw(std::exception) = 0;
-			virtual void canceling_work(work* w, bool in_progress) throw(std::exception);
-			virtual void finishing_work(work* w) throw(std::exception);
-			virtual void on_work_enqueued() throw();
-			void enqueue_work(work* w) throw(std::bad_alloc);
-			void init_bg_thread() volatile throw(std::exception);
-			void join_bg_thread() volatile throw();
-			pthread_mutex_t& get_lock() volatile throw() { return const_cast<pthread_mutex_t&>(_lock); }
-			bool is_thread_shutdown() const volatile throw() { return thread_shutdown; }
-
-		public:
-			virtual ~hcd() throw();
-
-			void add_work_enqueued_callback(callback c) volatile throw(std::bad_alloc);
-			void remove_work_enqueued_callback(callback c) volatile throw();
-			virtual const port_stat& get_port_stat(uint8_t port) volatile throw(std::exception) = 0;
-			virtual void port_connect(uint8_t port, usb::data_rate rate) volatile throw(std::exception) = 0;
-			virtual void port_disconnect(uint8_t port) volatile throw(std::exception) = 0;
-			virtual void port_disable(uint8_t port) volatile throw(std::exception) = 0;
-			virtual void port_resumed(uint8_t port) volatile throw(std::exception) = 0;
-			virtual void port_overcurrent(uint8_t port, bool set) volatile throw(std::exception) = 0;
-			virtual void port_reset_done(uint8_t port, bool enable = true) volatile throw(std::exception) = 0;
-			uint8_t get_port_count() const volatile throw() { return port_count; }
-			bool next_work(work** w) volatile throw(std::bad_alloc);
-			void finish_work(work* w) volatile throw(std::exception);
-			bool cancel_process_urb_work(uint64_t handle) volatile throw(std::exception);
+			explicit hcd(uint8_t ports) USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+			virtual void bg_work() volatile USB_VHCI_NOTHROW = 0;
+			virtual uint8_t address_from_port(uint8_t port) const USB_VHCI_THROWS(std::exception) = 0;
+			virtual uint8_t port_from_address(uint8_t address) const USB_VHCI_THROWS(std::exception) = 0;
+			virtual void canceling_work(work* w, bool in_progress) USB_VHCI_THROWS(std::exception);
+			virtual void finishing_work(work* w) USB_VHCI_THROWS(std::exception);
+			virtual void on_work_enqueued() USB_VHCI_NOTHROW;
+			// false if an endpoint_handler took w, so that nothing was enqueued
+			bool enqueue_work(work* w) USB_VHCI_THROWS(std::bad_alloc);
+			// interruptible: bg_work blocks in a call it cannot poll together
+			// with get_wake_fd (like the fetch ioctl of the kernel driver), so
+			// a stop request also sends the thread SIGURG, for which a handler
+			// without SA_RESTART is installed unless the application has an
+			// own one, to make that call fail with EINTR
+			void init_bg_thread(bool interruptible = false) volatile USB_VHCI_THROWS(std::exception);
+			void join_bg_thread() volatile USB_VHCI_NOTHROW;
+			pthread_mutex_t& get_lock() volatile USB_VHCI_NOTHROW { return const_cast<pthread_mutex_t&>(_lock); }
+			bool is_thread_shutdown() const volatile USB_VHCI_NOTHROW { return thread_shutdown; }
+			// polls readable once the background thread is asked to stop, so
+			// that bg_work can wait on it together with its own descriptors
+			// instead of noticing the request only after a timeout; -1 if
+			// there has never been a background thread
+			int get_wake_fd() const volatile USB_VHCI_NOTHROW { return wake_fd; }
+			// sleeps up to timeout milliseconds, but returns as soon as the
+			// background thread is asked to stop; returns is_thread_shutdown()
+			bool wait_for_shutdown(int timeout) volatile USB_VHCI_NOTHROW;
+			// true if no work is queued, being processed, held or parked
+			bool is_idle() volatile USB_VHCI_NOTHROW;
+			// gives back every urb which is queued, held or parked as canceled
+			// and throws away the other queued works; works the application is
+			// processing are left alone
+			void drop_works() volatile USB_VHCI_THROWS(std::exception);
+			// removes every endpoint handler and work enqueued callback and
+			// restores the default work order and weights
+			void forget_consumers() volatile USB_VHCI_THROWS(std::bad_alloc);
+
+		public:
+			virtual ~hcd() USB_VHCI_NOTHROW;
+
+			// asks the background thread to stop without waiting for it; this
+			// instance is only good for destruction afterwards. Calling this on
+			// many controllers before destroying them lets their threads wind
+			// down in parallel
+			void shutdown() volatile USB_VHCI_NOTHROW;
+			void add_work_enqueued_callback(callback c) volatile USB_VHCI_THROWS(std::bad_alloc);
+			void remove_work_enqueued_callback(callback c) volatile USB_VHCI_NOTHROW;
+			// does not take ownership; pass NULL to stop recording
+			void set_recorder(urb_recorder* r) volatile USB_VHCI_NOTHROW;
+			virtual const port_stat& get_port_stat(uint8_t port) volatile USB_VHCI_THROWS(std::exception) = 0;
+			virtual void port_connect(uint8_t port, usb::data_rate rate) volatile USB_VHCI_THROWS(std::exception) = 0;
+			virtual void port_disconnect(uint8_t port) volatile USB_VHCI_THROWS(std::exception) = 0;
+			virtual void port_disable(uint8_t port) volatile USB_VHCI_THROWS(std::exception) = 0;
+			virtual void port_resumed(uint8_t port) volatile USB_VHCI_THROWS(std::exception) = 0;
+			virtual void port_overcurrent(uint8_t port, bool set) volatile USB_VHCI_THROWS(std::exception) = 0;
+			virtual void port_reset_done(uint8_t port, bool enable = true) volatile USB_VHCI_THROWS(std::exception) = 0;
+			uint8_t get_port_count() const volatile USB_VHCI_NOTHROW { return port_count; }
+			bool next_work(work** w) volatile USB_VHCI_THROWS(std::bad_alloc);
+			void finish_work(work* w) volatile USB_VHCI_THROWS(std::exception);
+			bool cancel_process_urb_work(uint64_t handle) volatile USB_VHCI_THROWS(std::exception);
+			// routes the urbs of epadr on port to h instead of the inbox; works
+			// h still holds are passed to the application when h is replaced
+			// or removed, which has to happen before h or this is destroyed
+			void set_endpoint_handler(uint8_t port, uint8_t epadr, endpoint_handler* h) volatile USB_VHCI_THROWS(std::exception);
+			// does nothing if h is not the handler of epadr on port
+			void remove_endpoint_handler(uint8_t port, uint8_t epadr, endpoint_handler* h) volatile USB_VHCI_THROWS(std::exception);
+			// gives back a work the endpoint_handler has held; the handler must
+			// not hold a lock here which it takes in release
+			void complete_held(process_urb_work* w) volatile USB_VHCI_THROWS(std::exception);
+			// moves w, a process_urb_work fetched by next_work, out of
+			// processing into a queue of its endpoint, like a device answering
+			// with NAKs; finish_work must not be called for it anymore. If w
+			// got canceled meanwhile, it is given back as canceled instead
+			void park(work* w) volatile USB_VHCI_THROWS(std::exception);
+			// gives back the oldest urb parked on epadr of port, with data
+			// copied into it if it is an IN urb; false if there is none
+			bool complete_parked(uint8_t port, uint8_t epadr, const void* data, size_t size) volatile USB_VHCI_THROWS(std::exception);
+			size_t get_parked_count(uint8_t port, uint8_t epadr) volatile USB_VHCI_NOTHROW;
+			// how next_work picks among the work classes; order_fifo by default
+			void set_work_order(work_queue::order o) volatile USB_VHCI_THROWS(std::bad_alloc);
+			// used by order_weighted; weight has to be at least 1
+			void set_work_class_weight(work_queue::work_class c, unsigned int weight) volatile USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			work_queue::class_stats get_work_class_stats(work_queue::work_class c) volatile USB_VHCI_THROWS(std::out_of_range);
+			// used by order_port_drr; weight has to be at least 1
+			void set_port_weight(uint8_t port, unsigned int weight) volatile USB_VHCI_THROWS3(std::invalid_argument, std::out_of_range, std::bad_alloc);
+		};
+
+		// hands out the data buffers and iso packets of the urbs local_hcd
+		// receives; allocate returns NULL if the pool is exhausted, and the
+		// pool has to be thread-safe
+		class buffer_pool
+		{
+		public:
+			virtual ~buffer_pool() USB_VHCI_NOTHROW;
+			virtual uint8_t* allocate(size_t size) USB_VHCI_NOTHROW = 0;
+			virtual void release(uint8_t* p, size_t size) USB_VHCI_NOTHROW = 0;
+		};
+
+		// an urb whose buffers come from a buffer_pool, or, without a pool,
+		// belong to someone else and are left alone by the destructor
+		class pooled_urb : public usb::urb
+		{
+		private:
+			buffer_pool* pool;
+
+			pooled_urb(const pooled_urb&) USB_VHCI_NOTHROW;
+			pooled_urb& operator=(const pooled_urb&) USB_VHCI_NOTHROW;
+
+		public:
+			pooled_urb(const usb_vhci_urb& urb, buffer_pool* pool) USB_VHCI_THROWS(std::invalid_argument);
+			virtual ~pooled_urb() USB_VHCI_NOTHROW;
+			// a copy of the fields of urb with buffers of the sizes urb
+			// specifies, allocated from pool; NULL if that fails
+			static pooled_urb* create(const usb_vhci_urb& urb, buffer_pool& pool) USB_VHCI_NOTHROW;
+		};
+
+		// a buffer_pool in a memfd, which can be mapped by other processes;
+		// chunks are powers of two of at least 64 bytes, and freed chunks are
+		// reused for the same size only
+		class shared_region : public buffer_pool
+		{
+		private:
+			int fd;
+			uint8_t* base;
+			size_t size;
+			size_t next;
+			pthread_mutex_t _lock;
+			// offsets of free chunks, by size class
+			std::vector<std::vector<size_t> > free_chunks;
+			volatile size_t used;
+
+			shared_region(const shared_region&) USB_VHCI_NOTHROW;
+			shared_region& operator=(const shared_region&) USB_VHCI_NOTHROW;
+
+		public:
+			// creates a region of size bytes whose first reserved bytes are
+			// never handed out; both are rounded up to whole pages
+			shared_region(size_t size, size_t reserved) USB_VHCI_THROWS(std::exception);
+			// maps the region behind fd, which is taken over (and closed if
+			// this throws); allocate always fails on such a mapping
+			explicit shared_region(int fd) USB_VHCI_THROWS(std::exception);
+			virtual ~shared_region() USB_VHCI_NOTHROW;
+
+			virtual uint8_t* allocate(size_t size) USB_VHCI_NOTHROW;
+			virtual void release(uint8_t* p, size_t size) USB_VHCI_NOTHROW;
+			int get_fd() const volatile USB_VHCI_NOTHROW { return fd; }
+			uint8_t* get_base() const volatile USB_VHCI_NOTHROW { return base; }
+			size_t get_size() const volatile USB_VHCI_NOTHROW { return size; }
+			// bytes in allocated chunks
+			size_t get_used() const volatile USB_VHCI_NOTHROW { return used; }
+			bool contains(const void* p, size_t length) const volatile USB_VHCI_NOTHROW
+			{
+				const uint8_t* b(static_cast<const uint8_t*>(p));
+				return b >= base && b <= base + size && length <= static_cast<size_t>(base + size - b);
+			}
+		};
+
+		// the channel between local_hcd and the virtual host controller; all
+		// functions behave like their usb_vhci_* counterparts (-1 and errno on
+		// failure)
+		class transport
+		{
+		public:
+			virtual ~transport() USB_VHCI_NOTHROW;
+			virtual int open(uint8_t port_count, int32_t* id, int32_t* usb_busnum, char** bus_id) USB_VHCI_NOTHROW = 0;
+			virtual int close() USB_VHCI_NOTHROW = 0;
+			virtual int fetch_work(usb_vhci_work* work, int16_t timeout) USB_VHCI_NOTHROW = 0;
+			virtual int fetch_data(const usb_vhci_urb* urb) USB_VHCI_NOTHROW = 0;
+			virtual int giveback(const usb_vhci_urb* urb) USB_VHCI_NOTHROW = 0;
+			virtual int port_connect(uint8_t port, uint8_t data_rate) USB_VHCI_NOTHROW = 0;
+			virtual int port_disconnect(uint8_t port) USB_VHCI_NOTHROW = 0;
+			virtual int port_disable(uint8_t port) USB_VHCI_NOTHROW = 0;
+			virtual int port_resumed(uint8_t port) USB_VHCI_NOTHROW = 0;
+			virtual int port_overcurrent(uint8_t port, uint8_t set) USB_VHCI_NOTHROW = 0;
+			virtual int port_reset_done(uint8_t port, uint8_t enable) USB_VHCI_NOTHROW = 0;
+			// a descriptor which polls readable while fetch_work would not
+			// block, or -1 if there is none; used by controller_manager
+			virtual int get_poll_fd() USB_VHCI_NOTHROW;
+			// gives up the open controller without closing it and returns a
+			// descriptor for it, which another transport (in any process) can
+			// adopt; close does nothing afterwards. -1 with errno ENOTSUP if the
+			// transport cannot do this
+			virtual int detach() USB_VHCI_NOTHROW;
+			// takes over a controller given up by detach instead of opening a
+			// new one; takes ownership of fd only if it succeeds
+			virtual int adopt(int fd) USB_VHCI_NOTHROW;
+		};
+
+		// talks to the kernel module through USB_VHCI_DEVICE_FILE
+		class ioctl_transport : public transport
+		{
+		private:
+			int fd;
+
+			ioctl_transport(const ioctl_transport&) USB_VHCI_NOTHROW;
+			ioctl_transport& operator=(const ioctl_transport&) USB_VHCI_NOTHROW;
+
+		public:
+			ioctl_transport() USB_VHCI_NOTHROW : fd(-1) { }
+			virtual ~ioctl_transport() USB_VHCI_NOTHROW;
+			int get_fd() const USB_VHCI_NOTHROW { return fd; }
+			virtual int get_poll_fd() USB_VHCI_NOTHROW { return fd; }
+			virtual int detach() USB_VHCI_NOTHROW;
+			virtual int adopt(int fd) USB_VHCI_NOTHROW;
+			virtual int open(uint8_t port_count, int32_t* id, int32_t* usb_busnum, char** bus_id) USB_VHCI_NOTHROW;
+			virtual int close() USB_VHCI_NOTHROW;
+			virtual int fetch_work(usb_vhci_work* work, int16_t timeout) USB_VHCI_NOTHROW;
+			virtual int fetch_data(const usb_vhci_urb* urb) USB_VHCI_NOTHROW;
+			virtual int giveback(const usb_vhci_urb* urb) USB_VHCI_NOTHROW;
+			virtual int port_connect(uint8_t port, uint8_t data_rate) USB_VHCI_NOTHROW;
+			virtual int port_disconnect(uint8_t port) USB_VHCI_NOTHROW;
+			virtual int port_disable(uint8_t port) USB_VHCI_NOTHROW;
+			virtual int port_resumed(uint8_t port) USB_VHCI_NOTHROW;
+			virtual int port_overcurrent(uint8_t port, uint8_t set) USB_VHCI_NOTHROW;
+			virtual int port_reset_done(uint8_t port, uint8_t enable) USB_VHCI_NOTHROW;
+		};
+
+		// an in-process host controller: the host side is driven through the
+		// public functions below instead of the usb core of the kernel, so
+		// local_hcd can be used without the kernel module
+		class loopback_transport : public transport
+		{
+		private:
+			struct _urb
+			{
+				usb::urb* urb;
+				bool fetched;
+			};
+
+			uint8_t port_count;
+			bool opened;
+			bool detached;
+			uint64_t next_handle;
+			usb_vhci_port_stat* ports;
+			std::deque<usb_vhci_work> works;
+			std::map<uint64_t, _urb> urbs;
+			std::deque<usb::urb*> completed;
+			pthread_mutex_t _lock;
+			pthread_cond_t work_cond;
+			pthread_cond_t completed_cond;
+			// eventfd, readable while works is not empty
+			int event_fd;
+			bool event_set;
+
+			loopback_transport(const loopback_transport&) USB_VHCI_NOTHROW;
+			loopback_transport& operator=(const loopback_transport&) USB_VHCI_NOTHROW;
+
+			void sync_work_event() USB_VHCI_NOTHROW;
+			void update_port(uint8_t port, uint16_t status, uint16_t change, uint8_t flags) USB_VHCI_NOTHROW;
+			void complete(std::map<uint64_t, _urb>::iterator i, int32_t status) USB_VHCI_NOTHROW;
+			static bool wait(pthread_cond_t& cond, pthread_mutex_t& mutex, int timeout) USB_VHCI_NOTHROW;
+
+		public:
+			loopback_transport() USB_VHCI_NOTHROW;
+			virtual ~loopback_transport() USB_VHCI_NOTHROW;
+
+			// device side, used by local_hcd
+			virtual int open(uint8_t port_count, int32_t* id, int32_t* usb_busnum, char** bus_id) USB_VHCI_NOTHROW;
+			virtual int close() USB_VHCI_NOTHROW;
+			virtual int fetch_work(usb_vhci_work* work, int16_t timeout) USB_VHCI_NOTHROW;
+			virtual int fetch_data(const usb_vhci_urb* urb) USB_VHCI_NOTHROW;
+			virtual int giveback(const usb_vhci_urb* urb) USB_VHCI_NOTHROW;
+			virtual int port_connect(uint8_t port, uint8_t data_rate) USB_VHCI_NOTHROW;
+			virtual int port_disconnect(uint8_t port) USB_VHCI_NOTHROW;
+			virtual int port_disable(uint8_t port) USB_VHCI_NOTHROW;
+			virtual int port_resumed(uint8_t port) USB_VHCI_NOTHROW;
+			virtual int port_overcurrent(uint8_t port, uint8_t set) USB_VHCI_NOTHROW;
+			virtual int port_reset_done(uint8_t port, uint8_t enable) USB_VHCI_NOTHROW;
+			virtual int get_poll_fd() USB_VHCI_NOTHROW;
+			// the controller stays with this instance; the descriptor only
+			// stands in for it, so it can be handed over within the process
+			virtual int detach() USB_VHCI_NOTHROW;
+			virtual int adopt(int fd) USB_VHCI_NOTHROW;
+
+			// host side
+			usb_vhci_port_stat get_port_stat(uint8_t port) volatile USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			void power_on(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			void power_off(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			// acknowledges all pending change bits first, like the hub driver does
+			void reset(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			void suspend(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			void resume(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			void disable(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			void clear_port_change(uint8_t port, uint16_t change) volatile USB_VHCI_THROWS(std::exception);
+			// copies urb (including the OUT data) and returns the handle, which
+			// replaces the handle of urb
+			uint64_t submit(const usb::urb& urb) volatile USB_VHCI_THROWS(std::exception);
+			bool cancel(uint64_t handle) volatile USB_VHCI_NOTHROW;
+			// waits up to timeout milliseconds (-1 forever) for a completed urb;
+			// the caller takes ownership of *urb
+			bool reap(usb::urb** urb, int timeout) volatile USB_VHCI_NOTHROW;
+		};
+
+		// what local_hcd does on its own when the usb core changes the state
+		// of a port, instead of waiting for the application to react to the
+		// port_stat_work; the work is enqueued nevertheless
+		struct port_policy
+		{
+			// port_connect(rate) on power on
+			bool connect;
+			usb::data_rate rate;
+			// port_reset_done(enable) when a reset of a connected port is requested
+			bool reset;
+			bool enable;
+			// port_resumed when resuming is requested
+			bool resume;
+
+			// everything manual, like without a policy
+			port_policy() USB_VHCI_NOTHROW :
+				connect(false), rate(usb::data_rate_full), reset(false), enable(true), resume(false) { }
+			// everything automatic
+			explicit port_policy(usb::data_rate rate) USB_VHCI_NOTHROW :
+				connect(true), rate(rate), reset(true), enable(true), resume(true) { }
+		};
+
+		// nanoseconds from the last port_connect to each enumeration step;
+		// 0 if the step has not happened yet
+		struct enumeration_timing
+		{
+			uint64_t reset_done;
+			uint64_t addressed;
+			uint64_t configured;
+			// port operations of the port_policy which failed since then, and
+			// the errno of the last one
+			unsigned int policy_failures;
+			int policy_errno;
+
+			enumeration_timing() USB_VHCI_NOTHROW :
+				reset_done(0), addressed(0), configured(0), policy_failures(0), policy_errno(0) { }
+		};
+
+		class controller_manager;
+		class work_handler;
+
+		// the state local_hcd::hand_over passes to another process together
+		// with the controller; a local_hcd constructed from it carries on
+		// where the old one stopped, so that the usb core does not see the
+		// devices disconnect and enumerate again
+		class controller_handoff
+		{
+		public:
+			struct port
+			{
+				uint8_t adr;
+				port_stat stat;
+				usb::device_state state;
+
+				port() USB_VHCI_NOTHROW : adr(0xff), stat(), state() { }
+			};
+
+		private:
+			int fd;
+			int32_t id, usb_bus_num;
+			std::string bus_id;
+			std::vector<port> ports;
+
+			controller_handoff(const controller_handoff&) USB_VHCI_NOTHROW;
+			controller_handoff& operator=(const controller_handoff&) USB_VHCI_NOTHROW;
+
+			void send(int socket) const USB_VHCI_THROWS(std::exception);
+
+			friend class local_hcd;
+
+		public:
+			controller_handoff() USB_VHCI_NOTHROW;
+			// closes the controller if no local_hcd has adopted it
+			virtual ~controller_handoff() USB_VHCI_NOTHROW;
+
+			// waits up to timeout milliseconds (-1 forever) for the state
+			// hand_over sends over the connected unix stream socket; fails with
+			// errno ETIMEDOUT, or EPROTO if the peer is not a local_hcd
+			void receive(int socket, int timeout) USB_VHCI_THROWS(std::exception);
+			bool is_empty() const USB_VHCI_NOTHROW { return fd == -1; }
+			uint8_t get_port_count() const USB_VHCI_NOTHROW { return ports.size(); }
+			const port& get_port(uint8_t port) const USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			int32_t get_vhci_id() const USB_VHCI_NOTHROW { return id; }
+			const std::string& get_bus_id() const USB_VHCI_NOTHROW { return bus_id; }
+			int32_t get_usb_bus_num() const USB_VHCI_NOTHROW { return usb_bus_num; }
 		};
 
 		class local_hcd : public hcd
@@ -510,39 +1239,956 @@ namespace usb
 			{
 				uint8_t adr;
 				port_stat stat;
-				_port_info() throw() : adr(0xff), stat() { }
-				_port_info(uint8_t adr, const port_stat& stat) throw() : adr(adr), stat(stat) { }
+				const usb::descriptor_set* descriptors;
+				usb::device_state state;
+				port_policy policy;
+				uint64_t connect_time;
+				enumeration_timing timing;
+				_port_info() USB_VHCI_NOTHROW :
+					adr(0xff), stat(), descriptors(NULL), state(), policy(), connect_time(0), timing() { }
+				_port_info(uint8_t adr, const port_stat& stat) USB_VHCI_NOTHROW :
+					adr(adr), stat(stat), descriptors(NULL), state(), policy(), connect_time(0), timing() { }
+
+			private:
+				_port_info(const _port_info&) USB_VHCI_NOTHROW;
+				_port_info& operator=(const _port_info&) USB_VHCI_NOTHROW;
 			};
 
-			int fd;
+			transport* trans;
+			bool own_transport;
 			int32_t id, usb_bus_num;
 			std::string bus_id;
 			_port_info* port_info;
+			usbmon_capture* capture;
+			controller_manager* manager;
+			buffer_pool* pool;
+			bool handed_over;
+			// the descriptor of trans which the own background thread polls, -1
+			// if there is none or it does not support polling
+			int poll_fd;
+			bool run_inline;
 
-			local_hcd(const local_hcd&) throw();
-			local_hcd& operator=(const local_hcd&) throw();
+			// a work process_work fetched on a controller_manager, but could
+			// not queue for lack of mem; the reactor must not wait for mem, as
+			// that would hold up the other controllers it drives
+			struct _deferred
+			{
+				bool pending;
+				usb_vhci_work w;
+				int res;
+				bool captured;
+				usb::urb* u;
+				process_urb_work* puw;
+
+				_deferred() USB_VHCI_NOTHROW : pending(false), w(), res(0), captured(false), u(NULL), puw(NULL) { }
+
+			private:
+				_deferred(const _deferred&) USB_VHCI_NOTHROW;
+				_deferred& operator=(const _deferred&) USB_VHCI_NOTHROW;
+			};
+			_deferred deferred;
+
+			// the port operations a port_stat_work calls for by the port_policy
+			struct _policy_actions
+			{
+				uint8_t port;
+				bool connect;
+				usb::data_rate rate;
+				bool reset_done;
+				bool enable;
+				bool resumed;
+
+				_policy_actions() USB_VHCI_NOTHROW :
+					port(0), connect(false), rate(usb::data_rate_full), reset_done(false), enable(true), resumed(false) { }
+			};
+
+			local_hcd(const local_hcd&) USB_VHCI_NOTHROW;
+			local_hcd& operator=(const local_hcd&) USB_VHCI_NOTHROW;
+
+			void init() USB_VHCI_THROWS(std::exception);
+			void adopt(controller_handoff& h) USB_VHCI_THROWS(std::exception);
+			void start_bg_work() USB_VHCI_THROWS(std::exception);
+			void stop_bg_work() USB_VHCI_NOTHROW;
+			// fetches and enqueues at most one work; returns false if there was
+			// none. With defer, a work which cannot be queued for lack of mem is
+			// kept for the next call instead of waiting for mem, and false is
+			// returned, too
+			bool process_work(int16_t timeout, bool defer = false) volatile USB_VHCI_NOTHROW;
+			void defer_work(const usb_vhci_work& w, int res, bool captured, usb::urb* u, process_urb_work* puw) USB_VHCI_NOTHROW;
+			bool has_deferred_work() const USB_VHCI_NOTHROW { return deferred.pending; }
+			usb::urb* fetch_urb(usb_vhci_work& w, int res, bool defer) USB_VHCI_NOTHROW;
+			uint8_t accept_urb(usb::urb& u, bool* captured, uint8_t* rollback_address) USB_VHCI_NOTHROW;
+			void note_port_stat(uint8_t port, const port_stat& nps) USB_VHCI_NOTHROW;
+			bool answer_locally(uint8_t port, usb::urb& urb) USB_VHCI_NOTHROW;
+			bool set_address(uint8_t port, usb::urb& urb) USB_VHCI_NOTHROW;
+			_policy_actions plan_policy(uint8_t port, const port_stat_work& psw) const USB_VHCI_NOTHROW;
+			void apply_policy(const _policy_actions& a) USB_VHCI_NOTHROW;
+			void note_policy_failure(uint8_t port) USB_VHCI_NOTHROW;
+			void note_connect(uint8_t port) USB_VHCI_NOTHROW;
+			void note_address(uint8_t port) USB_VHCI_NOTHROW;
+			void note_configuration(uint8_t port, const usb::urb& urb) USB_VHCI_NOTHROW;
+			void discard_works() USB_VHCI_NOTHROW;
+
+			friend class controller_manager;
 
 		protected:
-			virtual uint8_t address_from_port(uint8_t port) const throw(std::invalid_argument, std::out_of_range);
-			virtual uint8_t port_from_address(uint8_t address) const throw(std::invalid_argument);
-			virtual void canceling_work(work* w, bool in_progress) throw(std::exception);
-			virtual void finishing_work(work* w) throw(std::exception);
-
-		public:
-			explicit local_hcd(uint8_t ports) throw(std::exception);
-			virtual ~local_hcd() throw();
-
-			int32_t get_vhci_id() volatile throw() { return id; }
-			const std::string& get_bus_id() volatile throw() { return const_cast<const std::string&>(bus_id); }
-			int32_t get_usb_bus_num() volatile throw() { return usb_bus_num; }
-			virtual void bg_work() volatile throw();
-			virtual const port_stat& get_port_stat(uint8_t port) volatile throw(std::invalid_argument, std::out_of_range);
-			virtual void port_connect(uint8_t port, usb::data_rate rate) volatile throw(std::exception);
-			virtual void port_disconnect(uint8_t port) volatile throw(std::exception);
-			virtual void port_disable(uint8_t port) volatile throw(std::exception);
-			virtual void port_resumed(uint8_t port) volatile throw(std::exception);
-			virtual void port_overcurrent(uint8_t port, bool set) volatile throw(std::exception);
-			virtual void port_reset_done(uint8_t port, bool enable = true) volatile throw(std::exception);
+			virtual uint8_t address_from_port(uint8_t port) const USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			virtual uint8_t port_from_address(uint8_t address) const USB_VHCI_THROWS(std::invalid_argument);
+			virtual void canceling_work(work* w, bool in_progress) USB_VHCI_THROWS(std::exception);
+			virtual void finishing_work(work* w) USB_VHCI_THROWS(std::exception);
+
+		public:
+			enum fetch_mode
+			{
+				// a thread (the own one or one of a controller_manager)
+				// fetches the works and queues them for next_work
+				fetch_background,
+				// no thread is started and nothing is queued: the application
+				// fetches with poll on its own thread
+				fetch_inline
+			};
+
+			// how a local_hcd reaches and drives its controller; converts
+			// implicitly from each of its parts, so that local_hcd(ports, t)
+			// or local_hcd(ports, m) read as before
+			struct options
+			{
+				// NULL opens USB_VHCI_DEVICE_FILE; otherwise it has to outlive
+				// the local_hcd
+				transport* trans;
+				// the background work runs on the threads of manager instead
+				// of an own thread if it is not NULL; it has to outlive the
+				// local_hcd. Not used with fetch_inline
+				controller_manager* manager;
+				fetch_mode mode;
+
+				options() USB_VHCI_NOTHROW : trans(NULL), manager(NULL), mode(fetch_background) { }
+				options(transport& t) USB_VHCI_NOTHROW : trans(&t), manager(NULL), mode(fetch_background) { }
+				options(controller_manager& m) USB_VHCI_NOTHROW : trans(NULL), manager(&m), mode(fetch_background) { }
+				options(fetch_mode mode) USB_VHCI_NOTHROW : trans(NULL), manager(NULL), mode(mode) { }
+				options(transport& t, controller_manager& m) USB_VHCI_NOTHROW : trans(&t), manager(&m), mode(fetch_background) { }
+				options(transport& t, fetch_mode mode) USB_VHCI_NOTHROW : trans(&t), manager(NULL), mode(mode) { }
+			};
+
+			explicit local_hcd(uint8_t ports, const options& o = options()) USB_VHCI_THROWS(std::exception);
+			// adopt the controller in h instead of opening a new one and
+			// restore the state of its ports; h is empty afterwards. The port
+			// descriptors, policies and the capture are not part of the handoff
+			explicit local_hcd(controller_handoff& h, const options& o = options()) USB_VHCI_THROWS(std::exception);
+			virtual ~local_hcd() USB_VHCI_NOTHROW;
+
+			int32_t get_vhci_id() volatile USB_VHCI_NOTHROW { return id; }
+			const std::string& get_bus_id() volatile USB_VHCI_NOTHROW { return const_cast<const std::string&>(bus_id); }
+			int32_t get_usb_bus_num() volatile USB_VHCI_NOTHROW { return usb_bus_num; }
+			// does not take ownership; pass NULL to stop capturing
+			void set_capture(usbmon_capture* c) volatile USB_VHCI_NOTHROW;
+			// allocates the buffers of new urbs from p, falling back to new if
+			// it is exhausted; p has to outlive every urb it has handed out
+			// buffers for, pass NULL to stop
+			void set_buffer_pool(buffer_pool* p) volatile USB_VHCI_NOTHROW;
+			// lets the background thread answer SET_ADDRESS and the standard
+			// requests handled by descriptor_set::handle for the device on
+			// port, so that they never show up as process_urb_work (nor in an
+			// urb_recorder); d has to stay valid until it is replaced, NULL
+			// passes everything to the application again
+			void set_port_descriptors(uint8_t port, const usb::descriptor_set* d) volatile USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			// the value of the last SET_CONFIGURATION answered through the descriptors of port
+			uint8_t get_port_configuration(uint8_t port) volatile USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			void set_port_policy(uint8_t port, const port_policy& p) volatile USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			port_policy get_port_policy(uint8_t port) volatile USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			enumeration_timing get_enumeration_timing(uint8_t port) volatile USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			// stops fetching works and waits up to timeout milliseconds (-1
+			// forever) until the application has finished all of them, then
+			// passes the controller and the state of its ports over the
+			// connected unix stream socket to controller_handoff::receive; works
+			// arriving meanwhile stay queued in the controller for the new owner.
+			// Afterwards this instance can only be destroyed, which leaves the
+			// controller alone. On failure (errno ETIMEDOUT if the works were not
+			// finished in time) the background work is resumed
+			void hand_over(int socket, int timeout) volatile USB_VHCI_THROWS(std::exception);
+			// disconnects every port, drops the queued works (see
+			// hcd::drop_works) and forgets the port descriptors, policies,
+			// capture, recorder, buffer pool, endpoint handlers, work enqueued
+			// callbacks, work order and weights, so that the controller can be
+			// used like a newly opened one. Works the usb core produces later in
+			// reaction to the disconnect still arrive
+			void reset() volatile USB_VHCI_THROWS(std::exception);
+			// fetch_inline only: waits up to timeout milliseconds (-1 forever)
+			// for one work of the controller and runs hd on it right here;
+			// urbs are given back when hd returns, so they never show up as
+			// cancel_urb_work, and they bypass the endpoint handlers and the
+			// recorder of the hcd; an exception of hd is passed on after the
+			// urb has been given back. Returns false if there was none. Only the
+			// thread calling poll may use this instance, apart from the port
+			// operations hd calls on it; fails with errno EINVAL in
+			// fetch_background mode
+			bool poll(work_handler& hd, int16_t timeout) USB_VHCI_THROWS(std::exception);
+			virtual void bg_work() volatile USB_VHCI_NOTHROW;
+			virtual const port_stat& get_port_stat(uint8_t port) volatile USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			virtual void port_connect(uint8_t port, usb::data_rate rate) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_disconnect(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_disable(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_resumed(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_overcurrent(uint8_t port, bool set) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_reset_done(uint8_t port, bool enable = true) volatile USB_VHCI_THROWS(std::exception);
+		};
+
+		// drives the background work of many local_hcd instances on a fixed
+		// number of reactor threads instead of one thread per controller;
+		// controllers whose transport has no pollable descriptor are fetched
+		// from every poll_interval milliseconds
+		class controller_manager
+		{
+		private:
+			struct _reactor
+			{
+				controller_manager* owner;
+				pthread_t thread;
+				int epoll_fd;
+				int wake_fd;
+				pthread_mutex_t _lock;
+				std::set<local_hcd*> controllers;
+				std::vector<local_hcd*> polled;
+				// a controller has a deferred work (see local_hcd::process_work)
+				bool deferred;
+
+				explicit _reactor(controller_manager* owner) USB_VHCI_NOTHROW :
+					owner(owner), thread(), epoll_fd(-1), wake_fd(-1), _lock(), controllers(), polled(), deferred(false)
+				{ pthread_mutex_init(&_lock, NULL); }
+				~_reactor() USB_VHCI_NOTHROW { pthread_mutex_destroy(&_lock); }
+
+			private:
+				_reactor(const _reactor&) USB_VHCI_NOTHROW;
+				_reactor& operator=(const _reactor&) USB_VHCI_NOTHROW;
+			};
+
+			std::vector<_reactor*> reactors;
+			std::map<local_hcd*, _reactor*> placement;
+			int poll_interval;
+			volatile bool shutdown;
+			pthread_mutex_t _lock;
+
+			controller_manager(const controller_manager&) USB_VHCI_NOTHROW;
+			controller_manager& operator=(const controller_manager&) USB_VHCI_NOTHROW;
+
+			static void* reactor_start(void* r) USB_VHCI_NOTHROW;
+			void run(_reactor& r) volatile USB_VHCI_NOTHROW;
+			// returns true if h has a deferred work
+			static bool drive(local_hcd& h) USB_VHCI_NOTHROW;
+			static void wake(_reactor& r) USB_VHCI_NOTHROW;
+			void stop() USB_VHCI_NOTHROW;
+			// called by local_hcd; remove must not be called from a reactor thread
+			void add(local_hcd& h) volatile USB_VHCI_THROWS(std::exception);
+			void remove(local_hcd& h) volatile USB_VHCI_NOTHROW;
+
+			friend class local_hcd;
+
+		public:
+			// threads == 0 starts one thread per online cpu
+			explicit controller_manager(unsigned int threads = 0, int poll_interval = 10) USB_VHCI_THROWS(std::exception);
+			virtual ~controller_manager() USB_VHCI_NOTHROW;
+
+			unsigned int get_thread_count() const volatile USB_VHCI_NOTHROW;
+			size_t get_controller_count() const volatile USB_VHCI_NOTHROW;
+		};
+
+		// keeps controllers open between uses, because opening one costs the
+		// registration of a new bus with the usb core and a thread; acquire
+		// hands out an idle controller (opening one only if there is none),
+		// release resets it (see local_hcd::reset) and makes it idle again
+		class controller_pool
+		{
+		private:
+			uint8_t port_count;
+			controller_manager* manager;
+			std::vector<local_hcd*> idle;
+			std::set<local_hcd*> leased;
+			pthread_mutex_t _lock;
+
+			controller_pool(const controller_pool&) USB_VHCI_NOTHROW;
+			controller_pool& operator=(const controller_pool&) USB_VHCI_NOTHROW;
+
+		public:
+			// opens count controllers with ports ports each, on m if it is not NULL
+			controller_pool(unsigned int count, uint8_t ports, controller_manager* m = NULL) USB_VHCI_THROWS(std::exception);
+			// closes all controllers, including the leased ones
+			virtual ~controller_pool() USB_VHCI_NOTHROW;
+
+			// takes ownership of h, which has to have get_port_count() ports
+			void add(local_hcd* h) volatile USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+			local_hcd& acquire() volatile USB_VHCI_THROWS(std::exception);
+			void release(local_hcd& h) volatile USB_VHCI_THROWS(std::exception);
+			uint8_t get_port_count() const volatile USB_VHCI_NOTHROW { return port_count; }
+			size_t get_idle_count() const volatile USB_VHCI_NOTHROW;
+			size_t get_leased_count() const volatile USB_VHCI_NOTHROW;
+		};
+
+		// handles the works a work_executor routes to it
+		class work_handler
+		{
+		public:
+			virtual ~work_handler() USB_VHCI_NOTHROW;
+			// runs on a thread of the executor, which finishes w when this
+			// returns; runs concurrently for different endpoints, and the
+			// cancel_urb_work for an urb can arrive while the urb is handled.
+			// If it throws, an urb is given back with USB_VHCI_STATUS_ERROR
+			virtual void handle(hcd& from, work& w) USB_VHCI_THROWS(std::exception) = 0;
+		};
+
+		// runs the works of an hcd on a pool of threads instead of a consumer
+		// loop of the application: a process_urb_work goes to the handler of
+		// its endpoint, else of its port, else to the default handler (urbs
+		// nobody handles are stalled); port_stat_work and cancel_urb_work go
+		// to the handler of their port or the default one. The works of one
+		// endpoint, and the other works of one port, run one after the other
+		// in order; everything else runs in parallel, and threads without
+		// anything to do steal ready endpoints from the others. Nobody else
+		// may take works out of the hcd meanwhile. Handlers have to outlive
+		// the executor, as one may still be running when it is replaced
+		class work_executor
+		{
+		private:
+			struct _strand
+			{
+				std::deque<work*> works;
+				// in a ready deque or running
+				bool scheduled;
+
+				_strand() USB_VHCI_NOTHROW : works(), scheduled(false) { }
+			};
+
+			struct _worker
+			{
+				work_executor* owner;
+				pthread_t thread;
+				pthread_mutex_t _lock;
+				std::deque<_strand*> ready;
+
+				explicit _worker(work_executor* owner) USB_VHCI_NOTHROW :
+					owner(owner), thread(), _lock(), ready()
+				{ pthread_mutex_init(&_lock, NULL); }
+				~_worker() USB_VHCI_NOTHROW { pthread_mutex_destroy(&_lock); }
+
+			private:
+				_worker(const _worker&) USB_VHCI_NOTHROW;
+				_worker& operator=(const _worker&) USB_VHCI_NOTHROW;
+			};
+
+			hcd& h;
+			std::vector<_worker*> workers;
+			// keyed by port << 8 | endpoint address, 0xff instead of the
+			// endpoint address for the other works of a port
+			std::map<uint16_t, _strand*> strands;
+			std::map<uint16_t, work_handler*> handlers;
+			work_handler* default_handler;
+			// h has enqueued works since the last pull
+			bool work_pending;
+			// bumped whenever a strand gets ready
+			uint64_t ready_generation;
+			unsigned int sleeping;
+			size_t scheduled;
+			volatile bool shutdown;
+			volatile int pulling;
+			volatile uint64_t steals;
+			pthread_mutex_t _lock;
+			pthread_cond_t wake_cond;
+
+			work_executor(const work_executor&) USB_VHCI_NOTHROW;
+			work_executor& operator=(const work_executor&) USB_VHCI_NOTHROW;
+
+			static void work_enqueued(void* arg, hcd& from) USB_VHCI_NOTHROW;
+			static void* worker_start(void* w) USB_VHCI_NOTHROW;
+			void run(_worker& self) USB_VHCI_NOTHROW;
+			bool pull(_worker& self) USB_VHCI_NOTHROW;
+			_strand* steal(_worker& self) USB_VHCI_NOTHROW;
+			void run_strand(_worker& self, _strand* s) USB_VHCI_NOTHROW;
+			void dispatch(work& w) USB_VHCI_NOTHROW;
+			void make_ready(_worker& self, _strand* s) USB_VHCI_THROWS(std::bad_alloc);
+			void stop() USB_VHCI_NOTHROW;
+
+		public:
+			// threads == 0 starts one thread per online cpu
+			explicit work_executor(hcd& h, unsigned int threads = 0) USB_VHCI_THROWS(std::exception);
+			// runs the works already taken out of h before it returns
+			virtual ~work_executor() USB_VHCI_NOTHROW;
+
+			// NULL removes the handler
+			void set_handler(uint8_t port, work_handler* hd) volatile USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+			void set_handler(uint8_t port, uint8_t epadr, work_handler* hd) volatile USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+			void set_default_handler(work_handler* hd) volatile USB_VHCI_NOTHROW;
+			unsigned int get_thread_count() const volatile USB_VHCI_NOTHROW;
+			// how often a thread took a ready endpoint from another one
+			uint64_t get_steal_count() const volatile USB_VHCI_NOTHROW { return steals; }
+		};
+
+		// spreads virtual devices over several local_hcd instances: connect
+		// picks a free port on the controller with the lowest load, where
+		// every device counts as 1 plus its recent urb rate (in urbs per
+		// second, decaying with a time constant of one second); the rate is
+		// observed in next_work, which is the consumer interface for the
+		// work of all controllers
+		class controller_set
+		{
+		public:
+			struct placement
+			{
+				local_hcd* controller;
+				uint8_t port;
+
+				placement() USB_VHCI_NOTHROW : controller(NULL), port(0) { }
+				placement(local_hcd* controller, uint8_t port) USB_VHCI_NOTHROW : controller(controller), port(port) { }
+				bool operator==(const placement& other) const USB_VHCI_NOTHROW
+				{ return controller == other.controller && port == other.port; }
+				bool operator!=(const placement& other) const USB_VHCI_NOTHROW { return !(*this == other); }
+			};
+
+		private:
+			struct _port
+			{
+				bool used;
+				double rate;
+				uint64_t stamp;
+				_port() USB_VHCI_NOTHROW : used(false), rate(0.0), stamp(0) { }
+			};
+
+			struct _controller
+			{
+				local_hcd* hcd;
+				bool own;
+				std::vector<_port> ports;
+				_controller(local_hcd* hcd, bool own) USB_VHCI_THROWS(std::bad_alloc) :
+					hcd(hcd), own(own), ports(hcd->get_port_count()) { }
+				_controller(const _controller& other) USB_VHCI_THROWS(std::bad_alloc) :
+					hcd(other.hcd), own(other.own), ports(other.ports) { }
+				_controller& operator=(const _controller& other) USB_VHCI_THROWS(std::bad_alloc)
+				{
+					hcd = other.hcd;
+					own = other.own;
+					ports = other.ports;
+					return *this;
+				}
+			};
+
+			std::vector<_controller> controllers;
+			std::vector<hcd::callback> work_enqueued_callbacks;
+			size_t next;
+			pthread_mutex_t _lock;
+
+			controller_set(const controller_set&) USB_VHCI_NOTHROW;
+			controller_set& operator=(const controller_set&) USB_VHCI_NOTHROW;
+
+			static uint64_t now() USB_VHCI_NOTHROW;
+			static double decayed(const _port& p, uint64_t t) USB_VHCI_NOTHROW;
+			_port& slot(const placement& p, bool used) USB_VHCI_THROWS(std::invalid_argument);
+			placement place(uint64_t t) USB_VHCI_THROWS(std::out_of_range);
+
+		public:
+			controller_set() USB_VHCI_NOTHROW;
+			// creates count controllers with ports ports each; their background
+			// work runs on m if given
+			controller_set(unsigned int count, uint8_t ports, controller_manager* m = NULL) USB_VHCI_THROWS(std::exception);
+			virtual ~controller_set() USB_VHCI_NOTHROW;
+
+			// does not take ownership; h has to outlive this instance
+			void add(local_hcd& h) volatile USB_VHCI_THROWS(std::bad_alloc);
+			size_t get_controller_count() const volatile USB_VHCI_NOTHROW;
+			local_hcd& get_controller(size_t index) volatile USB_VHCI_THROWS(std::out_of_range);
+			// throws std::out_of_range if all ports are in use
+			placement connect(usb::data_rate rate) volatile USB_VHCI_THROWS(std::exception);
+			void disconnect(const placement& p) volatile USB_VHCI_THROWS(std::exception);
+			// moves the device on p to the controller with the lowest load now;
+			// its urb rate moves along
+			placement reconnect(const placement& p, usb::data_rate rate) volatile USB_VHCI_THROWS(std::exception);
+			// urbs per second of the device on p
+			double get_rate(const placement& p) volatile USB_VHCI_THROWS(std::invalid_argument);
+			// the sum over all devices of a controller, as used for placement
+			double get_load(size_t index) volatile USB_VHCI_THROWS(std::out_of_range);
+			void add_work_enqueued_callback(hcd::callback c) volatile USB_VHCI_THROWS(std::bad_alloc);
+			void remove_work_enqueued_callback(hcd::callback c) volatile USB_VHCI_NOTHROW;
+			// fetches the next work of any controller, round robin; *from is
+			// the controller on which finish_work has to be called. Returns
+			// true whenever it found a work, as the other controllers may
+			// still have some, and false once a full round found nothing
+			bool next_work(local_hcd** from, work** w) volatile USB_VHCI_THROWS(std::bad_alloc);
+		};
+
+		// a byte queue between one producer and one consumer thread which
+		// needs no lock; the capacity is rounded up to a power of two
+		class byte_ring
+		{
+		private:
+			uint8_t* buf;
+			size_t mask;
+			// free running; only the producer writes head, only the consumer tail
+			volatile size_t head;
+			volatile size_t tail;
+
+			byte_ring(const byte_ring&) USB_VHCI_NOTHROW;
+			byte_ring& operator=(const byte_ring&) USB_VHCI_NOTHROW;
+
+		public:
+			explicit byte_ring(size_t capacity) USB_VHCI_THROWS2(std::invalid_argument, std::bad_alloc);
+			virtual ~byte_ring() USB_VHCI_NOTHROW;
+
+			size_t get_capacity() const volatile USB_VHCI_NOTHROW { return mask + 1; }
+			size_t get_used() const volatile USB_VHCI_NOTHROW { return head - tail; }
+			size_t get_free() const volatile USB_VHCI_NOTHROW { return get_capacity() - get_used(); }
+			// producer side; copies as much as fits and returns its size
+			size_t write(const void* data, size_t size) volatile USB_VHCI_NOTHROW;
+			// consumer side; copies up to size bytes and returns their count
+			size_t read(void* data, size_t size) volatile USB_VHCI_NOTHROW;
+		};
+
+		// serves an isochronous endpoint of a device from a byte_ring instead
+		// of the application: for IN endpoints the application writes its
+		// samples and every urb is filled as soon as it arrives, each packet up
+		// to its length in whole frames of frame_size bytes; for OUT
+		// endpoints the packets of every urb are appended to the ring and the
+		// application reads them
+		class iso_stream : public endpoint_handler
+		{
+		public:
+			struct statistics
+			{
+				uint64_t urbs;
+				uint64_t packets;
+				uint64_t bytes;
+				// IN packets which got less than their length from the ring
+				uint64_t underruns;
+				// bytes which did not fit into the ring (written by the
+				// application for IN, received from the host for OUT)
+				uint64_t overruns;
+				// average time between two urbs, and the average and the
+				// largest deviation from it
+				uint64_t interval_ns;
+				uint64_t jitter_ns;
+				uint64_t max_jitter_ns;
+
+				statistics() USB_VHCI_NOTHROW :
+					urbs(0), packets(0), bytes(0), underruns(0), overruns(0),
+					interval_ns(0), jitter_ns(0), max_jitter_ns(0) { }
+			};
+
+		private:
+			hcd& owner;
+			uint8_t port;
+			uint8_t epadr;
+			size_t frame_size;
+			byte_ring ring;
+			statistics stats;
+			volatile uint64_t write_overruns;
+			uint64_t last_arrival;
+			double interval;
+			double jitter;
+			pthread_mutex_t _lock;
+
+			iso_stream(const iso_stream&) USB_VHCI_NOTHROW;
+			iso_stream& operator=(const iso_stream&) USB_VHCI_NOTHROW;
+
+			void note_arrival() USB_VHCI_NOTHROW;
+			void fill(usb::urb& urb) USB_VHCI_NOTHROW;
+			void drain(usb::urb& urb) USB_VHCI_NOTHROW;
+
+		public:
+			// attaches itself to epadr on port of h, which has to outlive this
+			// instance
+			iso_stream(hcd& h, uint8_t port, uint8_t epadr, size_t capacity, size_t frame_size = 1) USB_VHCI_THROWS(std::exception);
+			virtual ~iso_stream() USB_VHCI_NOTHROW;
+
+			// IN endpoints; returns the number of bytes taken
+			size_t write(const void* data, size_t size) volatile USB_VHCI_NOTHROW;
+			// OUT endpoints; returns the number of bytes read
+			size_t read(void* data, size_t size) volatile USB_VHCI_NOTHROW;
+			size_t get_fill() const volatile USB_VHCI_NOTHROW { return ring.get_used(); }
+			statistics get_statistics() volatile USB_VHCI_NOTHROW;
+			virtual disposition submit(hcd& from, process_urb_work* w) USB_VHCI_NOTHROW;
+			virtual bool release(hcd& from, process_urb_work* w) USB_VHCI_NOTHROW;
+		};
+
+		// serves a bulk IN endpoint from a byte stream: the application
+		// writes into a byte_ring (from one thread) and the urbs of the host
+		// are filled from it, many writes at once; a urb completes as soon as
+		// the ring holds its whole length, or as a short transfer ending at
+		// the data written before the last flush (which fails urbs with
+		// short_not_ok set with USB_VHCI_STATUS_SHORT_PACKET)
+		class bulk_in_stream : public endpoint_handler
+		{
+		private:
+			hcd& owner;
+			uint8_t port;
+			uint8_t epadr;
+			byte_ring ring;
+			// free running byte counts: written by the application, sent
+			// to the host, and the end of the data to flush
+			volatile size_t written;
+			size_t sent;
+			volatile size_t mark;
+			std::deque<process_urb_work*> pending;
+			pthread_mutex_t _lock;
+
+			bulk_in_stream(const bulk_in_stream&) USB_VHCI_NOTHROW;
+			bulk_in_stream& operator=(const bulk_in_stream&) USB_VHCI_NOTHROW;
+
+			bool fill(usb::urb& urb) USB_VHCI_NOTHROW;
+			void deliver() USB_VHCI_NOTHROW;
+
+		public:
+			// attaches itself to epadr on port of h, which has to outlive this
+			// instance
+			bulk_in_stream(hcd& h, uint8_t port, uint8_t epadr, size_t capacity) USB_VHCI_THROWS(std::exception);
+			virtual ~bulk_in_stream() USB_VHCI_NOTHROW;
+
+			// return the number of bytes taken, which is less than asked for
+			// if the ring is full
+			size_t write(const void* data, size_t size) volatile USB_VHCI_NOTHROW;
+			size_t writev(const iovec* iov, int count) volatile USB_VHCI_NOTHROW;
+			void flush() volatile USB_VHCI_NOTHROW;
+			size_t get_fill() const volatile USB_VHCI_NOTHROW { return ring.get_used(); }
+			// urbs waiting for data
+			size_t get_pending_count() volatile USB_VHCI_NOTHROW;
+			virtual disposition submit(hcd& from, process_urb_work* w) USB_VHCI_NOTHROW;
+			virtual bool release(hcd& from, process_urb_work* w) USB_VHCI_NOTHROW;
+		};
+
+		// collects the data of a bulk OUT endpoint in a byte_ring for the
+		// application (reading from one thread); urbs which do not fit wait
+		// like behind a NAK until reading makes room, so that the host can
+		// never overrun the application
+		class bulk_out_stream : public endpoint_handler
+		{
+		private:
+			hcd& owner;
+			uint8_t port;
+			uint8_t epadr;
+			byte_ring ring;
+			std::deque<process_urb_work*> pending;
+			// bytes of the first pending urb which are in the ring already
+			size_t offset;
+			pthread_mutex_t _lock;
+
+			bulk_out_stream(const bulk_out_stream&) USB_VHCI_NOTHROW;
+			bulk_out_stream& operator=(const bulk_out_stream&) USB_VHCI_NOTHROW;
+
+			bool drain(usb::urb& urb) USB_VHCI_NOTHROW;
+			void make_room() USB_VHCI_NOTHROW;
+
+		public:
+			// attaches itself to epadr on port of h, which has to outlive this
+			// instance
+			bulk_out_stream(hcd& h, uint8_t port, uint8_t epadr, size_t capacity) USB_VHCI_THROWS(std::exception);
+			virtual ~bulk_out_stream() USB_VHCI_NOTHROW;
+
+			// return the number of bytes read, 0 if there is nothing
+			size_t read(void* data, size_t size) volatile USB_VHCI_NOTHROW;
+			size_t readv(const iovec* iov, int count) volatile USB_VHCI_NOTHROW;
+			size_t get_fill() const volatile USB_VHCI_NOTHROW { return ring.get_used(); }
+			// urbs waiting for room
+			size_t get_pending_count() volatile USB_VHCI_NOTHROW;
+			virtual disposition submit(hcd& from, process_urb_work* w) USB_VHCI_NOTHROW;
+			virtual bool release(hcd& from, process_urb_work* w) USB_VHCI_NOTHROW;
+		};
+
+		// parks the interrupt IN urbs of the endpoints attached to it and
+		// completes them with the reports the application posts: a posted
+		// report goes out with the oldest parked urb right away, queued
+		// reports go out one per interval; an endpoint with repeat set
+		// sends its last report again at every interval boundary (like the
+		// idle rate of hid), otherwise it keeps its urbs parked until there
+		// is a report; the boundaries of all endpoints are kept in a timer
+		// wheel with a resolution of tick_ns, driven by one timerfd
+		class interrupt_scheduler : public endpoint_handler
+		{
+		private:
+			struct _endpoint
+			{
+				hcd* owner;
+				uint8_t port;
+				uint8_t epadr;
+				uint64_t unit_ns;
+				bool repeat;
+				std::deque<std::vector<uint8_t> > reports;
+				std::vector<uint8_t> last;
+				bool have_last;
+				std::deque<process_urb_work*> parked;
+				uint64_t last_complete;
+				// the slot list of the wheel while queued
+				bool queued;
+				_endpoint* prev;
+				_endpoint* next;
+				uint64_t due;
+
+				_endpoint(hcd* owner, uint8_t port, uint8_t epadr, uint64_t unit_ns, bool repeat) USB_VHCI_NOTHROW :
+					owner(owner), port(port), epadr(epadr), unit_ns(unit_ns), repeat(repeat),
+					reports(), last(), have_last(false), parked(), last_complete(0),
+					queued(false), prev(NULL), next(NULL), due(0) { }
+
+			private:
+				_endpoint(const _endpoint&) USB_VHCI_NOTHROW;
+				_endpoint& operator=(const _endpoint&) USB_VHCI_NOTHROW;
+			};
+
+			typedef std::pair<hcd*, uint16_t> _key;
+			typedef std::vector<std::pair<hcd*, process_urb_work*> > _done;
+
+			uint64_t tick_ns;
+			uint64_t epoch;
+			// list heads, one per slot
+			std::vector<_endpoint*> wheel;
+			// the last tick advance has handled
+			uint64_t current;
+			size_t scheduled;
+			std::map<_key, _endpoint*> endpoints;
+			int timer_fd;
+			int wake_fd;
+			pthread_t thread;
+			volatile bool shutdown;
+			pthread_mutex_t _lock;
+
+			interrupt_scheduler(const interrupt_scheduler&) USB_VHCI_NOTHROW;
+			interrupt_scheduler& operator=(const interrupt_scheduler&) USB_VHCI_NOTHROW;
+
+			static void* thread_start(void* s) USB_VHCI_NOTHROW;
+			void run() USB_VHCI_NOTHROW;
+			void stop() USB_VHCI_NOTHROW;
+			void arm(bool on) USB_VHCI_NOTHROW;
+			void schedule(_endpoint& e, uint64_t tick) USB_VHCI_NOTHROW;
+			void unschedule(_endpoint& e) USB_VHCI_NOTHROW;
+			void reschedule(_endpoint& e, uint64_t t) USB_VHCI_NOTHROW;
+			void advance(_done& done) USB_VHCI_NOTHROW;
+			process_urb_work* send(_endpoint& e, uint64_t t) USB_VHCI_NOTHROW;
+			static void complete(const _done& done) USB_VHCI_NOTHROW;
+
+		public:
+			explicit interrupt_scheduler(uint64_t tick_ns = 1000000) USB_VHCI_THROWS(std::exception);
+			virtual ~interrupt_scheduler() USB_VHCI_NOTHROW;
+
+			// takes over epadr on port of h, which has to outlive the
+			// attachment; the interval of the urbs counts in frames of 1 ms, or
+			// in microframes of 125 us if rate is data_rate_high
+			void attach(hcd& h, uint8_t port, uint8_t epadr, usb::data_rate rate = usb::data_rate_full, bool repeat = true) volatile USB_VHCI_THROWS(std::exception);
+			// passes the parked urbs to the application
+			void detach(hcd& h, uint8_t port, uint8_t epadr) volatile USB_VHCI_NOTHROW;
+			void post(hcd& h, uint8_t port, uint8_t epadr, const void* report, size_t size) volatile USB_VHCI_THROWS(std::exception);
+			size_t get_parked_count() volatile USB_VHCI_NOTHROW;
+			virtual disposition submit(hcd& from, process_urb_work* w) USB_VHCI_NOTHROW;
+			virtual bool release(hcd& from, process_urb_work* w) USB_VHCI_NOTHROW;
+		};
+
+		namespace remote
+		{
+			struct shm_work;
+			struct shm_completion;
+		}
+
+		// serves a local_hcd to one remote_hcd at a time over a unix domain
+		// socket, so that device emulators can run in processes of their own;
+		// the server is the only consumer of the works of the local_hcd, and
+		// when the client goes away, its urbs fail with
+		// USB_VHCI_STATUS_DEVICE_DISCONNECTED and all ports are disconnected
+		//
+		// with shared memory, the local_hcd allocates the urb buffers from a
+		// shared_region, which the client maps; works and givebacks are then
+		// descriptors on two rings in that region and the payload is never
+		// copied between the processes
+		class hcd_server
+		{
+		private:
+			local_hcd& owner;
+			std::string path;
+			int listen_fd;
+			int client_fd;
+			int wake_fd;
+			volatile int wake_pending;
+			pthread_t thread;
+			volatile bool shutdown;
+			// urbs the client has not given back yet, with the chunk of region
+			// they were copied to if their buffers are not in it
+			std::map<uint64_t, std::pair<process_urb_work*, uint8_t*> > in_flight;
+			std::vector<uint8_t> in;
+			std::vector<uint8_t> out;
+			size_t out_pos;
+			volatile bool connected;
+			// the client has sent REMOTE_FRAME_ATTACH
+			bool attached;
+			shared_region* region;
+			// the rings in region, laid out once on creation; the client maps
+			// the region writable, so the offsets in its header are never
+			// read back
+			remote::shm_work* work_slots;
+			const remote::shm_completion* completion_slots;
+			// doorbells of the work and the completion ring
+			int work_fd;
+			int completion_fd;
+			// works taken from owner which did not fit into the ring yet
+			std::deque<work*> backlog;
+
+			hcd_server(const hcd_server&) USB_VHCI_NOTHROW;
+			hcd_server& operator=(const hcd_server&) USB_VHCI_NOTHROW;
+
+			static void* thread_start(void* s) USB_VHCI_NOTHROW;
+			static void work_enqueued(void* s, hcd& from) USB_VHCI_NOTHROW;
+			void run() USB_VHCI_NOTHROW;
+			void stop() USB_VHCI_NOTHROW;
+			void accept_client() USB_VHCI_NOTHROW;
+			void drop_client() USB_VHCI_NOTHROW;
+			bool read_client() USB_VHCI_NOTHROW;
+			bool write_client() USB_VHCI_NOTHROW;
+			void send_works() USB_VHCI_NOTHROW;
+			void fail_work(work* w) USB_VHCI_NOTHROW;
+			bool publish(work* w, bool* ring) USB_VHCI_NOTHROW;
+			void publish_works() USB_VHCI_NOTHROW;
+			void reap_completions() USB_VHCI_NOTHROW;
+			bool attach() USB_VHCI_NOTHROW;
+			bool handle_frame(uint8_t type, const uint8_t* body, size_t size) USB_VHCI_NOTHROW;
+			void handle_giveback(const uint8_t* body, size_t size) USB_VHCI_NOTHROW;
+			void handle_port_op(const uint8_t* body, size_t size) USB_VHCI_NOTHROW;
+
+		public:
+			// h has to outlive this instance; an existing file at path is
+			// replaced; with a shared_size, h allocates its urb buffers from a
+			// shared_region of that many bytes while this instance exists
+			hcd_server(local_hcd& h, const char* path, size_t shared_size = 0) USB_VHCI_THROWS(std::exception);
+			virtual ~hcd_server() USB_VHCI_NOTHROW;
+
+			bool has_client() const volatile USB_VHCI_NOTHROW { return connected; }
+		};
+
+		// an hcd whose controller is a local_hcd served by hcd_server, most
+		// likely in another process; works arrive in batches and givebacks
+		// are sent in batches by the background thread; the port functions
+		// wait for the answer of the server, so they must not be called from
+		// a work_enqueued callback; if the server shares memory, the urb
+		// buffers point into it and must not be used after finish_work
+		class remote_hcd : public hcd
+		{
+		private:
+			int fd;
+			int wake_fd;
+			volatile int wake_pending;
+			port_stat* stats;
+			uint8_t* addresses;
+			std::vector<uint8_t> in;
+			// entries of the next REMOTE_FRAME_GIVEBACKS, and whole port op
+			// frames; both under send_lock
+			std::vector<uint8_t> givebacks;
+			std::vector<uint8_t> ops;
+			pthread_mutex_t send_lock;
+			// one port op at a time
+			pthread_mutex_t op_lock;
+			pthread_cond_t op_cond;
+			bool op_busy;
+			bool op_done;
+			int32_t op_error;
+			volatile bool connected;
+			// set if the server shares memory
+			shared_region* region;
+			int work_fd;
+			int completion_fd;
+
+			remote_hcd(const remote_hcd&) USB_VHCI_NOTHROW;
+			remote_hcd& operator=(const remote_hcd&) USB_VHCI_NOTHROW;
+
+			static uint8_t read_hello(int fd) USB_VHCI_THROWS(std::exception);
+			void attach() USB_VHCI_THROWS(std::exception);
+			void wake() USB_VHCI_NOTHROW;
+			void take_works() USB_VHCI_NOTHROW;
+			bool post_completion(const usb::urb& urb) USB_VHCI_NOTHROW;
+			bool receive() USB_VHCI_NOTHROW;
+			void dispatch_works(const uint8_t* body, size_t size) USB_VHCI_NOTHROW;
+			void enqueue_urb(uint8_t port, const uint8_t* body, size_t size) USB_VHCI_THROWS(std::exception);
+			bool enqueue_port_stat(uint8_t port, const port_stat& nps) USB_VHCI_THROWS(std::bad_alloc);
+			void finish_op(int32_t error) USB_VHCI_NOTHROW;
+			bool flush() USB_VHCI_NOTHROW;
+			void port_op(uint8_t op, uint8_t port, uint8_t arg) volatile USB_VHCI_THROWS(std::exception);
+
+		protected:
+			virtual uint8_t address_from_port(uint8_t port) const USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			virtual uint8_t port_from_address(uint8_t address) const USB_VHCI_THROWS(std::invalid_argument);
+			virtual void canceling_work(work* w, bool in_progress) USB_VHCI_THROWS(std::exception);
+			virtual void finishing_work(work* w) USB_VHCI_THROWS(std::exception);
+
+		public:
+			// takes ownership of fd, a stream socket connected to an
+			// hcd_server (which is closed if this throws)
+			explicit remote_hcd(int fd) USB_VHCI_THROWS(std::exception);
+			virtual ~remote_hcd() USB_VHCI_NOTHROW;
+
+			// connects to the hcd_server at path and returns the socket
+			static int connect(const char* path) USB_VHCI_THROWS(std::exception);
+			bool is_connected() const volatile USB_VHCI_NOTHROW { return connected; }
+			virtual void bg_work() volatile USB_VHCI_NOTHROW;
+			virtual const port_stat& get_port_stat(uint8_t port) volatile USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			virtual void port_connect(uint8_t port, usb::data_rate rate) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_disconnect(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_disable(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_resumed(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_overcurrent(uint8_t port, bool set) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_reset_done(uint8_t port, bool enable = true) volatile USB_VHCI_THROWS(std::exception);
+		};
+
+		struct replay_result
+		{
+			uint64_t handle;
+			uint8_t port;
+			uint8_t epadr;
+			bool canceled;
+			// time from submission to giveback; zero if unknown
+			uint64_t recorded_ns;
+			uint64_t replayed_ns;
+		};
+
+		// plays back a file written by urb_recorder; speed scales the recorded
+		// timing (2.0 runs twice as fast), 0 delivers the work as fast as possible
+		class replay_hcd : public hcd
+		{
+		private:
+			struct _pending
+			{
+				size_t result;
+				uint64_t recorded;
+				uint64_t enqueued;
+			};
+
+			int fd;
+			const uint8_t* map;
+			size_t map_size;
+			// where the records end
+			size_t end;
+			size_t pos;
+			double speed;
+			uint64_t first_record_time;
+			uint64_t start_time;
+			bool done;
+			port_stat* stats;
+			std::vector<replay_result> results;
+			std::map<uint64_t, _pending> pending;
+
+			replay_hcd(const replay_hcd&) USB_VHCI_NOTHROW;
+			replay_hcd& operator=(const replay_hcd&) USB_VHCI_NOTHROW;
+
+			static uint8_t read_port_count(const char* path) USB_VHCI_THROWS(std::exception);
+			bool dispatch(size_t at) USB_VHCI_NOTHROW;
+
+		protected:
+			virtual uint8_t address_from_port(uint8_t port) const USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			virtual uint8_t port_from_address(uint8_t address) const USB_VHCI_THROWS(std::invalid_argument);
+			virtual void finishing_work(work* w) USB_VHCI_THROWS(std::exception);
+
+		public:
+			explicit replay_hcd(const char* path, double speed = 1.0) USB_VHCI_THROWS(std::exception);
+			virtual ~replay_hcd() USB_VHCI_NOTHROW;
+
+			virtual void bg_work() volatile USB_VHCI_NOTHROW;
+			// true, once every recorded event has been delivered
+			bool is_done() const volatile USB_VHCI_NOTHROW { return done; }
+			std::vector<replay_result> get_results() volatile USB_VHCI_THROWS(std::bad_alloc);
+			virtual const port_stat& get_port_stat(uint8_t port) volatile USB_VHCI_THROWS2(std::invalid_argument, std::out_of_range);
+			virtual void port_connect(uint8_t port, usb::data_rate rate) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_disconnect(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_disable(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_resumed(uint8_t port) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_overcurrent(uint8_t port, bool set) volatile USB_VHCI_THROWS(std::exception);
+			virtual void port_reset_done(uint8_t port, bool enable = true) volatile USB_VHCI_THROWS(std::exception);
 		};
 	}
 }
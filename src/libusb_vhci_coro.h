@@ -0,0 +1,300 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LIBUSB_VHCI_CORO_H
+#define _LIBUSB_VHCI_CORO_H 1
+
+// device handlers as coroutines; this header needs c++20, while
+// libusb_vhci.h itself stays usable with older compilers
+#if __cplusplus < 202002L
+#error "libusb_vhci_coro.h needs c++20"
+#endif
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <map>
+#include "libusb_vhci.h"
+
+namespace usb
+{
+	namespace vhci
+	{
+		namespace coro
+		{
+			// the return type of device handler coroutines: they start right
+			// away and free themselves when they return
+			struct task
+			{
+				struct promise_type
+				{
+					task get_return_object() noexcept { return task(); }
+					std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+					std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+					void return_void() noexcept { }
+					void unhandled_exception() noexcept { std::terminate(); }
+				};
+			};
+
+			// hands the works of one hcd to the coroutines waiting for them;
+			// the coroutines are resumed on the thread calling poll or run, one
+			// after the other for a whole batch of works, and run only sleeps
+			// while the inbox is empty
+			//
+			//   task device(executor& e, hcd& h)
+			//   {
+			//       for(;;)
+			//       {
+			//           process_urb_work* w(co_await e.next_urb(1, 0x81));
+			//           ...
+			//           e.complete(w);
+			//       }
+			//   }
+			class executor
+			{
+			private:
+				template<typename T>
+				struct _waiter
+				{
+					std::coroutine_handle<> handle;
+					T* result;
+				};
+
+				hcd& owner;
+				int wake_fd;
+				volatile int sleeping;
+				volatile bool stopped;
+				// keyed by port << 8 | endpoint address
+				std::map<uint16_t, std::deque<_waiter<process_urb_work*> > > urb_waiters;
+				std::map<uint16_t, std::deque<process_urb_work*> > urbs;
+				std::map<uint8_t, std::deque<_waiter<port_stat_work> > > port_waiters;
+				std::map<uint8_t, std::deque<port_stat_work> > port_events;
+
+				executor(const executor&) = delete;
+				executor& operator=(const executor&) = delete;
+
+				static void work_enqueued(void* e, hcd&) noexcept
+				{
+					executor& _this(*static_cast<executor*>(e));
+					if(__sync_bool_compare_and_swap(&_this.sleeping, 1, 0))
+						_this.wake();
+				}
+
+				void wake() noexcept
+				{
+					uint64_t v(1);
+					while(::write(wake_fd, &v, sizeof v) == -1 && errno == EINTR);
+				}
+
+				template<typename T, typename K>
+				static bool take(std::map<K, std::deque<T> >& queues, K key, T& result)
+				{
+					typename std::map<K, std::deque<T> >::iterator i(queues.find(key));
+					if(i == queues.end()) return false;
+					result = i->second.front();
+					i->second.pop_front();
+					if(i->second.empty()) queues.erase(i);
+					return true;
+				}
+
+				template<typename T, typename K>
+				static bool resume(std::map<K, std::deque<_waiter<T> > >& waiters, K key, const T& value)
+				{
+					_waiter<T> w;
+					if(!take(waiters, key, w)) return false;
+					*w.result = value;
+					w.handle.resume();
+					return true;
+				}
+
+				void dispatch(work* w)
+				{
+					if(process_urb_work* uw = dynamic_cast<process_urb_work*>(w))
+					{
+						const uint16_t key(uw->get_port() << 8 | uw->get_urb()->get_endpoint_address());
+						if(!resume(urb_waiters, key, uw))
+							urbs[key].push_back(uw);
+					}
+					else if(port_stat_work* pw = dynamic_cast<port_stat_work*>(w))
+					{
+						const port_stat_work copy(*pw);
+						owner.finish_work(w);
+						if(!resume(port_waiters, copy.get_port(), copy))
+							port_events[copy.get_port()].push_back(copy);
+					}
+					else if(cancel_urb_work* cw = dynamic_cast<cancel_urb_work*>(w))
+					{
+						// urbs a coroutine has already got are up to it
+						for(std::map<uint16_t, std::deque<process_urb_work*> >::iterator i(urbs.begin()); i != urbs.end(); i++)
+						{
+							for(std::deque<process_urb_work*>::iterator u(i->second.begin()); u < i->second.end(); u++)
+							{
+								if((*u)->get_urb()->get_handle() != cw->get_handle()) continue;
+								process_urb_work* c(*u);
+								i->second.erase(u);
+								if(i->second.empty()) urbs.erase(i);
+								c->get_urb()->set_status(USB_VHCI_STATUS_CANCELED);
+								owner.finish_work(c);
+								goto done;
+							}
+						}
+					done:
+						owner.finish_work(w);
+					}
+					else
+						owner.finish_work(w);
+				}
+
+			public:
+				class urb_awaiter
+				{
+				private:
+					executor& exec;
+					uint16_t key;
+					process_urb_work* result;
+
+				public:
+					urb_awaiter(executor& exec, uint16_t key) noexcept : exec(exec), key(key), result(NULL) { }
+					bool await_ready() { return take(exec.urbs, key, result); }
+					void await_suspend(std::coroutine_handle<> h)
+					{
+						_waiter<process_urb_work*> w = { h, &result };
+						exec.urb_waiters[key].push_back(w);
+					}
+					process_urb_work* await_resume() noexcept { return result; }
+				};
+
+				class port_awaiter
+				{
+				private:
+					executor& exec;
+					uint8_t port;
+					port_stat_work result;
+
+				public:
+					port_awaiter(executor& exec, uint8_t port) : exec(exec), port(port), result(port, port_stat()) { }
+					bool await_ready() { return take(exec.port_events, port, result); }
+					void await_suspend(std::coroutine_handle<> h)
+					{
+						_waiter<port_stat_work> w = { h, &result };
+						exec.port_waiters[port].push_back(w);
+					}
+					const port_stat_work& await_resume() noexcept { return result; }
+				};
+
+				explicit executor(hcd& h) :
+					owner(h), wake_fd(eventfd(0, EFD_CLOEXEC)), sleeping(0), stopped(false),
+					urb_waiters(), urbs(), port_waiters(), port_events()
+				{
+					if(wake_fd == -1) throw std::exception();
+					try { owner.add_work_enqueued_callback(hcd::callback(work_enqueued, this)); }
+					catch(...)
+					{
+						::close(wake_fd);
+						throw;
+					}
+				}
+
+				~executor()
+				{
+					owner.remove_work_enqueued_callback(hcd::callback(work_enqueued, this));
+					// the frames of the coroutines still waiting go away with them
+					for(auto& q : urb_waiters)
+						for(auto& w : q.second) w.handle.destroy();
+					for(auto& q : port_waiters)
+						for(auto& w : q.second) w.handle.destroy();
+					for(auto& q : urbs)
+					{
+						for(process_urb_work* w : q.second)
+						{
+							w->get_urb()->set_status(USB_VHCI_STATUS_CANCELED);
+							owner.finish_work(w);
+						}
+					}
+					::close(wake_fd);
+				}
+
+				// the next urb for epadr on port; the coroutine owns it until
+				// it calls complete
+				urb_awaiter next_urb(uint8_t port, uint8_t epadr) noexcept { return urb_awaiter(*this, port << 8 | epadr); }
+				// the next port_stat_work of port, which is finished already
+				port_awaiter port_event(uint8_t port) { return port_awaiter(*this, port); }
+				void complete(process_urb_work* w) { owner.finish_work(w); }
+
+				// dispatches the works in the inbox and returns their number
+				size_t poll()
+				{
+					size_t n(0);
+					for(;;)
+					{
+						work* w;
+						const bool more(owner.next_work(&w));
+						if(!w) break;
+						dispatch(w);
+						n++;
+						if(!more) break;
+					}
+					return n;
+				}
+
+				// polls until stop is called
+				void run()
+				{
+					while(!stopped)
+					{
+						if(poll()) continue;
+						sleeping = 1;
+						__sync_synchronize();
+						// a work enqueued before sleeping was set is in the inbox
+						if(poll())
+						{
+							__sync_bool_compare_and_swap(&sleeping, 1, 0);
+							continue;
+						}
+						uint64_t v;
+						while(::read(wake_fd, &v, sizeof v) == -1 && errno == EINTR);
+					}
+				}
+
+				// callable from any thread
+				void stop() noexcept
+				{
+					stopped = true;
+					sleeping = 0;
+					wake();
+				}
+			};
+		}
+	}
+}
+
+#endif // _LIBUSB_VHCI_CORO_H
@@ -33,39 +33,187 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <new>
 #include "libusb_vhci.h"
 
+namespace
+{
+	uint64_t now() throw()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+	}
+
+	// poll reports a file without a poll operation as always readable,
+	// while epoll refuses it with EPERM
+	bool supports_poll(int fd) throw()
+	{
+		int ep(epoll_create1(EPOLL_CLOEXEC));
+		if(ep == -1) return false;
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;
+		bool res(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == 0);
+		close(ep);
+		return res;
+	}
+}
+
 namespace usb
 {
 	namespace vhci
 	{
-		local_hcd::local_hcd(uint8_t ports) throw(std::exception) :
+		local_hcd::local_hcd(uint8_t ports, const options& o) throw(std::exception) :
 			hcd(ports),
-			fd(-1),
+			trans(o.trans ? o.trans : new ioctl_transport()),
+			own_transport(!o.trans),
+			id(),
+			usb_bus_num(),
+			bus_id(),
+			port_info(NULL),
+			capture(NULL),
+			manager(o.mode == fetch_inline ? NULL : o.manager),
+			pool(NULL),
+			handed_over(false),
+			poll_fd(-1),
+			run_inline(o.mode == fetch_inline),
+			deferred()
+		{
+			try { init(); }
+			catch(...)
+			{
+				if(own_transport) delete trans;
+				throw;
+			}
+		}
+
+		local_hcd::local_hcd(controller_handoff& h, const options& o) throw(std::exception) :
+			hcd(h.get_port_count()),
+			trans(o.trans ? o.trans : new ioctl_transport()),
+			own_transport(!o.trans),
 			id(),
 			usb_bus_num(),
 			bus_id(),
-			port_info(NULL)
+			port_info(NULL),
+			capture(NULL),
+			manager(o.mode == fetch_inline ? NULL : o.manager),
+			pool(NULL),
+			handed_over(false),
+			poll_fd(-1),
+			run_inline(o.mode == fetch_inline),
+			deferred()
+		{
+			try { adopt(h); }
+			catch(...)
+			{
+				if(own_transport) delete trans;
+				throw;
+			}
+		}
+
+		void local_hcd::init() throw(std::exception)
 		{
 			uint8_t c = get_port_count();
 			char* _bus_id(NULL);
-			fd = usb_vhci_open(c, &id, &usb_bus_num, &_bus_id);
-			if(fd == -1) throw std::exception();
+			if(trans->open(c, &id, &usb_bus_num, &_bus_id) == -1) throw std::exception();
 			if(_bus_id)
 			{
 				bus_id.assign(_bus_id);
 				free(_bus_id);
 			}
-			if(c) port_info = new _port_info[c];
-			init_bg_thread();
+			try
+			{
+				if(c) port_info = new _port_info[c];
+				start_bg_work();
+			}
+			catch(...)
+			{
+				delete[] port_info;
+				trans->close();
+				throw;
+			}
+		}
+
+		void local_hcd::adopt(controller_handoff& h) throw(std::exception)
+		{
+			if(h.fd == -1) throw std::invalid_argument("h");
+			if(trans->adopt(h.fd) == -1) throw std::exception();
+			h.fd = -1;
+			try
+			{
+				id = h.id;
+				usb_bus_num = h.usb_bus_num;
+				bus_id = h.bus_id;
+				uint8_t c = get_port_count();
+				port_info = new _port_info[c];
+				for(uint8_t i(0); i < c; i++)
+				{
+					port_info[i].adr = h.ports[i].adr;
+					port_info[i].stat = h.ports[i].stat;
+					port_info[i].state = h.ports[i].state;
+				}
+				start_bg_work();
+			}
+			catch(...)
+			{
+				delete[] port_info;
+				port_info = NULL;
+				// the controller goes back to h
+				h.fd = trans->detach();
+				throw;
+			}
+		}
+
+		void local_hcd::start_bg_work() throw(std::exception)
+		{
+			// the application fetches with poll
+			if(run_inline) return;
+			if(manager)
+			{
+				manager->add(*this);
+				return;
+			}
+			poll_fd = trans->get_poll_fd();
+			if(poll_fd != -1 && !supports_poll(poll_fd)) poll_fd = -1;
+			// otherwise the fetch is interrupted on shutdown
+			init_bg_thread(poll_fd == -1);
+		}
+
+		void local_hcd::stop_bg_work() throw()
+		{
+			if(manager)
+			{
+				manager->remove(*this);
+				// no reactor retries it anymore, so it is queued right here
+				if(deferred.pending) process_work(0);
+			}
+			else join_bg_thread();
+		}
+
+		// keeps the state of a work process_work could not queue for lack of
+		// mem, so that the next call carries on with it
+		void local_hcd::defer_work(const usb_vhci_work& w, int res, bool captured, usb::urb* u, process_urb_work* puw) throw()
+		{
+			deferred.pending = true;
+			deferred.w = w;
+			deferred.res = res;
+			deferred.captured = captured;
+			deferred.u = u;
+			deferred.puw = puw;
 		}
 
 		local_hcd::~local_hcd() throw()
 		{
-			join_bg_thread();
-			usb_vhci_close(fd);
+			stop_bg_work();
+			// the controller belongs to another process now
+			if(!handed_over) trans->close();
+			if(own_transport) delete trans;
 			delete[] port_info;
 		}
 
@@ -88,16 +236,49 @@ namespace usb
 		}
 
 		void local_hcd::bg_work() volatile throw()
+		{
+			const int fd(const_cast<local_hcd&>(*this).poll_fd);
+			if(fd == -1)
+			{
+				// a shutdown request interrupts the fetch (see start_bg_work)
+				process_work(100);
+				return;
+			}
+			pollfd fds[2];
+			fds[0].fd = fd;
+			fds[0].events = POLLIN;
+			fds[1].fd = get_wake_fd();
+			fds[1].events = POLLIN;
+			fds[0].revents = fds[1].revents = 0;
+			if(::poll(fds, 2, 100) <= 0 || !(fds[0].revents & POLLIN)) return;
+			while(!is_thread_shutdown() && process_work(0));
+		}
+
+		bool local_hcd::process_work(int16_t timeout, bool defer) volatile throw()
 		{
 			local_hcd& _this(const_cast<local_hcd&>(*this));
+			_deferred& d(_this.deferred);
 			usb_vhci_work w;
-			int res(usb_vhci_fetch_work(_this.fd, &w));
-			if(res == -1)
+			int res;
+			bool captured(false);
+			usb::urb* u(NULL);
+			process_urb_work* puw(NULL);
+			if(d.pending)
+			{
+				// the work an earlier call could not queue comes first
+				w = d.w;
+				res = d.res;
+				captured = d.captured;
+				u = d.u;
+				puw = d.puw;
+				d.pending = false;
+			}
+			else if((res = _this.trans->fetch_work(&w, timeout)) == -1)
 			{
 				if(errno == ETIMEDOUT || errno == EINTR || errno == ENODATA)
-					return;
+					return false;
 				// TODO: debug msg
-				return;
+				return false;
 			}
 			uint8_t index;
 			switch(w.type)
@@ -113,160 +294,106 @@ namespace usb
 					break;
 				bool nomem_retry(false);
 				port_stat_work* psw(NULL);
+				_policy_actions actions;
 			retry_ps:
 				if(nomem_retry)
 				{
-					usleep(100000);
-					if(is_thread_shutdown())
+					if(defer)
+					{
+						delete psw;
+						_this.defer_work(w, res, false, NULL, NULL);
+						return false;
+					}
+					if(wait_for_shutdown(100))
 					{
 						delete psw;
-						return;
+						return true;
 					}
 				}
 				else
 				{
 					nomem_retry = true;
 				}
-				lock _(get_lock()); //  vvvv LOCKED vvvv  --  ^^^^ NOT LOCKED ^^^^
-				try
 				{
-					if(!psw) psw = new port_stat_work(index, nps, _this.port_info[index - 1].stat);
-					else
+					lock _(get_lock()); //  vvvv LOCKED vvvv  --  ^^^^ NOT LOCKED ^^^^
+					try
+					{
+						if(!psw) psw = new port_stat_work(index, nps, _this.port_info[index - 1].stat);
+						else
+						{
+							// reuse already allocated mem
+							psw->~port_stat_work();
+							new(psw) port_stat_work(index, nps, _this.port_info[index - 1].stat);
+						}
+						_this.enqueue_work(psw);
+					}
+					catch(std::bad_alloc)
 					{
-						// reuse already allocated mem
-						psw->~port_stat_work();
-						new(psw) port_stat_work(index, nps, _this.port_info[index - 1].stat);
+						// jump outside the lock and wait for others to free mem
+						goto retry_ps;
 					}
-					_this.enqueue_work(psw);
-				}
-				catch(std::bad_alloc)
-				{
-					// jump outside the lock and wait for others to free mem
-					goto retry_ps;
-				}
-				_this.port_info[index - 1].stat = nps;
-				if(nps.get_connection_changed())
-				{
-					// invalidate address on CONNECTION state change
-					_this.port_info[index - 1].adr = 0xff;
-				}
-				if(nps.get_reset_changed() && !nps.get_reset() && nps.get_enable())
-				{
-					// set address to 0 after successfull RESET
-					_this.port_info[index - 1].adr = 0x00;
-				}
-				// TODO: do we need to check for any other state changes here?
-				_this.on_work_enqueued();
+					_this.note_port_stat(index, nps);
+					_this.on_work_enqueued();
+					// psw may be gone as soon as the lock is released
+					actions = _this.plan_policy(index, *psw);
+				} //  vvvv NOT LOCKED vvvv  --  ^^^^ LOCKED ^^^^
+				// the port operations block, so they must not hold up the
+				// consumers of this controller
+				_this.apply_policy(actions);
 				break;
-			} //  vvvv NOT LOCKED vvvv  --  ^^^^ LOCKED ^^^^
+			}
 			case USB_VHCI_WORK_TYPE_PROCESS_URB:
 			{
 				bool nomem_retry(false);
-				process_urb_work* puw(NULL);
 			retry_pu:
 				if(nomem_retry)
 				{
-					usleep(100000);
-					if(is_thread_shutdown())
+					if(defer)
 					{
-						delete puw; // dtor of puw deletes the urb and the data buffers, too
-						return;
+						_this.defer_work(w, res, captured, u, puw);
+						return false;
+					}
+					if(wait_for_shutdown(100))
+					{
+						// dtor of puw deletes the urb and the data buffers, too
+						if(puw) delete puw;
+						else delete u;
+						return true;
 					}
 				}
 				else
 				{
 					nomem_retry = true;
 				}
-				if(w.work.urb.buffer_length)
+				if(!u && !(u = _this.fetch_urb(w, res, defer)))
 				{
-					do
+					if(defer && errno == ENOMEM)
 					{
-						w.work.urb.buffer = new(std::nothrow) uint8_t[w.work.urb.buffer_length];
-						if(!w.work.urb.buffer)
-						{
-							// wait for others to free mem
-							usleep(100000);
-							if(is_thread_shutdown()) return;
-						}
-					} while(!w.work.urb.buffer);
-				}
-				if(w.work.urb.packet_count)
-				{
-					do
-					{
-						w.work.urb.iso_packets = new(std::nothrow) usb_vhci_iso_packet[w.work.urb.packet_count];
-						if(!w.work.urb.iso_packets)
-						{
-							// wait for others to free mem
-							usleep(100000);
-							if(is_thread_shutdown()) return;
-						}
-					} while(!w.work.urb.iso_packets);
-				}
-				usb::urb* u(NULL);
-				while(!u)
-				{
-					if(!(u = new(std::nothrow) usb::urb(w.work.urb, true)))
-					{
-						// wait for others to free mem
-						usleep(100000);
-						if(is_thread_shutdown()) return;
-					}
-				}
-				if(res)
-				{
-					res = usb_vhci_fetch_data(fd, u->get_internal());
-					if(res == -1)
-					{
-						delete u;
-						// TODO: debug msg
-						//if(errno == ECANCELED) {} else {}
-						break;
+						_this.defer_work(w, res, captured, NULL, NULL);
+						return false;
 					}
+					break;
 				}
 				lock _(get_lock()); //  vvvv LOCKED vvvv  --  ^^^^ NOT LOCKED ^^^^
-				index = _this.port_from_address(w.work.urb.devadr);
-				// TODO: debug msg
+				uint8_t rollback_address;
+				index = _this.accept_urb(*u, &captured, &rollback_address);
 				if(!index)
 				{
-					delete puw; // dtor of puw deletes the urb and the data buffers, too
+					if(puw) delete puw;
+					else delete u;
 					break;
 				}
-				if(!puw)
-				{
-					if(!(puw = new(std::nothrow) process_urb_work(index, u)))
-					{
-						// jump outside the lock and wait for others to free mem
-						goto retry_pu;
-					}
-				}
-				else
-				{
-					// reuse already allocated mem
-					puw->~process_urb_work();
-					new(puw) process_urb_work(index, u);
-				}
-				uint8_t rollback_address(_this.port_info[index - 1].adr);
-				if(u->is_control())
+				if(!puw && !(puw = new(std::nothrow) process_urb_work(index, u)))
 				{
-					// SET_ADDRESS?
-					if(!u->get_endpoint_number() &&
-					   !u->get_bmRequestType() &&
-					   u->get_bRequest() == 5)
-					{
-						uint16_t val(u->get_wValue());
-						if(val > 0x7f)
-							u->stall();
-						else
-						{
-							u->ack();
-							_this.port_info[index - 1].adr = static_cast<uint8_t>(val);
-						}
-					}
+					// rollback changes on 'this'
+					_this.port_info[index - 1].adr = rollback_address;
+					// jump outside the lock and wait for others to free mem
+					goto retry_pu;
 				}
+				bool enqueued;
 				try
 				{
-					_this.enqueue_work(puw);
+					enqueued = _this.enqueue_work(puw);
 				}
 				catch(std::bad_alloc)
 				{
@@ -275,13 +402,305 @@ namespace usb
 					// jump outside the lock and wait for others to free mem
 					goto retry_pu;
 				}
-				_this.on_work_enqueued();
+				// an endpoint_handler may have taken it
+				if(enqueued) _this.on_work_enqueued();
 				break;
 			} //  vvvv NOT LOCKED vvvv  --  ^^^^ LOCKED ^^^^
 			case USB_VHCI_WORK_TYPE_CANCEL_URB:
 				cancel_process_urb_work(w.work.handle);
 				break;
 			}
+			return true;
+		}
+
+		bool local_hcd::poll(work_handler& hd, int16_t timeout) throw(std::exception)
+		{
+			if(!run_inline)
+			{
+				errno = EINVAL;
+				throw std::exception();
+			}
+			usb_vhci_work w;
+			int res(trans->fetch_work(&w, timeout));
+			if(res == -1)
+			{
+				if(errno == ETIMEDOUT || errno == EINTR || errno == ENODATA)
+					return false;
+				throw std::exception();
+			}
+			// nobody else fetches, so neither the inbox nor _lock is needed;
+			// the calling thread owns the port state
+			switch(w.type)
+			{
+			case USB_VHCI_WORK_TYPE_PORT_STAT:
+			{
+				const uint8_t index(w.work.port_stat.index);
+				if(!index || index > get_port_count())
+					break;
+				port_stat nps(w.work.port_stat.status,
+				              w.work.port_stat.change,
+				              w.work.port_stat.flags);
+				port_stat_work psw(index, nps, port_info[index - 1].stat);
+				note_port_stat(index, nps);
+				apply_policy(plan_policy(index, psw));
+				hd.handle(*this, psw);
+				break;
+			}
+			case USB_VHCI_WORK_TYPE_PROCESS_URB:
+			{
+				usb::urb* u(fetch_urb(w, res, false));
+				if(!u) break;
+				bool captured(false);
+				const uint8_t index(accept_urb(*u, &captured, NULL));
+				if(!index)
+				{
+					delete u;
+					break;
+				}
+				process_urb_work puw(index, u);
+				try
+				{
+					hd.handle(*this, puw);
+				}
+				catch(std::exception)
+				{
+					// the usb core would wait for the urb forever otherwise
+					u->set_status(USB_VHCI_STATUS_ERROR);
+					finishing_work(&puw);
+					throw;
+				}
+				finishing_work(&puw);
+				break;
+			}
+			case USB_VHCI_WORK_TYPE_CANCEL_URB:
+				// every urb has been given back before the next fetch
+				break;
+			}
+			return true;
+		}
+
+		// allocates the urb of w, from the pool if there is one, and fetches
+		// its data; NULL if that fails or the background thread is asked to
+		// stop while waiting for mem. With defer it does not wait for mem but
+		// fails with errno ENOMEM right away
+		usb::urb* local_hcd::fetch_urb(usb_vhci_work& w, int res, bool defer) throw()
+		{
+			usb::urb* u(NULL);
+			if(run_inline)
+			{
+				if(pool) u = pooled_urb::create(w.work.urb, *pool);
+			}
+			else
+			{
+				lock _(get_lock());
+				if(pool) u = pooled_urb::create(w.work.urb, *pool);
+			}
+			if(!u && w.work.urb.buffer_length)
+			{
+				while(!(w.work.urb.buffer = new(std::nothrow) uint8_t[w.work.urb.buffer_length]))
+				{
+					// wait for others to free mem
+					if(defer || wait_for_shutdown(100))
+					{
+						errno = ENOMEM;
+						return NULL;
+					}
+				}
+			}
+			if(!u && w.work.urb.packet_count)
+			{
+				while(!(w.work.urb.iso_packets = new(std::nothrow) usb_vhci_iso_packet[w.work.urb.packet_count]))
+				{
+					// wait for others to free mem
+					if(defer || wait_for_shutdown(100))
+					{
+						delete[] w.work.urb.buffer;
+						errno = ENOMEM;
+						return NULL;
+					}
+				}
+			}
+			while(!u)
+			{
+				if(!(u = new(std::nothrow) usb::urb(w.work.urb, true)))
+				{
+					// wait for others to free mem
+					if(defer || wait_for_shutdown(100))
+					{
+						delete[] w.work.urb.iso_packets;
+						delete[] w.work.urb.buffer;
+						errno = ENOMEM;
+						return NULL;
+					}
+				}
+			}
+			if(res && trans->fetch_data(u->get_internal()) == -1)
+			{
+				delete u;
+				// TODO: debug msg
+				//if(errno == ECANCELED) {} else {}
+				return NULL;
+			}
+			return u;
+		}
+
+		// caller has _lock, unless run_inline; captures u once and answers
+		// it if the descriptors of its port can, and takes note of a
+		// SET_ADDRESS, leaving the previous address in rollback_address if it
+		// is not NULL; returns the port of u, or 0 if u is done with (its
+		// device is gone or it has been given back already)
+		uint8_t local_hcd::accept_urb(usb::urb& u, bool* captured, uint8_t* rollback_address) throw()
+		{
+			const uint8_t index(port_from_address(u.get_device_address()));
+			// TODO: debug msg
+			if(!index) return 0;
+			if(capture && !*captured)
+			{
+				capture->submit(usb_bus_num, index, u);
+				*captured = true;
+			}
+			if(answer_locally(index, u)) return 0;
+			if(rollback_address) *rollback_address = port_info[index - 1].adr;
+			set_address(index, u);
+			return index;
+		}
+
+		// caller has _lock; acks a SET_ADDRESS request and takes over the new
+		// address of port (stalls it if the address is invalid); false if urb
+		// is no SET_ADDRESS request
+		bool local_hcd::set_address(uint8_t port, usb::urb& urb) throw()
+		{
+			if(!urb.is_control() ||
+			   urb.get_endpoint_number() ||
+			   urb.get_bmRequestType() ||
+			   urb.get_bRequest() != URB_RQ_SET_ADDRESS)
+				return false;
+			uint16_t val(urb.get_wValue());
+			if(val > 0x7f)
+				urb.stall();
+			else
+			{
+				urb.ack();
+				port_info[port - 1].adr = static_cast<uint8_t>(val);
+				note_address(port);
+			}
+			return true;
+		}
+
+		// caller has _lock
+		void local_hcd::note_port_stat(uint8_t port, const port_stat& nps) throw()
+		{
+			_port_info& pi(port_info[port - 1]);
+			pi.stat = nps;
+			if(nps.get_connection_changed())
+			{
+				// invalidate address on CONNECTION state change
+				pi.adr = 0xff;
+				pi.state.reset();
+			}
+			if(nps.get_reset_changed() && !nps.get_reset() && nps.get_enable())
+			{
+				// set address to 0 after successfull RESET
+				pi.adr = 0x00;
+				pi.state.reset();
+				if(pi.connect_time && !pi.timing.reset_done)
+					pi.timing.reset_done = now() - pi.connect_time;
+			}
+			// TODO: do we need to check for any other state changes here?
+		}
+
+		// caller has _lock
+		bool local_hcd::answer_locally(uint8_t port, usb::urb& urb) throw()
+		{
+			_port_info& pi(port_info[port - 1]);
+			if(!pi.descriptors) return false;
+			if(!set_address(port, urb))
+			{
+				if(!pi.descriptors->handle(urb, pi.state)) return false;
+				note_configuration(port, urb);
+			}
+			if(capture)
+				capture->complete(usb_bus_num, port, urb);
+			if(trans->giveback(urb.get_internal()) == -1)
+			{
+				// TODO: debug msg
+			}
+			return true;
+		}
+
+		// caller has _lock
+		local_hcd::_policy_actions local_hcd::plan_policy(uint8_t port, const port_stat_work& psw) const throw()
+		{
+			const port_policy& p(port_info[port - 1].policy);
+			const bool connected(psw.get_port_stat().get_connection());
+			_policy_actions a;
+			a.port = port;
+			a.connect = p.connect && psw.triggers_power_on();
+			a.rate = p.rate;
+			a.reset_done = p.reset && psw.triggers_reset() && connected;
+			a.enable = p.enable;
+			a.resumed = p.resume && psw.triggers_resuming() && connected;
+			return a;
+		}
+
+		// caller does not have _lock
+		void local_hcd::apply_policy(const _policy_actions& a) throw()
+		{
+			if(a.connect)
+			{
+				if(trans->port_connect(a.port, a.rate) != -1)
+				{
+					lock _(get_lock());
+					note_connect(a.port);
+				}
+				else note_policy_failure(a.port);
+			}
+			if(a.reset_done && trans->port_reset_done(a.port, a.enable) == -1)
+				note_policy_failure(a.port);
+			if(a.resumed && trans->port_resumed(a.port) == -1)
+				note_policy_failure(a.port);
+		}
+
+		// caller does not have _lock
+		void local_hcd::note_policy_failure(uint8_t port) throw()
+		{
+			const int err(errno);
+			lock _(get_lock());
+			enumeration_timing& t(port_info[port - 1].timing);
+			t.policy_failures++;
+			t.policy_errno = err;
+		}
+
+		// caller has _lock
+		void local_hcd::note_connect(uint8_t port) throw()
+		{
+			port_info[port - 1].connect_time = now();
+			port_info[port - 1].timing = enumeration_timing();
+		}
+
+		// caller has _lock
+		void local_hcd::note_address(uint8_t port) throw()
+		{
+			_port_info& pi(port_info[port - 1]);
+			if(pi.connect_time && !pi.timing.addressed)
+				pi.timing.addressed = now() - pi.connect_time;
+		}
+
+		// caller has _lock
+		void local_hcd::note_configuration(uint8_t port, const usb::urb& urb) throw()
+		{
+			_port_info& pi(port_info[port - 1]);
+			if(pi.connect_time &&
+			   !pi.timing.configured &&
+			   urb.is_control() &&
+			   !urb.get_endpoint_number() &&
+			   !urb.get_bmRequestType() &&
+			   urb.get_bRequest() == URB_RQ_SET_CONFIGURATION &&
+			   urb.get_wValue() &&
+			   urb.get_status() == USB_VHCI_STATUS_SUCCESS)
+			{
+				pi.timing.configured = now() - pi.connect_time;
+			}
 		}
 
 		// caller has _lock
@@ -308,13 +727,219 @@ namespace usb
 			if(uw)
 			{
 				const usb::urb* urb(uw->get_urb());
-				if(usb_vhci_giveback(fd, urb->get_internal()) == -1)
+				note_configuration(uw->get_port(), *urb);
+				if(capture)
+					capture->complete(usb_bus_num, uw->get_port(), *urb);
+				if(trans->giveback(urb->get_internal()) == -1)
 				{
 					// TODO: debug msg
 				}
 			}
 		}
 
+		void local_hcd::set_capture(usbmon_capture* c) volatile throw()
+		{
+			lock _(get_lock());
+			const_cast<local_hcd&>(*this).capture = c;
+		}
+
+		void local_hcd::set_buffer_pool(buffer_pool* p) volatile throw()
+		{
+			lock _(get_lock());
+			const_cast<local_hcd&>(*this).pool = p;
+		}
+
+		void local_hcd::set_port_descriptors(uint8_t port, const usb::descriptor_set* d) volatile throw(std::invalid_argument, std::out_of_range)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			lock _(get_lock());
+			const_cast<local_hcd&>(*this).port_info[port - 1].descriptors = d;
+		}
+
+		uint8_t local_hcd::get_port_configuration(uint8_t port) volatile throw(std::invalid_argument, std::out_of_range)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			lock _(get_lock());
+			return const_cast<local_hcd&>(*this).port_info[port - 1].state.configuration;
+		}
+
+		void local_hcd::set_port_policy(uint8_t port, const port_policy& p) volatile throw(std::invalid_argument, std::out_of_range)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			lock _(get_lock());
+			const_cast<local_hcd&>(*this).port_info[port - 1].policy = p;
+		}
+
+		port_policy local_hcd::get_port_policy(uint8_t port) volatile throw(std::invalid_argument, std::out_of_range)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			lock _(get_lock());
+			return const_cast<local_hcd&>(*this).port_info[port - 1].policy;
+		}
+
+		enumeration_timing local_hcd::get_enumeration_timing(uint8_t port) volatile throw(std::invalid_argument, std::out_of_range)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			lock _(get_lock());
+			return const_cast<local_hcd&>(*this).port_info[port - 1].timing;
+		}
+
+		void local_hcd::hand_over(int socket, int timeout) volatile throw(std::exception)
+		{
+			local_hcd& _this(const_cast<local_hcd&>(*this));
+			if(_this.handed_over)
+			{
+				errno = EBADF;
+				throw std::exception();
+			}
+			// nothing is fetched from here on, so the works can only get fewer
+			_this.stop_bg_work();
+			try
+			{
+				const uint64_t until(now() + static_cast<uint64_t>(timeout) * 1000000ull);
+				while(!is_idle())
+				{
+					if(timeout >= 0 && now() >= until)
+					{
+						errno = ETIMEDOUT;
+						throw std::exception();
+					}
+					usleep(1000);
+				}
+				controller_handoff h;
+				{
+					lock _(get_lock());
+					h.id = _this.id;
+					h.usb_bus_num = _this.usb_bus_num;
+					h.bus_id = _this.bus_id;
+					h.ports.resize(get_port_count());
+					for(uint8_t i(0); i < get_port_count(); i++)
+					{
+						h.ports[i].adr = _this.port_info[i].adr;
+						h.ports[i].stat = _this.port_info[i].stat;
+						h.ports[i].state = _this.port_info[i].state;
+					}
+				}
+				if((h.fd = _this.trans->detach()) == -1) throw std::exception();
+				try { h.send(socket); }
+				catch(...)
+				{
+					int err(errno);
+					if(_this.trans->adopt(h.fd) == 0) h.fd = -1;
+					errno = err;
+					throw;
+				}
+			}
+			catch(...)
+			{
+				int err(errno);
+				_this.start_bg_work();
+				errno = err;
+				throw;
+			}
+			_this.handed_over = true;
+		}
+
+		// fetches until there is nothing left, takes in the port state changes
+		// (the disconnects of reset cause some) and gives back the urbs as
+		// canceled right away; nothing is enqueued and no callback is called
+		void local_hcd::discard_works() throw()
+		{
+			usb_vhci_work w;
+			while(trans->fetch_work(&w, 0) != -1)
+			{
+				switch(w.type)
+				{
+				case USB_VHCI_WORK_TYPE_PORT_STAT:
+				{
+					const uint8_t index(w.work.port_stat.index);
+					if(!index || index > get_port_count())
+						break;
+					lock _(get_lock());
+					note_port_stat(index, port_stat(w.work.port_stat.status,
+					                                w.work.port_stat.change,
+					                                w.work.port_stat.flags));
+					break;
+				}
+				case USB_VHCI_WORK_TYPE_PROCESS_URB:
+				{
+					usb_vhci_urb& u(w.work.urb);
+					std::vector<usb_vhci_iso_packet> packets;
+					try
+					{
+						usb_vhci_iso_packet p;
+						memset(&p, 0, sizeof p);
+						p.status = USB_VHCI_STATUS_CANCELED;
+						if(u.packet_count > 0) packets.resize(u.packet_count, p);
+					}
+					catch(std::bad_alloc)
+					{
+					}
+					u.packet_count = packets.size();
+					u.buffer = NULL;
+					u.iso_packets = packets.empty() ? NULL : &packets[0];
+					u.buffer_actual = 0;
+					u.error_count = u.packet_count;
+					u.status = USB_VHCI_STATUS_CANCELED;
+					// TODO: debug msg
+					trans->giveback(&u);
+					break;
+				}
+				case USB_VHCI_WORK_TYPE_CANCEL_URB:
+					// the urb has been given back already
+					break;
+				}
+			}
+		}
+
+		void local_hcd::reset() volatile throw(std::exception)
+		{
+			local_hcd& _this(const_cast<local_hcd&>(*this));
+			_this.stop_bg_work();
+			try
+			{
+				{
+					lock _(get_lock());
+					_this.capture = NULL;
+					_this.pool = NULL;
+					for(uint8_t i(0); i < get_port_count(); i++)
+					{
+						_port_info& pi(_this.port_info[i]);
+						pi.descriptors = NULL;
+						pi.policy = port_policy();
+						pi.connect_time = 0;
+						pi.timing = enumeration_timing();
+					}
+				}
+				set_recorder(NULL);
+				for(uint8_t i(1); i <= get_port_count(); i++)
+				{
+					bool connected;
+					{
+						lock _(get_lock());
+						connected = _this.port_info[i - 1].stat.get_connection();
+					}
+					if(connected) port_disconnect(i);
+				}
+				_this.discard_works();
+				drop_works();
+				forget_consumers();
+			}
+			catch(...)
+			{
+				int err(errno);
+				_this.start_bg_work();
+				errno = err;
+				throw;
+			}
+			_this.start_bg_work();
+		}
+
 		const port_stat& local_hcd::get_port_stat(uint8_t port) volatile throw(std::invalid_argument, std::out_of_range)
 		{
 			if(!port) throw std::invalid_argument("port");
@@ -327,15 +952,17 @@ namespace usb
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
-			if(usb_vhci_port_connect(fd, port, rate) == -1)
+			if(trans->port_connect(port, rate) == -1)
 				throw std::exception();
+			lock _(get_lock());
+			const_cast<local_hcd&>(*this).note_connect(port);
 		}
 
 		void local_hcd::port_disconnect(uint8_t port) volatile throw(std::exception)
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
-			if(usb_vhci_port_disconnect(fd, port) == -1)
+			if(trans->port_disconnect(port) == -1)
 				throw std::exception();
 		}
 
@@ -343,7 +970,7 @@ namespace usb
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
-			if(usb_vhci_port_disable(fd, port) == -1)
+			if(trans->port_disable(port) == -1)
 				throw std::exception();
 		}
 
@@ -351,7 +978,7 @@ namespace usb
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
-			if(usb_vhci_port_resumed(fd, port) == -1)
+			if(trans->port_resumed(port) == -1)
 				throw std::exception();
 		}
 
@@ -359,7 +986,7 @@ namespace usb
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
-			if(usb_vhci_port_overcurrent(fd, port, set) == -1)
+			if(trans->port_overcurrent(port, set) == -1)
 				throw std::exception();
 		}
 
@@ -367,7 +994,7 @@ namespace usb
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
-			if(usb_vhci_port_reset_done(fd, port, enable) == -1)
+			if(trans->port_reset_done(port, enable) == -1)
 				throw std::exception();
 		}
 	}
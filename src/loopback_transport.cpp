@@ -0,0 +1,624 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <new>
+#include "libusb_vhci.h"
+
+namespace
+{
+	volatile int32_t next_loopback_id(0);
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		loopback_transport::loopback_transport() throw() :
+			port_count(0),
+			opened(false),
+			detached(false),
+			next_handle(1),
+			ports(NULL),
+			works(),
+			urbs(),
+			completed(),
+			_lock(),
+			work_cond(),
+			completed_cond(),
+			event_fd(-1),
+			event_set(false)
+		{
+			pthread_mutex_init(&_lock, NULL);
+			pthread_cond_init(&work_cond, NULL);
+			pthread_cond_init(&completed_cond, NULL);
+		}
+
+		loopback_transport::~loopback_transport() throw()
+		{
+			detached = false;
+			close();
+			for(std::deque<usb::urb*>::iterator i(completed.begin()); i < completed.end(); i++)
+				delete *i;
+			pthread_cond_destroy(&completed_cond);
+			pthread_cond_destroy(&work_cond);
+			pthread_mutex_destroy(&_lock);
+		}
+
+		// caller has _lock
+		bool loopback_transport::wait(pthread_cond_t& cond, pthread_mutex_t& mutex, int timeout) throw()
+		{
+			if(!timeout) return false;
+			if(timeout < 0)
+			{
+				pthread_cond_wait(&cond, &mutex);
+				return true;
+			}
+			timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += timeout / 1000;
+			ts.tv_nsec += (timeout % 1000) * 1000000;
+			if(ts.tv_nsec >= 1000000000)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			return pthread_cond_timedwait(&cond, &mutex, &ts) == 0;
+		}
+
+		// caller has _lock
+		void loopback_transport::sync_work_event() throw()
+		{
+			if(event_fd == -1 || event_set == !works.empty()) return;
+			uint64_t v(1);
+			if(event_set)
+				while(read(event_fd, &v, sizeof v) == -1 && errno == EINTR);
+			else
+				while(write(event_fd, &v, sizeof v) == -1 && errno == EINTR);
+			event_set = !event_set;
+		}
+
+		// caller has _lock
+		void loopback_transport::update_port(uint8_t port, uint16_t status, uint16_t change, uint8_t flags) throw()
+		{
+			usb_vhci_port_stat& ps(ports[port - 1]);
+			ps.status = status;
+			ps.change = change;
+			ps.flags = flags;
+			usb_vhci_work w;
+			memset(&w, 0, sizeof w);
+			w.type = USB_VHCI_WORK_TYPE_PORT_STAT;
+			w.work.port_stat = ps;
+			try { works.push_back(w); }
+			catch(std::bad_alloc) { return; }
+			sync_work_event();
+			pthread_cond_signal(&work_cond);
+		}
+
+		// caller has _lock
+		void loopback_transport::complete(std::map<uint64_t, _urb>::iterator i, int32_t status) throw()
+		{
+			usb::urb* u(i->second.urb);
+			u->set_status(status);
+			urbs.erase(i);
+			try { completed.push_back(u); }
+			catch(std::bad_alloc)
+			{
+				delete u;
+				return;
+			}
+			pthread_cond_broadcast(&completed_cond);
+		}
+
+		int loopback_transport::open(uint8_t port_count, int32_t* id, int32_t* usb_busnum, char** bus_id) throw()
+		{
+			lock _(_lock);
+			if(opened)
+			{
+				errno = EBUSY;
+				return -1;
+			}
+			if(!(ports = new(std::nothrow) usb_vhci_port_stat[port_count]))
+			{
+				errno = ENOMEM;
+				return -1;
+			}
+			if((event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+			{
+				int err(errno);
+				delete[] ports;
+				ports = NULL;
+				errno = err;
+				return -1;
+			}
+			memset(ports, 0, port_count * sizeof *ports);
+			for(uint8_t i(0); i < port_count; i++)
+				ports[i].index = i + 1;
+			this->port_count = port_count;
+			opened = true;
+			int32_t i(__sync_fetch_and_add(&next_loopback_id, 1));
+			if(id) *id = i;
+			if(usb_busnum) *usb_busnum = 0;
+			if(bus_id)
+			{
+				if((*bus_id = reinterpret_cast<char*>(malloc(24))))
+					snprintf(*bus_id, 24, "loopback.%d", i);
+			}
+			return 0;
+		}
+
+		int loopback_transport::close() throw()
+		{
+			lock _(_lock);
+			if(!opened || detached) return 0;
+			opened = false;
+			while(!urbs.empty())
+				complete(urbs.begin(), USB_VHCI_STATUS_DEVICE_DISCONNECTED);
+			works.clear();
+			::close(event_fd);
+			event_fd = -1;
+			event_set = false;
+			delete[] ports;
+			ports = NULL;
+			port_count = 0;
+			pthread_cond_broadcast(&work_cond);
+			return 0;
+		}
+
+		int loopback_transport::fetch_work(usb_vhci_work* work, int16_t timeout) throw()
+		{
+			lock _(_lock);
+			while(works.empty())
+			{
+				if(!opened)
+				{
+					errno = ENODEV;
+					return -1;
+				}
+				if(!wait(work_cond, _lock, timeout) && works.empty())
+				{
+					errno = ETIMEDOUT;
+					return -1;
+				}
+			}
+			*work = works.front();
+			works.pop_front();
+			sync_work_event();
+			if(work->type != USB_VHCI_WORK_TYPE_PROCESS_URB)
+				return 0;
+			std::map<uint64_t, _urb>::iterator i(urbs.find(work->work.urb.handle));
+			if(i != urbs.end()) i->second.fetched = true;
+			// return 1 if fetch_data should be called
+			return work->work.urb.buffer_actual || work->work.urb.packet_count;
+		}
+
+		int loopback_transport::fetch_data(const usb_vhci_urb* urb) throw()
+		{
+			lock _(_lock);
+			std::map<uint64_t, _urb>::iterator i(urbs.find(urb->handle));
+			if(i == urbs.end())
+			{
+				errno = ECANCELED;
+				return -1;
+			}
+			const usb::urb& src(*i->second.urb);
+			if(urb->buffer && src.get_buffer())
+				memcpy(urb->buffer, src.get_buffer(), std::min(urb->buffer_length, src.get_buffer_length()));
+			for(int32_t p(0); p < urb->packet_count && p < src.get_iso_packet_count(); p++)
+			{
+				urb->iso_packets[p].offset = src.get_iso_packet_offset(p);
+				urb->iso_packets[p].packet_length = src.get_iso_packet_length(p);
+				urb->iso_packets[p].packet_actual = 0;
+				urb->iso_packets[p].status = USB_VHCI_STATUS_PENDING;
+			}
+			return 0;
+		}
+
+		int loopback_transport::giveback(const usb_vhci_urb* urb) throw()
+		{
+			lock _(_lock);
+			std::map<uint64_t, _urb>::iterator i(urbs.find(urb->handle));
+			// already canceled; usb_vhci_giveback ignores ECANCELED, too
+			if(i == urbs.end()) return 0;
+			usb::urb& dst(*i->second.urb);
+			const bool iso(usb_vhci_is_iso(urb->type));
+			int32_t actual(std::min(urb->buffer_actual, dst.get_buffer_length()));
+			dst.set_buffer_actual(actual);
+			if(usb_vhci_is_in(urb->epadr) && actual > 0 && urb->buffer)
+				memcpy(dst.get_buffer(), urb->buffer, actual);
+			if(iso)
+			{
+				dst.set_iso_error_count(urb->error_count);
+				for(int32_t p(0); p < urb->packet_count && p < dst.get_iso_packet_count(); p++)
+				{
+					dst.set_iso_packet_actual(p, urb->iso_packets[p].packet_actual);
+					dst.set_iso_status(p, usb_vhci_from_iso_packets_errno(
+						usb_vhci_to_iso_packets_errno(urb->iso_packets[p].status)));
+				}
+			}
+			// the kernel only passes errno values, so status codes get translated
+			// back and forth like on the real path
+			complete(i, usb_vhci_from_errno(usb_vhci_to_errno(urb->status, iso), iso));
+			errno = 0;
+			return 0;
+		}
+
+		int loopback_transport::port_connect(uint8_t port, uint8_t data_rate) throw()
+		{
+			lock _(_lock);
+			if(!port || port > port_count ||
+			   (data_rate != USB_VHCI_DATA_RATE_FULL &&
+			    data_rate != USB_VHCI_DATA_RATE_LOW &&
+			    data_rate != USB_VHCI_DATA_RATE_HIGH))
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			const usb_vhci_port_stat& ps(ports[port - 1]);
+			uint16_t status((ps.status & ~(USB_VHCI_PORT_STAT_LOW_SPEED | USB_VHCI_PORT_STAT_HIGH_SPEED)) |
+			                USB_VHCI_PORT_STAT_CONNECTION);
+			if(data_rate == USB_VHCI_DATA_RATE_LOW)  status |= USB_VHCI_PORT_STAT_LOW_SPEED;
+			if(data_rate == USB_VHCI_DATA_RATE_HIGH) status |= USB_VHCI_PORT_STAT_HIGH_SPEED;
+			update_port(port, status, ps.change | USB_VHCI_PORT_STAT_C_CONNECTION, ps.flags);
+			return 0;
+		}
+
+		int loopback_transport::port_disconnect(uint8_t port) throw()
+		{
+			lock _(_lock);
+			if(!port || port > port_count)
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			const usb_vhci_port_stat& ps(ports[port - 1]);
+			update_port(port,
+			            ps.status & (USB_VHCI_PORT_STAT_POWER | USB_VHCI_PORT_STAT_OVERCURRENT),
+			            ps.change | USB_VHCI_PORT_STAT_C_CONNECTION,
+			            0);
+			return 0;
+		}
+
+		int loopback_transport::port_disable(uint8_t port) throw()
+		{
+			lock _(_lock);
+			if(!port || port > port_count)
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			const usb_vhci_port_stat& ps(ports[port - 1]);
+			update_port(port,
+			            ps.status & ~USB_VHCI_PORT_STAT_ENABLE,
+			            ps.change | USB_VHCI_PORT_STAT_C_ENABLE,
+			            ps.flags);
+			return 0;
+		}
+
+		int loopback_transport::port_resumed(uint8_t port) throw()
+		{
+			lock _(_lock);
+			if(!port || port > port_count)
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			const usb_vhci_port_stat& ps(ports[port - 1]);
+			update_port(port,
+			            ps.status & ~USB_VHCI_PORT_STAT_SUSPEND,
+			            ps.change | USB_VHCI_PORT_STAT_C_SUSPEND,
+			            ps.flags & ~USB_VHCI_PORT_STAT_FLAG_RESUMING);
+			return 0;
+		}
+
+		int loopback_transport::port_overcurrent(uint8_t port, uint8_t set) throw()
+		{
+			lock _(_lock);
+			if(!port || port > port_count)
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			const usb_vhci_port_stat& ps(ports[port - 1]);
+			update_port(port,
+			            set ? ps.status | USB_VHCI_PORT_STAT_OVERCURRENT :
+			                  ps.status & ~USB_VHCI_PORT_STAT_OVERCURRENT,
+			            ps.change | USB_VHCI_PORT_STAT_C_OVERCURRENT,
+			            ps.flags);
+			return 0;
+		}
+
+		int loopback_transport::port_reset_done(uint8_t port, uint8_t enable) throw()
+		{
+			lock _(_lock);
+			if(!port || port > port_count)
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			const usb_vhci_port_stat& ps(ports[port - 1]);
+			uint16_t status(ps.status & ~USB_VHCI_PORT_STAT_RESET);
+			uint16_t change(ps.change | USB_VHCI_PORT_STAT_C_RESET);
+			if(enable) status |= USB_VHCI_PORT_STAT_ENABLE;
+			else
+			{
+				status &= ~USB_VHCI_PORT_STAT_ENABLE;
+				change |= USB_VHCI_PORT_STAT_C_ENABLE;
+			}
+			update_port(port, status, change, ps.flags);
+			return 0;
+		}
+
+		usb_vhci_port_stat loopback_transport::get_port_stat(uint8_t port) volatile throw(std::invalid_argument, std::out_of_range)
+		{
+			loopback_transport& _this(const_cast<loopback_transport&>(*this));
+			lock _(_this._lock);
+			if(!port) throw std::invalid_argument("port");
+			if(port > _this.port_count) throw std::out_of_range("port");
+			return _this.ports[port - 1];
+		}
+
+		void loopback_transport::power_on(uint8_t port) volatile throw(std::exception)
+		{
+			loopback_transport& _this(const_cast<loopback_transport&>(*this));
+			lock _(_this._lock);
+			if(!port) throw std::invalid_argument("port");
+			if(port > _this.port_count) throw std::out_of_range("port");
+			const usb_vhci_port_stat& ps(_this.ports[port - 1]);
+			_this.update_port(port, ps.status | USB_VHCI_PORT_STAT_POWER, ps.change, ps.flags);
+		}
+
+		void loopback_transport::power_off(uint8_t port) volatile throw(std::exception)
+		{
+			loopback_transport& _this(const_cast<loopback_transport&>(*this));
+			lock _(_this._lock);
+			if(!port) throw std::invalid_argument("port");
+			if(port > _this.port_count) throw std::out_of_range("port");
+			const usb_vhci_port_stat& ps(_this.ports[port - 1]);
+			_this.update_port(port,
+			                  ps.status & ~(USB_VHCI_PORT_STAT_POWER |
+			                                USB_VHCI_PORT_STAT_ENABLE |
+			                                USB_VHCI_PORT_STAT_SUSPEND |
+			                                USB_VHCI_PORT_STAT_RESET),
+			                  ps.change,
+			                  0);
+		}
+
+		void loopback_transport::reset(uint8_t port) volatile throw(std::exception)
+		{
+			loopback_transport& _this(const_cast<loopback_transport&>(*this));
+			lock _(_this._lock);
+			if(!port) throw std::invalid_argument("port");
+			if(port > _this.port_count) throw std::out_of_range("port");
+			const usb_vhci_port_stat& ps(_this.ports[port - 1]);
+			_this.update_port(port,
+			                  (ps.status & ~(USB_VHCI_PORT_STAT_ENABLE | USB_VHCI_PORT_STAT_SUSPEND)) |
+			                  USB_VHCI_PORT_STAT_RESET,
+			                  0,
+			                  0);
+		}
+
+		void loopback_transport::suspend(uint8_t port) volatile throw(std::exception)
+		{
+			loopback_transport& _this(const_cast<loopback_transport&>(*this));
+			lock _(_this._lock);
+			if(!port) throw std::invalid_argument("port");
+			if(port > _this.port_count) throw std::out_of_range("port");
+			const usb_vhci_port_stat& ps(_this.ports[port - 1]);
+			_this.update_port(port, ps.status | USB_VHCI_PORT_STAT_SUSPEND, ps.change, ps.flags);
+		}
+
+		void loopback_transport::resume(uint8_t port) volatile throw(std::exception)
+		{
+			loopback_transport& _this(const_cast<loopback_transport&>(*this));
+			lock _(_this._lock);
+			if(!port) throw std::invalid_argument("port");
+			if(port > _this.port_count) throw std::out_of_range("port");
+			const usb_vhci_port_stat& ps(_this.ports[port - 1]);
+			_this.update_port(port, ps.status, ps.change, ps.flags | USB_VHCI_PORT_STAT_FLAG_RESUMING);
+		}
+
+		void loopback_transport::disable(uint8_t port) volatile throw(std::exception)
+		{
+			loopback_transport& _this(const_cast<loopback_transport&>(*this));
+			lock _(_this._lock);
+			if(!port) throw std::invalid_argument("port");
+			if(port > _this.port_count) throw std::out_of_range("port");
+			const usb_vhci_port_stat& ps(_this.ports[port - 1]);
+			_this.update_port(port, ps.status & ~USB_VHCI_PORT_STAT_ENABLE, ps.change, ps.flags);
+		}
+
+		void loopback_transport::clear_port_change(uint8_t port, uint16_t change) volatile throw(std::exception)
+		{
+			loopback_transport& _this(const_cast<loopback_transport&>(*this));
+			lock _(_this._lock);
+			if(!port) throw std::invalid_argument("port");
+			if(port > _this.port_count) throw std::out_of_range("port");
+			const usb_vhci_port_stat& ps(_this.ports[port - 1]);
+			_this.update_port(port, ps.status, ps.change & ~change, ps.flags);
+		}
+
+		uint64_t loopback_transport::submit(const usb::urb& urb) volatile throw(std::exception)
+		{
+			loopback_transport& _this(const_cast<loopback_transport&>(*this));
+			lock _(_this._lock);
+			if(!_this.opened) throw std::logic_error("not opened");
+			usb_vhci_urb u(*urb.get_internal());
+			u.handle = _this.next_handle;
+			u.status = USB_VHCI_STATUS_PENDING;
+
+			// same conversion as usb_vhci_fetch_work_timeout does
+			usb_vhci_work w;
+			memset(&w, 0, sizeof w);
+			w.type = USB_VHCI_WORK_TYPE_PROCESS_URB;
+			usb_vhci_urb& wu(w.work.urb);
+			switch(u.type)
+			{
+			case USB_VHCI_URB_TYPE_ISO:
+				wu.packet_count  = u.packet_count;
+			case USB_VHCI_URB_TYPE_INT:
+				wu.interval      = u.interval;
+				break;
+			case USB_VHCI_URB_TYPE_CONTROL:
+				wu.wValue        = u.wValue;
+				wu.wIndex        = u.wIndex;
+				wu.wLength       = u.wLength;
+				wu.bmRequestType = u.bmRequestType;
+				wu.bRequest      = u.bRequest;
+				break;
+			case USB_VHCI_URB_TYPE_BULK:
+				wu.flags         = u.flags & (USB_VHCI_URB_FLAGS_SHORT_NOT_OK | USB_VHCI_URB_FLAGS_ZERO_PACKET);
+				break;
+			default:
+				throw std::invalid_argument("urb");
+			}
+			wu.type          = u.type;
+			wu.status        = USB_VHCI_STATUS_PENDING;
+			wu.handle        = u.handle;
+			wu.buffer_length = u.buffer_length;
+			if(usb_vhci_is_out(u.epadr) || usb_vhci_is_iso(u.type))
+				wu.buffer_actual = u.buffer_length;
+			wu.devadr        = u.devadr;
+			wu.epadr         = u.epadr;
+
+			_urb e;
+			e.urb = new usb::urb(u);
+			e.fetched = false;
+			try
+			{
+				_this.urbs.insert(std::make_pair(u.handle, e));
+				try { _this.works.push_back(w); }
+				catch(...)
+				{
+					_this.urbs.erase(u.handle);
+					throw;
+				}
+			}
+			catch(...)
+			{
+				delete e.urb;
+				throw;
+			}
+			_this.next_handle++;
+			_this.sync_work_event();
+			pthread_cond_signal(&_this.work_cond);
+			return u.handle;
+		}
+
+		bool loopback_transport::cancel(uint64_t handle) volatile throw()
+		{
+			loopback_transport& _this(const_cast<loopback_transport&>(*this));
+			lock _(_this._lock);
+			std::map<uint64_t, _urb>::iterator i(_this.urbs.find(handle));
+			if(i == _this.urbs.end()) return false;
+			if(!i->second.fetched)
+			{
+				for(std::deque<usb_vhci_work>::iterator w(_this.works.begin()); w < _this.works.end(); w++)
+				{
+					if(w->type == USB_VHCI_WORK_TYPE_PROCESS_URB && w->work.urb.handle == handle)
+					{
+						_this.works.erase(w);
+						_this.sync_work_event();
+						break;
+					}
+				}
+			}
+			else
+			{
+				usb_vhci_work w;
+				memset(&w, 0, sizeof w);
+				w.type = USB_VHCI_WORK_TYPE_CANCEL_URB;
+				w.work.handle = handle;
+				try { _this.works.push_back(w); }
+				catch(std::bad_alloc) { return false; }
+				_this.sync_work_event();
+				pthread_cond_signal(&_this.work_cond);
+			}
+			_this.complete(i, USB_VHCI_STATUS_CANCELED);
+			return true;
+		}
+
+		int loopback_transport::get_poll_fd() throw()
+		{
+			lock _(_lock);
+			return event_fd;
+		}
+
+		int loopback_transport::detach() throw()
+		{
+			lock _(_lock);
+			if(!opened || detached)
+			{
+				errno = EBADF;
+				return -1;
+			}
+			int fd(fcntl(event_fd, F_DUPFD_CLOEXEC, 0));
+			if(fd == -1) return -1;
+			detached = true;
+			return fd;
+		}
+
+		int loopback_transport::adopt(int fd) throw()
+		{
+			lock _(_lock);
+			if(!opened || !detached)
+			{
+				errno = EBADF;
+				return -1;
+			}
+			::close(fd);
+			detached = false;
+			return 0;
+		}
+
+		bool loopback_transport::reap(usb::urb** urb, int timeout) volatile throw()
+		{
+			loopback_transport& _this(const_cast<loopback_transport&>(*this));
+			lock _(_this._lock);
+			*urb = NULL;
+			while(_this.completed.empty())
+				if(!wait(_this.completed_cond, _this._lock, timeout) && _this.completed.empty())
+					return false;
+			*urb = _this.completed.front();
+			_this.completed.pop_front();
+			return true;
+		}
+	}
+}
@@ -0,0 +1,867 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <algorithm>
+#include "libusb_vhci.h"
+#include "remote_protocol.h"
+
+namespace
+{
+	// writes all of iov (which is modified) to the blocking socket fd
+	bool send_all(int fd, iovec* iov, int n) throw()
+	{
+		while(n)
+		{
+			if(!iov->iov_len)
+			{
+				iov++;
+				n--;
+				continue;
+			}
+			msghdr m;
+			memset(&m, 0, sizeof m);
+			m.msg_iov = iov;
+			m.msg_iovlen = n;
+			ssize_t r(sendmsg(fd, &m, MSG_NOSIGNAL));
+			if(r == -1)
+			{
+				if(errno == EINTR) continue;
+				return false;
+			}
+			while(n && static_cast<size_t>(r) >= iov->iov_len)
+			{
+				r -= iov->iov_len;
+				iov++;
+				n--;
+			}
+			if(n)
+			{
+				iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + r;
+				iov->iov_len -= r;
+			}
+		}
+		return true;
+	}
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		remote_hcd::remote_hcd(int fd) throw(std::exception) :
+			hcd(read_hello(fd)),
+			fd(fd),
+			wake_fd(-1),
+			wake_pending(0),
+			stats(NULL),
+			addresses(NULL),
+			in(),
+			givebacks(),
+			ops(),
+			send_lock(),
+			op_lock(),
+			op_cond(),
+			op_busy(false),
+			op_done(false),
+			op_error(0),
+			connected(true),
+			region(NULL),
+			work_fd(-1),
+			completion_fd(-1)
+		{
+			pthread_mutex_init(&send_lock, NULL);
+			pthread_mutex_init(&op_lock, NULL);
+			pthread_cond_init(&op_cond, NULL);
+			try
+			{
+				stats = new port_stat[get_port_count()];
+				addresses = new uint8_t[get_port_count()];
+				memset(addresses, 0xff, get_port_count());
+				if((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+					throw std::exception();
+				attach();
+				init_bg_thread();
+			}
+			catch(...)
+			{
+				if(completion_fd != -1) close(completion_fd);
+				if(work_fd != -1) close(work_fd);
+				delete region;
+				if(wake_fd != -1) close(wake_fd);
+				close(fd);
+				delete[] addresses;
+				delete[] stats;
+				pthread_cond_destroy(&op_cond);
+				pthread_mutex_destroy(&op_lock);
+				pthread_mutex_destroy(&send_lock);
+				throw;
+			}
+		}
+
+		remote_hcd::~remote_hcd() throw()
+		{
+			join_bg_thread();
+			if(region)
+			{
+				close(work_fd);
+				close(completion_fd);
+			}
+			// the urbs still in the inbox only borrow their buffers from the
+			// mapping, so it can go before them
+			delete region;
+			close(wake_fd);
+			close(fd);
+			delete[] addresses;
+			delete[] stats;
+			pthread_cond_destroy(&op_cond);
+			pthread_mutex_destroy(&op_lock);
+			pthread_mutex_destroy(&send_lock);
+		}
+
+		int remote_hcd::connect(const char* path) throw(std::exception)
+		{
+			sockaddr_un sa;
+			memset(&sa, 0, sizeof sa);
+			sa.sun_family = AF_UNIX;
+			if(!path || strlen(path) >= sizeof sa.sun_path) throw std::invalid_argument("path");
+			strcpy(sa.sun_path, path);
+			int fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+			if(fd == -1) throw std::exception();
+			if(::connect(fd, reinterpret_cast<sockaddr*>(&sa), sizeof sa) == -1)
+			{
+				const int e(errno);
+				close(fd);
+				errno = e;
+				throw std::exception();
+			}
+			return fd;
+		}
+
+		// closes fd if the server does not introduce itself properly
+		uint8_t remote_hcd::read_hello(int fd) throw(std::exception)
+		{
+			struct
+			{
+				remote::frame_header h;
+				remote::hello hello;
+			} f;
+			ssize_t n;
+			do n = recv(fd, &f, sizeof f, MSG_WAITALL);
+			while(n == -1 && errno == EINTR);
+			if(n != static_cast<ssize_t>(sizeof f) ||
+			   f.h.type != REMOTE_FRAME_HELLO ||
+			   f.h.size != sizeof f.hello ||
+			   f.hello.version != REMOTE_PROTOCOL_VERSION ||
+			   !f.hello.port_count)
+			{
+				close(fd);
+				if(n >= 0) errno = EPROTO;
+				throw std::exception();
+			}
+			return f.hello.port_count;
+		}
+
+		// tells the server that works can be sent, and maps its shared
+		// memory if it has some
+		void remote_hcd::attach() throw(std::exception)
+		{
+			remote::frame_header h;
+			memset(&h, 0, sizeof h);
+			h.type = REMOTE_FRAME_ATTACH;
+			iovec iov;
+			iov.iov_base = &h;
+			iov.iov_len = sizeof h;
+			if(!send_all(fd, &iov, 1)) throw std::exception();
+			struct
+			{
+				remote::frame_header h;
+				remote::attached a;
+			} f;
+			iov.iov_base = &f;
+			iov.iov_len = sizeof f;
+			union
+			{
+				cmsghdr c;
+				uint8_t buf[CMSG_SPACE(3 * sizeof(int))];
+			} control;
+			msghdr m;
+			memset(&m, 0, sizeof m);
+			m.msg_iov = &iov;
+			m.msg_iovlen = 1;
+			m.msg_control = control.buf;
+			m.msg_controllen = sizeof control.buf;
+			ssize_t n;
+			do n = recvmsg(fd, &m, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+			while(n == -1 && errno == EINTR);
+			if(n == -1) throw std::exception();
+			int fds[3] = { -1, -1, -1 };
+			for(cmsghdr* c(CMSG_FIRSTHDR(&m)); c; c = CMSG_NXTHDR(&m, c))
+				if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof fds))
+					memcpy(fds, CMSG_DATA(c), sizeof fds);
+			const bool shared(n == static_cast<ssize_t>(sizeof f) &&
+			                  f.h.type == REMOTE_FRAME_ATTACHED &&
+			                  f.h.size == sizeof f.a &&
+			                  (f.a.flags & REMOTE_ATTACHED_SHARED));
+			if(n != static_cast<ssize_t>(sizeof f) ||
+			   f.h.type != REMOTE_FRAME_ATTACHED ||
+			   f.h.size != sizeof f.a ||
+			   (shared && (fds[0] == -1 || (m.msg_flags & MSG_CTRUNC))))
+			{
+				for(int i(0); i < 3; i++)
+					if(fds[i] != -1) close(fds[i]);
+				errno = EPROTO;
+				throw std::exception();
+			}
+			if(!shared)
+			{
+				for(int i(0); i < 3; i++)
+					if(fds[i] != -1) close(fds[i]);
+				return;
+			}
+			work_fd = fds[1];
+			completion_fd = fds[2];
+			region = new shared_region(fds[0]);
+			const remote::shm_header& sh(*reinterpret_cast<const remote::shm_header*>(region->get_base()));
+			if(region->get_size() < remote::shm_reserved() ||
+			   sh.magic != REMOTE_SHM_MAGIC ||
+			   sh.entries != REMOTE_SHM_ENTRIES ||
+			   !region->contains(region->get_base() + sh.work_offset, REMOTE_SHM_ENTRIES * sizeof(remote::shm_work)) ||
+			   !region->contains(region->get_base() + sh.completion_offset, REMOTE_SHM_ENTRIES * sizeof(remote::shm_completion)))
+			{
+				errno = EPROTO;
+				throw std::exception();
+			}
+		}
+
+		void remote_hcd::wake() throw()
+		{
+			if(__sync_bool_compare_and_swap(&wake_pending, 0, 1))
+			{
+				uint64_t v(1);
+				while(write(wake_fd, &v, sizeof v) == -1 && errno == EINTR);
+			}
+		}
+
+		uint8_t remote_hcd::address_from_port(uint8_t port) const throw(std::invalid_argument, std::out_of_range)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			return addresses[port - 1];
+		}
+
+		// caller has _lock
+		uint8_t remote_hcd::port_from_address(uint8_t address) const throw(std::invalid_argument)
+		{
+			if(address > 0x7f) throw std::invalid_argument("address");
+			for(uint8_t i(0); i < get_port_count(); i++)
+				if(addresses[i] == address)
+					return i + 1;
+			return 0;
+		}
+
+		void remote_hcd::bg_work() volatile throw()
+		{
+			remote_hcd& _this(const_cast<remote_hcd&>(*this));
+			pollfd fds[4];
+			fds[0].fd = wake_fd;
+			fds[0].events = POLLIN;
+			fds[1].fd = fd;
+			fds[1].events = POLLIN;
+			fds[2].fd = work_fd;
+			fds[2].events = POLLIN;
+			fds[3].fd = get_wake_fd();
+			fds[3].events = POLLIN;
+			fds[0].revents = fds[1].revents = fds[2].revents = fds[3].revents = 0;
+			// the shutdown descriptor goes into the slot the unused ones leave
+			const nfds_t n(connected ? (region ? 3 : 2) : 1);
+			fds[n] = fds[3];
+			if(poll(fds, n + 1, 100) == -1) return;
+			if(is_thread_shutdown()) return;
+			if(fds[0].revents & POLLIN)
+			{
+				uint64_t v;
+				while(read(wake_fd, &v, sizeof v) == -1 && errno == EINTR);
+				wake_pending = 0;
+				__sync_synchronize();
+			}
+			if(!connected) return;
+			if(fds[2].revents & POLLIN)
+			{
+				uint64_t v;
+				while(read(work_fd, &v, sizeof v) == -1 && errno == EINTR);
+				_this.take_works();
+			}
+			if(!_this.flush() || ((fds[1].revents & (POLLIN | POLLHUP | POLLERR)) && !_this.receive()))
+			{
+				// the server is gone: every device is unplugged
+				connected = false;
+				::shutdown(fd, SHUT_RDWR);
+				_this.finish_op(ENOTCONN);
+				lock _(get_lock());
+				bool enqueued(false);
+				for(uint8_t port(1); port <= get_port_count(); port++)
+				{
+					const port_stat prev(_this.stats[port - 1]);
+					if(!prev.get_connection()) continue;
+					port_stat nps(prev);
+					nps.set_connection(false);
+					nps.set_enable(false);
+					nps.set_connection_changed(true);
+					try
+					{
+						port_stat_work* psw(new port_stat_work(port, nps, prev));
+						if(!_this.enqueue_work(psw)) continue;
+						enqueued = true;
+					}
+					catch(std::bad_alloc)
+					{
+						// TODO: debug msg
+					}
+					_this.stats[port - 1] = nps;
+					_this.addresses[port - 1] = 0xff;
+				}
+				if(enqueued) _this.on_work_enqueued();
+			}
+		}
+
+		// sends the pending givebacks and port ops; false if the connection is broken
+		bool remote_hcd::flush() throw()
+		{
+			std::vector<uint8_t> g, o;
+			{
+				lock _(send_lock);
+				g.swap(givebacks);
+				o.swap(ops);
+			}
+			if(g.empty() && o.empty()) return true;
+			remote::frame_header h;
+			memset(&h, 0, sizeof h);
+			h.size = g.size();
+			h.type = REMOTE_FRAME_GIVEBACKS;
+			iovec iov[3];
+			iov[0].iov_base = &h;
+			iov[0].iov_len = g.empty() ? 0 : sizeof h;
+			iov[1].iov_base = g.empty() ? NULL : &g[0];
+			iov[1].iov_len = g.size();
+			iov[2].iov_base = o.empty() ? NULL : &o[0];
+			iov[2].iov_len = o.size();
+			if(!send_all(fd, iov, 3)) return false;
+			// keep the capacity for the next batch
+			lock _(send_lock);
+			if(givebacks.empty())
+			{
+				g.clear();
+				givebacks.swap(g);
+			}
+			return true;
+		}
+
+		// reads what is there and processes all complete frames; false if
+		// the connection is broken or the server violated the protocol
+		bool remote_hcd::receive() throw()
+		{
+			const size_t chunk(65536);
+			for(;;)
+			{
+				const size_t have(in.size());
+				try { in.resize(have + chunk); }
+				catch(std::bad_alloc) { return false; }
+				ssize_t n(recv(fd, &in[have], chunk, MSG_DONTWAIT));
+				if(n <= 0)
+				{
+					in.resize(have);
+					if(!n) return false;
+					if(errno == EINTR) continue;
+					if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+					return false;
+				}
+				in.resize(have + n);
+				if(static_cast<size_t>(n) < chunk) break;
+			}
+			size_t pos(0);
+			remote::frame_header h;
+			const uint8_t* body;
+			while(remote::next(in.empty() ? NULL : &in[0], in.size(), &pos, &h, &body))
+			{
+				switch(h.type)
+				{
+				case REMOTE_FRAME_WORKS:
+					dispatch_works(body, h.size);
+					break;
+				case REMOTE_FRAME_PORT_RESULT:
+				{
+					remote::port_result r;
+					if(h.size < sizeof r) return false;
+					memcpy(&r, body, sizeof r);
+					finish_op(r.error);
+					break;
+				}
+				default:
+					return false;
+				}
+			}
+			if(in.size() - pos >= sizeof h)
+			{
+				memcpy(&h, &in[pos], sizeof h);
+				if(h.size > REMOTE_FRAME_MAX) return false;
+			}
+			in.erase(in.begin(), in.begin() + pos);
+			return true;
+		}
+
+		void remote_hcd::dispatch_works(const uint8_t* body, size_t size) throw()
+		{
+			std::vector<uint64_t> cancels;
+			size_t pos(0);
+			remote::entry_header eh;
+			const uint8_t* entry;
+			bool enqueued(false);
+			{
+				lock _(get_lock());
+				while(remote::next(body, size, &pos, &eh, &entry))
+				{
+					if(!eh.port || eh.port > get_port_count()) continue;
+					try
+					{
+						switch(eh.kind)
+						{
+						case REMOTE_WORK_PORT_STAT:
+						{
+							remote::port_stat_entry e;
+							if(eh.size < sizeof e) break;
+							memcpy(&e, entry, sizeof e);
+							if(enqueue_port_stat(eh.port, port_stat(e.status, e.change, e.flags)))
+								enqueued = true;
+							break;
+						}
+						case REMOTE_WORK_URB:
+							enqueue_urb(eh.port, entry, eh.size);
+							enqueued = true;
+							break;
+						case REMOTE_WORK_CANCEL:
+						{
+							remote::cancel_entry e;
+							if(eh.size < sizeof e) break;
+							memcpy(&e, entry, sizeof e);
+							// cancel_process_urb_work takes the lock itself
+							cancels.push_back(e.handle);
+							break;
+						}
+						}
+					}
+					catch(std::exception)
+					{
+						// TODO: debug msg
+					}
+				}
+				if(enqueued) on_work_enqueued();
+			}
+			for(std::vector<uint64_t>::const_iterator i(cancels.begin()); i != cancels.end(); i++)
+			{
+				try { cancel_process_urb_work(*i); }
+				catch(std::exception)
+				{
+					// TODO: debug msg
+				}
+			}
+		}
+
+		// caller has _lock
+		bool remote_hcd::enqueue_port_stat(uint8_t port, const port_stat& nps) throw(std::bad_alloc)
+		{
+			port_stat_work* psw(new port_stat_work(port, nps, stats[port - 1]));
+			const bool enqueued(enqueue_work(psw));
+			stats[port - 1] = nps;
+			if(nps.get_connection_changed())
+				addresses[port - 1] = 0xff;
+			if(nps.get_reset_changed() && !nps.get_reset() && nps.get_enable())
+				addresses[port - 1] = 0x00;
+			return enqueued;
+		}
+
+		// takes the descriptors off the work ring; the urbs borrow their
+		// buffers from the region
+		void remote_hcd::take_works() throw()
+		{
+			uint8_t* const base(region->get_base());
+			remote::shm_header& sh(*reinterpret_cast<remote::shm_header*>(base));
+			const remote::shm_work* slots(reinterpret_cast<const remote::shm_work*>(base + sh.work_offset));
+			std::vector<uint64_t> cancels;
+			bool enqueued(false);
+			{
+				lock _(get_lock());
+				remote::shm_work d;
+				while(remote::ring_pop(sh.works, slots, &d))
+				{
+					if(!d.port || d.port > get_port_count()) continue;
+					try
+					{
+						switch(d.kind)
+						{
+						case REMOTE_WORK_PORT_STAT:
+							if(enqueue_port_stat(d.port, port_stat(d.port_status, d.port_change, d.port_flags)))
+								enqueued = true;
+							break;
+						case REMOTE_WORK_URB:
+						{
+							usb_vhci_urb u;
+							memset(&u, 0, sizeof u);
+							const size_t iso_size(d.packet_count * sizeof *u.iso_packets);
+							if(d.buffer_length < 0 || d.packet_count < 0 ||
+							   d.buffer_actual < 0 || d.buffer_actual > d.buffer_length ||
+							   (d.buffer_length && !region->contains(base + d.buffer_offset, d.buffer_length)) ||
+							   (iso_size && !region->contains(base + d.iso_offset, iso_size)))
+								throw std::invalid_argument("work");
+							u.handle = d.handle;
+							u.buffer = d.buffer_length ? base + d.buffer_offset : NULL;
+							u.iso_packets = iso_size ? reinterpret_cast<usb_vhci_iso_packet*>(base + d.iso_offset) : NULL;
+							u.buffer_length = d.buffer_length;
+							u.buffer_actual = usb_vhci_is_out(d.epadr) || usb_vhci_is_iso(d.type) ? d.buffer_actual : 0;
+							u.packet_count = d.packet_count;
+							u.interval = d.interval;
+							u.flags = d.flags;
+							u.wValue = d.wValue;
+							u.wIndex = d.wIndex;
+							u.wLength = d.wLength;
+							u.bmRequestType = d.bmRequestType;
+							u.bRequest = d.bRequest;
+							u.devadr = d.devadr;
+							u.epadr = d.epadr;
+							u.type = d.type;
+							u.status = USB_VHCI_STATUS_PENDING;
+							usb::urb* urb(new pooled_urb(u, NULL));
+							process_urb_work* w;
+							try { w = new process_urb_work(d.port, urb); }
+							catch(...)
+							{
+								delete urb;
+								throw;
+							}
+							addresses[d.port - 1] = d.devadr;
+							try { enqueue_work(w); }
+							catch(...)
+							{
+								delete w;
+								throw;
+							}
+							enqueued = true;
+							break;
+						}
+						case REMOTE_WORK_CANCEL:
+							// cancel_process_urb_work takes the lock itself
+							cancels.push_back(d.handle);
+							break;
+						}
+					}
+					catch(std::exception)
+					{
+						// TODO: debug msg
+					}
+				}
+				if(enqueued) on_work_enqueued();
+			}
+			for(std::vector<uint64_t>::const_iterator i(cancels.begin()); i != cancels.end(); i++)
+			{
+				try { cancel_process_urb_work(*i); }
+				catch(std::exception)
+				{
+					// TODO: debug msg
+				}
+			}
+		}
+
+		// caller has _lock; false if the completion ring is full
+		bool remote_hcd::post_completion(const usb::urb& urb) throw()
+		{
+			uint8_t* const base(region->get_base());
+			remote::shm_header& sh(*reinterpret_cast<remote::shm_header*>(base));
+			remote::shm_completion* slots(reinterpret_cast<remote::shm_completion*>(base + sh.completion_offset));
+			remote::shm_completion c;
+			memset(&c, 0, sizeof c);
+			c.handle = urb.get_handle();
+			c.status = urb.get_status();
+			c.buffer_actual = urb.get_buffer_actual();
+			c.error_count = urb.get_iso_error_count();
+			bool was_empty;
+			if(!remote::ring_push(sh.completions, slots, c, &was_empty)) return false;
+			if(was_empty)
+			{
+				uint64_t v(1);
+				while(write(completion_fd, &v, sizeof v) == -1 && errno == EINTR);
+			}
+			return true;
+		}
+
+		// caller has _lock
+		void remote_hcd::enqueue_urb(uint8_t port, const uint8_t* body, size_t size) throw(std::exception)
+		{
+			remote::urb_entry e;
+			if(size < sizeof e) throw std::invalid_argument("size");
+			memcpy(&e, body, sizeof e);
+			if(e.buffer_length < 0 || e.packet_count < 0 || e.buffer_actual < 0 ||
+			   e.buffer_actual > e.buffer_length ||
+			   size - sizeof e < e.packet_count * sizeof(remote::iso_entry))
+				throw std::invalid_argument("size");
+			const uint8_t* p(body + sizeof e);
+			const uint8_t* data(p + e.packet_count * sizeof(remote::iso_entry));
+			usb_vhci_urb u;
+			memset(&u, 0, sizeof u);
+			u.handle = e.handle;
+			u.buffer_length = e.buffer_length;
+			u.packet_count = e.packet_count;
+			u.interval = e.interval;
+			u.flags = e.flags;
+			u.wValue = e.wValue;
+			u.wIndex = e.wIndex;
+			u.wLength = e.wLength;
+			u.bmRequestType = e.bmRequestType;
+			u.bRequest = e.bRequest;
+			u.devadr = e.devadr;
+			u.epadr = e.epadr;
+			u.type = e.type;
+			u.status = USB_VHCI_STATUS_PENDING;
+			if(usb_vhci_is_out(e.epadr) || usb_vhci_is_iso(e.type))
+			{
+				if(body + size - data < e.buffer_actual) throw std::invalid_argument("size");
+				u.buffer_actual = e.buffer_actual;
+			}
+			try
+			{
+				if(u.buffer_length)
+				{
+					u.buffer = new uint8_t[u.buffer_length];
+					memcpy(u.buffer, data, u.buffer_actual);
+				}
+				if(u.packet_count)
+				{
+					u.iso_packets = new usb_vhci_iso_packet[u.packet_count];
+					memset(u.iso_packets, 0, u.packet_count * sizeof *u.iso_packets);
+					for(int32_t i(0); i < u.packet_count; i++, p += sizeof(remote::iso_entry))
+					{
+						remote::iso_entry ie;
+						memcpy(&ie, p, sizeof ie);
+						u.iso_packets[i].offset = ie.offset;
+						u.iso_packets[i].packet_length = ie.packet_length;
+					}
+				}
+			}
+			catch(...)
+			{
+				delete[] u.iso_packets;
+				delete[] u.buffer;
+				throw;
+			}
+			usb::urb* urb;
+			try { urb = new usb::urb(u, true); }
+			catch(...)
+			{
+				delete[] u.iso_packets;
+				delete[] u.buffer;
+				throw;
+			}
+			process_urb_work* w;
+			try { w = new process_urb_work(port, urb); }
+			catch(...)
+			{
+				delete urb;
+				throw;
+			}
+			addresses[port - 1] = e.devadr;
+			try { enqueue_work(w); }
+			catch(...)
+			{
+				delete w;
+				throw;
+			}
+		}
+
+		void remote_hcd::finish_op(int32_t error) throw()
+		{
+			lock _(op_lock);
+			if(op_busy && !op_done)
+			{
+				op_done = true;
+				op_error = error;
+			}
+			pthread_cond_broadcast(&op_cond);
+		}
+
+		void remote_hcd::port_op(uint8_t op, uint8_t port, uint8_t arg) volatile throw(std::exception)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			remote_hcd& _this(const_cast<remote_hcd&>(*this));
+			int32_t error;
+			{
+				lock _(_this.op_lock);
+				while(_this.op_busy && connected)
+					pthread_cond_wait(&_this.op_cond, &_this.op_lock);
+				if(!connected)
+				{
+					errno = ENOTCONN;
+					throw std::exception();
+				}
+				_this.op_busy = true;
+				_this.op_done = false;
+				try
+				{
+					lock _(_this.send_lock);
+					remote::port_op o;
+					memset(&o, 0, sizeof o);
+					o.op = op;
+					o.port = port;
+					o.arg = arg;
+					const size_t at(remote::begin_frame(_this.ops, REMOTE_FRAME_PORT_OP));
+					remote::append(_this.ops, &o, sizeof o);
+					remote::end_frame(_this.ops, at);
+				}
+				catch(...)
+				{
+					_this.op_busy = false;
+					pthread_cond_broadcast(&_this.op_cond);
+					throw;
+				}
+				_this.wake();
+				while(!_this.op_done && connected)
+					pthread_cond_wait(&_this.op_cond, &_this.op_lock);
+				error = _this.op_done ? _this.op_error : ENOTCONN;
+				_this.op_busy = false;
+				pthread_cond_broadcast(&_this.op_cond);
+			}
+			if(error)
+			{
+				errno = error;
+				throw std::exception();
+			}
+		}
+
+		// caller has _lock
+		void remote_hcd::canceling_work(work* w, bool in_progress) throw(std::exception)
+		{
+			process_urb_work* uw;
+			if(in_progress && (uw = dynamic_cast<process_urb_work*>(w)))
+			{
+				cancel_urb_work* cw = new cancel_urb_work(uw->get_port(), uw->get_urb()->get_handle());
+				try { enqueue_work(cw); }
+				catch(...)
+				{
+					delete cw;
+					throw;
+				}
+				on_work_enqueued();
+			}
+		}
+
+		// caller has _lock
+		void remote_hcd::finishing_work(work* w) throw(std::exception)
+		{
+			process_urb_work* uw(dynamic_cast<process_urb_work*>(w));
+			if(!uw || !connected) return;
+			const usb::urb& u(*uw->get_urb());
+			// the data is in place already; the socket takes the overflow
+			if(region && post_completion(u)) return;
+			remote::giveback_entry g;
+			memset(&g, 0, sizeof g);
+			g.handle = u.get_handle();
+			g.status = u.get_status();
+			g.buffer_actual = u.get_buffer_actual();
+			g.error_count = u.get_iso_error_count();
+			g.packet_count = u.get_iso_packet_count();
+			if(u.is_in() && u.get_buffer())
+				g.data_length = std::max(0, std::min(u.is_isochronous() ? u.get_buffer_length() : g.buffer_actual,
+				                                     u.get_buffer_length()));
+			{
+				lock _(send_lock);
+				const size_t at(remote::begin_entry(givebacks, 0, uw->get_port()));
+				remote::append(givebacks, &g, sizeof g);
+				for(int32_t i(0); i < g.packet_count; i++)
+				{
+					remote::iso_result r;
+					r.packet_actual = u.get_iso_packet_actual(i);
+					r.status = u.get_iso_packet_status(i);
+					remote::append(givebacks, &r, sizeof r);
+				}
+				remote::append(givebacks, u.get_buffer(), g.data_length);
+				remote::end_entry(givebacks, at);
+			}
+			wake();
+		}
+
+		const port_stat& remote_hcd::get_port_stat(uint8_t port) volatile throw(std::invalid_argument, std::out_of_range)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			lock _(get_lock());
+			return stats[port - 1];
+		}
+
+		void remote_hcd::port_connect(uint8_t port, usb::data_rate rate) volatile throw(std::exception)
+		{
+			port_op(REMOTE_PORT_CONNECT, port, rate);
+		}
+
+		void remote_hcd::port_disconnect(uint8_t port) volatile throw(std::exception)
+		{
+			port_op(REMOTE_PORT_DISCONNECT, port, 0);
+		}
+
+		void remote_hcd::port_disable(uint8_t port) volatile throw(std::exception)
+		{
+			port_op(REMOTE_PORT_DISABLE, port, 0);
+		}
+
+		void remote_hcd::port_resumed(uint8_t port) volatile throw(std::exception)
+		{
+			port_op(REMOTE_PORT_RESUMED, port, 0);
+		}
+
+		void remote_hcd::port_overcurrent(uint8_t port, bool set) volatile throw(std::exception)
+		{
+			port_op(REMOTE_PORT_OVERCURRENT, port, set);
+		}
+
+		void remote_hcd::port_reset_done(uint8_t port, bool enable) volatile throw(std::exception)
+		{
+			port_op(REMOTE_PORT_RESET_DONE, port, enable);
+		}
+	}
+}
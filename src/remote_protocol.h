@@ -0,0 +1,320 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _REMOTE_PROTOCOL_H
+#define _REMOTE_PROTOCOL_H 1
+
+#include <string.h>
+#include <vector>
+#include "libusb_vhci.h"
+
+// the frames between hcd_server and remote_hcd: a frame_header, whose size
+// counts the bytes after it, and the body; both ends are on the same
+// machine, so everything is in host byte order
+#define REMOTE_PROTOCOL_VERSION 2
+#define REMOTE_FRAME_MAX (64u << 20)
+
+// server to client
+#define REMOTE_FRAME_HELLO       1
+#define REMOTE_FRAME_WORKS       2
+#define REMOTE_FRAME_PORT_RESULT 3
+#define REMOTE_FRAME_ATTACHED    7
+// client to server
+#define REMOTE_FRAME_GIVEBACKS   4
+#define REMOTE_FRAME_PORT_OP     5
+// sent once after HELLO; the server delivers no works before it
+#define REMOTE_FRAME_ATTACH      6
+
+// flags of REMOTE_FRAME_ATTACHED; with REMOTE_ATTACHED_SHARED, the frame
+// carries the memfd of the shared_region and the eventfds of the work and
+// the completion ring (in this order) as SCM_RIGHTS
+#define REMOTE_ATTACHED_SHARED 0x01
+
+#define REMOTE_SHM_MAGIC   0x69636876u
+#define REMOTE_SHM_ENTRIES 1024
+
+// entries of REMOTE_FRAME_WORKS
+#define REMOTE_WORK_PORT_STAT 1
+#define REMOTE_WORK_URB       2
+#define REMOTE_WORK_CANCEL    3
+
+#define REMOTE_PORT_CONNECT     1
+#define REMOTE_PORT_DISCONNECT  2
+#define REMOTE_PORT_DISABLE     3
+#define REMOTE_PORT_RESUMED     4
+#define REMOTE_PORT_OVERCURRENT 5
+#define REMOTE_PORT_RESET_DONE  6
+
+namespace usb
+{
+	namespace vhci
+	{
+		namespace remote
+		{
+			struct frame_header
+			{
+				uint32_t size;
+				uint8_t type;
+				uint8_t reserved[3];
+			};
+
+			struct hello
+			{
+				uint32_t version;
+				uint8_t port_count;
+				uint8_t reserved[3];
+			};
+
+			// REMOTE_FRAME_WORKS and REMOTE_FRAME_GIVEBACKS are a sequence of
+			// entries, each an entry_header (size counting the bytes after it)
+			// and the body
+			struct entry_header
+			{
+				uint32_t size;
+				uint8_t kind;
+				uint8_t port;
+				uint8_t reserved[2];
+			};
+
+			struct port_stat_entry
+			{
+				uint16_t status, change;
+				uint8_t flags;
+				uint8_t reserved[3];
+			};
+
+			// followed by packet_count iso_entry and, for OUT and iso urbs,
+			// buffer_actual bytes of data
+			struct urb_entry
+			{
+				uint64_t handle;
+				int32_t buffer_length, buffer_actual;
+				int32_t packet_count, interval;
+				uint16_t flags;
+				uint16_t wValue, wIndex, wLength;
+				uint8_t bmRequestType, bRequest;
+				uint8_t devadr, epadr;
+				uint8_t type;
+				uint8_t reserved[3];
+			};
+
+			struct iso_entry
+			{
+				uint32_t offset;
+				int32_t packet_length;
+			};
+
+			struct cancel_entry
+			{
+				uint64_t handle;
+			};
+
+			// followed by packet_count iso_result and data_length bytes of
+			// IN data
+			struct giveback_entry
+			{
+				uint64_t handle;
+				int32_t status, buffer_actual;
+				int32_t error_count, packet_count;
+				int32_t data_length;
+				int32_t reserved;
+			};
+
+			struct iso_result
+			{
+				int32_t packet_actual;
+				int32_t status;
+			};
+
+			struct port_op
+			{
+				uint8_t op, port, arg;
+				uint8_t reserved;
+			};
+
+			struct port_result
+			{
+				// an errno value, 0 on success
+				int32_t error;
+			};
+
+			struct attached
+			{
+				uint8_t flags;
+				uint8_t reserved[3];
+			};
+
+			// a ring of fixed size entries with a single producer and a single
+			// consumer; head and tail run freely and are on cache lines of
+			// their own
+			struct shm_ring
+			{
+				volatile uint32_t head;
+				uint8_t pad0[60];
+				volatile uint32_t tail;
+				uint8_t pad1[60];
+			};
+
+			// at the start of the shared_region; the offsets are relative to
+			// it, too
+			struct shm_header
+			{
+				uint32_t magic;
+				uint32_t entries;
+				uint32_t work_offset;
+				uint32_t completion_offset;
+				uint8_t pad[48];
+				// server to client, shm_work entries
+				shm_ring works;
+				// client to server, shm_completion entries
+				shm_ring completions;
+			};
+
+			// a work descriptor; for REMOTE_WORK_URB, the data buffer and the
+			// usb_vhci_iso_packet array are in the region; the iso results
+			// and the IN data are written there in place
+			struct shm_work
+			{
+				uint64_t handle;
+				uint32_t buffer_offset;
+				int32_t buffer_length, buffer_actual;
+				uint32_t iso_offset;
+				int32_t packet_count, interval;
+				uint16_t flags;
+				uint16_t wValue, wIndex, wLength;
+				uint8_t bmRequestType, bRequest;
+				uint8_t devadr, epadr;
+				uint8_t type;
+				uint8_t kind, port;
+				uint8_t port_flags;
+				uint16_t port_status, port_change;
+				uint8_t reserved[12];
+			};
+
+			struct shm_completion
+			{
+				uint64_t handle;
+				int32_t status, buffer_actual;
+				int32_t error_count;
+				int32_t reserved;
+			};
+
+			inline size_t shm_reserved()
+			{
+				return REMOTE_SHM_ENTRIES * (sizeof(shm_work) + sizeof(shm_completion)) + sizeof(shm_header);
+			}
+
+			// false if the ring is full; *was_empty is set if the consumer had
+			// taken everything before v, and so may be waiting for a doorbell
+			template<typename T>
+			bool ring_push(shm_ring& r, T* slots, const T& v, bool* was_empty)
+			{
+				const uint32_t tail(r.tail);
+				__sync_synchronize();
+				if(tail - r.head >= REMOTE_SHM_ENTRIES) return false;
+				slots[tail & (REMOTE_SHM_ENTRIES - 1)] = v;
+				__sync_synchronize();
+				r.tail = tail + 1;
+				__sync_synchronize();
+				*was_empty = r.head == tail;
+				return true;
+			}
+
+			template<typename T>
+			bool ring_pop(shm_ring& r, const T* slots, T* v)
+			{
+				const uint32_t head(r.head);
+				__sync_synchronize();
+				if(head == r.tail) return false;
+				__sync_synchronize();
+				*v = slots[head & (REMOTE_SHM_ENTRIES - 1)];
+				__sync_synchronize();
+				r.head = head + 1;
+				__sync_synchronize();
+				return true;
+			}
+
+			inline void append(std::vector<uint8_t>& out, const void* data, size_t size)
+			{
+				const uint8_t* d(static_cast<const uint8_t*>(data));
+				out.insert(out.end(), d, d + size);
+			}
+
+			// returns the offset of the header, for end_frame and end_entry
+			inline size_t begin_frame(std::vector<uint8_t>& out, uint8_t type)
+			{
+				const size_t at(out.size());
+				frame_header h;
+				memset(&h, 0, sizeof h);
+				h.type = type;
+				append(out, &h, sizeof h);
+				return at;
+			}
+
+			inline void end_frame(std::vector<uint8_t>& out, size_t at)
+			{
+				const uint32_t size(out.size() - at - sizeof(frame_header));
+				memcpy(&out[at], &size, sizeof size);
+			}
+
+			inline size_t begin_entry(std::vector<uint8_t>& out, uint8_t kind, uint8_t port)
+			{
+				const size_t at(out.size());
+				entry_header h;
+				memset(&h, 0, sizeof h);
+				h.kind = kind;
+				h.port = port;
+				append(out, &h, sizeof h);
+				return at;
+			}
+
+			inline void end_entry(std::vector<uint8_t>& out, size_t at)
+			{
+				const uint32_t size(out.size() - at - sizeof(entry_header));
+				memcpy(&out[at], &size, sizeof size);
+			}
+
+			// finds the next complete entry (or frame, with H = frame_header)
+			// in [*pos, end); false if there is none yet
+			template<typename H>
+			bool next(const uint8_t* data, size_t end, size_t* pos, H* h, const uint8_t** body)
+			{
+				if(end - *pos < sizeof(H)) return false;
+				memcpy(h, data + *pos, sizeof(H));
+				if(end - *pos - sizeof(H) < h->size) return false;
+				*body = data + *pos + sizeof(H);
+				*pos += sizeof(H) + h->size;
+				return true;
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <new>
+#include "libusb_vhci.h"
+
+namespace
+{
+	const size_t min_chunk(64);
+
+	size_t page_align(size_t size) throw()
+	{
+		const size_t page(sysconf(_SC_PAGESIZE));
+		return (size + page - 1) / page * page;
+	}
+
+	// index of the smallest power of two chunk holding size bytes
+	size_t size_class(size_t size) throw()
+	{
+		size_t c(0);
+		while((min_chunk << c) < size) c++;
+		return c;
+	}
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		buffer_pool::~buffer_pool() throw() { }
+
+		pooled_urb::pooled_urb(const usb_vhci_urb& urb, buffer_pool* pool) throw(std::invalid_argument) :
+			usb::urb(urb, true),
+			pool(pool)
+		{
+		}
+
+		pooled_urb::~pooled_urb() throw()
+		{
+			const usb_vhci_urb& u(*get_internal());
+			if(pool)
+			{
+				if(u.buffer) pool->release(u.buffer, u.buffer_length);
+				if(u.iso_packets)
+					pool->release(reinterpret_cast<uint8_t*>(u.iso_packets), u.packet_count * sizeof *u.iso_packets);
+			}
+			detach();
+		}
+
+		pooled_urb* pooled_urb::create(const usb_vhci_urb& urb, buffer_pool& pool) throw()
+		{
+			usb_vhci_urb u(urb);
+			u.buffer = NULL;
+			u.iso_packets = NULL;
+			if(u.buffer_length > 0 && !(u.buffer = pool.allocate(u.buffer_length)))
+				return NULL;
+			if(u.packet_count > 0)
+			{
+				const size_t size(u.packet_count * sizeof *u.iso_packets);
+				u.iso_packets = reinterpret_cast<usb_vhci_iso_packet*>(pool.allocate(size));
+				if(!u.iso_packets)
+				{
+					if(u.buffer) pool.release(u.buffer, u.buffer_length);
+					return NULL;
+				}
+				memset(u.iso_packets, 0, size);
+			}
+			pooled_urb* p(NULL);
+			try { p = new(std::nothrow) pooled_urb(u, &pool); }
+			catch(std::invalid_argument) { }
+			if(!p)
+			{
+				if(u.iso_packets)
+					pool.release(reinterpret_cast<uint8_t*>(u.iso_packets), u.packet_count * sizeof *u.iso_packets);
+				if(u.buffer) pool.release(u.buffer, u.buffer_length);
+			}
+			return p;
+		}
+
+		shared_region::shared_region(size_t size, size_t reserved) throw(std::exception) :
+			fd(-1),
+			base(NULL),
+			size(page_align(size)),
+			next(page_align(reserved)),
+			_lock(),
+			free_chunks(),
+			used(0)
+		{
+			if(next >= this->size) throw std::invalid_argument("size");
+			if((fd = memfd_create("usb-vhci", MFD_CLOEXEC)) == -1)
+				throw std::exception();
+			void* m(MAP_FAILED);
+			if(ftruncate(fd, this->size) == -1 ||
+			   (m = mmap(NULL, this->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+			{
+				close(fd);
+				throw std::exception();
+			}
+			base = static_cast<uint8_t*>(m);
+			try { free_chunks.resize(size_class(this->size - next) + 1); }
+			catch(...)
+			{
+				munmap(base, this->size);
+				close(fd);
+				throw;
+			}
+			pthread_mutex_init(&_lock, NULL);
+		}
+
+		shared_region::shared_region(int fd) throw(std::exception) :
+			fd(fd),
+			base(NULL),
+			size(0),
+			next(0),
+			_lock(),
+			free_chunks(),
+			used(0)
+		{
+			struct stat st;
+			void* m(MAP_FAILED);
+			if(fstat(fd, &st) == -1 || st.st_size <= 0 ||
+			   (m = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+			{
+				close(fd);
+				throw std::exception();
+			}
+			base = static_cast<uint8_t*>(m);
+			size = st.st_size;
+			next = size;
+			pthread_mutex_init(&_lock, NULL);
+		}
+
+		shared_region::~shared_region() throw()
+		{
+			pthread_mutex_destroy(&_lock);
+			munmap(base, size);
+			close(fd);
+		}
+
+		uint8_t* shared_region::allocate(size_t size) throw()
+		{
+			if(!size) return NULL;
+			const size_t c(size_class(size));
+			const size_t chunk(min_chunk << c);
+			lock _(_lock);
+			if(c < free_chunks.size() && !free_chunks[c].empty())
+			{
+				const size_t offset(free_chunks[c].back());
+				free_chunks[c].pop_back();
+				used += chunk;
+				return base + offset;
+			}
+			if(this->size - next < chunk) return NULL;
+			const size_t offset(next);
+			next += chunk;
+			used += chunk;
+			return base + offset;
+		}
+
+		void shared_region::release(uint8_t* p, size_t size) throw()
+		{
+			if(!p || !size) return;
+			const size_t c(size_class(size));
+			lock _(_lock);
+			if(c >= free_chunks.size()) return;
+			used -= min_chunk << c;
+			try { free_chunks[c].push_back(p - base); }
+			catch(std::bad_alloc)
+			{
+				// the chunk is lost
+				// TODO: debug msg
+			}
+		}
+	}
+}
@@ -0,0 +1,154 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "libusb_vhci.h"
+
+namespace usb
+{
+	namespace vhci
+	{
+		transport::~transport() throw()
+		{
+		}
+
+		int transport::get_poll_fd() throw()
+		{
+			return -1;
+		}
+
+		int transport::detach() throw()
+		{
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		int transport::adopt(int) throw()
+		{
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		ioctl_transport::~ioctl_transport() throw()
+		{
+			close();
+		}
+
+		int ioctl_transport::open(uint8_t port_count, int32_t* id, int32_t* usb_busnum, char** bus_id) throw()
+		{
+			if(fd != -1)
+			{
+				errno = EBUSY;
+				return -1;
+			}
+			fd = usb_vhci_open(port_count, id, usb_busnum, bus_id);
+			return fd == -1 ? -1 : 0;
+		}
+
+		int ioctl_transport::detach() throw()
+		{
+			if(fd == -1)
+			{
+				errno = EBADF;
+				return -1;
+			}
+			int res(fd);
+			fd = -1;
+			return res;
+		}
+
+		int ioctl_transport::adopt(int fd) throw()
+		{
+			if(this->fd != -1)
+			{
+				errno = EBUSY;
+				return -1;
+			}
+			this->fd = fd;
+			return 0;
+		}
+
+		int ioctl_transport::close() throw()
+		{
+			if(fd == -1) return 0;
+			int res(usb_vhci_close(fd));
+			fd = -1;
+			return res;
+		}
+
+		int ioctl_transport::fetch_work(usb_vhci_work* work, int16_t timeout) throw()
+		{
+			return usb_vhci_fetch_work_timeout(fd, work, timeout);
+		}
+
+		int ioctl_transport::fetch_data(const usb_vhci_urb* urb) throw()
+		{
+			return usb_vhci_fetch_data(fd, urb);
+		}
+
+		int ioctl_transport::giveback(const usb_vhci_urb* urb) throw()
+		{
+			return usb_vhci_giveback(fd, urb);
+		}
+
+		int ioctl_transport::port_connect(uint8_t port, uint8_t data_rate) throw()
+		{
+			return usb_vhci_port_connect(fd, port, data_rate);
+		}
+
+		int ioctl_transport::port_disconnect(uint8_t port) throw()
+		{
+			return usb_vhci_port_disconnect(fd, port);
+		}
+
+		int ioctl_transport::port_disable(uint8_t port) throw()
+		{
+			return usb_vhci_port_disable(fd, port);
+		}
+
+		int ioctl_transport::port_resumed(uint8_t port) throw()
+		{
+			return usb_vhci_port_resumed(fd, port);
+		}
+
+		int ioctl_transport::port_overcurrent(uint8_t port, uint8_t set) throw()
+		{
+			return usb_vhci_port_overcurrent(fd, port, set);
+		}
+
+		int ioctl_transport::port_reset_done(uint8_t port, uint8_t enable) throw()
+		{
+			return usb_vhci_port_reset_done(fd, port, enable);
+		}
+	}
+}
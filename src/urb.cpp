@@ -35,6 +35,7 @@
 #include <algorithm>
 
 #include "libusb_vhci.h"
+#include "iso_packets.h"
 
 namespace usb
 {
@@ -240,12 +241,7 @@ namespace usb
 			throw std::logic_error("not an isochronous urb");
 
 		// count error statuses
-		int32_t errors(0);
-		for(int32_t i(0); i < get_iso_packet_count(); i++)
-		{
-			if(get_iso_packet_status(i) != USB_VHCI_STATUS_SUCCESS)
-				errors++;
-		}
+		const int32_t errors(usb_vhci_iso_count_errors(_urb.iso_packets, get_iso_packet_count()));
 		set_iso_error_count(errors);
 
 		// set urb status according to packet statuses
@@ -0,0 +1,752 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <new>
+#include "libusb_vhci.h"
+
+// file layout: header, records (each padded to 8 bytes)
+#define URB_RECORD_MAGIC "VHCIREC1"
+#define URB_RECORD_VERSION 1
+
+#define URB_RECORD_KIND_PROCESS_URB 1
+#define URB_RECORD_KIND_CANCEL_URB  2
+#define URB_RECORD_KIND_PORT_STAT   3
+#define URB_RECORD_KIND_GIVEBACK    4
+
+// records the writer thread passes to one writev
+#define URB_RECORD_WRITE_BATCH 64
+
+namespace
+{
+	struct file_header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t header_size;
+		uint64_t record_count;
+		// zero, if the recording was not closed properly
+		uint64_t records_end;
+		uint64_t reserved0;
+		uint64_t start_realtime;
+		uint8_t port_count;
+		uint8_t reserved[15];
+	};
+
+	struct record_header
+	{
+		uint64_t time;
+		uint32_t size;
+		uint8_t kind;
+		uint8_t port;
+		uint16_t reserved;
+	};
+
+	// followed by packet_count iso_record entries and the OUT data
+	struct urb_record
+	{
+		uint64_t handle;
+		int32_t buffer_length, buffer_actual;
+		int32_t packet_count, interval;
+		uint16_t flags;
+		uint16_t wValue, wIndex, wLength;
+		uint8_t bmRequestType, bRequest;
+		uint8_t devadr, epadr;
+		uint8_t type;
+		uint8_t reserved[3];
+	};
+
+	struct iso_record
+	{
+		uint32_t offset;
+		int32_t packet_length;
+	};
+
+	struct giveback_record
+	{
+		uint64_t handle;
+		int32_t status, buffer_actual;
+		int32_t error_count;
+		int32_t reserved;
+	};
+
+	struct cancel_record
+	{
+		uint64_t handle;
+	};
+
+	struct port_stat_record
+	{
+		uint16_t status, change;
+		uint8_t flags, trigger_flags;
+		uint8_t reserved[2];
+	};
+
+	uint64_t now(clockid_t clock = CLOCK_MONOTONIC) throw()
+	{
+		timespec ts;
+		clock_gettime(clock, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	}
+
+	inline size_t pad8(size_t v) throw() { return (v + 7) & ~static_cast<size_t>(7); }
+
+	// writes all of iov, continuing after short writes; iov gets modified
+	bool write_all(int fd, iovec* iov, int count) throw()
+	{
+		while(count)
+		{
+			ssize_t res(writev(fd, iov, count));
+			if(res == -1)
+			{
+				if(errno == EINTR) continue;
+				return false;
+			}
+			while(count && static_cast<size_t>(res) >= iov->iov_len)
+			{
+				res -= iov->iov_len;
+				iov++;
+				count--;
+			}
+			if(count)
+			{
+				iov->iov_base = reinterpret_cast<uint8_t*>(iov->iov_base) + res;
+				iov->iov_len -= res;
+			}
+		}
+		return true;
+	}
+
+	void fill_header(file_header& h) throw()
+	{
+		memset(&h, 0, sizeof h);
+		memcpy(h.magic, URB_RECORD_MAGIC, sizeof h.magic);
+		h.version = URB_RECORD_VERSION;
+		h.header_size = sizeof h;
+	}
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		urb_recorder::urb_recorder(const char* path, size_t max_pending) throw(std::exception) :
+			fd(-1),
+			record_count(0),
+			start_time(now()),
+			port_count(0),
+			max_pending(max_pending),
+			dropped(0),
+			error(0),
+			written_count(0),
+			written_end(sizeof(file_header)),
+			writer_thread(),
+			writer_shutdown(false),
+			_lock(),
+			pending_cond(),
+			pending()
+		{
+			if(!path) throw std::invalid_argument("path");
+			while((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 && errno == EINTR);
+			if(fd == -1) throw std::exception();
+			file_header h;
+			fill_header(h);
+			h.start_realtime = now(CLOCK_REALTIME);
+			iovec iov;
+			iov.iov_base = &h;
+			iov.iov_len = sizeof h;
+			if(!write_all(fd, &iov, 1))
+			{
+				close(fd);
+				throw std::exception();
+			}
+			pthread_mutex_init(&_lock, NULL);
+			pthread_cond_init(&pending_cond, NULL);
+			if(pthread_create(&writer_thread, NULL, writer_thread_start, this))
+			{
+				pthread_cond_destroy(&pending_cond);
+				pthread_mutex_destroy(&_lock);
+				close(fd);
+				throw std::exception();
+			}
+		}
+
+		urb_recorder::~urb_recorder() throw()
+		{
+			{
+				lock _(_lock);
+				writer_shutdown = true;
+				pthread_cond_signal(&pending_cond);
+			}
+			pthread_join(writer_thread, NULL);
+			// complete the header; after a failed write it only covers the
+			// records which made it into the file
+			file_header h;
+			fill_header(h);
+			h.record_count = written_count;
+			h.records_end = written_end;
+			h.start_realtime = now(CLOCK_REALTIME) - (now() - start_time);
+			h.port_count = port_count;
+			while(pwrite(fd, &h, sizeof h, 0) == -1 && errno == EINTR);
+			close(fd);
+			pthread_cond_destroy(&pending_cond);
+			pthread_mutex_destroy(&_lock);
+		}
+
+		// builds the complete record, so that the writer thread only has to
+		// pass it on to the file
+		void urb_recorder::write_record(uint8_t kind,
+		                                uint8_t port,
+		                                const void* body,
+		                                size_t body_size,
+		                                const void* data,
+		                                size_t data_size) volatile throw()
+		{
+			urb_recorder& _this(const_cast<urb_recorder&>(*this));
+			record_header h;
+			h.time = now() - _this.start_time;
+			h.size = pad8(sizeof h + body_size + data_size);
+			h.kind = kind;
+			h.port = port;
+			h.reserved = 0;
+			std::vector<uint8_t>* rec(NULL);
+			// the padding stays zero
+			try { rec = new std::vector<uint8_t>(h.size); }
+			catch(std::bad_alloc)
+			{
+				__sync_fetch_and_add(&_this.dropped, 1);
+				return;
+			}
+			uint8_t* p(&(*rec)[0]);
+			memcpy(p, &h, sizeof h);
+			memcpy(p + sizeof h, body, body_size);
+			if(data_size) memcpy(p + sizeof h + body_size, data, data_size);
+
+			lock _(_this._lock);
+			if(_this.pending.size() >= _this.max_pending)
+			{
+				// never block the urb path on a slow disk
+				__sync_fetch_and_add(&_this.dropped, 1);
+				delete rec;
+				return;
+			}
+			try { _this.pending.push_back(rec); }
+			catch(std::bad_alloc)
+			{
+				__sync_fetch_and_add(&_this.dropped, 1);
+				delete rec;
+				return;
+			}
+			_this.record_count++;
+			if(port > _this.port_count) _this.port_count = port;
+			if(_this.pending.size() == 1)
+				pthread_cond_signal(&_this.pending_cond);
+		}
+
+		// writes and frees the records of batch
+		void urb_recorder::write_batch(std::deque<std::vector<uint8_t>*>& batch) throw()
+		{
+			while(!batch.empty())
+			{
+				iovec iov[URB_RECORD_WRITE_BATCH];
+				const size_t n(std::min<size_t>(batch.size(), URB_RECORD_WRITE_BATCH));
+				size_t total(0);
+				for(size_t i(0); i < n; i++)
+				{
+					iov[i].iov_base = &(*batch[i])[0];
+					iov[i].iov_len = batch[i]->size();
+					total += iov[i].iov_len;
+				}
+				if(!error && !write_all(fd, iov, n)) error = errno;
+				if(error) __sync_fetch_and_add(&dropped, n);
+				else
+				{
+					written_count += n;
+					written_end += total;
+				}
+				for(size_t i(0); i < n; i++)
+				{
+					delete batch.front();
+					batch.pop_front();
+				}
+			}
+		}
+
+		void* urb_recorder::writer_thread_start(void* _this) throw()
+		{
+			urb_recorder& rec(*reinterpret_cast<urb_recorder*>(_this));
+			std::deque<std::vector<uint8_t>*> batch;
+			while(true)
+			{
+				{
+					lock _(rec._lock);
+					while(rec.pending.empty() && !rec.writer_shutdown)
+						pthread_cond_wait(&rec.pending_cond, &rec._lock);
+					if(rec.pending.empty()) break;
+					// takes everything without allocating under the lock
+					batch.swap(rec.pending);
+				}
+				rec.write_batch(batch);
+			}
+			return NULL;
+		}
+
+		void urb_recorder::record_work(const work& w) volatile throw()
+		{
+			if(const process_urb_work* puw = dynamic_cast<const process_urb_work*>(&w))
+			{
+				const usb::urb& u(*puw->get_urb());
+				const int32_t pc(u.get_iso_packet_count());
+				// iso entries and OUT data go into one block behind the fixed part
+				const size_t iso_size(pc * sizeof(iso_record));
+				const size_t data_size((u.is_out() || u.is_isochronous()) && u.get_buffer() ? u.get_buffer_actual() : 0);
+				uint8_t* block(NULL);
+				if(iso_size + data_size)
+				{
+					if(!(block = new(std::nothrow) uint8_t[iso_size + data_size]))
+						return;
+					for(int32_t i(0); i < pc; i++)
+					{
+						iso_record r;
+						r.offset = u.get_iso_packet_offset(i);
+						r.packet_length = u.get_iso_packet_length(i);
+						memcpy(block + i * sizeof r, &r, sizeof r);
+					}
+					if(data_size) memcpy(block + iso_size, u.get_buffer(), data_size);
+				}
+				urb_record r;
+				memset(&r, 0, sizeof r);
+				r.handle = u.get_handle();
+				r.buffer_length = u.get_buffer_length();
+				r.buffer_actual = u.get_buffer_actual();
+				r.packet_count = pc;
+				r.interval = u.get_interval();
+				r.flags = u.get_flags();
+				r.wValue = u.get_wValue();
+				r.wIndex = u.get_wIndex();
+				r.wLength = u.get_wLength();
+				r.bmRequestType = u.get_bmRequestType();
+				r.bRequest = u.get_bRequest();
+				r.devadr = u.get_device_address();
+				r.epadr = u.get_endpoint_address();
+				r.type = u.get_internal()->type;
+				write_record(URB_RECORD_KIND_PROCESS_URB, w.get_port(), &r, sizeof r, block, iso_size + data_size);
+				delete[] block;
+			}
+			else if(const port_stat_work* psw = dynamic_cast<const port_stat_work*>(&w))
+			{
+				port_stat_record r;
+				memset(&r, 0, sizeof r);
+				r.status = psw->get_port_stat().get_status();
+				r.change = psw->get_port_stat().get_change();
+				r.flags = psw->get_port_stat().get_flags();
+				r.trigger_flags = psw->get_trigger_flags();
+				write_record(URB_RECORD_KIND_PORT_STAT, w.get_port(), &r, sizeof r);
+			}
+			// cancel_urb_work is derived from a cancel request, which has been
+			// recorded already
+		}
+
+		void urb_recorder::record_cancel(uint64_t handle) volatile throw()
+		{
+			cancel_record r;
+			r.handle = handle;
+			write_record(URB_RECORD_KIND_CANCEL_URB, 0, &r, sizeof r);
+		}
+
+		void urb_recorder::record_giveback(uint8_t port, const usb::urb& urb) volatile throw()
+		{
+			giveback_record r;
+			r.handle = urb.get_handle();
+			r.status = urb.get_status();
+			r.buffer_actual = urb.get_buffer_actual();
+			r.error_count = urb.get_iso_error_count();
+			r.reserved = 0;
+			write_record(URB_RECORD_KIND_GIVEBACK, port, &r, sizeof r);
+		}
+
+		uint8_t replay_hcd::read_port_count(const char* path) throw(std::exception)
+		{
+			if(!path) throw std::invalid_argument("path");
+			int fd(open(path, O_RDONLY));
+			if(fd == -1) throw std::exception();
+			file_header h;
+			ssize_t res(pread(fd, &h, sizeof h, 0));
+			close(fd);
+			if(res != sizeof h ||
+			   memcmp(h.magic, URB_RECORD_MAGIC, sizeof h.magic) ||
+			   h.version != URB_RECORD_VERSION ||
+			   h.header_size < sizeof h)
+				throw std::invalid_argument("path");
+			if(h.port_count) return h.port_count;
+			// unfinished recording: every port may have been used
+			return 0xff;
+		}
+
+		replay_hcd::replay_hcd(const char* path, double speed) throw(std::exception) :
+			hcd(read_port_count(path)),
+			fd(-1),
+			map(NULL),
+			map_size(0),
+			end(0),
+			pos(0),
+			speed(speed),
+			first_record_time(0),
+			start_time(0),
+			done(false),
+			stats(NULL),
+			results(),
+			pending()
+		{
+			if(speed < 0) throw std::invalid_argument("speed");
+			if((fd = open(path, O_RDONLY)) == -1) throw std::exception();
+			struct stat st;
+			if(fstat(fd, &st) == -1)
+			{
+				close(fd);
+				throw std::exception();
+			}
+			map_size = st.st_size;
+			// read_port_count has seen a header, but the file may have changed
+			if(map_size < sizeof(file_header))
+			{
+				close(fd);
+				throw std::invalid_argument("path");
+			}
+			void* m(mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0));
+			if(m == MAP_FAILED)
+			{
+				close(fd);
+				throw std::exception();
+			}
+			map = reinterpret_cast<const uint8_t*>(m);
+			try
+			{
+				madvise(m, map_size, MADV_SEQUENTIAL);
+				file_header h;
+				memcpy(&h, map, sizeof h);
+				pos = h.header_size;
+				// records of an unfinished recording run up to the end of the file
+				end = (h.records_end && h.records_end <= map_size) ? h.records_end : map_size;
+				if(pos + sizeof(record_header) <= end)
+				{
+					record_header rh;
+					memcpy(&rh, map + pos, sizeof rh);
+					first_record_time = rh.time;
+				}
+				stats = new port_stat[get_port_count()];
+				start_time = now();
+				init_bg_thread();
+			}
+			catch(...)
+			{
+				delete[] stats;
+				munmap(m, map_size);
+				close(fd);
+				throw;
+			}
+		}
+
+		replay_hcd::~replay_hcd() throw()
+		{
+			join_bg_thread();
+			munmap(const_cast<uint8_t*>(map), map_size);
+			close(fd);
+			delete[] stats;
+		}
+
+		// caller has _lock
+		uint8_t replay_hcd::address_from_port(uint8_t port) const throw(std::invalid_argument, std::out_of_range)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			return port;
+		}
+
+		// caller has _lock
+		uint8_t replay_hcd::port_from_address(uint8_t address) const throw(std::invalid_argument)
+		{
+			if(address > 0x7f) throw std::invalid_argument("address");
+			return address <= get_port_count() ? address : 0;
+		}
+
+		void replay_hcd::bg_work() volatile throw()
+		{
+			replay_hcd& _this(const_cast<replay_hcd&>(*this));
+			if(_this.pos + sizeof(record_header) > _this.end)
+			{
+				_this.done = true;
+				wait_for_shutdown(10);
+				return;
+			}
+			record_header rh;
+			memcpy(&rh, _this.map + _this.pos, sizeof rh);
+			if(rh.size < sizeof rh || _this.pos + rh.size > _this.end)
+			{
+				// truncated recording
+				_this.pos = _this.end;
+				return;
+			}
+			if(_this.speed > 0)
+			{
+				const uint64_t due(_this.start_time +
+				                   static_cast<uint64_t>((rh.time - _this.first_record_time) / _this.speed));
+				const uint64_t t(now());
+				if(t < due)
+				{
+					// whole milliseconds can be cut short by a shutdown request
+					uint64_t wait((due - t) / 1000);
+					if(wait < 1000) usleep(wait);
+					else wait_for_shutdown(wait > 100000 ? 100 : static_cast<int>(wait / 1000));
+					return;
+				}
+			}
+			if(_this.dispatch(_this.pos))
+				_this.pos += rh.size;
+			else
+				wait_for_shutdown(100);
+		}
+
+		// returns false, if the record has to be retried later
+		bool replay_hcd::dispatch(size_t at) throw()
+		{
+			record_header rh;
+			memcpy(&rh, map + at, sizeof rh);
+			const uint8_t* body(map + at + sizeof rh);
+			if(rh.port > get_port_count()) return true;
+			switch(rh.kind)
+			{
+			case URB_RECORD_KIND_PROCESS_URB:
+			{
+				urb_record r;
+				memcpy(&r, body, sizeof r);
+				if(!rh.port) return true;
+				usb_vhci_urb u;
+				memset(&u, 0, sizeof u);
+				u.handle = r.handle;
+				u.buffer_length = r.buffer_length;
+				u.buffer_actual = r.buffer_actual;
+				u.packet_count = r.packet_count;
+				u.interval = r.interval;
+				u.flags = r.flags;
+				u.wValue = r.wValue;
+				u.wIndex = r.wIndex;
+				u.wLength = r.wLength;
+				u.bmRequestType = r.bmRequestType;
+				u.bRequest = r.bRequest;
+				u.devadr = r.devadr;
+				u.epadr = r.epadr;
+				u.type = r.type;
+				u.status = USB_VHCI_STATUS_PENDING;
+				const uint8_t* p(body + sizeof r);
+				if(r.packet_count < 0 || r.buffer_actual < 0 ||
+				   sizeof rh + sizeof r + r.packet_count * sizeof(iso_record) > rh.size)
+					return true;
+				process_urb_work* puw(NULL);
+				try
+				{
+					if(u.buffer_length)
+						u.buffer = new uint8_t[u.buffer_length];
+					if(u.packet_count)
+						u.iso_packets = new usb_vhci_iso_packet[u.packet_count];
+					for(int32_t i(0); i < u.packet_count; i++, p += sizeof(iso_record))
+					{
+						iso_record ir;
+						memcpy(&ir, p, sizeof ir);
+						u.iso_packets[i].offset = ir.offset;
+						u.iso_packets[i].packet_length = ir.packet_length;
+						u.iso_packets[i].packet_actual = 0;
+						u.iso_packets[i].status = USB_VHCI_STATUS_PENDING;
+					}
+					if((usb_vhci_is_out(u.epadr) || usb_vhci_is_iso(u.type)) && u.buffer &&
+					   u.buffer_actual <= u.buffer_length &&
+					   p + u.buffer_actual <= map + at + rh.size)
+						memcpy(u.buffer, p, u.buffer_actual);
+					usb::urb* urb(new usb::urb(u, true));
+					u.buffer = NULL;
+					u.iso_packets = NULL;
+					try { puw = new process_urb_work(rh.port, urb); }
+					catch(...)
+					{
+						delete urb;
+						throw;
+					}
+					replay_result res;
+					res.handle = r.handle;
+					res.port = rh.port;
+					res.epadr = r.epadr;
+					res.canceled = false;
+					res.recorded_ns = 0;
+					res.replayed_ns = 0;
+					lock _(get_lock());
+					results.push_back(res);
+					_pending& pe(pending[r.handle]);
+					pe.result = results.size() - 1;
+					pe.recorded = rh.time;
+					pe.enqueued = now();
+					if(enqueue_work(puw)) on_work_enqueued();
+				}
+				catch(std::exception)
+				{
+					delete[] u.buffer;
+					delete[] u.iso_packets;
+					delete puw;
+					return false;
+				}
+				return true;
+			}
+			case URB_RECORD_KIND_CANCEL_URB:
+			{
+				cancel_record r;
+				memcpy(&r, body, sizeof r);
+				try { cancel_process_urb_work(r.handle); }
+				catch(std::exception) { return false; }
+				return true;
+			}
+			case URB_RECORD_KIND_PORT_STAT:
+			{
+				port_stat_record r;
+				memcpy(&r, body, sizeof r);
+				if(!rh.port) return true;
+				port_stat ps(r.status, r.change, r.flags);
+				lock _(get_lock());
+				port_stat_work* psw(NULL);
+				try
+				{
+					psw = new port_stat_work(rh.port, ps, stats[rh.port - 1]);
+					enqueue_work(psw);
+				}
+				catch(std::exception)
+				{
+					delete psw;
+					return false;
+				}
+				stats[rh.port - 1] = ps;
+				on_work_enqueued();
+				return true;
+			}
+			case URB_RECORD_KIND_GIVEBACK:
+			{
+				giveback_record r;
+				memcpy(&r, body, sizeof r);
+				lock _(get_lock());
+				std::map<uint64_t, _pending>::iterator i(pending.find(r.handle));
+				if(i != pending.end())
+				{
+					replay_result& res(results[i->second.result]);
+					res.recorded_ns = rh.time - i->second.recorded;
+					if(!res.recorded_ns) res.recorded_ns = 1;
+					if(res.replayed_ns) pending.erase(i);
+				}
+				return true;
+			}
+			default:
+				return true;
+			}
+		}
+
+		// caller has _lock
+		void replay_hcd::finishing_work(work* w) throw(std::exception)
+		{
+			process_urb_work* uw(dynamic_cast<process_urb_work*>(w));
+			if(!uw) return;
+			std::map<uint64_t, _pending>::iterator i(pending.find(uw->get_urb()->get_handle()));
+			if(i == pending.end()) return;
+			replay_result& res(results[i->second.result]);
+			res.replayed_ns = now() - i->second.enqueued;
+			if(!res.replayed_ns) res.replayed_ns = 1;
+			res.canceled = w->is_canceled();
+			if(res.recorded_ns) pending.erase(i);
+		}
+
+		std::vector<replay_result> replay_hcd::get_results() volatile throw(std::bad_alloc)
+		{
+			lock _(get_lock());
+			return const_cast<replay_hcd&>(*this).results;
+		}
+
+		const port_stat& replay_hcd::get_port_stat(uint8_t port) volatile throw(std::invalid_argument, std::out_of_range)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			lock _(get_lock());
+			return stats[port - 1];
+		}
+
+		// the recording already contains the reaction of the host to these,
+		// so they are only checked for validity
+		void replay_hcd::port_connect(uint8_t port, usb::data_rate rate) volatile throw(std::exception)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+		}
+
+		void replay_hcd::port_disconnect(uint8_t port) volatile throw(std::exception)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+		}
+
+		void replay_hcd::port_disable(uint8_t port) volatile throw(std::exception)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+		}
+
+		void replay_hcd::port_resumed(uint8_t port) volatile throw(std::exception)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+		}
+
+		void replay_hcd::port_overcurrent(uint8_t port, bool set) volatile throw(std::exception)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+		}
+
+		void replay_hcd::port_reset_done(uint8_t port, bool enable) volatile throw(std::exception)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+		}
+	}
+}
@@ -0,0 +1,411 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include "libusb_vhci.h"
+
+#define PCAPNG_BLOCK_SHB 0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB 0x00000001
+#define PCAPNG_BLOCK_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+
+// records the writer thread passes to one writev
+#define USBMON_WRITE_BATCH 64
+
+namespace
+{
+	// binary layout of the 64 byte header in front of each usbmon packet
+	struct usbmon_header
+	{
+		uint64_t id;
+		uint8_t type;
+		uint8_t xfer_type;
+		uint8_t epnum;
+		uint8_t devnum;
+		uint16_t busnum;
+		char flag_setup;
+		char flag_data;
+		int64_t ts_sec;
+		int32_t ts_usec;
+		int32_t status;
+		uint32_t length;
+		uint32_t len_cap;
+		union
+		{
+			uint8_t setup[8];
+			struct
+			{
+				int32_t error_count;
+				int32_t numdesc;
+			} iso;
+		} s;
+		int32_t interval;
+		int32_t start_frame;
+		uint32_t xfer_flags;
+		uint32_t ndesc;
+	};
+
+	struct usbmon_iso_desc
+	{
+		int32_t status;
+		uint32_t offset;
+		uint32_t len;
+		uint32_t pad;
+	};
+
+	inline void put32(uint8_t* p, uint32_t v) throw() { memcpy(p, &v, sizeof v); }
+	inline uint32_t pad4(uint32_t v) throw() { return (v + 3) & ~3u; }
+
+	bool write_all(int fd, const void* buf, size_t len) throw()
+	{
+		const uint8_t* p(reinterpret_cast<const uint8_t*>(buf));
+		while(len)
+		{
+			ssize_t res(write(fd, p, len));
+			if(res == -1)
+			{
+				if(errno == EINTR) continue;
+				return false;
+			}
+			p += res;
+			len -= res;
+		}
+		return true;
+	}
+
+	uint8_t usbmon_xfer_type(uint8_t type) throw()
+	{
+		switch(type)
+		{
+		case USB_VHCI_URB_TYPE_ISO:     return 0;
+		case USB_VHCI_URB_TYPE_INT:     return 1;
+		case USB_VHCI_URB_TYPE_CONTROL: return 2;
+		default:                        return 3;
+		}
+	}
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		usbmon_capture::usbmon_capture(const char* path,
+		                               uint32_t snaplen,
+		                               size_t max_pending) throw(std::exception) :
+			fd(-1),
+			own_fd(true),
+			snaplen(snaplen),
+			max_pending(max_pending),
+			port_mask(),
+			dropped(0),
+			writer_thread(),
+			writer_shutdown(false),
+			_lock(),
+			pending_cond(),
+			pending()
+		{
+			if(!path) throw std::invalid_argument("path");
+			if(snaplen < sizeof(usbmon_header)) throw std::invalid_argument("snaplen");
+			while((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 && errno == EINTR);
+			if(fd == -1) throw std::exception();
+			try { init(); }
+			catch(...)
+			{
+				close(fd);
+				throw;
+			}
+		}
+
+		usbmon_capture::usbmon_capture(int fd,
+		                               uint32_t snaplen,
+		                               size_t max_pending) throw(std::exception) :
+			fd(fd),
+			own_fd(false),
+			snaplen(snaplen),
+			max_pending(max_pending),
+			port_mask(),
+			dropped(0),
+			writer_thread(),
+			writer_shutdown(false),
+			_lock(),
+			pending_cond(),
+			pending()
+		{
+			if(fd < 0) throw std::invalid_argument("fd");
+			if(snaplen < sizeof(usbmon_header)) throw std::invalid_argument("snaplen");
+			init();
+		}
+
+		usbmon_capture::~usbmon_capture() throw()
+		{
+			{
+				lock _(_lock);
+				writer_shutdown = true;
+				pthread_cond_signal(&pending_cond);
+			}
+			pthread_join(writer_thread, NULL);
+			for(std::deque<std::vector<uint8_t>*>::iterator r(pending.begin()); r < pending.end(); r++)
+				delete *r;
+			if(own_fd) close(fd);
+			pthread_cond_destroy(&pending_cond);
+			pthread_mutex_destroy(&_lock);
+		}
+
+		void usbmon_capture::init() throw(std::exception)
+		{
+			for(int i(0); i < 8; i++)
+				port_mask[i] = 0xffffffff;
+			write_header();
+			pthread_mutex_init(&_lock, NULL);
+			pthread_cond_init(&pending_cond, NULL);
+			if(pthread_create(&writer_thread, NULL, writer_thread_start, this))
+			{
+				pthread_cond_destroy(&pending_cond);
+				pthread_mutex_destroy(&_lock);
+				throw std::exception();
+			}
+		}
+
+		// section header and the single interface description block
+		void usbmon_capture::write_header() throw(std::exception)
+		{
+			uint8_t hdr[28 + 20];
+			uint8_t* shb(hdr);
+			put32(shb, PCAPNG_BLOCK_SHB);
+			put32(shb + 4, 28);
+			put32(shb + 8, PCAPNG_BYTE_ORDER_MAGIC);
+			uint16_t version[2] = { 1, 0 };
+			memcpy(shb + 12, version, sizeof version);
+			int64_t section_length(-1);
+			memcpy(shb + 16, &section_length, sizeof section_length);
+			put32(shb + 24, 28);
+			uint8_t* idb(hdr + 28);
+			put32(idb, PCAPNG_BLOCK_IDB);
+			put32(idb + 4, 20);
+			uint16_t linktype[2] = { LINKTYPE_USB_LINUX_MMAPPED, 0 };
+			memcpy(idb + 8, linktype, sizeof linktype);
+			put32(idb + 12, snaplen);
+			put32(idb + 16, 20);
+			if(!write_all(fd, hdr, sizeof hdr)) throw std::exception();
+		}
+
+		void usbmon_capture::set_port_filter(uint8_t port, bool capture) volatile throw()
+		{
+			lock _(_lock);
+			if(capture) port_mask[port >> 5] |= 1u << (port & 0x1f);
+			else        port_mask[port >> 5] &= ~(1u << (port & 0x1f));
+		}
+
+		// builds a complete enhanced packet block, so that the writer thread
+		// only has to pass it on to the file
+		void usbmon_capture::record(char event, uint16_t busnum, uint8_t port, const usb::urb& urb) volatile throw()
+		{
+			usbmon_capture& _this(const_cast<usbmon_capture&>(*this));
+			const bool submission(event == 'S');
+			usbmon_header h;
+			memset(&h, 0, sizeof h);
+			h.id = urb.get_handle();
+			h.type = event;
+			h.xfer_type = usbmon_xfer_type(urb.get_type());
+			h.epnum = urb.get_endpoint_address();
+			h.devnum = urb.get_device_address();
+			h.busnum = busnum;
+			h.flag_setup = '-';
+			timeval tv;
+			gettimeofday(&tv, NULL);
+			h.ts_sec = tv.tv_sec;
+			h.ts_usec = tv.tv_usec;
+			h.status = submission ? -EINPROGRESS : usb_vhci_to_errno(urb.get_status(), urb.is_isochronous());
+			h.interval = urb.get_interval();
+			h.xfer_flags = urb.get_flags();
+
+			// data travels host->device on submission and device->host on completion
+			uint32_t data_len(0);
+			if(submission)
+			{
+				h.length = urb.get_buffer_length();
+				if(urb.is_out()) data_len = h.length;
+				else             h.flag_data = '<';
+				if(urb.is_control())
+				{
+					h.flag_setup = 0;
+					h.s.setup[0] = urb.get_bmRequestType();
+					h.s.setup[1] = urb.get_bRequest();
+					h.s.setup[2] = urb.get_wValue() & 0xff;
+					h.s.setup[3] = urb.get_wValue() >> 8;
+					h.s.setup[4] = urb.get_wIndex() & 0xff;
+					h.s.setup[5] = urb.get_wIndex() >> 8;
+					h.s.setup[6] = urb.get_wLength() & 0xff;
+					h.s.setup[7] = urb.get_wLength() >> 8;
+				}
+			}
+			else
+			{
+				h.length = urb.get_buffer_actual();
+				if(urb.is_in()) data_len = h.length;
+				else            h.flag_data = '>';
+			}
+			if(!urb.get_buffer()) data_len = 0;
+
+			uint32_t ndesc(0);
+			if(urb.is_isochronous())
+			{
+				h.s.iso.error_count = urb.get_iso_error_count();
+				h.s.iso.numdesc = urb.get_iso_packet_count();
+				ndesc = std::min<uint32_t>(urb.get_iso_packet_count(),
+				                           (_this.snaplen - sizeof h) / sizeof(usbmon_iso_desc));
+				h.ndesc = ndesc;
+			}
+			const uint32_t orig_len(sizeof h + urb.get_iso_packet_count() * sizeof(usbmon_iso_desc) + data_len);
+			const uint32_t head_len(sizeof h + ndesc * sizeof(usbmon_iso_desc));
+			h.len_cap = std::min(data_len, _this.snaplen - head_len);
+			const uint32_t cap_len(head_len + h.len_cap);
+
+			std::vector<uint8_t>* rec(NULL);
+			try { rec = new std::vector<uint8_t>(28 + pad4(cap_len) + 4); }
+			catch(std::bad_alloc)
+			{
+				__sync_fetch_and_add(&_this.dropped, 1);
+				return;
+			}
+			uint8_t* p(&(*rec)[0]);
+			const uint64_t ts(static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec);
+			put32(p, PCAPNG_BLOCK_EPB);
+			put32(p + 4, rec->size());
+			put32(p + 8, 0);
+			put32(p + 12, ts >> 32);
+			put32(p + 16, ts & 0xffffffff);
+			put32(p + 20, cap_len);
+			put32(p + 24, orig_len);
+			memcpy(p + 28, &h, sizeof h);
+			uint8_t* d(p + 28 + sizeof h);
+			for(uint32_t i(0); i < ndesc; i++, d += sizeof(usbmon_iso_desc))
+			{
+				usbmon_iso_desc desc;
+				desc.status = usb_vhci_to_iso_packets_errno(urb.get_iso_packet_status(i));
+				desc.offset = urb.get_iso_packet_offset(i);
+				desc.len = submission ? urb.get_iso_packet_length(i) : urb.get_iso_packet_actual(i);
+				desc.pad = 0;
+				memcpy(d, &desc, sizeof desc);
+			}
+			if(h.len_cap) memcpy(d, urb.get_buffer(), h.len_cap);
+			put32(p + rec->size() - 4, rec->size());
+
+			lock _(_this._lock);
+			if(_this.pending.size() >= _this.max_pending)
+			{
+				// never block the urb path on a slow reader
+				__sync_fetch_and_add(&_this.dropped, 1);
+				delete rec;
+				return;
+			}
+			try { _this.pending.push_back(rec); }
+			catch(std::bad_alloc)
+			{
+				__sync_fetch_and_add(&_this.dropped, 1);
+				delete rec;
+				return;
+			}
+			if(_this.pending.size() == 1)
+				pthread_cond_signal(&_this.pending_cond);
+		}
+
+		void* usbmon_capture::writer_thread_start(void* _this) throw()
+		{
+			usbmon_capture& cap(*reinterpret_cast<usbmon_capture*>(_this));
+			std::deque<std::vector<uint8_t>*> batch;
+			bool failed(false);
+			while(true)
+			{
+				{
+					lock _(cap._lock);
+					while(cap.pending.empty() && !cap.writer_shutdown)
+						pthread_cond_wait(&cap.pending_cond, &cap._lock);
+					if(cap.pending.empty()) break;
+					// takes everything without allocating, so that running out of
+					// mem cannot keep this thread spinning under the lock
+					batch.swap(cap.pending);
+				}
+				while(!batch.empty())
+				{
+					iovec iov[USBMON_WRITE_BATCH];
+					const size_t n(std::min<size_t>(batch.size(), USBMON_WRITE_BATCH));
+					size_t total(0);
+					for(size_t i(0); i < n; i++)
+					{
+						iov[i].iov_base = &(*batch[i])[0];
+						iov[i].iov_len = batch[i]->size();
+						total += iov[i].iov_len;
+					}
+					if(!failed)
+					{
+						ssize_t res;
+						while((res = writev(cap.fd, iov, n)) == -1 && errno == EINTR);
+						if(res == -1) failed = true;
+						else if(static_cast<size_t>(res) < total)
+						{
+							// finish a short write record by record
+							size_t skip(res);
+							for(size_t i(0); i < n && !failed; i++)
+							{
+								if(skip >= iov[i].iov_len)
+								{
+									skip -= iov[i].iov_len;
+									continue;
+								}
+								failed = !write_all(cap.fd,
+								                    reinterpret_cast<uint8_t*>(iov[i].iov_base) + skip,
+								                    iov[i].iov_len - skip);
+								skip = 0;
+							}
+						}
+					}
+					if(failed) __sync_fetch_and_add(&cap.dropped, n);
+					for(size_t i(0); i < n; i++)
+					{
+						delete batch.front();
+						batch.pop_front();
+					}
+				}
+			}
+			return NULL;
+		}
+	}
+}
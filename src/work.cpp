@@ -38,18 +38,61 @@ namespace usb
 {
 	namespace vhci
 	{
-		work::work(uint8_t port) throw(std::invalid_argument) : port(port), canceled(false)
+		work::work(uint8_t port) throw(std::invalid_argument) :
+			port(port),
+			cancel_state(cancel_state_none),
+			cancel_func(NULL),
+			cancel_arg(NULL)
 		{
 			if(port == 0) throw std::invalid_argument("port");
 		}
 
+		work::work(const work& w) throw() :
+			port(w.port),
+			cancel_state(w.is_canceled() ? cancel_state_canceled : cancel_state_none),
+			cancel_func(NULL),
+			cancel_arg(NULL)
+		{
+		}
+
+		work& work::operator=(const work& w) throw()
+		{
+			port = w.port;
+			if(w.is_canceled()) cancel();
+			return *this;
+		}
+
 		work::~work() throw()
 		{
 		}
 
 		void work::cancel() throw()
 		{
-			canceled = true;
+			int s;
+			do
+			{
+				s = cancel_state;
+				if(s == cancel_state_canceled) return;
+			} while(!__sync_bool_compare_and_swap(&cancel_state, s, cancel_state_canceled));
+			// the swap is a full barrier, so func and arg are the ones that
+			// were stored before the callback state was published
+			if(s == cancel_state_callback) (*cancel_func)(cancel_arg, *this);
+		}
+
+		bool work::set_cancel_callback(cancel_callback func, void* arg) throw()
+		{
+			if(!func) return clear_cancel_callback();
+			// take the old callback out of reach of cancel before replacing it
+			if(!clear_cancel_callback()) return false;
+			cancel_func = func;
+			cancel_arg = arg;
+			return __sync_bool_compare_and_swap(&cancel_state, cancel_state_none, cancel_state_callback);
+		}
+
+		bool work::clear_cancel_callback() throw()
+		{
+			return __sync_bool_compare_and_swap(&cancel_state, cancel_state_callback, cancel_state_none) ||
+			       __atomic_load_n(&cancel_state, __ATOMIC_ACQUIRE) == cancel_state_none;
 		}
 
 		process_urb_work::process_urb_work(uint8_t port, usb::urb* urb) throw(std::invalid_argument) :
@@ -0,0 +1,380 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include "libusb_vhci.h"
+
+namespace
+{
+	// works a thread runs from one endpoint in a row before it offers the
+	// rest to the other threads
+	const unsigned int strand_batch(16);
+	// works a thread takes out of the hcd at once
+	const unsigned int pull_batch(64);
+
+	uint16_t strand_key(const usb::vhci::work& w) throw()
+	{
+		const usb::vhci::process_urb_work* uw(dynamic_cast<const usb::vhci::process_urb_work*>(&w));
+		return w.get_port() << 8 | (uw ? uw->get_urb()->get_endpoint_address() : 0xff);
+	}
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		work_handler::~work_handler() throw()
+		{
+		}
+
+		work_executor::work_executor(hcd& h, unsigned int threads) throw(std::exception) :
+			h(h),
+			workers(),
+			strands(),
+			handlers(),
+			default_handler(NULL),
+			work_pending(true),
+			ready_generation(0),
+			sleeping(0),
+			scheduled(0),
+			shutdown(false),
+			pulling(0),
+			steals(0),
+			_lock(),
+			wake_cond()
+		{
+			if(!threads)
+			{
+				long n(sysconf(_SC_NPROCESSORS_ONLN));
+				threads = (n > 0) ? n : 1;
+			}
+			pthread_mutex_init(&_lock, NULL);
+			pthread_cond_init(&wake_cond, NULL);
+			try
+			{
+				// all of them exist before any thread looks for something to steal
+				workers.reserve(threads);
+				for(unsigned int i(0); i < threads; i++)
+					workers.push_back(new _worker(this));
+				h.add_work_enqueued_callback(hcd::callback(&work_enqueued, this));
+				for(std::vector<_worker*>::iterator i(workers.begin()); i < workers.end(); i++)
+				{
+					pthread_t t;
+					if(pthread_create(&t, NULL, worker_start, *i))
+						throw std::exception();
+					(*i)->thread = t;
+				}
+			}
+			catch(...)
+			{
+				stop();
+				pthread_cond_destroy(&wake_cond);
+				pthread_mutex_destroy(&_lock);
+				throw;
+			}
+		}
+
+		work_executor::~work_executor() throw()
+		{
+			stop();
+			pthread_cond_destroy(&wake_cond);
+			pthread_mutex_destroy(&_lock);
+		}
+
+		void work_executor::stop() throw()
+		{
+			h.remove_work_enqueued_callback(hcd::callback(&work_enqueued, this));
+			{
+				lock _(_lock);
+				shutdown = true;
+				pthread_cond_broadcast(&wake_cond);
+			}
+			for(std::vector<_worker*>::iterator i(workers.begin()); i < workers.end(); i++)
+			{
+				if((*i)->thread != pthread_t()) pthread_join((*i)->thread, NULL);
+				delete *i;
+			}
+			workers.clear();
+			for(std::map<uint16_t, _strand*>::iterator i(strands.begin()); i != strands.end(); i++)
+			{
+				// only if a handler never returned to its thread
+				for(std::deque<work*>::iterator w(i->second->works.begin()); w < i->second->works.end(); w++)
+				{
+					try { h.finish_work(*w); }
+					catch(...) { }
+				}
+				delete i->second;
+			}
+			strands.clear();
+		}
+
+		void work_executor::work_enqueued(void* arg, hcd&) throw()
+		{
+			// called with the lock of the hcd held, so only take note here
+			work_executor& e(*reinterpret_cast<work_executor*>(arg));
+			lock _(e._lock);
+			e.work_pending = true;
+			if(e.sleeping) pthread_cond_signal(&e.wake_cond);
+		}
+
+		void* work_executor::worker_start(void* w) throw()
+		{
+			_worker& _w(*reinterpret_cast<_worker*>(w));
+			_w.owner->run(_w);
+			return NULL;
+		}
+
+		void work_executor::run(_worker& self) throw()
+		{
+			for(;;)
+			{
+				uint64_t generation;
+				{
+					lock _(_lock);
+					generation = ready_generation;
+				}
+				_strand* s(NULL);
+				{
+					lock _(self._lock);
+					if(!self.ready.empty())
+					{
+						s = self.ready.back();
+						self.ready.pop_back();
+					}
+				}
+				if(!s) s = steal(self);
+				if(s)
+				{
+					run_strand(self, s);
+					continue;
+				}
+				if(!shutdown && __sync_bool_compare_and_swap(&pulling, 0, 1))
+				{
+					bool got(pull(self));
+					__sync_lock_release(&pulling);
+					if(got) continue;
+				}
+				lock _(_lock);
+				// a strand got ready after this thread looked for one
+				if(ready_generation != generation) continue;
+				// the others finish what they are running on their own
+				if(shutdown) return;
+				if(work_pending) continue;
+				sleeping++;
+				pthread_cond_wait(&wake_cond, &_lock);
+				sleeping--;
+			}
+		}
+
+		work_executor::_strand* work_executor::steal(_worker& self) throw()
+		{
+			for(std::vector<_worker*>::iterator i(workers.begin()); i < workers.end(); i++)
+			{
+				if(*i == &self) continue;
+				lock _((*i)->_lock);
+				if(!(*i)->ready.empty())
+				{
+					_strand* s((*i)->ready.front());
+					(*i)->ready.pop_front();
+					__sync_fetch_and_add(&steals, 1);
+					return s;
+				}
+			}
+			return NULL;
+		}
+
+		// caller has _lock
+		void work_executor::make_ready(_worker& self, _strand* s) throw(std::bad_alloc)
+		{
+			{
+				lock _(self._lock);
+				self.ready.push_back(s);
+			}
+			s->scheduled = true;
+			scheduled++;
+			ready_generation++;
+			if(sleeping) pthread_cond_signal(&wake_cond);
+		}
+
+		bool work_executor::pull(_worker& self) throw()
+		{
+			{
+				lock _(_lock);
+				work_pending = false;
+			}
+			unsigned int n(0);
+			for(; n < pull_batch; n++)
+			{
+				work* w;
+				try { h.next_work(&w); }
+				catch(std::bad_alloc) { break; }
+				if(!w) break;
+				const uint16_t key(strand_key(*w));
+				for(;;)
+				{
+					try
+					{
+						lock _(_lock);
+						std::map<uint16_t, _strand*>::iterator i(strands.find(key));
+						_strand* s;
+						if(i != strands.end()) s = i->second;
+						else
+						{
+							s = new _strand();
+							try { strands.insert(std::make_pair(key, s)); }
+							catch(...)
+							{
+								delete s;
+								throw;
+							}
+						}
+						if(!s->scheduled) make_ready(self, s);
+						s->works.push_back(w);
+						break;
+					}
+					catch(std::bad_alloc)
+					{
+						// wait for others to free mem
+						usleep(1000);
+					}
+				}
+			}
+			if(n == pull_batch)
+			{
+				// there may be more
+				lock _(_lock);
+				work_pending = true;
+			}
+			return n;
+		}
+
+		void work_executor::run_strand(_worker& self, _strand* s) throw()
+		{
+			for(unsigned int n(0);; n++)
+			{
+				work* w;
+				{
+					lock _(_lock);
+					if(s->works.empty())
+					{
+						s->scheduled = false;
+						scheduled--;
+						return;
+					}
+					if(n >= strand_batch)
+					{
+						// behind the other ready strands of this thread, and
+						// first in line for the thieves
+						try
+						{
+							lock __(self._lock);
+							self.ready.push_front(s);
+						}
+						catch(std::bad_alloc)
+						{
+							n = 0;
+							continue;
+						}
+						ready_generation++;
+						if(sleeping) pthread_cond_signal(&wake_cond);
+						return;
+					}
+					w = s->works.front();
+					s->works.pop_front();
+				}
+				dispatch(*w);
+				try { h.finish_work(w); }
+				catch(...) { }
+			}
+		}
+
+		void work_executor::dispatch(work& w) throw()
+		{
+			process_urb_work* uw(dynamic_cast<process_urb_work*>(&w));
+			work_handler* hd;
+			{
+				lock _(_lock);
+				hd = default_handler;
+				std::map<uint16_t, work_handler*>::const_iterator i(handlers.end());
+				if(uw) i = handlers.find(w.get_port() << 8 | uw->get_urb()->get_endpoint_address());
+				if(i == handlers.end()) i = handlers.find(w.get_port() << 8 | 0xff);
+				if(i != handlers.end()) hd = i->second;
+			}
+			if(!hd)
+			{
+				if(uw) uw->get_urb()->stall();
+				return;
+			}
+			try
+			{
+				hd->handle(h, w);
+			}
+			catch(std::exception)
+			{
+				if(uw) uw->get_urb()->set_status(USB_VHCI_STATUS_ERROR);
+			}
+		}
+
+		void work_executor::set_handler(uint8_t port, work_handler* hd) volatile throw(std::invalid_argument, std::bad_alloc)
+		{
+			if(!port) throw std::invalid_argument("port");
+			work_executor& _this(const_cast<work_executor&>(*this));
+			lock _(_this._lock);
+			if(hd) _this.handlers[port << 8 | 0xff] = hd;
+			else _this.handlers.erase(port << 8 | 0xff);
+		}
+
+		void work_executor::set_handler(uint8_t port, uint8_t epadr, work_handler* hd) volatile throw(std::invalid_argument, std::bad_alloc)
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(epadr & 0x70) throw std::invalid_argument("epadr");
+			work_executor& _this(const_cast<work_executor&>(*this));
+			lock _(_this._lock);
+			if(hd) _this.handlers[port << 8 | epadr] = hd;
+			else _this.handlers.erase(port << 8 | epadr);
+		}
+
+		void work_executor::set_default_handler(work_handler* hd) volatile throw()
+		{
+			work_executor& _this(const_cast<work_executor&>(*this));
+			lock _(_this._lock);
+			_this.default_handler = hd;
+		}
+
+		unsigned int work_executor::get_thread_count() const volatile throw()
+		{
+			return const_cast<const work_executor&>(*this).workers.size();
+		}
+	}
+}
@@ -0,0 +1,308 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <time.h>
+#include <algorithm>
+#include "libusb_vhci.h"
+
+namespace
+{
+	uint64_t now() throw()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+	}
+
+	const unsigned int default_weights[usb::vhci::work_queue::class_count] = { 8, 8, 4, 2, 1 };
+
+	// bytes a port of weight 1 may take per round in order_port_drr
+	const uint64_t drr_quantum(4096);
+
+	// an urb costs its buffer in order_port_drr, plus a little so that
+	// urbs without data are not free
+	uint64_t drr_cost(const usb::vhci::work* w) throw()
+	{
+		const int32_t len(static_cast<const usb::vhci::process_urb_work*>(w)->get_urb()->get_buffer_length());
+		return 64 + (len > 0 ? len : 0);
+	}
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		work_queue::work_queue() throw() :
+			queues(),
+			ports(),
+			ring(),
+			stats(),
+			weights(),
+			ord(order_fifo),
+			next_seq(0),
+			count(0),
+			current(0),
+			served(0)
+		{
+			for(unsigned int i(0); i < class_count; i++)
+				weights[i] = default_weights[i];
+		}
+
+		work_queue::work_class work_queue::classify(const work& w) throw()
+		{
+			const process_urb_work* uw(dynamic_cast<const process_urb_work*>(&w));
+			if(!uw) return class_port;
+			switch(uw->get_urb()->get_type())
+			{
+			case usb::urb_type_control:     return class_control;
+			case usb::urb_type_isochronous: return class_isochronous;
+			case usb::urb_type_interrupt:   return class_interrupt;
+			default:                        return class_bulk;
+			}
+		}
+
+		work_queue::_port& work_queue::port_queue(uint8_t port) throw(std::bad_alloc)
+		{
+			if(port >= ports.size()) ports.resize(port + 1);
+			return ports[port];
+		}
+
+		void work_queue::insert(const _entry& e) throw(std::bad_alloc)
+		{
+			const work_class c(classify(*e.w));
+			if(ord != order_port_drr || c == class_port)
+			{
+				queues[c].push_back(e);
+				return;
+			}
+			const uint8_t port(e.w->get_port());
+			_port& q(port_queue(port));
+			q.entries.push_back(e);
+			if(q.entries.size() == 1)
+			{
+				try { ring.push_back(port); }
+				catch(...)
+				{
+					q.entries.pop_back();
+					throw;
+				}
+			}
+		}
+
+		void work_queue::push(work* w) throw(std::bad_alloc)
+		{
+			_entry e;
+			e.w = w;
+			e.seq = next_seq;
+			e.time = now();
+			insert(e);
+			next_seq++;
+			count++;
+			class_stats& s(stats[classify(*w)]);
+			if(++s.depth > s.max_depth) s.max_depth = s.depth;
+		}
+
+		// caller made sure there is an active port
+		work_queue::_entry work_queue::take_drr() throw()
+		{
+			for(;;)
+			{
+				const uint8_t port(ring.front());
+				_port& q(ports[port]);
+				if(!q.granted)
+				{
+					q.deficit += drr_quantum * q.weight;
+					q.granted = true;
+				}
+				const uint64_t cost(drr_cost(q.entries.front().w));
+				if(cost <= q.deficit)
+				{
+					q.deficit -= cost;
+					const _entry e(q.entries.front());
+					q.entries.pop_front();
+					if(q.entries.empty())
+					{
+						// an idle port does not save up
+						q.deficit = 0;
+						q.granted = false;
+						ring.pop_front();
+					}
+					return e;
+				}
+				// the rest of the deficit carries over to the next round
+				q.granted = false;
+				ring.pop_front();
+				ring.push_back(port);
+			}
+		}
+
+		work* work_queue::pop() throw()
+		{
+			if(!count) return NULL;
+			unsigned int c(0);
+			_entry e;
+			if(ord == order_port_drr && queues[class_port].empty())
+			{
+				e = take_drr();
+				goto taken;
+			}
+			switch(ord)
+			{
+			case order_fifo:
+				for(unsigned int i(0); i < class_count; i++)
+					if(!queues[i].empty() && (queues[c].empty() || queues[i].front().seq < queues[c].front().seq))
+						c = i;
+				break;
+			case order_strict:
+				while(queues[c].empty()) c++;
+				break;
+			case order_weighted:
+				// terminates, because some class is not empty and every weight is at least 1
+				while(queues[current].empty() || served >= weights[current])
+				{
+					current = (current + 1) % class_count;
+					served = 0;
+				}
+				served++;
+				c = current;
+				break;
+			case order_port_drr:
+				// class_port goes first
+				break;
+			}
+			e = queues[c].front();
+			queues[c].pop_front();
+		taken:
+			count--;
+			class_stats& s(stats[classify(*e.w)]);
+			const uint64_t wait(now() - e.time);
+			s.depth--;
+			s.dequeued++;
+			s.total_wait += wait;
+			if(wait > s.max_wait) s.max_wait = wait;
+			return e.w;
+		}
+
+		process_urb_work* work_queue::find_urb(uint64_t handle) const throw()
+		{
+			for(unsigned int c(class_control); c < class_count; c++)
+			{
+				for(std::deque<_entry>::const_iterator i(queues[c].begin()); i < queues[c].end(); i++)
+				{
+					process_urb_work* uw(static_cast<process_urb_work*>(i->w));
+					if(uw->get_urb()->get_handle() == handle) return uw;
+				}
+			}
+			for(std::vector<_port>::const_iterator p(ports.begin()); p < ports.end(); p++)
+			{
+				for(std::deque<_entry>::const_iterator i(p->entries.begin()); i < p->entries.end(); i++)
+				{
+					process_urb_work* uw(static_cast<process_urb_work*>(i->w));
+					if(uw->get_urb()->get_handle() == handle) return uw;
+				}
+			}
+			return NULL;
+		}
+
+		void work_queue::set_order(order o) throw(std::bad_alloc)
+		{
+			if((o == order_port_drr) == (ord == order_port_drr))
+			{
+				ord = o;
+				return;
+			}
+			// rebuild everything but class_port in a copy first, so that
+			// running out of memory leaves this queue as it was
+			std::vector<_entry> all;
+			all.reserve(count);
+			for(unsigned int c(class_control); c < class_count; c++)
+				all.insert(all.end(), queues[c].begin(), queues[c].end());
+			for(std::vector<_port>::const_iterator p(ports.begin()); p < ports.end(); p++)
+				all.insert(all.end(), p->entries.begin(), p->entries.end());
+			std::sort(all.begin(), all.end());
+			work_queue t;
+			t.ord = o;
+			t.ports.resize(ports.size());
+			for(size_t i(0); i < ports.size(); i++)
+				t.ports[i].weight = ports[i].weight;
+			for(std::vector<_entry>::const_iterator i(all.begin()); i < all.end(); i++)
+				t.insert(*i);
+			for(unsigned int c(class_control); c < class_count; c++)
+				queues[c].swap(t.queues[c]);
+			ports.swap(t.ports);
+			ring.swap(t.ring);
+			ord = o;
+			current = 0;
+			served = 0;
+		}
+
+		unsigned int work_queue::get_weight(work_class c) const throw(std::out_of_range)
+		{
+			if(c >= class_count) throw std::out_of_range("c");
+			return weights[c];
+		}
+
+		void work_queue::set_weight(work_class c, unsigned int weight) throw(std::invalid_argument, std::out_of_range)
+		{
+			if(c >= class_count) throw std::out_of_range("c");
+			if(!weight) throw std::invalid_argument("weight");
+			weights[c] = weight;
+		}
+
+		unsigned int work_queue::get_port_weight(uint8_t port) const throw()
+		{
+			return port < ports.size() ? ports[port].weight : 1;
+		}
+
+		void work_queue::set_port_weight(uint8_t port, unsigned int weight) throw(std::invalid_argument, std::bad_alloc)
+		{
+			if(!weight) throw std::invalid_argument("weight");
+			port_queue(port).weight = weight;
+		}
+
+		void work_queue::reset_weights() throw()
+		{
+			for(unsigned int i(0); i < class_count; i++)
+				weights[i] = default_weights[i];
+			for(std::vector<_port>::iterator p(ports.begin()); p < ports.end(); p++)
+				p->weight = 1;
+		}
+
+		work_queue::class_stats work_queue::get_stats(work_class c) const throw(std::out_of_range)
+		{
+			if(c >= class_count) throw std::out_of_range("c");
+			return stats[c];
+		}
+	}
+}